@@ -45,6 +45,7 @@
 #include "htslib/thread_pool.h"
 #include "htslib/hts_endian.h"
 #include "cram/pooled_alloc.h"
+#include "hts_internal.h"
 
 #define BGZF_CACHE
 #define BGZF_MT
@@ -994,7 +995,9 @@ int bgzf_read_block(BGZF *fp)
     return 0;
 }
 
-ssize_t bgzf_read(BGZF *fp, void *data, size_t length)
+// As bgzf_read(), but if data is NULL the bytes are skipped over instead of
+// being copied.
+static ssize_t bgzf_read_(BGZF *fp, void *data, size_t length)
 {
     ssize_t bytes_read = 0;
     uint8_t *output = (uint8_t*)data;
@@ -1015,9 +1018,11 @@ ssize_t bgzf_read(BGZF *fp, void *data, size_t length)
         }
         copy_length = length - bytes_read < available? length - bytes_read : available;
         buffer = (uint8_t*)fp->uncompressed_block;
-        memcpy(output, buffer + fp->block_offset, copy_length);
+        if (output) {
+            memcpy(output, buffer + fp->block_offset, copy_length);
+            output += copy_length;
+        }
         fp->block_offset += copy_length;
-        output += copy_length;
         bytes_read += copy_length;
 
         // For raw gzip streams this avoids short reads.
@@ -1032,6 +1037,54 @@ ssize_t bgzf_read(BGZF *fp, void *data, size_t length)
     return bytes_read;
 }
 
+ssize_t bgzf_read(BGZF *fp, void *data, size_t length)
+{
+    return bgzf_read_(fp, data, length);
+}
+
+ssize_t bgzf_skip(BGZF *fp, size_t length)
+{
+    return bgzf_read_(fp, NULL, length);
+}
+
+int64_t bgzf_block_search(hFILE *hf, int64_t pos, int64_t size)
+{
+    const size_t win = 65536;
+    uint8_t *buf = malloc(win + BLOCK_HEADER_LENGTH), next[BLOCK_HEADER_LENGTH];
+    int64_t ret = size;
+
+    if (!buf) return -1;
+    while (pos < size) {
+        ssize_t len, i;
+        if (hseek(hf, pos, SEEK_SET) < 0
+            || (len = hread(hf, buf, win + BLOCK_HEADER_LENGTH)) < 0) {
+            ret = -1;
+            break;
+        }
+        for (i = 0; i + BLOCK_HEADER_LENGTH <= len; i++) {
+            int64_t after;
+            if (buf[i] != 31 || check_header(buf + i) != 0) continue;
+            // Confirm by looking for the next block, or the end of the file
+            after = pos + i + unpackInt16(buf + i + 16) + 1;
+            if (after == size) break;
+            if (after > size) continue;
+            if (hseek(hf, after, SEEK_SET) < 0) { ret = -1; goto out; }
+            if (hread(hf, next, BLOCK_HEADER_LENGTH) == BLOCK_HEADER_LENGTH
+                && check_header(next) == 0)
+                break;
+        }
+        if (i + BLOCK_HEADER_LENGTH <= len) {
+            ret = pos + i;
+            break;
+        }
+        if (len < (ssize_t) (win + BLOCK_HEADER_LENGTH)) break;
+        pos += win;
+    }
+ out:
+    free(buf);
+    return ret;
+}
+
 // -1 for EOF, -2 for error, 0-255 for byte.
 int bgzf_peek(BGZF *fp) {
     int available = fp->block_length - fp->block_offset;
@@ -130,6 +130,61 @@ static int kget_int64(kstring_t *k, size_t *pos, int64_t *val_p) {
     return 0;
 }
 
+/*
+ * A loaded index, as kept in the shared index cache (see
+ * hts_idx_set_shared_limit()).
+ */
+typedef struct {
+    int index_sz;
+    cram_index *index;
+} cram_index_set;
+
+static void cram_index_free_recurse(cram_index *e);
+
+static void cram_index_set_free(void *data) {
+    cram_index_set *set = (cram_index_set *) data;
+    int i;
+
+    for (i = 0; i < set->index_sz; i++)
+        cram_index_free_recurse(&set->index[i]);
+    free(set->index);
+    free(set);
+}
+
+static size_t cram_index_size(const cram_index *e, int n) {
+    size_t sz = n * sizeof(*e);
+    int i;
+
+    for (i = 0; i < n; i++)
+        if (e[i].e)
+            sz += cram_index_size(e[i].e, e[i].nslice);
+    return sz;
+}
+
+/*
+ * Offers a newly loaded index to the shared index cache.  If it was
+ * taken, fd->index may afterwards point to a copy loaded elsewhere.
+ */
+static void cram_index_share(cram_fd *fd, const char *fn_idx,
+                             const struct stat *st) {
+    cram_index_set *set = malloc(sizeof(*set)), *cached;
+
+    if (!set)
+        return; // Not an error; fd keeps its own copy
+
+    set->index_sz = fd->index_sz;
+    set->index = fd->index;
+    cached = hts_idx_shared_put(fn_idx, HTS_FMT_CRAI, st, set,
+                                cram_index_size(fd->index, fd->index_sz),
+                                cram_index_set_free, &fd->index_shared, NULL);
+    if (!fd->index_shared) {
+        free(set);
+        return;
+    }
+    fd->index_sz = cached->index_sz;
+    fd->index = cached->index;
+}
+
 /*
  * Loads a CRAM .crai index into memory.
  *
@@ -146,14 +201,37 @@ int cram_index_load(cram_fd *fd, const char *fn, const char *fn_idx) {
     cram_index **idx_stack = NULL, *ep, e;
     int idx_stack_alloc = 0, idx_stack_ptr = 0;
     size_t pos = 0;
+    struct stat st;
+    int shareable;
 
     /* Check if already loaded */
     if (fd->index)
         return 0;
 
+    if (!fn_idx) {
+        fn2 = hts_idx_getfn(fn, ".crai");
+        if (!fn2)
+            return -1;
+
+        fn_idx = fn2;
+    }
+
+    /* Or loaded elsewhere and shared */
+    shareable = (stat(fn_idx, &st) == 0);
+    if (shareable) {
+        cram_index_set *set = hts_idx_shared_get(fn_idx, HTS_FMT_CRAI, &st,
+                                                 &fd->index_shared);
+        if (set) {
+            fd->index_sz = set->index_sz;
+            fd->index = set->index;
+            free(fn2);
+            return 0;
+        }
+    }
+
     fd->index = calloc((fd->index_sz = 1), sizeof(*fd->index));
     if (!fd->index)
-        return -1;
+        goto fail;
 
     idx = &fd->index[0];
     idx->refid = -1;
@@ -166,14 +244,6 @@ int cram_index_load(cram_fd *fd, const char *fn, const char *fn_idx) {
 
     idx_stack[idx_stack_ptr] = idx;
 
-    if (!fn_idx) {
-        fn2 = hts_idx_getfn(fn, ".crai");
-        if (!fn2)
-            goto fail;
-
-        fn_idx = fn2;
-    }
-
     if (!(fp = hopen(fn_idx, "r"))) {
         perror(fn_idx);
         goto fail;
@@ -296,10 +366,13 @@ int cram_index_load(cram_fd *fd, const char *fn, const char *fn_idx) {
 
     free(idx_stack);
     free(kstr.s);
-    free(fn2);
 
     // dump_index(fd);
 
+    if (shareable)
+        cram_index_share(fd, fn_idx, &st);
+    free(fn2);
+
     return 0;
 
  fail:
@@ -326,6 +399,13 @@ void cram_index_free(cram_fd *fd) {
     if (!fd->index)
         return;
 
+    if (fd->index_shared) {
+        hts_idx_shared_release(fd->index_shared);
+        fd->index_shared = NULL;
+        fd->index = NULL;
+        return;
+    }
+
     for (i = 0; i < fd->index_sz; i++) {
         cram_index_free_recurse(&fd->index[i]);
     }
@@ -4222,6 +4222,7 @@ cram_fd *cram_dopen(hFILE *fp, const char *filename, const char *mode) {
     fd->store_nm = 0;
 
     fd->index       = NULL;
+    fd->index_shared = NULL;
     fd->own_pool    = 0;
     fd->pool        = NULL;
     fd->rqueue      = NULL;
@@ -36,6 +36,7 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 #include "cram/cram.h"
 #include "htslib/sam.h"
+#include "simd_internal.h"
 
 /*---------------------------------------------------------------------------
  * Samtools compatibility portion
@@ -54,24 +55,6 @@ int bam_construct_seq(bam_seq_t **bp, size_t extra_len,
                       int len,
                       const char *seq,
                       const char *qual) {
-    static const char L[256] = {
-        15,15,15,15,15,15,15,15,15,15,15,15,15,15,15,15,
-        15,15,15,15,15,15,15,15,15,15,15,15,15,15,15,15,
-        15,15,15,15,15,15,15,15,15,15,15,15,15,15,15,15,
-        15,15,15,15,15,15,15,15,15,15,15,15,15, 0,15,15,
-        15, 1,14, 2,13,15,15, 4,11,15,15,12,15, 3,15,15,
-        15,15, 5, 6, 8,15, 7, 9,15,10,15,15,15,15,15,15,
-        15, 1,14, 2,13,15,15, 4,11,15,15,12,15, 3,15,15,
-        15,15, 5, 6, 8,15, 7, 9,15,10,15,15,15,15,15,15,
-        15,15,15,15,15,15,15,15,15,15,15,15,15,15,15,15,
-        15,15,15,15,15,15,15,15,15,15,15,15,15,15,15,15,
-        15,15,15,15,15,15,15,15,15,15,15,15,15,15,15,15,
-        15,15,15,15,15,15,15,15,15,15,15,15,15,15,15,15,
-        15,15,15,15,15,15,15,15,15,15,15,15,15,15,15,15,
-        15,15,15,15,15,15,15,15,15,15,15,15,15,15,15,15,
-        15,15,15,15,15,15,15,15,15,15,15,15,15,15,15,15,
-        15,15,15,15,15,15,15,15,15,15,15,15,15,15,15,15
-    };
     bam1_t *b = (bam1_t *)*bp;
     uint8_t *cp;
     int i, qname_nuls, bam_len;
@@ -90,6 +73,7 @@ int bam_construct_seq(bam_seq_t **bp, size_t extra_len,
             return -1;
     }
     b->l_data = bam_len;
+    b->data_gen++;
 
     b->core.tid     = rname;
     b->core.pos     = pos-1;
@@ -113,11 +97,8 @@ int bam_construct_seq(bam_seq_t **bp, size_t extra_len,
     if (ncigar > 0) memcpy(cp, cigar, ncigar*4);
     cp += ncigar*4;
 
-    for (i = 0; i+1 < len; i+=2) {
-        *cp++ = (L[(uc)seq[i]]<<4) + L[(uc)seq[i+1]];
-    }
-    if (i < len)
-        *cp++ = L[(uc)seq[i]]<<4;
+    hts_nibble_pack(seq, cp, len);
+    cp += (len+1)/2;
 
     if (qual)
         memcpy(cp, qual, len);
@@ -737,6 +737,7 @@ typedef struct cram_fd {
 
     int         index_sz;
     cram_index *index;                  // array, sizeof index_sz
+    struct hts_idx_shared_t *index_shared; // set if index is shared
     off_t first_container;
     off_t curr_position;
     int eof;
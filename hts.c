@@ -35,11 +35,17 @@ DEALINGS IN THE SOFTWARE.  */
 #include <errno.h>
 #include <sys/stat.h>
 #include <assert.h>
+#include <unistd.h>
+#include <pthread.h>
+#ifdef HAVE_MMAP
+#include <sys/mman.h>
+#endif
 
 #include "htslib/hts.h"
 #include "htslib/bgzf.h"
 #include "cram/cram.h"
 #include "htslib/hfile.h"
+#include "htslib/thread_pool.h"
 #include "htslib/hts_endian.h"
 #include "version.h"
 #include "hts_internal.h"
@@ -810,6 +816,7 @@ htsFile *hts_hopen(hFILE *hfile, const char *fn, const char *mode)
 
     fp->fn = strdup(fn);
     fp->is_be = ed_is_big();
+    fp->required_fields = INT_MAX;
 
     // Split mode into simple_mode,opts strings
     if ((cp = strchr(mode, ','))) {
@@ -948,10 +955,11 @@ int hts_close(htsFile *fp)
     case text_format:
     case sam:
     case vcf:
+        ret = sam_state_destroy(fp);
         if (fp->format.compression != no_compression)
-            ret = bgzf_close(fp->fp.bgzf);
+            ret |= bgzf_close(fp->fp.bgzf);
         else
-            ret = hclose(fp->fp.hfile);
+            ret |= hclose(fp->fp.hfile);
         break;
 
     default:
@@ -1050,6 +1058,14 @@ int hts_set_opt(htsFile *fp, enum hts_fmt_option opt, ...) {
         return 0;
     }
 
+    case CRAM_OPT_REQUIRED_FIELDS: {
+        // Honoured by the SAM and BAM readers too, then passed on to CRAM
+        va_start(args, opt);
+        fp->required_fields = va_arg(args, int);
+        va_end(args);
+        break;
+    }
+
     case HTS_OPT_COMPRESSION_LEVEL: {
         va_start(args, opt);
         int level = va_arg(args, int);
@@ -1076,7 +1092,15 @@ BGZF *hts_get_bgzfp(htsFile *fp);
 
 int hts_set_threads(htsFile *fp, int n)
 {
-    if (fp->format.compression == bgzf) {
+    // Text output is assumed to be SAM until a header says otherwise.
+    if (fp->format.format == sam
+        || (fp->format.format == text_format && fp->is_write)) {
+        if (sam_set_threads(fp, n) < 0)
+            return -1;
+        if (fp->format.compression == bgzf)
+            return bgzf_mt(hts_get_bgzfp(fp), n, 256/*unused*/);
+        return 0;
+    } else if (fp->format.compression == bgzf) {
         return bgzf_mt(hts_get_bgzfp(fp), n, 256/*unused*/);
     } else if (fp->format.format == cram) {
         return hts_set_opt(fp, CRAM_OPT_NTHREADS, n);
@@ -1085,6 +1109,11 @@ int hts_set_threads(htsFile *fp, int n)
 }
 
 int hts_set_thread_pool(htsFile *fp, htsThreadPool *p) {
+    if ((fp->format.format == sam
+         || (fp->format.format == text_format && fp->is_write))
+        && sam_set_thread_pool(fp, p) < 0)
+        return -1;
+
     if (fp->format.compression == bgzf) {
         return bgzf_thread_pool(hts_get_bgzfp(fp), p->pool, p->qsize);
     } else if (fp->format.format == cram) {
@@ -1313,6 +1342,25 @@ typedef struct {
     uint64_t *offset;
 } lidx_t;
 
+// Indexes loaded with HTS_IDX_LAZY only read the bins of each reference
+// when it is first used.  A first pass through the index notes where each
+// reference's data starts, and its pseudo-bin so that the statistics and
+// hts_itr_off() are available without loading anything else.
+typedef struct {
+    uint64_t off;       // Offset in fp (see idx_tell()), or into map
+    uint64_t meta[4];   // off_beg, off_end, n_mapped, n_unmapped
+    int has_meta, loaded;
+} idx_lazy_ref_t;
+
+typedef struct {
+    BGZF *fp;           // The index itself, or
+    uint8_t *map;       // an uncompressed copy from the cache file
+    size_t map_len;
+    int is_mmap;
+    idx_lazy_ref_t *ref;
+    pthread_mutex_t lock;
+} idx_lazy_t;
+
 struct __hts_idx_t {
     int fmt, min_shift, n_lvls, n_bins;
     uint32_t l_meta;
@@ -1321,6 +1369,8 @@ struct __hts_idx_t {
     bidx_t **bidx;
     lidx_t *lidx;
     uint8_t *meta; // MUST have a terminating NUL on the end
+    idx_lazy_t *lazy;
+    hts_idx_shared_t *shared; // Set if owned by the shared index cache
     int tbi_n, last_tbi_tid;
     struct {
         uint32_t last_bin, save_bin;
@@ -1633,6 +1683,312 @@ int hts_idx_push(hts_idx_t *idx, int tid, int beg, int end, uint64_t offset, int
     }
 }
 
+/*
+ * Parallel index building; see hts_internal.h for an overview.
+ */
+
+#define HTS_IDX_SHARD_MIN ((int64_t) 64 << 10)
+#define HTS_IDX_SHARD_MAX ((int64_t) 16 << 20)
+#define HTS_IDX_SYNC_MAX  (16 << 20)  // bytes searched for a first record
+#define HTS_IDX_SYNC_RECS 4           // records checked for a good start
+
+typedef struct {
+    const hts_idx_reader_t *r;
+    const char *fn;
+    int64_t block;          // address of the first BGZF block
+    uint64_t start;         // first record, if known_start is set
+    int known_start;
+    uint64_t limit;         // stop at the first record that starts after this
+    // Results
+    hts_idx_rec_t *rec;
+    size_t n, m;
+    void *state;
+    uint64_t first, stop;   // first record read, and the one after the last
+    int found, eof, ret;
+} idx_shard_t;
+
+static void idx_shard_reset(idx_shard_t *sh)
+{
+    if (sh->state && sh->r->free_state) sh->r->free_state(sh->state);
+    sh->state = NULL;
+    sh->n = 0;
+    sh->found = sh->eof = sh->ret = 0;
+}
+
+static void idx_shard_free(idx_shard_t *sh)
+{
+    idx_shard_reset(sh);
+    free(sh->rec);
+    sh->rec = NULL;
+    sh->m = 0;
+}
+
+// Positions fp at the first plausible record of a binary format at or
+// after its current block.  Returns 1 if one was found, 0 if not, -1 on
+// error.  Whole blocks are read into a buffer, noting where each starts,
+// so candidates can be checked without seeking.
+static int idx_shard_sync_binary(idx_shard_t *sh, BGZF *fp)
+{
+    const hts_idx_reader_t *r = sh->r;
+    uint8_t *buf = NULL;
+    size_t len = 0, mlen = 0, i;
+    int64_t *baddr = NULL;
+    size_t *bpos = NULL, nb = 0, mb = 0, mp = 0;
+    int eof = 0, ret = -1;
+
+    for (i = 0; ; i++) {
+        size_t p = i;
+        int nrec = 0;
+
+        // Follow a chain of records from i, reading more data if needed
+        while (nrec < HTS_IDX_SYNC_RECS && !(eof && p == len)) {
+            int64_t l = p < len ? r->check(r->data, buf + p, len - p) : 0;
+            if (l < 0) break;
+            if (l > 0 && p + l <= len) {
+                p += l;
+                nrec++;
+                continue;
+            }
+            // A chain cut short by the end of the data is accepted below
+            if (eof || len >= HTS_IDX_SYNC_MAX) break;
+            if (bgzf_read_block(fp) < 0) goto out;
+            if (fp->block_length == 0) {
+                eof = 1;
+                continue;
+            }
+            if (hts_resize(int64_t, nb + 1, &mb, &baddr, 0) < 0
+                || hts_resize(size_t, nb + 1, &mp, &bpos, 0) < 0
+                || hts_resize(uint8_t, len + fp->block_length, &mlen, &buf, 0) < 0)
+                goto out;
+            baddr[nb] = fp->block_address;
+            bpos[nb++] = len;
+            memcpy(buf + len, fp->uncompressed_block, fp->block_length);
+            len += fp->block_length;
+        }
+        if (nrec == HTS_IDX_SYNC_RECS || (nrec > 0 && (eof || len >= HTS_IDX_SYNC_MAX)))
+            break;
+        if (i >= len) {
+            ret = 0;
+            goto out;
+        }
+    }
+
+    // Find the block holding offset i.  If i is at a block boundary, use the
+    // first block starting there, as bgzf_tell() would.
+    {
+        size_t j = 0;
+        while (j + 1 < nb && bpos[j+1] < i) j++;
+        if (j + 1 < nb && bpos[j+1] == i) j++;
+        if (bgzf_seek(fp, baddr[j] << 16 | (i - bpos[j]), SEEK_SET) < 0)
+            goto out;
+    }
+    ret = 1;
+
+ out:
+    free(buf);
+    free(baddr);
+    free(bpos);
+    return ret;
+}
+
+static void *idx_shard_read(void *arg)
+{
+    idx_shard_t *sh = (idx_shard_t *) arg;
+    const hts_idx_reader_t *r = sh->r;
+    BGZF *fp = bgzf_open(sh->fn, "r");
+    int ret;
+
+    if (!fp) {
+        sh->ret = -1;
+        return sh;
+    }
+
+    if (sh->known_start) {
+        if (bgzf_seek(fp, sh->start, SEEK_SET) < 0) goto fail;
+    } else {
+        if (bgzf_seek(fp, sh->block << 16, SEEK_SET) < 0) goto fail;
+        if (r->text) {
+            // The line running into the shard belongs to the one before
+            kstring_t str = { 0, 0, NULL };
+            ret = bgzf_getline(fp, '\n', &str);
+            free(str.s);
+            if (ret < -1) goto fail;
+            if (ret == -1) goto done;
+        } else {
+            if ((ret = idx_shard_sync_binary(sh, fp)) < 0) goto fail;
+            if (ret == 0) goto done;
+        }
+    }
+
+    sh->found = 1;
+    sh->first = bgzf_tell(fp);
+    for (;;) {
+        hts_idx_rec_t rec;
+        uint64_t pos = bgzf_tell(fp);
+        if (pos > sh->limit) {
+            sh->stop = pos;
+            break;
+        }
+        ret = r->read(r->data, fp, &sh->state, &rec);
+        if (ret == -1) {
+            sh->stop = bgzf_tell(fp);
+            sh->eof = 1;
+            break;
+        }
+        if (ret < -1) {
+            sh->ret = ret;
+            break;
+        }
+        if (ret == 1) continue;
+        rec.offset = bgzf_tell(fp);
+        if (sh->n == sh->m
+            && hts_resize(hts_idx_rec_t, sh->n + 1, &sh->m, &sh->rec, 0) < 0)
+            goto fail;
+        sh->rec[sh->n++] = rec;
+    }
+
+ done:
+    bgzf_close(fp);
+    return sh;
+
+ fail:
+    sh->ret = -1;
+    bgzf_close(fp);
+    return sh;
+}
+
+// Pushes the records of a finished shard into idx.  Returns 0 on success,
+// -1 on error.
+static int idx_shard_push(hts_idx_t *idx, idx_shard_t *sh, uint64_t *next,
+                          int *eof)
+{
+    const hts_idx_reader_t *r = sh->r;
+    size_t i;
+
+    if (*eof) return 0;  // an empty shard after the end of the data
+    if (!sh->found || sh->ret < 0 || sh->first != *next) {
+        // The shard started in the wrong place, or a bad start led to an
+        // error.  Read it again from where the one before it ended.
+        idx_shard_reset(sh);
+        sh->known_start = 1;
+        sh->start = *next;
+        idx_shard_read(sh);
+    }
+    if (sh->ret < 0) return -1;
+
+    if (r->finish && r->finish(r->data, sh->state, sh->rec, sh->n) < 0)
+        return -1;
+    for (i = 0; i < sh->n; i++) {
+        hts_idx_rec_t *rec = &sh->rec[i];
+        if (hts_idx_push(idx, rec->tid, rec->beg, rec->end, rec->offset,
+                         rec->is_mapped) < 0)
+            return -1;
+    }
+    *next = sh->stop;
+    *eof = sh->eof;
+    return 0;
+}
+
+int hts_idx_build_shards(hts_idx_t *idx, const char *fn, uint64_t offset0,
+                         int n_threads, const hts_idx_reader_t *reader)
+{
+    hFILE *hf;
+    int64_t size, target, *blocks = NULL;
+    size_t nblocks = 0, mblocks = 0, k, done = 0, dispatched = 0;
+    idx_shard_t *sh = NULL;
+    hts_tpool *p = NULL;
+    hts_tpool_process *q = NULL;
+    uint64_t next = offset0;
+    int eof = 0, ret = -1;
+
+    if (n_threads < 2 || !fn) return 1;
+    if (!(hf = hopen(fn, "r"))) return -1;
+    if ((size = hseek(hf, 0, SEEK_END)) < 0) goto out;
+
+    target = size / ((int64_t) n_threads * 8);
+    if (target < HTS_IDX_SHARD_MIN) target = HTS_IDX_SHARD_MIN;
+    if (target > HTS_IDX_SHARD_MAX) target = HTS_IDX_SHARD_MAX;
+
+    // Shard boundaries; the first shard starts at offset0
+    if (hts_resize(int64_t, 1, &mblocks, &blocks, 0) < 0) goto out;
+    blocks[nblocks++] = offset0 >> 16;
+    for (;;) {
+        int64_t b = bgzf_block_search(hf, blocks[nblocks-1] + target, size);
+        if (b < 0) goto out;
+        if (b >= size) break;
+        if (hts_resize(int64_t, nblocks + 1, &mblocks, &blocks, 0) < 0)
+            goto out;
+        blocks[nblocks++] = b;
+    }
+    if (nblocks < 2) {
+        ret = 1;
+        goto out;
+    }
+
+    if (!(sh = calloc(nblocks, sizeof(*sh)))) goto out;
+    for (k = 0; k < nblocks; k++) {
+        sh[k].r = reader;
+        sh[k].fn = fn;
+        sh[k].block = blocks[k];
+        if (k + 1 < nblocks) {
+            uint64_t b = (uint64_t) blocks[k+1] << 16;
+            sh[k].limit = reader->text ? b : b - 1;
+        } else {
+            sh[k].limit = UINT64_MAX;
+        }
+    }
+    sh[0].known_start = 1;
+    sh[0].start = offset0;
+
+    if (!(p = hts_tpool_init(n_threads))
+        || !(q = hts_tpool_process_init(p, n_threads * 2, 0)))
+        goto out;
+
+    // Queue shards until the queue is full, then push the oldest one
+    while (done < nblocks) {
+        hts_tpool_result *res;
+        if (dispatched < nblocks) {
+            if (hts_tpool_dispatch2(p, q, idx_shard_read, &sh[dispatched], 1) == 0) {
+                dispatched++;
+                continue;
+            }
+            if (errno != EAGAIN) goto out;
+        }
+        if (!(res = hts_tpool_next_result_wait(q))) goto out;
+        hts_tpool_delete_result(res, 0);
+        k = done++;
+        if (idx_shard_push(idx, &sh[k], &next, &eof) < 0) goto out;
+        idx_shard_free(&sh[k]);
+    }
+
+    if (!eof) {
+        hts_log_error("Failed to read to the end of \"%s\"", fn);
+        goto out;
+    }
+    if (hts_idx_finish(idx, next) < 0) goto out;
+    ret = 0;
+
+ out:
+    if (q) {
+        // Let any jobs still running finish before their shards are freed
+        while (done < dispatched) {
+            hts_tpool_result *res = hts_tpool_next_result_wait(q);
+            if (!res) break;
+            hts_tpool_delete_result(res, 0);
+            done++;
+        }
+        hts_tpool_process_destroy(q);
+    }
+    if (p) hts_tpool_destroy(p);
+    if (sh) {
+        for (k = 0; k < nblocks; k++) idx_shard_free(&sh[k]);
+        free(sh);
+    }
+    free(blocks);
+    if (hclose(hf) < 0) ret = -1;
+    return ret;
+}
+
 // Needed for TBI only.  Ensure 'tid' with 'name' is in the index meta data.
 // idx->meta needs to have been initialsed first with an appropriate Tabix
 // configuration via hts_idx_set_meta.
@@ -1678,10 +2034,50 @@ void hts_idx_amend_last(hts_idx_t *idx, uint64_t offset)
     idx->z.last_off = offset;
 }
 
-void hts_idx_destroy(hts_idx_t *idx)
+static void idx_free_ref(hts_idx_t *idx, int i)
 {
+    bidx_t *bidx = idx->bidx[i];
     khint_t k;
+
+    free(idx->lidx[i].offset);
+    idx->lidx[i].offset = NULL;
+    idx->lidx[i].n = idx->lidx[i].m = 0;
+    if (bidx == 0) return;
+    for (k = kh_begin(bidx); k != kh_end(bidx); ++k)
+        if (kh_exist(bidx, k))
+            free(kh_value(bidx, k).list);
+    kh_destroy(bin, bidx);
+    idx->bidx[i] = NULL;
+}
+
+static void idx_lazy_destroy(idx_lazy_t *lz)
+{
+    if (!lz) return;
+    if (lz->fp) bgzf_close(lz->fp);
+#ifdef HAVE_MMAP
+    if (lz->is_mmap)
+        munmap(lz->map, lz->map_len);
+    else
+#endif
+        free(lz->map);
+    free(lz->ref);
+    pthread_mutex_destroy(&lz->lock);
+    free(lz);
+}
+
+static void idx_destroy(void *data)
+{
+    hts_idx_t *idx = (hts_idx_t *) data;
     int i;
+    for (i = 0; i < idx->m; ++i)
+        idx_free_ref(idx, i);
+    idx_lazy_destroy(idx->lazy);
+    free(idx->bidx); free(idx->lidx); free(idx->meta);
+    free(idx);
+}
+
+void hts_idx_destroy(hts_idx_t *idx)
+{
     if (idx == 0) return;
 
     // For HTS_FMT_CRAI, idx actually points to a different type -- see sam.c
@@ -1692,17 +2088,40 @@ void hts_idx_destroy(hts_idx_t *idx)
         return;
     }
 
-    for (i = 0; i < idx->m; ++i) {
-        bidx_t *bidx = idx->bidx[i];
-        free(idx->lidx[i].offset);
-        if (bidx == 0) continue;
-        for (k = kh_begin(bidx); k != kh_end(bidx); ++k)
-            if (kh_exist(bidx, k))
-                free(kh_value(bidx, k).list);
-        kh_destroy(bin, bidx);
+    if (idx->shared)
+        hts_idx_shared_release(idx->shared);
+    else
+        idx_destroy(idx);
+}
+
+// Approximate memory used by reference tid's bins and linear index
+static size_t idx_ref_mem_size(const hts_idx_t *idx, int tid)
+{
+    bidx_t *bidx = idx->bidx[tid];
+    size_t sz = idx->lidx[tid].m * sizeof(uint64_t);
+    khint_t k;
+    if (!bidx) return sz;
+    sz += kh_n_buckets(bidx) * (sizeof(uint32_t) + sizeof(bins_t));
+    for (k = kh_begin(bidx); k != kh_end(bidx); ++k)
+        if (kh_exist(bidx, k))
+            sz += kh_value(bidx, k).m * sizeof(hts_pair64_t);
+    return sz;
+}
+
+// Approximate memory used by idx, for the shared index cache.  For lazily
+// loaded indexes, references loaded later are added by idx_lazy_load_ref().
+static size_t idx_mem_size(const hts_idx_t *idx)
+{
+    size_t sz = sizeof(*idx) + idx->l_meta
+        + idx->m * (sizeof(bidx_t *) + sizeof(lidx_t));
+    int i;
+    for (i = 0; i < idx->n; ++i)
+        sz += idx_ref_mem_size(idx, i);
+    if (idx->lazy) {
+        sz += sizeof(*idx->lazy) + idx->n * sizeof(idx_lazy_ref_t);
+        if (!idx->lazy->is_mmap) sz += idx->lazy->map_len;
     }
-    free(idx->bidx); free(idx->lidx); free(idx->meta);
-    free(idx);
+    return sz;
 }
 
 int hts_idx_fmt(hts_idx_t *idx) {
@@ -1739,12 +2158,16 @@ static inline void swap_bins(bins_t *p)
     }
 }
 
+static int idx_load_all(const hts_idx_t *idx);
+
 static int hts_idx_save_core(const hts_idx_t *idx, BGZF *fp, int fmt)
 {
     int32_t i, j;
 
     #define check(ret) if ((ret) < 0) return -1
 
+    check(idx_load_all(idx));
+
     // VCF TBI/CSI only writes IDs for non-empty bins (ie covered references)
     //
     // NOTE: CSI meta is undefined in spec, so this code has an assumption
@@ -1849,196 +2272,632 @@ fail:
     return -1;
 }
 
-static int hts_idx_load_core(hts_idx_t *idx, BGZF *fp, int fmt)
+// Index data is read either from the BGZF-compressed index itself, or from
+// an uncompressed copy of it in memory.  If tee is set, everything read
+// from fp is also written there, which is how the cache file is made.
+typedef struct {
+    BGZF *fp;
+    const uint8_t *mem;
+    size_t len, pos;
+    FILE *tee;
+    uint64_t tee_pos;
+} idx_src_t;
+
+static int idx_src_read(idx_src_t *src, void *buf, size_t len)
 {
-    int32_t i, n, is_be;
-    is_be = ed_is_big();
-    if (idx == NULL) return -4;
-    for (i = 0; i < idx->n; ++i) {
-        bidx_t *h;
-        lidx_t *l = &idx->lidx[i];
-        uint32_t key;
-        int j, absent;
-        bins_t *p;
-        h = idx->bidx[i] = kh_init(bin);
-        if (bgzf_read(fp, &n, 4) != 4) return -1;
-        if (is_be) ed_swap_4p(&n);
-        if (n < 0) return -3;
-        for (j = 0; j < n; ++j) {
-            khint_t k;
-            if (bgzf_read(fp, &key, 4) != 4) return -1;
-            if (is_be) ed_swap_4p(&key);
-            k = kh_put(bin, h, key, &absent);
-            if (absent <  0) return -2; // No memory
-            if (absent == 0) return -3; // Duplicate bin number
-            p = &kh_val(h, k);
-            if (fmt == HTS_FMT_CSI) {
-                if (bgzf_read(fp, &p->loff, 8) != 8) return -1;
-                if (is_be) ed_swap_8p(&p->loff);
-            } else p->loff = 0;
-            if (bgzf_read(fp, &p->n, 4) != 4) return -1;
-            if (is_be) ed_swap_4p(&p->n);
-            if (p->n < 0) return -3;
-            if ((size_t) p->n > SIZE_MAX / sizeof(hts_pair64_t)) return -2;
-            p->m = p->n;
-            p->list = (hts_pair64_t*)malloc(p->m * sizeof(hts_pair64_t));
-            if (p->list == NULL) return -2;
-            if (bgzf_read(fp, p->list, ((size_t) p->n)<<4) != ((size_t) p->n)<<4) return -1;
-            if (is_be) swap_bins(p);
-        }
-        if (fmt != HTS_FMT_CSI) { // load linear index
-            int j;
-            if (bgzf_read(fp, &l->n, 4) != 4) return -1;
-            if (is_be) ed_swap_4p(&l->n);
-            if (l->n < 0) return -3;
-            if ((size_t) l->n > SIZE_MAX / sizeof(uint64_t)) return -2;
-            l->m = l->n;
-            l->offset = (uint64_t*)malloc(l->n * sizeof(uint64_t));
-            if (l->offset == NULL) return -2;
-            if (bgzf_read(fp, l->offset, l->n << 3) != l->n << 3) return -1;
-            if (is_be) for (j = 0; j < l->n; ++j) ed_swap_8p(&l->offset[j]);
-            for (j = 1; j < l->n; ++j) // fill missing values; may happen given older samtools and tabix
-                if (l->offset[j] == 0) l->offset[j] = l->offset[j-1];
-            update_loff(idx, i, 1);
+    if (src->fp) {
+        if (bgzf_read(src->fp, buf, len) != (ssize_t) len) return -1;
+        if (src->tee) {
+            if (fwrite(buf, 1, len, src->tee) != len) return -1;
+            src->tee_pos += len;
         }
+        return 0;
     }
-    if (bgzf_read(fp, &idx->n_no_coor, 8) != 8) idx->n_no_coor = 0;
-    if (is_be) ed_swap_8p(&idx->n_no_coor);
+    if (len > src->len - src->pos) return -1;
+    memcpy(buf, src->mem + src->pos, len);
+    src->pos += len;
     return 0;
 }
 
-static hts_idx_t *hts_idx_load_local(const char *fn)
+static int idx_src_skip(idx_src_t *src, size_t len)
 {
-    uint8_t magic[4];
-    int i, is_be;
-    hts_idx_t *idx = NULL;
-    uint8_t *meta = NULL;
-    BGZF *fp = bgzf_open(fn, "r");
-    if (fp == NULL) return NULL;
-    is_be = ed_is_big();
-    if (bgzf_read(fp, magic, 4) != 4) goto fail;
+    uint8_t buf[4096];
 
-    if (memcmp(magic, "CSI\1", 4) == 0) {
-        uint32_t x[3], n;
-        if (bgzf_read(fp, x, 12) != 12) goto fail;
-        if (is_be) for (i = 0; i < 3; ++i) ed_swap_4p(&x[i]);
-        if (x[2]) {
-            if (SIZE_MAX - x[2] < 1) goto fail; // Prevent possible overflow
-            if ((meta = (uint8_t*)malloc((size_t) x[2] + 1)) == NULL) goto fail;
-            if (bgzf_read(fp, meta, x[2]) != x[2]) goto fail;
-            // Prevent possible strlen past the end in tbx_index_load2
-            meta[x[2]] = '\0';
-        }
-        if (bgzf_read(fp, &n, 4) != 4) goto fail;
-        if (is_be) ed_swap_4p(&n);
-        if (n > INT32_MAX) goto fail;
-        if ((idx = hts_idx_init(n, HTS_FMT_CSI, 0, x[0], x[1])) == NULL) goto fail;
-        idx->l_meta = x[2];
-        idx->meta = meta;
-        meta = NULL;
-        if (hts_idx_load_core(idx, fp, HTS_FMT_CSI) < 0) goto fail;
-    }
-    else if (memcmp(magic, "TBI\1", 4) == 0) {
-        uint8_t x[8 * 4];
-        uint32_t n;
-        // Read file header
-        if (bgzf_read(fp, x, sizeof(x)) != sizeof(x)) goto fail;
-        n = le_to_u32(&x[0]); // location of n_ref
-        if (n > INT32_MAX) goto fail;
-        if ((idx = hts_idx_init(n, HTS_FMT_TBI, 0, 14, 5)) == NULL) goto fail;
-        n = le_to_u32(&x[7*4]); // location of l_nm
-        if (n > UINT32_MAX - 29) goto fail; // Prevent possible overflow
-        idx->l_meta = 28 + n;
-        if ((idx->meta = (uint8_t*)malloc(idx->l_meta + 1)) == NULL) goto fail;
-        // copy format, col_seq, col_beg, col_end, meta, skip, l_nm
-        // N.B. left in little-endian byte order.
-        memcpy(idx->meta, &x[1*4], 28);
-        // Read in sequence names.
-        if (bgzf_read(fp, idx->meta + 28, n) != n) goto fail;
-        // Prevent possible strlen past the end in tbx_index_load2
-        idx->meta[idx->l_meta] = '\0';
-        if (hts_idx_load_core(idx, fp, HTS_FMT_TBI) < 0) goto fail;
+    if (!src->fp) {
+        if (len > src->len - src->pos) return -1;
+        src->pos += len;
+        return 0;
     }
-    else if (memcmp(magic, "BAI\1", 4) == 0) {
-        uint32_t n;
-        if (bgzf_read(fp, &n, 4) != 4) goto fail;
-        if (is_be) ed_swap_4p(&n);
-        if (n > INT32_MAX) goto fail;
-        if ((idx = hts_idx_init(n, HTS_FMT_BAI, 0, 14, 5)) == NULL) goto fail;
-        if (hts_idx_load_core(idx, fp, HTS_FMT_BAI) < 0) goto fail;
+    if (!src->tee)
+        return bgzf_skip(src->fp, len) == (ssize_t) len ? 0 : -1;
+    while (len > 0) {
+        size_t l = len < sizeof(buf) ? len : sizeof(buf);
+        if (idx_src_read(src, buf, l) < 0) return -1;
+        len -= l;
     }
-    else { errno = EINVAL; goto fail; }
+    return 0;
+}
 
-    bgzf_close(fp);
-    return idx;
+// Reads the binning and linear index for reference i
+static int idx_read_ref(hts_idx_t *idx, idx_src_t *src, int i, int fmt)
+{
+    int32_t n, is_be;
+    bidx_t *h;
+    lidx_t *l = &idx->lidx[i];
+    uint32_t key;
+    int j, absent;
+    bins_t *p;
 
-fail:
-    bgzf_close(fp);
-    hts_idx_destroy(idx);
-    free(meta);
-    return NULL;
+    is_be = ed_is_big();
+    h = idx->bidx[i] = kh_init(bin);
+    if (h == NULL) return -2;
+    if (idx_src_read(src, &n, 4) < 0) return -1;
+    if (is_be) ed_swap_4p(&n);
+    if (n < 0) return -3;
+    for (j = 0; j < n; ++j) {
+        khint_t k;
+        if (idx_src_read(src, &key, 4) < 0) return -1;
+        if (is_be) ed_swap_4p(&key);
+        k = kh_put(bin, h, key, &absent);
+        if (absent <  0) return -2; // No memory
+        if (absent == 0) return -3; // Duplicate bin number
+        p = &kh_val(h, k);
+        p->n = p->m = 0;
+        p->list = NULL;
+        if (fmt == HTS_FMT_CSI) {
+            if (idx_src_read(src, &p->loff, 8) < 0) return -1;
+            if (is_be) ed_swap_8p(&p->loff);
+        } else p->loff = 0;
+        if (idx_src_read(src, &p->n, 4) < 0) return -1;
+        if (is_be) ed_swap_4p(&p->n);
+        if (p->n < 0) return -3;
+        if ((size_t) p->n > SIZE_MAX / sizeof(hts_pair64_t)) return -2;
+        p->m = p->n;
+        p->list = (hts_pair64_t*)malloc(p->m * sizeof(hts_pair64_t));
+        if (p->list == NULL) return -2;
+        if (idx_src_read(src, p->list, ((size_t) p->n)<<4) < 0) return -1;
+        if (is_be) swap_bins(p);
+    }
+    if (fmt != HTS_FMT_CSI) { // load linear index
+        if (idx_src_read(src, &l->n, 4) < 0) return -1;
+        if (is_be) ed_swap_4p(&l->n);
+        if (l->n < 0) return -3;
+        if ((size_t) l->n > SIZE_MAX / sizeof(uint64_t)) return -2;
+        l->m = l->n;
+        l->offset = (uint64_t*)malloc(l->n * sizeof(uint64_t));
+        if (l->offset == NULL) return -2;
+        if (idx_src_read(src, l->offset, ((size_t) l->n) << 3) < 0) return -1;
+        if (is_be) for (j = 0; j < l->n; ++j) ed_swap_8p(&l->offset[j]);
+        for (j = 1; j < l->n; ++j) // fill missing values; may happen given older samtools and tabix
+            if (l->offset[j] == 0) l->offset[j] = l->offset[j-1];
+        update_loff(idx, i, 1);
+    }
+    return 0;
 }
 
-int hts_idx_set_meta(hts_idx_t *idx, uint32_t l_meta, uint8_t *meta,
-                      int is_copy)
+// Steps over the data for one reference, keeping only its pseudo-bin
+static int idx_scan_ref(hts_idx_t *idx, idx_src_t *src, int fmt,
+                        idx_lazy_ref_t *ref)
 {
-    uint8_t *new_meta = meta;
-    if (is_copy) {
-        size_t l = l_meta;
-        if (l > SIZE_MAX - 1) {
-            errno = ENOMEM;
+    int32_t n, n_chunk, is_be;
+    uint32_t key;
+    int j, k;
+
+    is_be = ed_is_big();
+    if (idx_src_read(src, &n, 4) < 0) return -1;
+    if (is_be) ed_swap_4p(&n);
+    if (n < 0) return -3;
+    for (j = 0; j < n; ++j) {
+        if (idx_src_read(src, &key, 4) < 0) return -1;
+        if (is_be) ed_swap_4p(&key);
+        if (fmt == HTS_FMT_CSI && idx_src_skip(src, 8) < 0) return -1;
+        if (idx_src_read(src, &n_chunk, 4) < 0) return -1;
+        if (is_be) ed_swap_4p(&n_chunk);
+        if (n_chunk < 0) return -3;
+        if (key == META_BIN(idx) && n_chunk > 0) {
+            int n_meta = n_chunk < 2 ? 2 * n_chunk : 4;
+            if (idx_src_read(src, ref->meta, n_meta * 8) < 0) return -1;
+            if (is_be) for (k = 0; k < n_meta; ++k) ed_swap_8p(&ref->meta[k]);
+            if (idx_src_skip(src, (size_t) (n_chunk - n_meta / 2) << 4) < 0)
+                return -1;
+            ref->has_meta = 1;
+        } else if (idx_src_skip(src, (size_t) n_chunk << 4) < 0) {
             return -1;
         }
-        new_meta = malloc(l + 1);
-        if (!new_meta) return -1;
-        memcpy(new_meta, meta, l);
-        // Prevent possible strlen past the end in tbx_index_load2
-        new_meta[l] = '\0';
     }
-    if (idx->meta) free(idx->meta);
-    idx->l_meta = l_meta;
-    idx->meta = new_meta;
+    if (fmt != HTS_FMT_CSI) {
+        if (idx_src_read(src, &n, 4) < 0) return -1;
+        if (is_be) ed_swap_4p(&n);
+        if (n < 0) return -3;
+        if (idx_src_skip(src, (size_t) n << 3) < 0) return -1;
+    }
     return 0;
 }
 
-uint8_t *hts_idx_get_meta(hts_idx_t *idx, uint32_t *l_meta)
+// BAI files are written uncompressed, and so use plain file offsets
+static inline uint64_t idx_tell(BGZF *fp)
 {
-    *l_meta = idx->l_meta;
-    return idx->meta;
+    return bgzf_compression(fp) == no_compression ? bgzf_utell(fp) : bgzf_tell(fp);
 }
 
-const char **hts_idx_seqnames(const hts_idx_t *idx, int *n, hts_id2name_f getid, void *hdr)
+static inline int idx_seek(BGZF *fp, uint64_t off)
 {
-    if ( !idx->n )
-    {
-        *n = 0;
-        return NULL;
-    }
-
-    int tid = 0, i;
-    const char **names = (const char**) calloc(idx->n,sizeof(const char*));
-    for (i=0; i<idx->n; i++)
-    {
-        bidx_t *bidx = idx->bidx[i];
-        if ( !bidx ) continue;
-        names[tid++] = getid(hdr,i);
-    }
-    *n = tid;
-    return names;
+    if (bgzf_compression(fp) == no_compression)
+        return bgzf_useek(fp, off, SEEK_SET);
+    return bgzf_seek(fp, off, SEEK_SET) < 0 ? -1 : 0;
 }
 
-int hts_idx_get_stat(const hts_idx_t* idx, int tid, uint64_t* mapped, uint64_t* unmapped)
+static int hts_idx_load_core(hts_idx_t *idx, BGZF *fp, int fmt)
 {
-    if ( idx->fmt == HTS_FMT_CRAI ) {
-        *mapped = 0; *unmapped = 0;
+    idx_src_t src = { fp, NULL, 0, 0, NULL, 0 };
+    int32_t i;
+    int ret;
+    if (idx == NULL) return -4;
+    for (i = 0; i < idx->n; ++i)
+        if ((ret = idx_read_ref(idx, &src, i, fmt)) < 0) return ret;
+    if (bgzf_read(fp, &idx->n_no_coor, 8) != 8) idx->n_no_coor = 0;
+    if (ed_is_big()) ed_swap_8p(&idx->n_no_coor);
+    return 0;
+}
+
+static idx_lazy_t *idx_lazy_init(int n)
+{
+    idx_lazy_t *lz = calloc(1, sizeof(*lz));
+    if (!lz) return NULL;
+    lz->ref = calloc(n > 0 ? n : 1, sizeof(*lz->ref));
+    if (!lz->ref || pthread_mutex_init(&lz->lock, NULL) != 0) {
+        free(lz->ref);
+        free(lz);
+        return NULL;
+    }
+    return lz;
+}
+
+// The lazy counterpart of hts_idx_load_core().  On success fp belongs to
+// the index.  If cache is set, an uncompressed copy of the data is written
+// to it, starting at cache_base, and each reference's offset within the
+// copy is stored in cache_off.
+static int idx_lazy_scan(hts_idx_t *idx, BGZF *fp, FILE *cache,
+                         uint64_t cache_base, uint64_t *cache_off)
+{
+    idx_src_t src = { fp, NULL, 0, 0, cache, cache_base };
+    int32_t i;
+    int ret;
+
+    if (!(idx->lazy = idx_lazy_init(idx->n))) return -2;
+    for (i = 0; i < idx->n; ++i) {
+        idx->lazy->ref[i].off = idx_tell(fp);
+        if (cache) cache_off[i] = src.tee_pos;
+        if ((ret = idx_scan_ref(idx, &src, idx->fmt, &idx->lazy->ref[i])) < 0)
+            return ret;
+    }
+    src.tee = NULL;
+    if (idx_src_read(&src, &idx->n_no_coor, 8) < 0) idx->n_no_coor = 0;
+    if (ed_is_big()) ed_swap_8p(&idx->n_no_coor);
+    idx->lazy->fp = fp;
+    return 0;
+}
+
+static int idx_lazy_load_ref(hts_idx_t *idx, int tid)
+{
+    idx_lazy_t *lz = idx->lazy;
+    idx_src_t src = { NULL, lz->map, lz->map_len, 0, NULL, 0 };
+    size_t added = 0;
+    int ret = 0;
+
+    pthread_mutex_lock(&lz->lock);
+    if (!lz->ref[tid].loaded) {
+        if (lz->fp) {
+            src.fp = lz->fp;
+            if (idx_seek(lz->fp, lz->ref[tid].off) < 0) ret = -1;
+        } else {
+            src.pos = lz->ref[tid].off;
+        }
+        if (ret == 0) ret = idx_read_ref(idx, &src, tid, idx->fmt);
+        if (ret == 0) {
+            lz->ref[tid].loaded = 1;
+            added = idx_ref_mem_size(idx, tid);
+        } else {
+            idx_free_ref(idx, tid);
+            hts_log_error("Failed to load the index for reference #%d", tid);
+        }
+    }
+    pthread_mutex_unlock(&lz->lock);
+    // The cache's limit has to cover what lazy loading adds too
+    if (added && idx->shared)
+        hts_idx_shared_grow(idx->shared, added);
+    return ret < 0 ? -1 : 0;
+}
+
+// Makes sure that the bins of reference tid are in memory.  Loading them
+// does not change what the index holds, so this is allowed on a const one.
+static inline int idx_load_ref(const hts_idx_t *idx, int tid)
+{
+    return idx->lazy ? idx_lazy_load_ref((hts_idx_t *) idx, tid) : 0;
+}
+
+static int idx_load_all(const hts_idx_t *idx)
+{
+    int i;
+    if (!idx->lazy) return 0;
+    for (i = 0; i < idx->n; ++i)
+        if (idx_lazy_load_ref((hts_idx_t *) idx, i) < 0) return -1;
+    return 0;
+}
+
+// Gets the contents of a reference's pseudo-bin: off_beg, off_end,
+// n_mapped and n_unmapped.  Returns 0 on success, or -1 if there is none.
+static int idx_get_meta(const hts_idx_t *idx, int tid, uint64_t meta[4])
+{
+    bidx_t *h;
+    khint_t k;
+    const bins_t *p;
+
+    if (idx->lazy) {
+        if (!idx->lazy->ref[tid].has_meta) return -1;
+        memcpy(meta, idx->lazy->ref[tid].meta, 4 * sizeof(*meta));
+        return 0;
+    }
+    if (!(h = idx->bidx[tid])) return -1;
+    k = kh_get(bin, h, META_BIN(idx));
+    if (k == kh_end(h) || kh_val(h, k).n < 1) return -1;
+    p = &kh_val(h, k);
+    meta[0] = p->list[0].u;
+    meta[1] = p->list[0].v;
+    meta[2] = p->n > 1 ? p->list[1].u : 0;
+    meta[3] = p->n > 1 ? p->list[1].v : 0;
+    return 0;
+}
+
+/*
+ * The index cache (HTS_IDX_CACHE) is an uncompressed copy of an index that
+ * can be mapped into memory, so that a lazily loaded index can be opened
+ * without reading through the whole of it.  All values are little-endian:
+ *
+ *   "HIC\1", fmt, min_shift, n_lvls, n_ref, l_meta       int32_t each
+ *   size and mtime of the index file it was made from  int64_t each
+ *   meta                                                 l_meta bytes
+ *   the data for each reference, as in the index itself
+ *   n_ref * { offset, off_beg, off_end, n_mapped,        uint64_t each
+ *             n_unmapped, has_meta }
+ *   n_no_coor                                            uint64_t
+ *
+ * The offsets table goes at the end so the file can be written in one pass.
+ */
+#define IDX_CACHE_HDR 40
+#define IDX_CACHE_REF 48
+
+static void idx_cache_put_ref(uint8_t *buf, uint64_t off,
+                              const idx_lazy_ref_t *ref)
+{
+    int k;
+    u64_to_le(off, buf);
+    for (k = 0; k < 4; ++k)
+        u64_to_le(ref->meta[k], buf + 8 * (k + 1));
+    u64_to_le(ref->has_meta, buf + 40);
+}
+
+static hts_idx_t *idx_cache_load(const char *fn, const struct stat *st_idx)
+{
+    FILE *f;
+    struct stat st;
+    uint8_t *map = NULL;
+    size_t len, data_end, i;
+    int is_mmap = 0, fmt, min_shift, n_lvls;
+    uint32_t n, l_meta;
+    hts_idx_t *idx = NULL;
+
+    if (!(f = fopen(fn, "rb"))) return NULL;
+    if (fstat(fileno(f), &st) < 0 || st.st_size < IDX_CACHE_HDR + 8
+        || (uint64_t) st.st_size > SIZE_MAX) {
+        fclose(f);
+        return NULL;
+    }
+    len = st.st_size;
+#ifdef HAVE_MMAP
+    map = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fileno(f), 0);
+    if (map == MAP_FAILED) map = NULL;
+    else is_mmap = 1;
+#endif
+    if (!map) {
+        if (!(map = malloc(len)) || fread(map, 1, len, f) != len) {
+            free(map);
+            fclose(f);
+            return NULL;
+        }
+    }
+    fclose(f);
+
+    // Anything unexpected, including a stale cache, means it is not used
+    if (memcmp(map, "HIC\1", 4) != 0) goto bad;
+    fmt = le_to_i32(map + 4);
+    min_shift = le_to_i32(map + 8);
+    n_lvls = le_to_i32(map + 12);
+    n = le_to_u32(map + 16);
+    l_meta = le_to_u32(map + 20);
+    if (le_to_i64(map + 24) != (int64_t) st_idx->st_size
+        || le_to_i64(map + 32) != (int64_t) st_idx->st_mtime)
+        goto bad;
+    if (fmt != HTS_FMT_CSI && fmt != HTS_FMT_TBI && fmt != HTS_FMT_BAI)
+        goto bad;
+    if (min_shift < 0 || n_lvls < 0 || n_lvls > 9 || n > INT32_MAX)
+        goto bad;
+    if (l_meta > len - IDX_CACHE_HDR - 8
+        || n > (len - IDX_CACHE_HDR - 8 - l_meta) / IDX_CACHE_REF)
+        goto bad;
+    data_end = len - 8 - (size_t) n * IDX_CACHE_REF;
+
+    if (!(idx = hts_idx_init(n, fmt, 0, min_shift, n_lvls))) goto bad;
+    if (!(idx->meta = malloc((size_t) l_meta + 1))) goto bad;
+    memcpy(idx->meta, map + IDX_CACHE_HDR, l_meta);
+    idx->meta[l_meta] = '\0';
+    idx->l_meta = l_meta;
+    if (!(idx->lazy = idx_lazy_init(n))) goto bad;
+    for (i = 0; i < n; ++i) {
+        const uint8_t *r = map + data_end + i * IDX_CACHE_REF;
+        idx_lazy_ref_t *ref = &idx->lazy->ref[i];
+        ref->off = le_to_u64(r);
+        if (ref->off < IDX_CACHE_HDR + (uint64_t) l_meta || ref->off > data_end)
+            goto bad;
+        ref->meta[0] = le_to_u64(r + 8);
+        ref->meta[1] = le_to_u64(r + 16);
+        ref->meta[2] = le_to_u64(r + 24);
+        ref->meta[3] = le_to_u64(r + 32);
+        ref->has_meta = le_to_u64(r + 40) != 0;
+    }
+    idx->n_no_coor = le_to_u64(map + len - 8);
+    idx->lazy->map = map;
+    idx->lazy->map_len = data_end;
+    idx->lazy->is_mmap = is_mmap;
+    return idx;
+
+ bad:
+    hts_idx_destroy(idx);
+#ifdef HAVE_MMAP
+    if (is_mmap) munmap(map, len);
+    else
+#endif
+        free(map);
+    return NULL;
+}
+
+// Starts writing a cache file for idx.  It goes to a temporary file, which
+// is renamed by idx_cache_finish() once it is complete.
+static FILE *idx_cache_start(const hts_idx_t *idx, const struct stat *st_idx,
+                             const char *tmp_fn)
+{
+    uint8_t hdr[IDX_CACHE_HDR];
+    FILE *f = fopen(tmp_fn, "wb");
+    if (!f) return NULL;
+
+    memcpy(hdr, "HIC\1", 4);
+    i32_to_le(idx->fmt, hdr + 4);
+    i32_to_le(idx->min_shift, hdr + 8);
+    i32_to_le(idx->n_lvls, hdr + 12);
+    u32_to_le(idx->n, hdr + 16);
+    u32_to_le(idx->l_meta, hdr + 20);
+    i64_to_le(st_idx->st_size, hdr + 24);
+    i64_to_le(st_idx->st_mtime, hdr + 32);
+    if (fwrite(hdr, 1, sizeof(hdr), f) != sizeof(hdr)
+        || fwrite(idx->meta, 1, idx->l_meta, f) != idx->l_meta) {
+        fclose(f);
+        remove(tmp_fn);
+        return NULL;
+    }
+    return f;
+}
+
+static int idx_cache_finish(const hts_idx_t *idx, FILE *f,
+                            const uint64_t *cache_off,
+                            const char *tmp_fn, const char *fn)
+{
+    uint8_t buf[IDX_CACHE_REF];
+    int i;
+
+    for (i = 0; i < idx->n; ++i) {
+        idx_cache_put_ref(buf, cache_off[i], &idx->lazy->ref[i]);
+        if (fwrite(buf, 1, IDX_CACHE_REF, f) != IDX_CACHE_REF) goto fail;
+    }
+    u64_to_le(idx->n_no_coor, buf);
+    if (fwrite(buf, 1, 8, f) != 8) goto fail;
+    if (fclose(f) != 0) {
+        f = NULL;
+        goto fail;
+    }
+    if (rename(tmp_fn, fn) < 0) {
+        f = NULL;
+        goto fail;
+    }
+    return 0;
+
+ fail:
+    if (f) fclose(f);
+    remove(tmp_fn);
+    return -1;
+}
+
+static hts_idx_t *hts_idx_load_local(const char *fn, int flags)
+{
+    uint8_t magic[4];
+    int i, is_be, fmt;
+    hts_idx_t *idx = NULL;
+    uint8_t *meta = NULL;
+    kstring_t cache_fn = { 0, 0, NULL }, tmp_fn = { 0, 0, NULL };
+    uint64_t *cache_off = NULL;
+    FILE *cache = NULL;
+    struct stat st;
+    BGZF *fp;
+
+    if ((flags & HTS_IDX_CACHE) && stat(fn, &st) == 0) {
+        if (ksprintf(&cache_fn, "%s.cache", fn) < 0) return NULL;
+        if ((idx = idx_cache_load(cache_fn.s, &st)) != NULL) {
+            free(cache_fn.s);
+            return idx;
+        }
+    }
+
+    fp = bgzf_open(fn, "r");
+    if (fp == NULL) goto fail;
+    is_be = ed_is_big();
+    if (bgzf_read(fp, magic, 4) != 4) goto fail;
+
+    if (memcmp(magic, "CSI\1", 4) == 0) {
+        uint32_t x[3], n;
+        if (bgzf_read(fp, x, 12) != 12) goto fail;
+        if (is_be) for (i = 0; i < 3; ++i) ed_swap_4p(&x[i]);
+        if (x[2]) {
+            if (SIZE_MAX - x[2] < 1) goto fail; // Prevent possible overflow
+            if ((meta = (uint8_t*)malloc((size_t) x[2] + 1)) == NULL) goto fail;
+            if (bgzf_read(fp, meta, x[2]) != x[2]) goto fail;
+            // Prevent possible strlen past the end in tbx_index_load2
+            meta[x[2]] = '\0';
+        }
+        if (bgzf_read(fp, &n, 4) != 4) goto fail;
+        if (is_be) ed_swap_4p(&n);
+        if (n > INT32_MAX) goto fail;
+        if ((idx = hts_idx_init(n, HTS_FMT_CSI, 0, x[0], x[1])) == NULL) goto fail;
+        idx->l_meta = x[2];
+        idx->meta = meta;
+        meta = NULL;
+        fmt = HTS_FMT_CSI;
+    }
+    else if (memcmp(magic, "TBI\1", 4) == 0) {
+        uint8_t x[8 * 4];
+        uint32_t n;
+        // Read file header
+        if (bgzf_read(fp, x, sizeof(x)) != sizeof(x)) goto fail;
+        n = le_to_u32(&x[0]); // location of n_ref
+        if (n > INT32_MAX) goto fail;
+        if ((idx = hts_idx_init(n, HTS_FMT_TBI, 0, 14, 5)) == NULL) goto fail;
+        n = le_to_u32(&x[7*4]); // location of l_nm
+        if (n > UINT32_MAX - 29) goto fail; // Prevent possible overflow
+        idx->l_meta = 28 + n;
+        if ((idx->meta = (uint8_t*)malloc(idx->l_meta + 1)) == NULL) goto fail;
+        // copy format, col_seq, col_beg, col_end, meta, skip, l_nm
+        // N.B. left in little-endian byte order.
+        memcpy(idx->meta, &x[1*4], 28);
+        // Read in sequence names.
+        if (bgzf_read(fp, idx->meta + 28, n) != n) goto fail;
+        // Prevent possible strlen past the end in tbx_index_load2
+        idx->meta[idx->l_meta] = '\0';
+        fmt = HTS_FMT_TBI;
+    }
+    else if (memcmp(magic, "BAI\1", 4) == 0) {
+        uint32_t n;
+        if (bgzf_read(fp, &n, 4) != 4) goto fail;
+        if (is_be) ed_swap_4p(&n);
+        if (n > INT32_MAX) goto fail;
+        if ((idx = hts_idx_init(n, HTS_FMT_BAI, 0, 14, 5)) == NULL) goto fail;
+        fmt = HTS_FMT_BAI;
+    }
+    else { errno = EINVAL; goto fail; }
+
+    // Plain gzip files can't be seeked in, so are always read in full
+    if (!(flags & (HTS_IDX_LAZY | HTS_IDX_CACHE))
+        || bgzf_compression(fp) == gzip) {
+        if (hts_idx_load_core(idx, fp, fmt) < 0) goto fail;
+        bgzf_close(fp);
+        return idx;
+    }
+
+    if (cache_fn.s) {
+        if (ksprintf(&tmp_fn, "%s.%d.tmp", cache_fn.s, (int) getpid()) < 0)
+            goto fail;
+        cache_off = malloc((idx->n > 0 ? idx->n : 1) * sizeof(*cache_off));
+        if (!cache_off) goto fail;
+        if (!(cache = idx_cache_start(idx, &st, tmp_fn.s)))
+            hts_log_warning("Couldn't create index cache \"%s\" : %s",
+                            tmp_fn.s, strerror(errno));
+    }
+    if (idx_lazy_scan(idx, fp, cache, IDX_CACHE_HDR + (uint64_t) idx->l_meta,
+                      cache_off) < 0)
+        goto fail;
+    fp = NULL; // Now belongs to idx
+    if (cache) {
+        if (idx_cache_finish(idx, cache, cache_off, tmp_fn.s, cache_fn.s) < 0)
+            hts_log_warning("Couldn't write index cache \"%s\" : %s",
+                            cache_fn.s, strerror(errno));
+        cache = NULL;
+    }
+    free(cache_off);
+    free(cache_fn.s);
+    free(tmp_fn.s);
+    return idx;
+
+fail:
+    if (cache) {
+        fclose(cache);
+        remove(tmp_fn.s);
+    }
+    if (fp) bgzf_close(fp);
+    hts_idx_destroy(idx);
+    free(meta);
+    free(cache_off);
+    free(cache_fn.s);
+    free(tmp_fn.s);
+    return NULL;
+}
+
+int hts_idx_set_meta(hts_idx_t *idx, uint32_t l_meta, uint8_t *meta,
+                      int is_copy)
+{
+    uint8_t *new_meta = meta;
+    if (is_copy) {
+        size_t l = l_meta;
+        if (l > SIZE_MAX - 1) {
+            errno = ENOMEM;
+            return -1;
+        }
+        new_meta = malloc(l + 1);
+        if (!new_meta) return -1;
+        memcpy(new_meta, meta, l);
+        // Prevent possible strlen past the end in tbx_index_load2
+        new_meta[l] = '\0';
+    }
+    if (idx->meta) free(idx->meta);
+    idx->l_meta = l_meta;
+    idx->meta = new_meta;
+    return 0;
+}
+
+uint8_t *hts_idx_get_meta(hts_idx_t *idx, uint32_t *l_meta)
+{
+    *l_meta = idx->l_meta;
+    return idx->meta;
+}
+
+const char **hts_idx_seqnames(const hts_idx_t *idx, int *n, hts_id2name_f getid, void *hdr)
+{
+    if ( !idx->n )
+    {
+        *n = 0;
+        return NULL;
+    }
+
+    int tid = 0, i;
+    const char **names = (const char**) calloc(idx->n,sizeof(const char*));
+    for (i=0; i<idx->n; i++)
+    {
+        // Lazily loaded indexes have data for every reference
+        bidx_t *bidx = idx->bidx[i];
+        if ( !bidx && !idx->lazy ) continue;
+        names[tid++] = getid(hdr,i);
+    }
+    *n = tid;
+    return names;
+}
+
+int hts_idx_get_stat(const hts_idx_t* idx, int tid, uint64_t* mapped, uint64_t* unmapped)
+{
+    if ( idx->fmt == HTS_FMT_CRAI ) {
+        *mapped = 0; *unmapped = 0;
         return -1;
     }
 
-    bidx_t *h = idx->bidx[tid];
-    khint_t k = kh_get(bin, h, META_BIN(idx));
-    if (k != kh_end(h)) {
-        *mapped = kh_val(h, k).list[1].u;
-        *unmapped = kh_val(h, k).list[1].v;
+    uint64_t meta[4];
+    if (tid >= 0 && tid < idx->n && idx_get_meta(idx, tid, meta) == 0) {
+        *mapped = meta[2];
+        *unmapped = meta[3];
         return 0;
     } else {
         *mapped = 0; *unmapped = 0;
@@ -2081,7 +2940,8 @@ static inline int reg2intervals(hts_itr_t *iter, const hts_idx_t *idx, int tid,
     bidx_t *bidx;
     khint_t k;
 
-    if (!iter || !idx || (bidx = idx->bidx[tid]) == NULL || beg >= end)
+    if (!iter || !idx || idx_load_ref(idx, tid) < 0
+        || (bidx = idx->bidx[tid]) == NULL || beg >= end)
         return -1;
 
     s = min_shift + (n_lvls<<1) + n_lvls;
@@ -2129,23 +2989,26 @@ static int compare_regions(const void *r1, const void *r2) {
         return reg1->tid - reg2->tid;
 }
 
+static int compare_intervals(const void *i1, const void *i2) {
+    const hts_pair32_t *a = (const hts_pair32_t *)i1;
+    const hts_pair32_t *b = (const hts_pair32_t *)i2;
+
+    return (a->beg > b->beg) - (a->beg < b->beg);
+}
+
 uint64_t hts_itr_off(const hts_idx_t* idx, int tid) {
 
     int i;
-    bidx_t* bidx;
-    uint64_t off0 = (uint64_t) -1;
-    khint_t k;
+    uint64_t off0 = (uint64_t) -1, meta[4];
     switch (tid) {
     case HTS_IDX_START:
         // Find the smallest offset, note that sequence ids may not be ordered sequentially
         for (i = 0; i < idx->n; i++) {
-            bidx = idx->bidx[i];
-            k = kh_get(bin, bidx, META_BIN(idx));
-            if (k == kh_end(bidx))
+            if (idx_get_meta(idx, i, meta) < 0)
                 continue;
 
-            if (off0 > kh_val(bidx, k).list[0].u)
-                off0 = kh_val(bidx, k).list[0].u;
+            if (off0 > meta[0])
+                off0 = meta[0];
         }
         if (off0 == (uint64_t) -1 && idx->n_no_coor)
             off0 = 0;
@@ -2159,11 +3022,9 @@ uint64_t hts_itr_off(const hts_idx_t* idx, int tid) {
            or sequence ids are not ordered sequentially.
            See issue samtools#568 and commits b2aab8, 60c22d and cc207d. */
         for (i = 0; i < idx->n; i++) {
-            bidx = idx->bidx[i];
-            k = kh_get(bin, bidx, META_BIN(idx));
-            if (k != kh_end(bidx)) {
-                if (off0 == (uint64_t) -1 || off0 < kh_val(bidx, k).list[0].v) {
-                    off0 = kh_val(bidx, k).list[0].v;
+            if (idx_get_meta(idx, i, meta) == 0) {
+                if (off0 == (uint64_t) -1 || off0 < meta[1]) {
+                    off0 = meta[1];
                 }
             }
         }
@@ -2218,7 +3079,8 @@ hts_itr_t *hts_itr_query(const hts_idx_t *idx, int tid, int beg, int end, hts_re
               free(iter);
               return NULL;
             }
-            if (tid >= idx->n || (bidx = idx->bidx[tid]) == NULL) {
+            if (tid >= idx->n || idx_load_ref(idx, tid) < 0
+                || (bidx = idx->bidx[tid]) == NULL) {
               free(iter);
               return NULL;
             }
@@ -2306,10 +3168,146 @@ hts_itr_t *hts_itr_query(const hts_idx_t *idx, int tid, int beg, int end, hts_re
     return iter;
 }
 
+// Sorts chunks, then merges those that are contained in or overlap the
+// one before, or start in the BGZF block where it ends.  Returns the number
+// of chunks left.
+static int itr_merge_chunks(hts_pair64_max_t *off, int n_off)
+{
+    int i, l;
+
+    if (n_off == 0)
+        return 0;
+    ks_introsort(_off_max, n_off, off);
+    // resolve completely contained adjacent blocks
+    for (i = 1, l = 0; i < n_off; ++i) {
+        if (off[l].v < off[i].v) {
+            off[++l] = off[i];
+        } else {
+            off[l].max = (off[i].max > off[l].max ? off[i].max : off[l].max);
+        }
+    }
+    n_off = l + 1;
+    // resolve overlaps between adjacent blocks; this may happen due to the merge in indexing
+    for (i = 1; i < n_off; ++i)
+        if (off[i-1].v >= off[i].u) off[i-1].v = off[i].u;
+    // merge adjacent blocks
+    for (i = 1, l = 0; i < n_off; ++i) {
+        if (off[l].v>>16 == off[i].u>>16) {
+            off[l].v = off[i].v;
+            off[l].max = (off[i].max > off[l].max ? off[i].max : off[l].max);
+        } else off[++l] = off[i];
+    }
+    return l + 1;
+}
+
+/*
+ * Query planning for multi-region iterators.  The chunks for each
+ * reference can be read as they are, or with the gaps between them read
+ * through instead of seeked over where they are shorter than a seek, or
+ * be replaced by one chunk covering all of the reference's data (from its
+ * pseudo-bin).  Costs are in bytes of compressed data, as chunk sizes are
+ * all that the index gives, with each seek counted as iter->seek_cost bytes
+ * (or HTS_ITR_SEEK_COST).
+ */
+static inline int64_t chunk_bytes(const hts_pair64_max_t *c)
+{
+    return (int64_t) (c->v >> 16) - (int64_t) (c->u >> 16);
+}
+
+static int itr_plan_chunks(const hts_idx_t *idx, hts_itr_t *iter)
+{
+    static const char *names[] = { "auto", "index", "coalesce", "scan" };
+    hts_pair64_max_t *off = iter->off;
+    int64_t itr_seek_cost = iter->seek_cost > 0 ? iter->seek_cost : HTS_ITR_SEEK_COST;
+    int i, j, k, n = 0;
+
+    if (!iter->reg_plan && iter->n_reg > 0) {
+        iter->reg_plan = malloc(iter->n_reg * sizeof(*iter->reg_plan));
+        if (!iter->reg_plan)
+            return -1;
+    }
+    for (i = 0; i < iter->n_reg; i++)
+        iter->reg_plan[i] = -1;
+
+    for (i = 0; i < iter->n_off; i = j) {
+        // Chunks are in file order, so each reference's are together
+        int tid = (int) (off[i].max >> 32), plan = iter->plan;
+        int64_t index_cost = 0, merged_cost = 0, scan_cost = -1, gap;
+        uint64_t max = 0, meta[4];
+        hts_reglist_t key, *reg;
+
+        for (j = i; j < iter->n_off && (int) (off[j].max >> 32) == tid; j++) {
+            index_cost += chunk_bytes(&off[j]) + itr_seek_cost;
+            merged_cost += chunk_bytes(&off[j]);
+            if (j == i) {
+                merged_cost += itr_seek_cost;
+            } else {
+                gap = (int64_t) (off[j].u >> 16) - (int64_t) (off[j-1].v >> 16);
+                merged_cost += gap < itr_seek_cost ? gap : itr_seek_cost;
+            }
+            if (off[j].max > max) max = off[j].max;
+        }
+        if (tid < idx->n && idx_get_meta(idx, tid, meta) == 0
+            && meta[1] > meta[0]) {
+            // Cover the chunks too, in case one strays over the ends
+            if (off[i].u < meta[0]) meta[0] = off[i].u;
+            if (off[j-1].v > meta[1]) meta[1] = off[j-1].v;
+            scan_cost = (int64_t) (meta[1] >> 16) - (int64_t) (meta[0] >> 16)
+                + itr_seek_cost;
+        }
+
+        if (plan == HTS_ITR_PLAN_AUTO) {
+            int64_t best = index_cost;
+            plan = HTS_ITR_PLAN_INDEX;
+            if (merged_cost < best) {
+                plan = HTS_ITR_PLAN_COALESCE;
+                best = merged_cost;
+            }
+            if (scan_cost >= 0 && scan_cost < best)
+                plan = HTS_ITR_PLAN_SCAN;
+        } else if (plan == HTS_ITR_PLAN_SCAN && scan_cost < 0) {
+            plan = HTS_ITR_PLAN_COALESCE; // No pseudo-bin to give the extent
+        }
+
+        switch (plan) {
+        case HTS_ITR_PLAN_SCAN:
+            off[n].u = meta[0];
+            off[n].v = meta[1];
+            off[n++].max = max;
+            break;
+        case HTS_ITR_PLAN_COALESCE:
+            off[n++] = off[i];
+            for (k = i + 1; k < j; k++) {
+                gap = (int64_t) (off[k].u >> 16) - (int64_t) (off[n-1].v >> 16);
+                if (gap < itr_seek_cost) {
+                    off[n-1].v = off[k].v;
+                    if (off[k].max > off[n-1].max) off[n-1].max = off[k].max;
+                } else {
+                    off[n++] = off[k];
+                }
+            }
+            break;
+        default:
+            for (k = i; k < j; k++)
+                off[n++] = off[k];
+            break;
+        }
+
+        key.tid = tid;
+        reg = bsearch(&key, iter->reg_list, iter->n_reg, sizeof(hts_reglist_t), compare_regions);
+        if (reg) iter->reg_plan[reg - iter->reg_list] = plan;
+        hts_log_info("Reading %d chunk(s) for reference #%d by %s; estimated"
+                     " costs %" PRId64 " (index), %" PRId64 " (coalesce), %"
+                     PRId64 " (scan)", j - i, tid, names[plan],
+                     index_cost, merged_cost, scan_cost);
+    }
+    iter->n_off = itr_merge_chunks(off, n);
+    return 0;
+}
+
 int hts_itr_multi_bam(const hts_idx_t *idx, hts_itr_t *iter)
 {
-    int i, j, l, n_off = 0, bin;
-    hts_pair64_max_t *off = NULL;
+    int i, j, n_off = 0, bin;
     khint_t k;
     bidx_t *bidx;
     uint64_t min_off, max_off, t_off = (uint64_t)-1;
@@ -2344,7 +3342,11 @@ int hts_itr_multi_bam(const hts_idx_t *idx, hts_itr_t *iter)
                 }
             }
         } else {
-            if (tid >= idx->n || (bidx = idx->bidx[tid]) == NULL || !kh_size(bidx))
+            if (tid >= idx->n)
+                continue;
+            if (idx_load_ref(idx, tid) < 0)
+                return -1;
+            if ((bidx = idx->bidx[tid]) == NULL || !kh_size(bidx))
                 continue;
 
             for(j=0; j<curr_reg->count; j++) {
@@ -2392,43 +3394,50 @@ int hts_itr_multi_bam(const hts_idx_t *idx, hts_itr_t *iter)
                 //convert coordinates to file offsets
                 reg2intervals(iter, idx, tid, beg, end, min_off, max_off, idx->min_shift, idx->n_lvls);
             }
-        }
-    }
-
-    off = iter->off;
-    n_off = iter->n_off;
-
-    if (n_off) {
-        ks_introsort(_off_max, n_off, off);
-        // resolve completely contained adjacent blocks
-        for (i = 1, l = 0; i < n_off; ++i) {
-            if (off[l].v < off[i].v) {
-                off[++l] = off[i];
-            } else {
-                off[l].max = (off[i].max > off[l].max ? off[i].max : off[l].max);
-            }
-        }
-        n_off = l + 1;
-        // resolve overlaps between adjacent blocks; this may happen due to the merge in indexing
-        for (i = 1; i < n_off; ++i)
-            if (off[i-1].v >= off[i].u) off[i-1].v = off[i].u;
-        // merge adjacent blocks
-        for (i = 1, l = 0; i < n_off; ++i) {
-            if (off[l].v>>16 == off[i].u>>16) {
-                off[l].v = off[i].v;
-                off[l].max = (off[i].max > off[l].max ? off[i].max : off[l].max);
-            } else off[++l] = off[i];
-        }
-        n_off = l + 1;
-        iter->n_off = n_off; iter->off = off;
+        }
     }
 
+    iter->n_off = itr_merge_chunks(iter->off, iter->n_off);
+    if (iter->n_off && itr_plan_chunks(idx, iter) < 0)
+        return -1;
+    n_off = iter->n_off;
+
     if(!n_off && !iter->nocoor)
         iter->finished = 1;
 
     return 0;
 }
 
+int hts_itr_multi_set_plan(const hts_idx_t *idx, hts_itr_t *iter,
+                           int plan, int64_t seek_cost)
+{
+    if (!iter || !iter->multi
+        || plan < HTS_ITR_PLAN_AUTO || plan > HTS_ITR_PLAN_SCAN)
+        return -1;
+    if (iter->is_cram || iter->read_rest)
+        return 0; // Nothing to plan
+    if (!idx || iter->i >= 0 || iter->curr_off || iter->mt)
+        return -1; // Too late, reading has started
+
+    iter->plan = plan;
+    iter->seek_cost = seek_cost;
+    // Planning merges chunks in place, so work them out again
+    iter->n_off = 0;
+    iter->finished = 0;
+    return hts_itr_multi_bam(idx, iter);
+}
+
+int hts_itr_multi_plan(const hts_itr_t *iter, int tid)
+{
+    hts_reglist_t key, *reg;
+
+    if (!iter || !iter->multi || !iter->reg_plan)
+        return -1;
+    key.tid = tid;
+    reg = bsearch(&key, iter->reg_list, iter->n_reg, sizeof(hts_reglist_t), compare_regions);
+    return reg ? iter->reg_plan[reg - iter->reg_list] : -1;
+}
+
 int hts_itr_multi_cram(const hts_idx_t *idx, hts_itr_t *iter)
 {
     const hts_cram_idx_t *cidx = (const hts_cram_idx_t *) idx;
@@ -2558,13 +3567,533 @@ int hts_itr_multi_cram(const hts_idx_t *idx, hts_itr_t *iter)
     return 0;
 }
 
+/**************
+ *** Shards ***
+ **************/
+
+typedef struct {
+    uint64_t off;
+    int tid, pos;
+} shard_point_t;
+
+typedef struct {
+    shard_point_t *a;
+    size_t n, m;
+} shard_points_t;
+
+static int shard_point_cmp(const void *av, const void *bv)
+{
+    const shard_point_t *a = (const shard_point_t *) av;
+    const shard_point_t *b = (const shard_point_t *) bv;
+    return a->off < b->off ? -1 : a->off > b->off;
+}
+
+static int add_shard_point(shard_points_t *pts, uint64_t off, int tid, int pos)
+{
+    if (pts->n == pts->m
+        && hts_resize(shard_point_t, pts->n + 1, &pts->m, &pts->a, 0) < 0)
+        return -1;
+    pts->a[pts->n].off = off;
+    pts->a[pts->n].tid = tid;
+    pts->a[pts->n].pos = pos;
+    pts->n++;
+    return 0;
+}
+
+// Every chunk in the binning index starts on a record, as does the linear
+// offset of each bin, so together they give candidate shard boundaries.
+static int bgzf_shard_points(const hts_idx_t *idx, shard_points_t *pts,
+                             uint64_t *end_off)
+{
+    int tid, j;
+    khint_t k;
+
+    *end_off = 0;
+    for (tid = 0; tid < idx->n; tid++) {
+        bidx_t *bidx = idx->bidx[tid];
+        if (!bidx) continue;
+        for (k = kh_begin(bidx); k != kh_end(bidx); ++k) {
+            uint32_t bin;
+            bins_t *p;
+            int64_t pos64;
+            int pos, level = 0;
+            if (!kh_exist(bidx, k)) continue;
+            bin = kh_key(bidx, k);
+            p = &kh_val(bidx, k);
+            if (bin == META_BIN(idx)) {
+                if (p->n > 0 && *end_off < p->list[0].v)
+                    *end_off = p->list[0].v;
+                continue;
+            }
+            if (bin >= idx->n_bins) continue;
+            // Position of the start of the bin
+            while (level < idx->n_lvls && bin >= (uint32_t) hts_bin_first(level + 1))
+                level++;
+            pos64 = (int64_t) (bin - hts_bin_first(level))
+                << (idx->min_shift + 3 * (idx->n_lvls - level));
+            pos = pos64 < INT_MAX ? pos64 : INT_MAX;
+            if (p->loff && add_shard_point(pts, p->loff, tid, pos) < 0)
+                return -1;
+            for (j = 0; j < p->n; j++)
+                if (add_shard_point(pts, p->list[j].u, tid, pos) < 0)
+                    return -1;
+        }
+    }
+    return 0;
+}
+
+static int cram_shard_points_(cram_index *e, int n, shard_points_t *pts,
+                              uint64_t *end_off)
+{
+    int i;
+    for (i = 0; i < n; i++) {
+        uint64_t end = e[i].offset + e[i].slice + e[i].len;
+        if (e[i].offset < 0) continue;
+        if (add_shard_point(pts, e[i].offset, e[i].refid,
+                            e[i].refid >= 0 && e[i].start > 0 ? e[i].start - 1 : 0) < 0)
+            return -1;
+        if (*end_off < end) *end_off = end;
+        if (e[i].e && cram_shard_points_(e[i].e, e[i].nslice, pts, end_off) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+// CRAI entries give the offset of each container, and shards are made of
+// whole containers.
+static int cram_shard_points(const hts_cram_idx_t *cidx, shard_points_t *pts,
+                             uint64_t *end_off)
+{
+    cram_fd *fd = cidx->cram;
+    int i;
+
+    *end_off = 0;
+    for (i = 0; i < fd->index_sz; i++)
+        if (fd->index[i].e
+            && cram_shard_points_(fd->index[i].e, fd->index[i].nslice, pts,
+                                  end_off) < 0)
+            return -1;
+    return 0;
+}
+
+// Records of a reference before offset off, estimated by assuming that
+// they are evenly spread between its first and last offsets.
+static uint64_t shard_count_before(uint64_t count, uint64_t beg, uint64_t end,
+                                   uint64_t off)
+{
+    if (off <= beg) return 0;
+    if (off >= end) return count;
+    return (uint64_t) ((double) count * (double) (off - beg)
+                       / (double) (end - beg));
+}
+
+int hts_idx_shards(const hts_idx_t *idx, int n, hts_shard_t **shards)
+{
+    int is_cram = idx && idx->fmt == HTS_FMT_CRAI;
+    shard_points_t pts = { NULL, 0, 0 };
+    hts_shard_t *sh = NULL;
+    uint64_t end_off, first, last;
+    size_t i, j;
+    int k, n_sh = 0, tid;
+
+    *shards = NULL;
+    if (!idx || n < 1) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (is_cram) {
+        if (cram_shard_points((const hts_cram_idx_t *) idx, &pts, &end_off) < 0)
+            goto fail;
+    } else {
+        if (idx_load_all(idx) < 0) goto fail;
+        if (bgzf_shard_points(idx, &pts, &end_off) < 0) goto fail;
+    }
+    if (pts.n == 0) {
+        free(pts.a);
+        return 0;
+    }
+
+    qsort(pts.a, pts.n, sizeof(*pts.a), shard_point_cmp);
+    for (i = 1, j = 0; i < pts.n; i++)
+        if (pts.a[i].off != pts.a[j].off) pts.a[++j] = pts.a[i];
+    pts.n = j + 1;
+
+    // Compressed byte positions of the data
+#define SHARD_BYTE(off) (is_cram ? (off) : (off) >> 16)
+    first = SHARD_BYTE(pts.a[0].off);
+    last = SHARD_BYTE(end_off);
+    if (last <= first) last = first + 1;
+
+    if (!(sh = calloc(n, sizeof(*sh)))) goto fail;
+    for (k = 0, i = 0; k < n && i < pts.n; k++) {
+        uint64_t target = first + (uint64_t) ((double) (last - first) * k / n);
+        while (i < pts.n && SHARD_BYTE(pts.a[i].off) < target) i++;
+        if (i == pts.n) break;
+        if (n_sh > 0 && pts.a[i].off <= sh[n_sh-1].beg_off) continue;
+        sh[n_sh].beg_off = pts.a[i].off;
+        sh[n_sh].tid = pts.a[i].tid;
+        sh[n_sh].pos = pts.a[i].pos;
+        n_sh++;
+    }
+    for (k = 0; k < n_sh; k++) {
+        uint64_t end = k + 1 < n_sh ? sh[k+1].beg_off : UINT64_MAX;
+        uint64_t end_byte = k + 1 < n_sh ? SHARD_BYTE(end) : last;
+        sh[k].end_off = end;
+        sh[k].bytes = end_byte > SHARD_BYTE(sh[k].beg_off)
+            ? end_byte - SHARD_BYTE(sh[k].beg_off) : 0;
+    }
+#undef SHARD_BYTE
+
+    if (!is_cram) {
+        for (tid = 0; tid < idx->n; tid++) {
+            uint64_t mapped, unmapped, beg, end;
+            khint_t kk;
+            if (!idx->bidx[tid]) continue;
+            kk = kh_get(bin, idx->bidx[tid], META_BIN(idx));
+            if (kk == kh_end(idx->bidx[tid]) || kh_val(idx->bidx[tid], kk).n < 2)
+                continue;
+            beg = kh_val(idx->bidx[tid], kk).list[0].u;
+            end = kh_val(idx->bidx[tid], kk).list[0].v;
+            mapped = kh_val(idx->bidx[tid], kk).list[1].u;
+            unmapped = kh_val(idx->bidx[tid], kk).list[1].v;
+            for (k = 0; k < n_sh; k++) {
+                sh[k].n_mapped
+                    += shard_count_before(mapped, beg, end, sh[k].end_off)
+                    - shard_count_before(mapped, beg, end, sh[k].beg_off);
+                sh[k].n_unmapped
+                    += shard_count_before(unmapped, beg, end, sh[k].end_off)
+                    - shard_count_before(unmapped, beg, end, sh[k].beg_off);
+            }
+        }
+        sh[n_sh-1].n_unmapped += idx->n_no_coor;
+    }
+
+    free(pts.a);
+    *shards = sh;
+    return n_sh;
+
+ fail:
+    free(pts.a);
+    free(sh);
+    return -1;
+}
+
+hts_itr_t *hts_shard_itr(const hts_idx_t *idx, const hts_shard_t *shard,
+                         hts_readrec_func *readrec)
+{
+    hts_itr_t *iter;
+
+    if (!idx || !shard) {
+        errno = EINVAL;
+        return NULL;
+    }
+    if (idx->fmt == HTS_FMT_CRAI) {
+        hts_log_error("CRAM shards need sam_itr_shard()");
+        errno = EINVAL;
+        return NULL;
+    }
+    if (!(iter = calloc(1, sizeof(*iter)))) return NULL;
+    if (!(iter->off = malloc(sizeof(*iter->off)))) {
+        free(iter);
+        return NULL;
+    }
+    iter->by_offset = 1;
+    iter->readrec = readrec;
+    iter->tid = shard->tid;
+    iter->beg = shard->pos;
+    iter->end = INT_MAX;
+    iter->i = -1;
+    iter->n_off = 1;
+    iter->off[0].u = shard->beg_off;
+    iter->off[0].v = shard->end_off;
+    iter->off[0].max = UINT64_MAX;
+    if (shard->beg_off >= shard->end_off) iter->finished = 1;
+    return iter;
+}
+
+/*
+ * Parallel multi-region iteration.  Consecutive chunks are grouped into
+ * jobs of about ITR_MT_JOB_BYTES of compressed data, and each job is read
+ * on the thread pool with the same filtering that hts_itr_multi_next()
+ * does.  Results come back from the pool in the order the jobs were
+ * dispatched, so records are returned just as they are by the serial
+ * iterator.  Unplaced reads are read serially once the chunks are done.
+ */
+#define ITR_MT_JOB_BYTES  (1 << 20)
+#define ITR_MT_CHUNK_COST (16 << 10) // Added per chunk, for the seek
+
+typedef struct {
+    void *r;
+    int ret, tid, beg, end;
+} itr_mt_rec_t;
+
+typedef struct itr_mt_job_t {
+    struct hts_itr_mt_t *mt;
+    int first, last;    // Chunks [first, last) of iter->off
+    itr_mt_rec_t *rec;  // Records found, reused when the job is recycled
+    size_t n, m;
+    int ret;            // 0, -1 at the end of the file, or <= -2 on error
+    struct itr_mt_job_t *next;
+} itr_mt_job_t;
+
+struct hts_itr_mt_t {
+    hts_itr_t *iter;
+    htsFile *fp;
+    hts_itr_mt_ops_t ops;
+    hts_tpool *pool;
+    hts_tpool_process *q;
+    int next_chunk, n_flight, max_flight;
+    itr_mt_job_t *curr, *free_jobs;
+    size_t curr_i;
+    pthread_mutex_t lock;   // Protects handles
+    htsFile **handles;      // Spare file handles for the workers
+    int n_handles;
+};
+
+static void *itr_mt_read(void *arg)
+{
+    itr_mt_job_t *job = (itr_mt_job_t *) arg;
+    struct hts_itr_mt_t *mt = job->mt;
+    const hts_itr_t *iter = mt->iter;
+    htsFile *fp = NULL;
+    uint64_t off = 0;
+    int i, j, ret = 0, tid, beg, end, curr_tid = INT_MIN, cr = 0, ci = 0;
+
+    job->n = 0;
+    pthread_mutex_lock(&mt->lock);
+    if (mt->n_handles > 0)
+        fp = mt->handles[--mt->n_handles];
+    pthread_mutex_unlock(&mt->lock);
+    if (!fp && !(fp = mt->ops.open(mt->fp))) {
+        job->ret = -2;
+        return job;
+    }
+
+    for (i = job->first; i < job->last && ret >= 0; i++) {
+        const hts_pair64_max_t *chunk = &iter->off[i];
+        if (iter->seek(fp->fp.bgzf, chunk->u, SEEK_SET) < 0) {
+            hts_log_error("Seek at offset %" PRIu64 " failed.", chunk->u);
+            ret = -2;
+            break;
+        }
+        do {
+            itr_mt_rec_t *rec;
+            if (job->n == job->m) {
+                size_t m = job->m ? job->m * 2 : 256;
+                itr_mt_rec_t *nr = realloc(job->rec, m * sizeof(*nr));
+                if (!nr) { ret = -2; break; }
+                job->rec = nr;
+                for (; job->m < m; job->m++)
+                    if (!(nr[job->m].r = mt->ops.rec_init())) break;
+                if (job->m < m) { ret = -2; break; }
+            }
+            rec = &job->rec[job->n];
+            ret = iter->readrec(fp->fp.bgzf, fp, rec->r, &tid, &beg, &end);
+            if (ret < 0)
+                break;
+            off = iter->tell(fp->fp.bgzf);
+
+            if (!iter->by_offset) {
+                if (tid != curr_tid) {
+                    hts_reglist_t key, *found_reg;
+                    key.tid = tid;
+                    found_reg = (hts_reglist_t *)bsearch(&key, iter->reg_list, iter->n_reg, sizeof(hts_reglist_t), compare_regions);
+                    if (!found_reg)
+                        continue;
+                    cr = found_reg - iter->reg_list;
+                    curr_tid = tid;
+                    ci = 0;
+                }
+                if (beg > chunk->max)
+                    break; // Nothing more in this chunk
+                if (beg > iter->reg_list[cr].max_end)
+                    continue;
+                for (j = ci; j < iter->reg_list[cr].count; j++) {
+                    if (end <= iter->reg_list[cr].intervals[j].beg) {
+                        j = iter->reg_list[cr].count; // Sorted by beg
+                        break;
+                    }
+                    if (iter->reg_list[cr].intervals[j].end > beg)
+                        break;
+                }
+                if (j == iter->reg_list[cr].count)
+                    continue;
+                ci = j;
+            }
+            rec->ret = ret;
+            rec->tid = tid;
+            rec->beg = beg;
+            rec->end = end;
+            job->n++;
+        } while (off < chunk->v);
+    }
+    job->ret = ret < 0 ? ret : 0;
+
+    pthread_mutex_lock(&mt->lock);
+    mt->handles[mt->n_handles++] = fp;
+    pthread_mutex_unlock(&mt->lock);
+    return job;
+}
+
+static void itr_mt_free_job(struct hts_itr_mt_t *mt, itr_mt_job_t *job)
+{
+    job->next = mt->free_jobs;
+    mt->free_jobs = job;
+}
+
+static int itr_mt_dispatch(struct hts_itr_mt_t *mt)
+{
+    const hts_itr_t *iter = mt->iter;
+
+    while (mt->n_flight < mt->max_flight && mt->next_chunk < iter->n_off) {
+        itr_mt_job_t *job = mt->free_jobs;
+        uint64_t cost = 0;
+
+        if (job)
+            mt->free_jobs = job->next;
+        else if (!(job = calloc(1, sizeof(*job))))
+            return -1;
+        job->mt = mt;
+        job->first = mt->next_chunk;
+        do {
+            const hts_pair64_max_t *chunk = &iter->off[mt->next_chunk++];
+            cost += (chunk->v >> 16) - (chunk->u >> 16) + ITR_MT_CHUNK_COST;
+        } while (cost < ITR_MT_JOB_BYTES && mt->next_chunk < iter->n_off);
+        job->last = mt->next_chunk;
+
+        if (hts_tpool_dispatch(mt->pool, mt->q, itr_mt_read, job) < 0) {
+            itr_mt_free_job(mt, job);
+            return -1;
+        }
+        mt->n_flight++;
+    }
+    return 0;
+}
+
+static void itr_mt_destroy(struct hts_itr_mt_t *mt)
+{
+    hts_tpool_result *res;
+    itr_mt_job_t *job;
+    size_t i;
+
+    if (!mt) return;
+    if (mt->q) {
+        hts_tpool_process_flush(mt->q);
+        while ((res = hts_tpool_next_result(mt->q)) != NULL) {
+            itr_mt_free_job(mt, hts_tpool_result_data(res));
+            hts_tpool_delete_result(res, 0);
+        }
+        hts_tpool_process_destroy(mt->q);
+    }
+    if (mt->curr)
+        itr_mt_free_job(mt, mt->curr);
+    while ((job = mt->free_jobs) != NULL) {
+        mt->free_jobs = job->next;
+        for (i = 0; i < job->m; i++)
+            mt->ops.rec_destroy(job->rec[i].r);
+        free(job->rec);
+        free(job);
+    }
+    while (mt->n_handles > 0)
+        hts_close(mt->handles[--mt->n_handles]);
+    free(mt->handles);
+    pthread_mutex_destroy(&mt->lock);
+    free(mt);
+}
+
+// As hts_itr_multi_next(), but sets *serial instead when all the chunks
+// have been read.
+static int itr_mt_next(hts_itr_t *iter, void *r, int *serial)
+{
+    struct hts_itr_mt_t *mt = iter->mt;
+    hts_tpool_result *res;
+
+    *serial = 0;
+    for (;;) {
+        itr_mt_job_t *job = mt->curr;
+        if (job) {
+            if (mt->curr_i < job->n) {
+                itr_mt_rec_t *rec = &job->rec[mt->curr_i++];
+                if (mt->ops.rec_copy(r, rec->r) < 0)
+                    return -2;
+                iter->curr_tid = rec->tid;
+                iter->curr_beg = rec->beg;
+                iter->curr_end = rec->end;
+                return rec->ret;
+            }
+            mt->curr = NULL;
+            itr_mt_free_job(mt, job);
+            if (job->ret < 0) {
+                iter->finished = 1;
+                return job->ret;
+            }
+        }
+
+        if (itr_mt_dispatch(mt) < 0)
+            return -2;
+        if (mt->n_flight == 0) {
+            *serial = 1;
+            return 0;
+        }
+        if (!(res = hts_tpool_next_result_wait(mt->q)))
+            return -2;
+        mt->curr = hts_tpool_result_data(res);
+        mt->curr_i = 0;
+        mt->n_flight--;
+        hts_tpool_delete_result(res, 0);
+    }
+}
+
+int hts_itr_multi_set_pool(htsFile *fp, hts_itr_t *iter, htsThreadPool *p,
+                           const hts_itr_mt_ops_t *ops)
+{
+    struct hts_itr_mt_t *mt;
+    int n;
+
+    if (!iter || !p || !p->pool)
+        return -1;
+    // Only worthwhile for BGZF files with index chunks still to read
+    if (!iter->multi || iter->is_cram || !fp->is_bgzf || !fp->fn
+        || iter->read_rest || iter->finished || iter->n_off == 0
+        || iter->i >= 0 || iter->mt)
+        return 0;
+
+    n = hts_tpool_size(p->pool);
+    if (!(mt = calloc(1, sizeof(*mt))))
+        return -1;
+    if (!(mt->handles = calloc(n, sizeof(*mt->handles)))) {
+        free(mt);
+        return -1;
+    }
+    if (pthread_mutex_init(&mt->lock, NULL) != 0) {
+        free(mt->handles);
+        free(mt);
+        return -1;
+    }
+    mt->iter = iter;
+    mt->fp = fp;
+    mt->ops = *ops;
+    mt->pool = p->pool;
+    // Results are bounded by max_flight, so the queue never fills up
+    mt->max_flight = 2 * n;
+    if (!(mt->q = hts_tpool_process_init(p->pool, mt->max_flight, 0))) {
+        itr_mt_destroy(mt);
+        return -1;
+    }
+    iter->mt = mt;
+    return 0;
+}
+
 void hts_itr_destroy(hts_itr_t *iter)
 {
     if (iter) {
+        itr_mt_destroy(iter->mt);
         if (iter->multi)
             hts_reglist_free(iter->reg_list, iter->n_reg);
         else
             free(iter->bins.a);
+        free(iter->reg_plan);
 
         if (iter->off)
             free(iter->off);
@@ -2916,6 +4445,11 @@ hts_itr_t *hts_itr_regions(const hts_idx_t *idx, hts_reglist_t *reglist, int cou
         }
 
         qsort(itr->reg_list, itr->n_reg, sizeof(hts_reglist_t), compare_regions);
+        // The record filter relies on each reference's intervals being in order
+        for (i = 0; i < itr->n_reg; i++)
+            if (itr->reg_list[i].count > 1)
+                qsort(itr->reg_list[i].intervals, itr->reg_list[i].count,
+                      sizeof(hts_pair32_t), compare_intervals);
         if (itr_specific(idx, itr) != 0) {
             hts_log_error("Failed to create the multi-region iterator!");
             hts_itr_destroy(itr);
@@ -2955,6 +4489,12 @@ int hts_itr_next(BGZF *fp, hts_itr_t *iter, void *r, void *data)
         }
         if ((ret = iter->readrec(fp, data, r, &tid, &beg, &end)) >= 0) {
             iter->curr_off = bgzf_tell(fp);
+            if (iter->by_offset) { // every record in the chunks is wanted
+                iter->curr_tid = tid;
+                iter->curr_beg = beg;
+                iter->curr_end = end;
+                return ret;
+            }
             if (tid != iter->tid || beg >= iter->end) { // no need to proceed
                 ret = -1; break;
             } else if (end > iter->beg && iter->end > beg) {
@@ -2983,6 +4523,18 @@ int hts_itr_multi_next(htsFile *fd, hts_itr_t *iter, void *r)
         fp = fd->fp.bgzf;
     }
 
+    if (iter->mt) {
+        int serial;
+        ret = itr_mt_next(iter, r, &serial);
+        if (!serial)
+            return ret;
+        // All chunks read; carry on serially with any unplaced reads
+        itr_mt_destroy(iter->mt);
+        iter->mt = NULL;
+        iter->i = iter->n_off - 1;
+        iter->curr_off = 0;
+    }
+
     if (iter->read_rest) {
         if (iter->curr_off) { // seek to the start
             if (iter->seek(fp, iter->curr_off, SEEK_SET) < 0) {
@@ -3049,6 +4601,13 @@ int hts_itr_multi_next(htsFile *fd, hts_itr_t *iter, void *r)
 
         iter->curr_off = iter->tell(fp);
 
+        if (iter->by_offset) { // every record in the chunks is wanted
+            iter->curr_tid = tid;
+            iter->curr_beg = beg;
+            iter->curr_end = end;
+            return ret;
+        }
+
         if (tid != iter->curr_tid) {
             hts_reglist_t key;
             key.tid = tid;
@@ -3073,7 +4632,10 @@ int hts_itr_multi_next(htsFile *fd, hts_itr_t *iter, void *r)
             continue;
 
         for (i = ci; i < iter->reg_list[cr].count; i++) {
-            if (end > iter->reg_list[cr].intervals[i].beg && iter->reg_list[cr].intervals[i].end > beg) {
+            // Intervals are sorted by beg, so none of the rest can overlap
+            if (end <= iter->reg_list[cr].intervals[i].beg)
+                break;
+            if (iter->reg_list[cr].intervals[i].end > beg) {
                 iter->curr_beg = beg;
                 iter->curr_end = end;
                 iter->curr_intv = i;
@@ -3188,46 +4750,233 @@ char *hts_idx_getfn(const char *fn, const char *ext)
     return fnidx;
 }
 
+/*
+ * The shared index cache.  Entries are kept in order of last use, and
+ * are matched on the index file's name, identity, size and modification
+ * time, so an index that has been rewritten is loaded afresh.  An entry
+ * that is still referenced is never freed; the others are freed, least
+ * recently used first, when the total size goes over the limit.
+ */
+struct hts_idx_shared_t {
+    struct hts_idx_shared_t *prev, *next;
+    char *fn;
+    int kind;
+    dev_t dev;
+    ino_t ino;
+    off_t file_size;
+    time_t mtime;
+    void *data;
+    void (*free_data)(void *);
+    size_t size;
+    int refs;
+};
+
+static struct {
+    pthread_mutex_t lock;
+    size_t limit, used;
+    hts_idx_shared_t *head, *tail; // Most and least recently used
+} idx_shared = { PTHREAD_MUTEX_INITIALIZER, 0, 0, NULL, NULL };
+
+static void idx_shared_unlink(hts_idx_shared_t *e)
+{
+    if (e->prev) e->prev->next = e->next; else idx_shared.head = e->next;
+    if (e->next) e->next->prev = e->prev; else idx_shared.tail = e->prev;
+    e->prev = e->next = NULL;
+}
+
+static void idx_shared_push(hts_idx_shared_t *e)
+{
+    e->prev = NULL;
+    e->next = idx_shared.head;
+    if (idx_shared.head) idx_shared.head->prev = e;
+    else idx_shared.tail = e;
+    idx_shared.head = e;
+}
+
+static void idx_shared_free(hts_idx_shared_t *e)
+{
+    idx_shared_unlink(e);
+    idx_shared.used -= e->size;
+    e->free_data(e->data);
+    free(e->fn);
+    free(e);
+}
+
+// Frees unused entries until the cache is within its limit.  Must be
+// called with the lock held.
+static void idx_shared_evict(void)
+{
+    hts_idx_shared_t *e = idx_shared.tail, *prev;
+    for (; e && idx_shared.used > idx_shared.limit; e = prev) {
+        prev = e->prev;
+        if (e->refs == 0)
+            idx_shared_free(e);
+    }
+}
+
+static hts_idx_shared_t *idx_shared_find(const char *fn, int kind,
+                                         const struct stat *st)
+{
+    hts_idx_shared_t *e;
+    for (e = idx_shared.head; e; e = e->next) {
+        if (e->kind == kind && e->dev == st->st_dev && e->ino == st->st_ino
+            && e->file_size == st->st_size && e->mtime == st->st_mtime
+            && strcmp(e->fn, fn) == 0)
+            return e;
+    }
+    return NULL;
+}
+
+void hts_idx_set_shared_limit(size_t max_bytes)
+{
+    pthread_mutex_lock(&idx_shared.lock);
+    idx_shared.limit = max_bytes;
+    idx_shared_evict();
+    pthread_mutex_unlock(&idx_shared.lock);
+}
+
+void *hts_idx_shared_get(const char *fn, int kind, const struct stat *st,
+                         hts_idx_shared_t **ent)
+{
+    hts_idx_shared_t *e = NULL;
+    pthread_mutex_lock(&idx_shared.lock);
+    if (idx_shared.limit > 0 && (e = idx_shared_find(fn, kind, st)) != NULL) {
+        e->refs++;
+        idx_shared_unlink(e);
+        idx_shared_push(e);
+    }
+    pthread_mutex_unlock(&idx_shared.lock);
+    *ent = e;
+    return e ? e->data : NULL;
+}
+
+void *hts_idx_shared_put(const char *fn, int kind, const struct stat *st,
+                         void *data, size_t size, void (*free_data)(void *),
+                         hts_idx_shared_t **ent, hts_idx_shared_t **data_ent)
+{
+    hts_idx_shared_t *e;
+
+    *ent = NULL;
+    pthread_mutex_lock(&idx_shared.lock);
+    if (idx_shared.limit == 0) goto out;
+
+    // Another thread may have loaded the same index in the meantime
+    if ((e = idx_shared_find(fn, kind, st)) != NULL) {
+        e->refs++;
+        idx_shared_unlink(e);
+        idx_shared_push(e);
+        pthread_mutex_unlock(&idx_shared.lock);
+        free_data(data);
+        *ent = e;
+        return e->data;
+    }
+
+    if (!(e = calloc(1, sizeof(*e))) || !(e->fn = strdup(fn))) {
+        free(e);
+        goto out;  // Not an error; the caller keeps its own copy
+    }
+    e->kind = kind;
+    e->dev = st->st_dev;
+    e->ino = st->st_ino;
+    e->file_size = st->st_size;
+    e->mtime = st->st_mtime;
+    e->data = data;
+    e->free_data = free_data;
+    e->size = size;
+    e->refs = 1;
+    idx_shared_push(e);
+    idx_shared.used += size;
+    // Others may find data as soon as the lock is released
+    if (data_ent) *data_ent = e;
+    idx_shared_evict();
+    *ent = e;
+
+ out:
+    pthread_mutex_unlock(&idx_shared.lock);
+    return data;
+}
+
+void hts_idx_shared_grow(hts_idx_shared_t *ent, size_t bytes)
+{
+    pthread_mutex_lock(&idx_shared.lock);
+    ent->size += bytes;
+    idx_shared.used += bytes;
+    idx_shared_evict();
+    pthread_mutex_unlock(&idx_shared.lock);
+}
+
+void hts_idx_shared_release(hts_idx_shared_t *ent)
+{
+    pthread_mutex_lock(&idx_shared.lock);
+    if (--ent->refs == 0)
+        idx_shared_evict();
+    pthread_mutex_unlock(&idx_shared.lock);
+}
+
+static hts_idx_t *idx_load_shared(const char *fn, int flags)
+{
+    hts_idx_shared_t *ent;
+    struct stat st;
+    hts_idx_t *idx;
+
+    if (stat(fn, &st) < 0)
+        return hts_idx_load_local(fn, flags);
+    if ((idx = hts_idx_shared_get(fn, 0, &st, &ent)) != NULL)
+        return idx;
+    if ((idx = hts_idx_load_local(fn, flags)) == NULL)
+        return NULL;
+    return hts_idx_shared_put(fn, 0, &st, idx, idx_mem_size(idx),
+                              idx_destroy, &ent, &idx->shared);
+}
+
 hts_idx_t *hts_idx_load(const char *fn, int fmt)
 {
-    char *fnidx = strstr(fn, HTS_IDX_DELIM);
+    return hts_idx_load3(fn, NULL, fmt, 0);
+}
+
+hts_idx_t *hts_idx_load2(const char *fn, const char *fnidx)
+{
+    return hts_idx_load3(fn, fnidx, 0, 0);
+}
+
+hts_idx_t *hts_idx_load3(const char *fn, const char *fnidx, int fmt, int flags)
+{
+    char *delim, *fn2, *local_fnidx;
     hts_idx_t *idx;
 
-    if ( fnidx ) {
-        char *fn2 = strdup(fn);
+    if (fnidx) {
+        // Check that the index file is up to date, the main file might have changed
+        struct stat stat_idx,stat_main;
+        if ( !stat(fn, &stat_main) && !stat(fnidx, &stat_idx) )
+        {
+            if ( stat_idx.st_mtime < stat_main.st_mtime )
+                hts_log_warning("The index file is older than the data file: %s", fnidx);
+        }
+
+        return idx_load_shared(fnidx, flags);
+    }
+
+    if ( (delim = strstr(fn, HTS_IDX_DELIM)) != NULL ) {
+        fn2 = strdup(fn);
         if (!fn2) {
             hts_log_error("%s", strerror(errno));
             return NULL;
         }
-        fn2[fnidx - fn] = '\0';
-        fnidx += strlen(HTS_IDX_DELIM);
-        idx = hts_idx_load2(fn2, fnidx);
+        fn2[delim - fn] = '\0';
+        idx = hts_idx_load3(fn2, delim + strlen(HTS_IDX_DELIM), fmt, flags);
         free(fn2);
         return idx;
     }
 
-    fnidx = hts_idx_getfn(fn, ".csi");
-    if (! fnidx) fnidx = hts_idx_getfn(fn, fmt == HTS_FMT_BAI? ".bai" : ".tbi");
-    if (fnidx == 0) return 0;
+    local_fnidx = hts_idx_getfn(fn, ".csi");
+    if (! local_fnidx) local_fnidx = hts_idx_getfn(fn, fmt == HTS_FMT_BAI? ".bai" : ".tbi");
+    if (local_fnidx == 0) return 0;
 
-    idx = hts_idx_load2(fn, fnidx);
-    free(fnidx);
+    idx = hts_idx_load3(fn, local_fnidx, fmt, flags);
+    free(local_fnidx);
     return idx;
 }
 
-hts_idx_t *hts_idx_load2(const char *fn, const char *fnidx)
-{
-    // Check that the index file is up to date, the main file might have changed
-    struct stat stat_idx,stat_main;
-    if ( !stat(fn, &stat_main) && !stat(fnidx, &stat_idx) )
-    {
-        if ( stat_idx.st_mtime < stat_main.st_mtime )
-            hts_log_warning("The index file is older than the data file: %s", fnidx);
-    }
-
-    return hts_idx_load_local(fnidx);
-}
-
 
 
 /**********************
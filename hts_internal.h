@@ -25,8 +25,10 @@ DEALINGS IN THE SOFTWARE.  */
 
 #include <stddef.h>
 #include <ctype.h>
+#include <sys/types.h>
 
 #include "htslib/hts.h"
+#include "htslib/tbx.h"
 
 #include "textutils_internal.h"
 
@@ -63,6 +65,38 @@ typedef struct hts_cram_idx_t {
 } hts_cram_idx_t;
 
 
+/*
+ * The process-wide cache of loaded indexes, in hts.c; see
+ * hts_idx_set_shared_limit().  Data is cached under the index filename
+ * and a stat() of the file taken before it was loaded, and kind says
+ * which loader made it (HTS_FMT_CRAI for CRAM, 0 for hts_idx_t).
+ */
+struct stat;
+typedef struct hts_idx_shared_t hts_idx_shared_t;
+
+// Returns cached data and sets *ent to its entry, or returns NULL and sets
+// *ent to NULL if it is not in the cache (or the cache is disabled).
+void *hts_idx_shared_get(const char *fn, int kind, const struct stat *st,
+                         hts_idx_shared_t **ent);
+
+// Adds data, of approximately size bytes, to the cache.  If the same index
+// was added meanwhile, data is freed with free_data() and the cached copy
+// is returned instead.  If the cache is disabled, data is returned and
+// *ent is set to NULL, and the caller remains responsible for it.  Data
+// that keeps a pointer to its own entry passes its location as data_ent,
+// which is set while the cache is still locked if data is added.
+void *hts_idx_shared_put(const char *fn, int kind, const struct stat *st,
+                         void *data, size_t size, void (*free_data)(void *),
+                         hts_idx_shared_t **ent, hts_idx_shared_t **data_ent);
+
+// Adds bytes to the size of a referenced entry, for data that grows after
+// it is cached, and frees unused entries if that takes the cache over its
+// limit.
+void hts_idx_shared_grow(hts_idx_shared_t *ent, size_t bytes);
+
+// Drops a reference taken by hts_idx_shared_get() or hts_idx_shared_put().
+void hts_idx_shared_release(hts_idx_shared_t *ent);
+
 // Entry point to hFILE_multipart backend.
 struct hFILE *hopen_htsget_redirect(struct hFILE *hfile, const char *mode);
 
@@ -83,6 +117,84 @@ void *load_plugin(void **pluginp, const char *filename, const char *symbol);
 void *plugin_sym(void *plugin, const char *name, const char **errmsg);
 void close_plugin(void *plugin);
 
+// Reads and discards length bytes, returning the number skipped or -1 on
+// error.  Used to step over record fields that the caller has not asked for.
+ssize_t bgzf_skip(BGZF *fp, size_t length);
+
+// Returns the address of the first BGZF block that starts at or after
+// file offset pos, or size if there is none, or -1 on error.  A candidate
+// is only accepted if another block or the end of the file follows it.
+int64_t bgzf_block_search(struct hFILE *hf, int64_t pos, int64_t size);
+
+/*
+ * Parallel index building, in hts.c.  The file is split into shards at
+ * BGZF block boundaries, and a format specific reader finds the first
+ * record in each shard and notes what hts_idx_push() needs for every
+ * record up to the next shard.  Shards are read on a thread pool but
+ * pushed into the index in file order, so the result is the same as
+ * building it serially.  Each shard's starting point is checked against
+ * where the one before it ended, and any that disagree are read again.
+ */
+typedef struct {
+    uint64_t offset;        // bgzf_tell() after the record
+    int tid, beg, end, is_mapped;
+} hts_idx_rec_t;
+
+typedef struct {
+    // Non-zero if records are lines of text.  Shards then start after the
+    // first newline in their first block.
+    int text;
+    // Binary formats only.  Returns the length of the record at buf if it
+    // looks valid, 0 if more than len bytes are needed to tell, else -1.
+    int64_t (*check)(void *data, const uint8_t *buf, size_t len);
+    // Reads the next record and fills in rec, apart from rec->offset.
+    // Returns 0 on success, 1 for a record that should not be indexed, -1
+    // at end of file or <= -2 on error.  *state is private to the shard;
+    // it starts as NULL and is released by free_state().
+    int (*read)(void *data, BGZF *fp, void **state, hts_idx_rec_t *rec);
+    // Optional.  Called on the calling thread for each shard, in file
+    // order, before its records are pushed; e.g. to translate tids.
+    int (*finish)(void *data, void *state, hts_idx_rec_t *rec, size_t n);
+    void (*free_state)(void *state);
+    void *data;
+} hts_idx_reader_t;
+
+// Adds the records of fn after offset0 to idx and finishes it.  Returns 0
+// on success, -1 on error, or 1 without doing anything if n_threads or
+// the file is too small for sharding to be worthwhile.
+int hts_idx_build_shards(hts_idx_t *idx, const char *fn, uint64_t offset0,
+                         int n_threads, const hts_idx_reader_t *reader);
+
+/*
+ * Parallel multi-region iteration, in hts.c.  The iterator's chunks are
+ * grouped into jobs that are read on a thread pool, each worker using its
+ * own handle on the file, and hts_itr_multi_next() hands the records back
+ * in file order.  The callbacks deal with the record type.
+ */
+typedef struct {
+    // Opens another handle on fp's file, ready for iter->readrec().
+    htsFile *(*open)(htsFile *fp);
+    void *(*rec_init)(void);
+    void (*rec_destroy)(void *r);
+    int (*rec_copy)(void *dst, const void *src);  // Returns < 0 on error
+} hts_itr_mt_ops_t;
+
+// Returns 0 on success (including when iter is not suitable, in which case
+// it is left to run serially), or -1 on error.
+int hts_itr_multi_set_pool(htsFile *fp, hts_itr_t *iter, htsThreadPool *p,
+                           const hts_itr_mt_ops_t *ops);
+
+// Tabix indexing, in tbx.c.  If fn is not NULL and n_threads > 1, the
+// file may be indexed in shards; otherwise fp is read from the start.
+tbx_t *tbx_index_threads(BGZF *fp, const char *fn, int min_shift,
+                         int n_threads, const tbx_conf_t *conf);
+
+// Multi-threaded SAM text handling, in sam.c.  fp->state holds the
+// SAM_state; sam_state_destroy() must be called before the file is closed.
+int sam_set_thread_pool(htsFile *fp, htsThreadPool *p);
+int sam_set_threads(htsFile *fp, int nthreads);
+int sam_state_destroy(htsFile *fp);
+
 #ifdef __cplusplus
 }
 #endif
@@ -67,6 +67,7 @@ HTSLIB_PUBLIC_HEADERS = \
 	$(HTSDIR)/htslib/kstring.h \
 	$(HTSDIR)/htslib/regidx.h \
 	$(HTSDIR)/htslib/sam.h \
+	$(HTSDIR)/htslib/sam_sort.h \
 	$(HTSDIR)/htslib/synced_bcf_reader.h \
 	$(HTSDIR)/htslib/tbx.h \
 	$(HTSDIR)/htslib/thread_pool.h \
@@ -102,6 +103,9 @@ HTSLIB_ALL = \
 	$(HTSDIR)/regidx.c \
 	$(HTSDIR)/region.c \
 	$(HTSDIR)/sam.c \
+	$(HTSDIR)/sam_sort.c \
+	$(HTSDIR)/simd.c \
+	$(HTSDIR)/simd_internal.h \
 	$(HTSDIR)/synced_bcf_reader.c \
 	$(HTSDIR)/tbx.c \
 	$(HTSDIR)/textutils.c \
@@ -228,6 +228,8 @@ typedef struct {
     hts_idx_t *idx;
     const char *fnidx;
     struct bam_hdr_t *bam_header;
+    void *state;  // format specific state information
+    unsigned int required_fields; // SAM_* fields that readers must decode
 } htsFile;
 
 // A combined thread pool and queue allocation size.
@@ -243,6 +245,13 @@ typedef struct {
 } htsThreadPool;
 
 // REQUIRED_FIELDS
+// Set with hts_set_opt(fp, CRAM_OPT_REQUIRED_FIELDS, mask).  Despite the
+// name, this is honoured by the SAM and BAM readers as well as CRAM.  Fields
+// that are not required may be left empty: SEQ and QUAL are dropped (l_qseq
+// set to 0) unless one of them is listed, QUAL is set to 0xff if only SEQ
+// is listed, and aux tags are dropped unless SAM_AUX, or SAM_RGAUX for just
+// the RG tag, is listed.  The core fields, QNAME and CIGAR are always
+// decoded for SAM and BAM.
 enum sam_fields {
     SAM_QNAME = 0x00000001,
     SAM_FLAG  = 0x00000002,
@@ -596,7 +605,7 @@ typedef int hts_seek_func(void *fp, int64_t offset, int where);
 typedef int64_t hts_tell_func(void *fp);
 
 typedef struct {
-    uint32_t read_rest:1, finished:1, is_cram:1, nocoor:1, multi:1, dummy:27;
+    uint32_t read_rest:1, finished:1, is_cram:1, nocoor:1, multi:1, by_offset:1, dummy:26;
     int tid, beg, end, n_off, i, n_reg;
     hts_reglist_t *reg_list;
     int curr_tid, curr_beg, curr_end, curr_reg, curr_intv;
@@ -609,6 +618,10 @@ typedef struct {
         int n, m;
         int *a;
     } bins;
+    struct hts_itr_mt_t *mt;
+    int plan;           // HTS_ITR_PLAN_* requested
+    int64_t seek_cost;  // 0 for HTS_ITR_SEEK_COST
+    int *reg_plan;      // HTS_ITR_PLAN_* used for each reg_list entry, or -1
 } hts_itr_t;
 
 typedef struct {
@@ -710,6 +723,54 @@ hts_idx_t *hts_idx_load(const char *fn, int fmt);
 */
 hts_idx_t *hts_idx_load2(const char *fn, const char *fnidx);
 
+/// Only read the bins of each reference when it is first used
+#define HTS_IDX_LAZY  0x01
+/// Keep an uncompressed copy of the index next to it, for faster loading.
+/// Implies HTS_IDX_LAZY.
+#define HTS_IDX_CACHE 0x02
+
+/// Load an index file, with options
+/** @param fn     Input BAM/BCF/etc filename
+    @param fnidx  The input index filename, or NULL to search for one as
+                  hts_idx_load() does
+    @param fmt    One of the HTS_FMT_* index formats, used when searching
+    @param flags  Zero or more of HTS_IDX_LAZY and HTS_IDX_CACHE
+    @return  The index, or NULL if an error occurred.
+
+    With HTS_IDX_LAZY, loading only steps through the index to note where
+    each reference's data is, and the bins are decoded when a reference
+    is first queried.  This is much quicker for a few queries on a file with
+    many references, and uses less memory.  Lazily loaded indexes may be
+    queried from several threads at once.  If loading a reference fails
+    later, the query returns an error.
+
+    With HTS_IDX_CACHE, an uncompressed copy of the index is written to
+    "<fnidx>.cache" the first time, and later calls map it into memory
+    instead of reading the index.  The cache is remade if the index file's
+    size or modification time changes.  Failure to write it is not an error.
+*/
+hts_idx_t *hts_idx_load3(const char *fn, const char *fnidx, int fmt, int flags);
+
+/// Share loaded indexes across the whole process
+/** @param max_bytes  Approximate memory to spend on indexes, or 0 to
+                      stop sharing them (the default)
+
+    While enabled, loading an index file that is already loaded (by
+    hts_idx_load3() or the functions built on it, or sam_index_load() for
+    CRAM) returns the same copy instead of reading the file again, as long
+    as the file's size and modification time are unchanged.  Indexes are
+    reference counted, so hts_idx_destroy() must still be called for each
+    one loaded.  Those no longer in use stay in memory until the total size
+    exceeds max_bytes, when the least recently used are freed.  The size
+    of an index loaded with HTS_IDX_LAZY grows as its references are
+    loaded, and is counted against max_bytes as it does.
+
+    Shared indexes may be used by several threads at once, but must not be
+    changed (for example by hts_idx_set_meta()).  This function is
+    thread safe.
+*/
+void hts_idx_set_shared_limit(size_t max_bytes);
+
 ///////////////////////////////////////////////////////////
 // Functions for accessing meta-data stored in indexes
 
@@ -938,6 +999,47 @@ int hts_itr_multi_cram(const hts_idx_t *idx, hts_itr_t *iter);
  */
 hts_itr_t *hts_itr_regions(const hts_idx_t *idx, hts_reglist_t *reglist, int count, hts_name2id_f getid, void *hdr, hts_itr_multi_query_func *itr_specific, hts_readrec_func *readrec, hts_seek_func *seek, hts_tell_func *tell);
 
+#define HTS_ITR_PLAN_AUTO     0 ///< Pick whichever is estimated to be quickest
+#define HTS_ITR_PLAN_INDEX    1 ///< Seek to each chunk found in the index
+#define HTS_ITR_PLAN_COALESCE 2 ///< Read through gaps shorter than a seek
+#define HTS_ITR_PLAN_SCAN     3 ///< Read all of the reference's data
+
+/// Default cost of a seek, in bytes of compressed data
+#define HTS_ITR_SEEK_COST (256 * 1024)
+
+/// Set how a multi-region iterator reads BAM and other BGZF files
+/** @param idx        Index the iterator was made from
+    @param iter       Iterator from hts_itr_regions() or sam_itr_regions()
+    @param plan       One of the HTS_ITR_PLAN_* values
+    @param seek_cost  Bytes of compressed data that could be read in the
+                      time one seek takes, or 0 for HTS_ITR_SEEK_COST
+    @return 0 on success; -1 on failure, or if @p plan is not valid
+
+For each reference, the iterator estimates how many bytes the index chunks
+for its regions cover, and how many seeks reading them needs.  It then
+either reads the chunks as they are, reads through the gaps between chunks
+where that is cheaper than seeking over them, or reads all of the
+reference's data, filtering the records against the regions as usual.
+Iterators start with HTS_ITR_PLAN_AUTO, which uses the cheapest, and this
+function makes @p iter plan its reads again, forcing one choice or using a
+different seek cost.  The records returned are the same in every case.
+
+This must be called before the first record is read, and before
+sam_itr_set_thread_pool().  It does nothing for CRAM iterators.
+*/
+int hts_itr_multi_set_plan(const hts_idx_t *idx, hts_itr_t *iter,
+                           int plan, int64_t seek_cost);
+
+/// Return the plan a multi-region iterator uses for a reference
+/** @param iter  Iterator from hts_itr_regions() or sam_itr_regions()
+    @param tid   Reference id
+    @return The HTS_ITR_PLAN_* value used to read @p tid's regions; -1 if
+            the iterator reads no index chunks for it
+
+The choice for each reference is also logged at the HTS_LOG_INFO level.
+*/
+int hts_itr_multi_plan(const hts_itr_t *iter, int tid);
+
 /// Return the next record from an iterator
 /** @param fp      Input file handle
     @param iter    Iterator
@@ -967,6 +1069,62 @@ void hts_reglist_free(hts_reglist_t *reglist, int count);
  */
 #define hts_itr_multi_destroy(iter) hts_itr_destroy(iter)
 
+/**********************************
+ * Splitting indexed files evenly *
+ **********************************/
+
+/*! @typedef
+ @abstract  A piece of an indexed file, as made by hts_idx_shards().
+ @field beg_off     File offset of the first record in the shard: a virtual
+                    offset for BGZF files, or a container offset for CRAM
+ @field end_off     Offset of the first record after the shard, or
+                    UINT64_MAX for the last shard, which runs to the end of
+                    the file
+ @field tid         Reference of the first record
+ @field pos         Approximate position of the first record; the offsets
+                    define the shard, this is only for reporting progress
+ @field bytes       Approximate compressed size of the shard
+ @field n_mapped    Estimated mapped records in the shard
+ @field n_unmapped  Estimated unmapped records in the shard.  The last shard
+                    also counts the unplaced reads (hts_idx_get_n_no_coor())
+
+ Every record is in exactly one shard.  Record counts are the per-reference
+ totals from hts_idx_get_stat(), shared between shards in proportion to
+ their part of each reference's data, so they add up to the real totals.
+ CRAM indexes do not store counts, so they are zero for CRAM.
+ */
+typedef struct {
+    uint64_t beg_off, end_off;
+    int tid, pos;
+    uint64_t bytes;
+    uint64_t n_mapped, n_unmapped;
+} hts_shard_t;
+
+/// Split an indexed file into pieces of about the same compressed size
+/** @param idx          Index (BAI, CSI, TBI or CRAI)
+    @param n            Number of shards wanted
+    @param[out] shards  Set to an array of shards, to be freed with free()
+    @return The number of shards made, or -1 on error
+
+    Shards start on records listed in the index, so fewer than @p n may be
+    made if the index does not have enough distinct offsets (for example,
+    when the file is small).  If the index holds no positioned data, no
+    shards are made.
+ */
+int hts_idx_shards(const hts_idx_t *idx, int n, hts_shard_t **shards);
+
+/// Create an iterator returning every record in a shard
+/** @param idx      Index the shard came from
+    @param shard    Shard to iterate over
+    @param readrec  Callback to read a record from the input file
+    @return An iterator on success; NULL on failure
+
+    This works for BGZF-compressed files; use it with hts_itr_next().  For
+    SAM, BAM and CRAM files use sam_itr_shard() instead.  Records are
+    returned in file order, without regard to their position.
+ */
+hts_itr_t *hts_shard_itr(const hts_idx_t *idx, const hts_shard_t *shard, hts_readrec_func *readrec);
+
 
     /**
      * hts_file_type() - Convenience function to determine file type
@@ -176,6 +176,7 @@ typedef struct {
  @field  core       core information about the alignment
  @field  l_data     current length of bam1_t::data
  @field  m_data     maximum length of bam1_t::data
+ @field  data_gen   changed by the library whenever it alters bam1_t::data
  @field  data       all variable-length data, concatenated; structure: qname-cigar-seq-qual-aux
 
  @discussion Notes:
@@ -197,6 +198,7 @@ typedef struct {
     bam1_core_t core;
     int l_data;
     uint32_t m_data;
+    uint32_t data_gen;
     uint8_t *data;
 #ifndef BAM_NO_ID
     uint64_t id;
@@ -291,6 +293,36 @@ typedef struct {
     bam1_t *bam_copy1(bam1_t *bdst, const bam1_t *bsrc);
     bam1_t *bam_dup1(const bam1_t *bsrc);
 
+    /*!
+      @abstract  Pooled allocation of alignment records.
+
+      @discussion A bam_pool_t hands out bam1_t structures from large slabs
+      and keeps released records, along with their data buffers, on free
+      lists grouped by buffer size.  Programs that create and discard many
+      records can use it in place of bam_init1(), bam_dup1() and
+      bam_destroy1() to avoid most calls to malloc and free.
+
+      Pooled records can be used with all the usual functions, including
+      those that resize their data.  They must be released with
+      bam_pool_free() and not bam_destroy1().  A pool is not thread safe,
+      so threads should each have their own.  bam_pool_destroy() frees
+      every record allocated from the pool, whether released or not.
+    */
+    typedef struct bam_pool_t bam_pool_t;
+
+    bam_pool_t *bam_pool_init(void);
+    void bam_pool_destroy(bam_pool_t *pool);
+
+    /// Get an empty record, preferably with room for @p l_data bytes of data
+    /** @return The record, or NULL on error */
+    bam1_t *bam_pool_alloc(bam_pool_t *pool, size_t l_data);
+
+    /// Return a record to the pool it was allocated from
+    void bam_pool_free(bam_pool_t *pool, bam1_t *b);
+
+    /// As bam_dup1(), with the copy allocated from @p pool
+    bam1_t *bam_pool_dup1(bam_pool_t *pool, const bam1_t *bsrc);
+
     int bam_cigar2qlen(int n_cigar, const uint32_t *cigar);
     int bam_cigar2rlen(int n_cigar, const uint32_t *cigar);
 
@@ -360,6 +392,17 @@ hts_idx_t *sam_index_load(htsFile *fp, const char *fn);
 */
 hts_idx_t *sam_index_load2(htsFile *fp, const char *fn, const char *fnidx);
 
+/// Load a BAM (.csi or .bai) or CRAM (.crai) index file, with options
+/** @param fp     File handle of the data file whose index is being opened
+    @param fn     BAM/CRAM/etc data file filename
+    @param fnidx  Index filename, or NULL to search alongside @a fn
+    @param flags  HTS_IDX_LAZY and/or HTS_IDX_CACHE; see hts_idx_load3()
+    @return  The index, or NULL if an error occurred.
+
+The flags are ignored for CRAM indexes.
+*/
+hts_idx_t *sam_index_load3(htsFile *fp, const char *fn, const char *fnidx, int flags);
+
 /// Generate and save an index file
 /** @param fn        Input BAM/etc filename, to which .csi/etc will be added
     @param min_shift Positive to generate CSI, or 0 to generate BAI
@@ -382,7 +425,9 @@ int sam_index_build2(const char *fn, const char *fnidx, int min_shift) HTS_RESUL
 /** @param fn        Input BAM/CRAM/etc filename
     @param fnidx     Output filename, or NULL to add .bai/.csi/etc to @a fn
     @param min_shift Positive to generate CSI, or 0 to generate BAI
-    @param nthreads  Number of threads to use when building the index
+    @param nthreads  Number of threads to use when building the index;
+                     large BGZF files are read in parallel pieces when
+                     this is more than 1
     @return  0 if successful, or negative if an error occurred (see
              sam_index_build for error codes)
 */
@@ -477,6 +522,35 @@ overlaps more than one region, it will only be returned once.
  */
 hts_itr_t *sam_itr_regarray(const hts_idx_t *idx, bam_hdr_t *hdr, char **regarray, unsigned int regcount);
 
+/// Create an iterator over one shard of a file
+/** @param idx    Index
+    @param shard  Shard from hts_idx_shards()
+    @return An iterator on success; NULL on failure
+
+The iterator returns every record in the shard, in file order, including
+unmapped reads.  Each record of the file is in exactly one shard.
+ */
+hts_itr_t *sam_itr_shard(const hts_idx_t *idx, const hts_shard_t *shard);
+
+/// Read a multi-region iterator's data on a thread pool
+/** @param htsfp  The file the iterator will read from
+    @param itr    Iterator from sam_itr_regions() or sam_itr_regarray()
+    @param p      Thread pool
+    @return 0 on success; -1 on failure
+
+This should be called before the first sam_itr_next().  The index chunks
+that the iterator covers are then split into batches, which are read and
+decoded on the thread pool, each thread opening its own handle on the file
+by name.  sam_itr_next() still returns the reads in the same order as it
+would without threads, and a read that overlaps several regions is still
+only returned once.
+
+This applies to BAM and bgzipped SAM files.  For other iterators and
+formats it does nothing and returns 0; CRAM files can use
+hts_set_thread_pool() instead.
+ */
+int sam_itr_set_thread_pool(htsFile *htsfp, hts_itr_t *itr, htsThreadPool *p);
+
 /// Get the next read from a SAM/BAM/CRAM iterator
 /** @param htsfp       Htsfile pointer for the input file
     @param itr         Iterator
@@ -545,9 +619,69 @@ static inline int sam_itr_next(htsFile *htsfp, hts_itr_t *itr, bam1_t *r) {
  *  @param h     Pointer to the header structure previously read
  *  @param b     Pointer to the record to be written
  *  @return >= 0 on successfully writing the record, -1 on error
+ *
+ *  When SAM output is multi-threaded the record is copied and formatted
+ *  later, so some errors may not be reported until a subsequent call or
+ *  hts_close().
  */
     int sam_write1(samFile *fp, const bam_hdr_t *h, const bam1_t *b) HTS_RESULT_USED;
 
+    /***********************
+     *** Batched reading ***
+     ***********************/
+
+/*! @typedef
+ @abstract  A reusable batch of alignment records.
+ @field b          Array of records; the first n are valid after reading
+ @field n          Number of records currently in the batch
+ @field max        Capacity of b
+ @field max_bytes  Stop filling once this much record data is held (0 for
+                   no limit)
+
+ The variable length data of every record in the batch is stored in a
+ single arena owned by the batch, so filling it does not need an allocation
+ per record once the arena has grown to its working size.  The records are
+ valid until the batch is next filled or destroyed.  They must be treated
+ as read-only: do not call bam_destroy1() on them or use functions that
+ change the size of their data.  Use bam_copy1() or bam_dup1() to take a
+ record that can be modified or kept.
+
+ Batches are independent of each other and of the file, so one may be
+ filled (on a thread pool job for example) while another is being
+ processed.  The remaining fields are private.
+ */
+typedef struct {
+    bam1_t *b;
+    int n, max;
+    size_t max_bytes;
+    // private
+    uint8_t *arena;
+    size_t l_arena, m_arena;
+    bam1_t tmp;
+} bam_batch_t;
+
+/// Allocate a batch of up to @p max_recs records
+/** @param max_recs   Maximum number of records per batch
+ *  @param max_bytes  Approximate limit on record data per batch, or 0
+ *  @return The new batch, or NULL on error
+ */
+bam_batch_t *bam_batch_init(int max_recs, size_t max_bytes);
+
+/// Free a batch and all of its records
+void bam_batch_destroy(bam_batch_t *batch);
+
+/// sam_read_batch - Read a batch of records from a file
+/** @param fp     Pointer to the source file
+ *  @param h      Pointer to the header previously read
+ *  @param batch  Batch to fill, replacing its current contents
+ *  @return Number of records read (> 0), -1 on end of stream, < -1 on error
+ *
+ *  Records are read with sam_read1(), so any threads or required_fields
+ *  option set on @p fp apply as usual.  On error, the batch->n records read
+ *  before the failing one are still valid.
+ */
+int sam_read_batch(samFile *fp, bam_hdr_t *h, bam_batch_t *batch) HTS_RESULT_USED;
+
     /*************************************
      *** Manipulating auxiliary fields ***
      *************************************/
@@ -563,6 +697,41 @@ static inline int sam_itr_next(htsFile *htsfp, hts_itr_t *itr, bam1_t *r) {
  */
 uint8_t *bam_aux_get(const bam1_t *b, const char tag[2]);
 
+/// Index for repeated aux tag lookups on the same record
+/** bam_aux_get() scans the aux data from the start on every call.  When
+    several tags are wanted from each record, bam_aux_index_get() can be
+    used instead.  The first lookup on a record makes one pass over its aux
+    data to build a table of tag offsets, and later lookups on the same
+    record use the table.
+
+    The index is rebuilt when it is passed a different record, or when
+    the record's data_gen shows that its data has changed.  Reading into
+    the record, bam_copy1() and the bam_aux_append(), bam_aux_del(),
+    bam_aux_update_*() and bam_aux_edit_apply() functions all change
+    data_gen, so lookups of both present and absent tags take constant
+    time.  Code that edits the data itself should increment data_gen, or
+    call bam_aux_index_reset().
+
+    An index must not be shared between threads.
+*/
+typedef struct bam_aux_index_t bam_aux_index_t;
+
+bam_aux_index_t *bam_aux_index_init(void);
+void bam_aux_index_destroy(bam_aux_index_t *idx);
+
+/// Forget the record the index was built for
+void bam_aux_index_reset(bam_aux_index_t *idx);
+
+/// As bam_aux_get(), but using (and if necessary building) @p idx
+/** @param idx  Index from bam_aux_index_init()
+    @param b    Pointer to the bam record
+    @param tag  Desired aux tag
+    @return Pointer to the tag data, or NULL with errno set as for
+    bam_aux_get()
+*/
+uint8_t *bam_aux_index_get(bam_aux_index_t *idx, const bam1_t *b,
+                           const char tag[2]);
+
 /// Get an integer aux value
 /** @param s Pointer to the tag data, as returned by bam_aux_get()
     @return The value, or 0 if the tag was not an integer type
@@ -744,6 +913,46 @@ int bam_aux_update_float(bam1_t *b, const char tag[2], float val);
 int bam_aux_update_array(bam1_t *b, const char tag[2],
                          uint8_t type, uint32_t items, void *data);
 
+/// Batched aux tag editing
+/** Each of the bam_aux_update_*(), bam_aux_append() and bam_aux_del()
+    functions searches the aux data and may resize and move the rest of
+    the record, so changing several tags on a long read one at a time is
+    slow.  A bam_aux_edit_t collects a set of changes which
+    bam_aux_edit_apply() then makes in a single pass, resizing the record
+    at most once.
+
+    The bam_aux_edit_set*() functions take the same arguments as
+    bam_aux_append(), bam_aux_update_str(), bam_aux_update_int(),
+    bam_aux_update_float() and bam_aux_update_array().  When applied, a set
+    replaces the first existing tag with that ID, whatever its type, without
+    changing the order of tags.  If the tag is not present, it is appended.
+    bam_aux_edit_del() removes the first tag with the ID, if there is one.
+    If a tag is given more than one change, the last one wins.
+
+    The edits are kept after being applied, so the same changes can be made
+    to several records.  Call bam_aux_edit_reset() to start a new set.
+    All of these functions return 0 on success or -1 on failure, setting
+    errno as the corresponding single-tag functions do.
+*/
+typedef struct bam_aux_edit_t bam_aux_edit_t;
+
+bam_aux_edit_t *bam_aux_edit_init(void);
+void bam_aux_edit_destroy(bam_aux_edit_t *ed);
+void bam_aux_edit_reset(bam_aux_edit_t *ed);
+
+int bam_aux_edit_set(bam_aux_edit_t *ed, const char tag[2], char type,
+                     int len, const uint8_t *data);
+int bam_aux_edit_set_str(bam_aux_edit_t *ed, const char tag[2], int len,
+                         const char *data);
+int bam_aux_edit_set_int(bam_aux_edit_t *ed, const char tag[2], int64_t val);
+int bam_aux_edit_set_float(bam_aux_edit_t *ed, const char tag[2], float val);
+int bam_aux_edit_set_array(bam_aux_edit_t *ed, const char tag[2],
+                           uint8_t type, uint32_t items, const void *data);
+int bam_aux_edit_del(bam_aux_edit_t *ed, const char tag[2]);
+
+/// Apply the edits collected in @p ed to @p b
+int bam_aux_edit_apply(bam_aux_edit_t *ed, bam1_t *b);
+
 /**************************
  *** Pileup and Mpileup ***
  **************************/
@@ -795,12 +1004,60 @@ typedef struct {
 
 typedef int (*bam_plp_auto_f)(void *data, bam1_t *b);
 
+/*! @typedef
+ @abstract A pileup column as separate arrays, with one entry per read.
+ @field  n       number of reads in the column
+ @field  m       number of entries allocated
+ @field  base    4-bit base code, as from bam_seqi(); 0 for a deletion
+ @field  qual    base quality; 0 for a deletion
+ @field  mapq    mapping quality of the read
+ @field  flags   BAM_PLP_* bits, including the strand
+ @field  qpos    as bam_pileup1_t::qpos
+ @field  indel   as bam_pileup1_t::indel
+
+ @discussion Filled by bam_plp_cols_fill() or bam_plp_auto_cols(), so
+ that code working on whole columns can read each value from one
+ contiguous array instead of following a pointer to every read.  Start
+ with an all-zero structure and free it with bam_plp_cols_free().
+ Reference skips are flagged as deletions too, as in bam_pileup1_t.
+
+ The arrays are copied from the bam_pileup1_t column, so filling them
+ still looks up each read's base and quality once per column, as direct
+ bam_seqi() use would.  They pay off when a column is gone over more than
+ once, or passed to code that wants arrays, such as errmod_cal() through
+ bam_plp_cols_errmod().
+ */
+typedef struct {
+    int n, m;
+    uint8_t *base, *qual, *mapq, *flags;
+    int32_t *qpos, *indel;
+} bam_plp_cols_t;
+
+#define BAM_PLP_REV      1  ///< The read is on the reverse strand
+#define BAM_PLP_DEL      2  ///< As bam_pileup1_t::is_del
+#define BAM_PLP_REFSKIP  4  ///< As bam_pileup1_t::is_refskip
+#define BAM_PLP_HEAD     8  ///< As bam_pileup1_t::is_head
+#define BAM_PLP_TAIL    16  ///< As bam_pileup1_t::is_tail
+
 struct __bam_plp_t;
 typedef struct __bam_plp_t *bam_plp_t;
 
 struct __bam_mplp_t;
 typedef struct __bam_mplp_t *bam_mplp_t;
 
+struct __bam_depth_t;
+typedef struct __bam_depth_t *bam_depth_t;
+
+struct __bam_pplp_t;
+typedef struct __bam_pplp_t *bam_pplp_t;
+
+/// Called by bam_pplp_run() for each column, with output for its window
+typedef int (*bam_pplp_column_f)(void *data, kstring_t *out, int tid, int pos,
+                                 int n, const bam_pileup1_t *plp);
+/// Called by bam_pplp_run() for each window, in order
+typedef int (*bam_pplp_output_f)(void *data, kstring_t *out, int tid,
+                                 int beg, int end);
+
     /**
      *  bam_plp_init() - sets an iterator over multiple
      *  @func:      see mplp_func in bam_plcmd.c in samtools for an example. Expected return
@@ -815,6 +1072,29 @@ typedef struct __bam_mplp_t *bam_mplp_t;
     void bam_plp_set_maxcnt(bam_plp_t iter, int maxcnt);
     void bam_plp_reset(bam_plp_t iter);
 
+    /// Set up pileup overlap detection, as bam_mplp_init_overlaps()
+    /**
+     * @param iter    pileup iterator
+     * @return 0 on success; a negative value on error
+     */
+    int bam_plp_init_overlaps(bam_plp_t iter);
+
+    /// Only report pileup columns inside a list of regions
+    /**
+     * @param iter    pileup iterator
+     * @param reg     regions, for example from hts_reglist_create()
+     * @param count   number of entries in @p reg, or 0 for no limit
+     * @return 0 on success; -1 on error
+     *
+     *  The regions are copied, and may overlap.  Positions outside them
+     *  are skipped without working out the reads' alignments there, and
+     *  reads that end before the next region are dropped as they are
+     *  pushed.  Once past the last region the iterator stops reading.  As
+     *  the reads are still read in, the read function should use an
+     *  iterator if the regions are a small part of the input.
+     */
+    int bam_plp_set_regions(bam_plp_t iter, const hts_reglist_t *reg, int count);
+
     /**
      *  bam_plp_constructor() - sets a callback to initialise any per-pileup1_t fields.
      *  @plp:       The bam_plp_t initialised using bam_plp_init.
@@ -843,6 +1123,40 @@ typedef struct __bam_mplp_t *bam_mplp_t;
      */
     int bam_plp_insertion(const bam_pileup1_t *p, kstring_t *ins, int *del_len) HTS_RESULT_USED;
 
+    /// Copy a pileup column into separate arrays
+    /**
+     * @param c       columns to fill, growing the arrays if needed
+     * @param plp     pileup column, as from bam_plp_auto()
+     * @param n       number of reads in @p plp
+     * @return 0 on success; -1 on failure
+     */
+    int bam_plp_cols_fill(bam_plp_cols_t *c, const bam_pileup1_t *plp, int n);
+
+    /// As bam_plp_auto(), but return the column as separate arrays
+    /**
+     * @return the number of reads in the column, 0 at the end or -1 on
+     * error
+     */
+    int bam_plp_auto_cols(bam_plp_t iter, int *tid, int *pos, bam_plp_cols_t *c);
+
+    /// Pack a column's bases for errmod_cal()
+    /**
+     * @param c          filled columns
+     * @param min_baseq  leave out bases with a lower quality
+     * @param bases      output, with room for @p c->n entries
+     * @return the number of entries written
+     *
+     *  Deletions and reference skips are left out.  Each entry holds
+     *  the quality, strand and base (0-4 for A, C, G, T and anything
+     *  else) in the layout errmod_cal() expects, to be passed to it with
+     *  m = 5.  The quality is the base quality, capped at the mapping
+     *  quality (unless that is 255) and at 63.
+     */
+    int bam_plp_cols_errmod(const bam_plp_cols_t *c, int min_baseq, uint16_t *bases);
+
+    /// Free the arrays of @p c, leaving it empty
+    void bam_plp_cols_free(bam_plp_cols_t *c);
+
     bam_mplp_t bam_mplp_init(int n, bam_plp_auto_f func, void **data);
     /// Set up mpileup overlap detection
     /**
@@ -859,13 +1173,169 @@ typedef struct __bam_mplp_t *bam_mplp_t;
     int bam_mplp_init_overlaps(bam_mplp_t iter);
     void bam_mplp_destroy(bam_mplp_t iter);
     void bam_mplp_set_maxcnt(bam_mplp_t iter, int maxcnt);
+    /// Only report mpileup columns inside a list of regions, as bam_plp_set_regions()
+    int bam_mplp_set_regions(bam_mplp_t iter, const hts_reglist_t *reg, int count);
+    /// Return the next mpileup position
+    /**
+     * @return the number of inputs with reads at the position, 0 at the
+     * end or -1 on error
+     *
+     *  n_plp and plp have one entry per input, and are set to 0 and NULL
+     *  for inputs without reads at the position.
+     */
     int bam_mplp_auto(bam_mplp_t iter, int *_tid, int *_pos, int *n_plp, const bam_pileup1_t **plp);
     void bam_mplp_reset(bam_mplp_t iter);
+
+    /// Read each mpileup input ahead on threads of its own
+    /**
+     * @param iter      mpileup iterator
+     * @param nthreads  number of prefetch threads, or 0 to stop reading ahead
+     * @param batch     reads fetched at a time for each input, or 0 for a default
+     * @return 0 on success; -1 on error
+     *
+     *  Calls the bam_plp_auto_f read function given to bam_mplp_init()
+     *  for each input on the prefetch threads, up to two batches ahead of
+     *  the pileup.  Read functions for different inputs may therefore run
+     *  at the same time, and must not share unprotected state.
+     *  Constructors and destructors are still called from the thread
+     *  calling bam_mplp_auto().  bam_mplp_reset() waits for the reads in
+     *  flight and discards them, so inputs can be repositioned after it.
+     *
+     *  The threads are separate from any pool given to the inputs with
+     *  hts_set_thread_pool(), as the read functions wait for that pool's
+     *  decoding jobs and could otherwise take every thread it has.  They
+     *  mostly wait, so a handful is enough even for many inputs.
+     */
+    int bam_mplp_set_threads(bam_mplp_t iter, int nthreads, int batch);
     void bam_mplp_constructor(bam_mplp_t iter,
                               int (*func)(void *data, const bam1_t *b, bam_pileup_cd *cd));
     void bam_mplp_destructor(bam_mplp_t iter,
                              int (*func)(void *data, const bam1_t *b, bam_pileup_cd *cd));
 
+    /**
+     *  bam_depth_init() - sets up a depth counter over one or more inputs
+     *  @n:         number of inputs
+     *  @func:      read function, as for bam_mplp_init()
+     *  @data:      array of @n pointers to pass to @func
+     *
+     *  Counts the reads covering each position much faster than a
+     *  pileup, by adding each read's aligned stretches to a difference
+     *  array.  Reads must be sorted by position.  By default unmapped
+     *  reads are skipped, deletions and reference skips are not counted
+     *  as coverage and there is no limit on the depth.
+     */
+    bam_depth_t bam_depth_init(int n, bam_plp_auto_f func, void **data);
+    void bam_depth_destroy(bam_depth_t iter);
+    void bam_depth_reset(bam_depth_t iter);
+
+    /// Set the reads and bases counted
+    /**
+     * @param iter       depth counter
+     * @param min_mapq   skip reads with a lower mapping quality
+     * @param min_baseq  do not count bases with a lower base quality
+     * @param flag_skip  skip reads with any of these BAM_F* flags set
+     *
+     *  Unmapped reads are always skipped.  Reads without qualities are
+     *  not filtered on base quality.
+     */
+    void bam_depth_set_filter(bam_depth_t iter, int min_mapq, int min_baseq,
+                              uint32_t flag_skip);
+
+    /// Set whether deletions count towards the depth
+    void bam_depth_set_deletions(bam_depth_t iter, int count);
+
+    /// Only report depths inside a list of regions
+    /**
+     * @param iter    depth counter
+     * @param reg     regions, for example from hts_reglist_create()
+     * @param count   number of entries in @p reg, or 0 for no limit
+     * @return 0 on success; -1 on error
+     *
+     *  The regions are copied, and may overlap.  Reads that do not touch
+     *  any region are skipped; the read function should still use an
+     *  iterator to avoid reading them if the regions are small.
+     */
+    int bam_depth_set_regions(bam_depth_t iter, const hts_reglist_t *reg, int count);
+
+    /// Return depths for the next stretch of positions
+    /**
+     * @param iter    depth counter
+     * @param tid     set to the reference of the stretch
+     * @param beg     set to its first position
+     * @param len     set to its length
+     * @param depth   set to the depths, with depth[i*n + k] for position
+     *                beg+i in input k
+     * @return the length of the stretch; 0 at the end or -1 on error
+     *
+     *  Every position with reads in any input (and inside the regions if
+     *  set) is in exactly one stretch.  Stretches may also include some
+     *  positions with no reads.  The depths stay valid until the next call.
+     */
+    int bam_depth_next(bam_depth_t iter, int *tid, int *beg, int *len,
+                       const int **depth);
+
+    /// Return depths for the next position with any reads
+    /**
+     * @return the number of inputs with reads at the position, 0 at the
+     * end or -1 on error
+     *
+     *  depth is set to @p n counts, one per input.  Should not be mixed
+     *  with calls to bam_depth_next() on the same counter.
+     */
+    int bam_depth_auto(bam_depth_t iter, int *tid, int *pos, const int **depth);
+
+    /**
+     *  bam_pplp_init() - sets up a pileup split into windows run in parallel
+     *  @fp:        open alignment file, with its header read
+     *  @hdr:       header of @fp
+     *  @idx:       index of @fp
+     *  @p:         thread pool, or NULL to run the windows in turn on @fp
+     *
+     *  Each window of the genome, or of the regions given to
+     *  bam_pplp_set_regions(), gets its own iterator and pileup.  Reads
+     *  that cross a window boundary are read for both windows, and each
+     *  window only reports its own columns, so the columns are the same
+     *  as those of a single pileup.  With a thread pool, each thread
+     *  opens @fp again by name; for CRAM it also loads the index again
+     *  from the default location.  The caller's handle is only used when
+     *  there is no pool.
+     *
+     *  There is no maximum depth, so the columns match those of a single
+     *  pileup given bam_plp_set_maxcnt(iter, INT_MAX).  The reads a limit
+     *  drops depend on all the reads held from earlier positions, and
+     *  these can go back past the start of a window.
+     */
+    bam_pplp_t bam_pplp_init(htsFile *fp, bam_hdr_t *hdr, hts_idx_t *idx,
+                             htsThreadPool *p);
+    void bam_pplp_destroy(bam_pplp_t pp);
+    /// Limit the pileup to some regions; with @p count 0, use every reference
+    int bam_pplp_set_regions(bam_pplp_t pp, const hts_reglist_t *reg, int count);
+    /// Set the window length, or 0 for the default of about a megabase
+    void bam_pplp_set_window(bam_pplp_t pp, int len);
+    /// Turn on overlapping read pair detection, as bam_mplp_init_overlaps()
+    void bam_pplp_init_overlaps(bam_pplp_t pp);
+    /// Set a function to skip reads, returning 0 to keep, 1 to skip or < 0 on error
+    void bam_pplp_set_filter(bam_pplp_t pp, int (*filter)(void *data, bam1_t *b));
+
+    /// Run the pileup over every window
+    /**
+     * @param pp      sharded pileup
+     * @param column  called for each column
+     * @param output  called for each window, or NULL
+     * @param data    passed to @p column, @p output and the filter
+     * @return 0 on success; -1 on error
+     *
+     *  @p column is called for the columns of a window in order, and can
+     *  append anything to the window's @p out string.  With a thread pool
+     *  it runs on the pool, so calls for different windows happen at the
+     *  same time; it must only change @p out.  The filter is also called on
+     *  the pool.  @p output is then called on the calling thread once for
+     *  each window, in genomic order, with the window's string, which it
+     *  may change or empty.  The window is [beg, end) on reference @p tid.
+     */
+    int bam_pplp_run(bam_pplp_t pp, bam_pplp_column_f column,
+                     bam_pplp_output_f output, void *data);
+
 #endif // ~!defined(BAM_NO_PILEUP)
 
 
@@ -0,0 +1,130 @@
+/// @file htslib/sam_sort.h
+/// External merge sort of SAM/BAM/CRAM records.
+/*
+    Copyright (C) 2019 Genome Research Ltd.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.  */
+
+/*
+    Example of usage:
+
+        sam_sort_opts opts = { SAM_SORT_COORD };
+        opts.max_mem = 768 << 20;
+        opts.pool = &pool;      // optional, see hts_tpool_init()
+
+        sam_sorter_t *s = sam_sorter_init(hdr, &opts);
+        while ((r = sam_read1(in, hdr, b)) >= 0)
+            if (sam_sorter_add(s, b) < 0) goto fail;
+        if (r < -1 || sam_sorter_finish(s) < 0) goto fail;
+        while ((r = sam_sorter_next(s, b)) >= 0)
+            if (sam_write1(out, hdr, b) < 0) goto fail;
+        if (r < -1) goto fail;
+        sam_sorter_destroy(s);
+
+    Records are held in memory until the budget is used up, at which point
+    the buffer is sorted and written to a temporary file as a "run".  Once
+    all records have been added the runs are merged.  If everything fits in
+    memory no temporary files are made.
+
+    The sorter does not change the header.  Callers writing the result
+    should update the @HD SO: field themselves.
+*/
+
+#ifndef HTSLIB_SAM_SORT_H
+#define HTSLIB_SAM_SORT_H
+
+#include <stddef.h>
+#include "hts.h"
+#include "sam.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum sam_sort_order {
+    SAM_SORT_COORD = 0, ///< By reference, position and strand; unmapped last
+    SAM_SORT_NAME,      ///< By read name as samtools sort -n, then READ1/2
+    SAM_SORT_TAG        ///< By the value of an aux tag, then by coordinate
+};
+
+/*! @typedef
+ @abstract  Options for sam_sorter_init().
+ @field order       Sort order
+ @field tag         Two character tag for SAM_SORT_TAG
+ @field max_mem     Memory budget for buffered records in bytes, or 0 for
+                    the default (768 MiB)
+ @field tmp_prefix  Prefix for temporary file names, or NULL to put them
+                    in $TMPDIR (or /tmp)
+ @field level       Compression level for temporary files, or -1 for the
+                    default (1)
+ @field pool        Thread pool used for sorting runs and for compressing
+                    and decompressing temporary files, or NULL
+
+ Zero-initialising the structure gives a single threaded coordinate sort
+ with the default budget, except that level 0 means uncompressed.
+ */
+typedef struct {
+    enum sam_sort_order order;
+    char tag[2];
+    size_t max_mem;
+    const char *tmp_prefix;
+    int level;
+    htsThreadPool *pool;
+} sam_sort_opts;
+
+typedef struct sam_sorter_t sam_sorter_t;
+
+/// Create a new sorter
+/** @param h     Header of the records that will be added (not copied, and
+ *               only used for sanity checks; may be NULL)
+ *  @param opts  Sort options (copied)
+ *  @return The new sorter, or NULL on error
+ */
+sam_sorter_t *sam_sorter_init(const bam_hdr_t *h, const sam_sort_opts *opts);
+
+/// Add a record to the sorter
+/** @return 0 on success, -1 on error
+ *
+ *  The record is copied.  Any temporary files are written by this call,
+ *  so it may fail for I/O reasons.
+ */
+int sam_sorter_add(sam_sorter_t *s, const bam1_t *b) HTS_RESULT_USED;
+
+/// Finish adding records and prepare to return them in order
+/** @return 0 on success, -1 on error
+ */
+int sam_sorter_finish(sam_sorter_t *s) HTS_RESULT_USED;
+
+/// Return the next record in sorted order
+/** @param b  Record to fill in
+ *  @return 0 on success, -1 when all records have been returned, < -1 on
+ *          error
+ *
+ *  Records that compare equal are returned in the order they were added.
+ */
+int sam_sorter_next(sam_sorter_t *s, bam1_t *b) HTS_RESULT_USED;
+
+/// Free a sorter and remove any temporary files it made
+void sam_sorter_destroy(sam_sorter_t *s);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
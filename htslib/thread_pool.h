@@ -87,6 +87,11 @@ typedef struct hts_tpool hts_tpool;
  */
 typedef struct hts_tpool_result hts_tpool_result;
 
+/*
+ * A job which may have dependencies on other jobs; see hts_tpool_task_init().
+ */
+typedef struct hts_tpool_job hts_tpool_task;
+
 
 /*-----------------------------------------------------------------------------
  * Thread pool external functions
@@ -187,6 +192,94 @@ int hts_tpool_dispatch3(hts_tpool *p, hts_tpool_process *q,
                         void (*result_cleanup)(void *data),
                         int nonblock);
 
+/// Add several items to the work pool with a single lock acquisition.
+/**
+ * @param p               Thread pool
+ * @param q               Process queue
+ * @param exec_func       Function run by the thread pool for every job
+ * @param args            Array of @p n data pointers, one per job
+ * @param n               Number of jobs to add
+ * @param job_cleanup     Callback to clean up when discarding jobs
+ * @param result_cleanup  Callback to clean up when discarding result data
+ * @param nonblock        Non-blocking flag (see description)
+ * @return Number of jobs added on success
+ *        -1 if no jobs could be added
+ *
+ * This is equivalent to calling hts_tpool_dispatch3() once for each element
+ * of @p args, but takes the pool lock once and wakes as many idle workers
+ * as there are new jobs.  Results are ordered as if dispatched in turn.
+ *
+ * The @p nonblock parameter is as for hts_tpool_dispatch3().  If it is
+ * +1, as many jobs as fit in the input queue are added and the number
+ * added is returned, with `errno` set to `EAGAIN` if this is less
+ * than @p n.  If it is 0, the call blocks whenever the queue is full.
+ * The caller is responsible for the @p args elements that were not added.
+ */
+int hts_tpool_dispatch_batch(hts_tpool *p, hts_tpool_process *q,
+                             void *(*exec_func)(void *arg),
+                             void **args, int n,
+                             void (*job_cleanup)(void *arg),
+                             void (*result_cleanup)(void *data),
+                             int nonblock);
+
+/// Create a task, which may depend on the completion of other tasks.
+/**
+ * @param q               Process queue the task belongs to
+ * @param exec_func       Function run by the thread pool
+ * @param arg             Data for use by exec_func()
+ * @param job_cleanup     Callback to clean up when discarding the task
+ * @param result_cleanup  Callback to clean up when discarding result data
+ * @return Task pointer on success
+ *         NULL on failure
+ *
+ * Tasks allow multi-stage pipelines to be expressed as a graph of jobs,
+ * possibly spread over several process queues, without the caller having
+ * to wait for the results of one stage before dispatching the next.
+ *
+ * The task is held until hts_tpool_task_submit() is called.  Before then,
+ * hts_tpool_task_depends() may be used to declare prerequisites.  Once
+ * submitted and all prerequisites have finished, the task is added to the
+ * input queue of @p q regardless of the queue size limit, and its result
+ * is returned through @p q in the usual way.  The order of results on @p q
+ * is the order in which its tasks and jobs were created.
+ *
+ * If a prerequisite is discarded by hts_tpool_process_reset(), so are the
+ * tasks that depend on it: their job_cleanup() is called and, if @p q
+ * stores results, a result with NULL data is queued in their place.
+ *
+ * The task pointer may not be used once the task has been submitted.
+ * hts_tpool_process_flush() on @p q waits for all its tasks to complete,
+ * including those still waiting on prerequisites.
+ */
+hts_tpool_task *hts_tpool_task_init(hts_tpool_process *q,
+                                    void *(*exec_func)(void *arg), void *arg,
+                                    void (*job_cleanup)(void *arg),
+                                    void (*result_cleanup)(void *data));
+
+/// Declare that a task depends on another.
+/**
+ * @param t   Task which is to wait
+ * @param on  Task which must finish before @p t is started
+ * @return 0 on success
+ *        -1 on failure
+ *
+ * Equivalently, @p t becomes a continuation of @p on.  Neither task
+ * may have been submitted yet.  A task may have any number of
+ * prerequisites and continuations.
+ */
+int hts_tpool_task_depends(hts_tpool_task *t, hts_tpool_task *on);
+
+/// Submit a task created by hts_tpool_task_init().
+/**
+ * @param t   Task to submit
+ * @return 0 on success
+ *        -1 on failure
+ *
+ * This never blocks.  The task will be queued for execution as soon as
+ * all of its prerequisites have finished.
+ */
+int hts_tpool_task_submit(hts_tpool_task *t);
+
 /*
  * Wakes up a single thread stuck in dispatch and make it return with
  * errno EAGAIN.
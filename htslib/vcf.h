@@ -931,6 +931,7 @@ set to one of BCF_ERR* codes and must be checked before calling bcf_write().
     #define bcf_itr_destroy(iter) hts_itr_destroy(iter)
     #define bcf_itr_queryi(idx, tid, beg, end) hts_itr_query((idx), (tid), (beg), (end), bcf_readrec)
     #define bcf_itr_querys(idx, hdr, s) hts_itr_querys((idx), (s), (hts_name2id_f)(bcf_hdr_name2id), (hdr), hts_itr_query, bcf_readrec)
+    #define bcf_itr_shard(idx, shard) hts_shard_itr((idx), (shard), bcf_readrec)
 
     static inline int bcf_itr_next(htsFile *htsfp, hts_itr_t *itr, void *r) {
         if (htsfp->is_bgzf)
@@ -945,6 +946,8 @@ set to one of BCF_ERR* codes and must be checked before calling bcf_write().
     #define bcf_index_seqnames(idx, hdr, nptr) hts_idx_seqnames((idx),(nptr),(hts_id2name_f)(bcf_hdr_id2name),(hdr))
 
     hts_idx_t *bcf_index_load2(const char *fn, const char *fnidx);
+    // flags are HTS_IDX_LAZY and/or HTS_IDX_CACHE; see hts_idx_load3()
+    hts_idx_t *bcf_index_load3(const char *fn, const char *fnidx, int flags);
 
     /**
      *  bcf_index_build() - Generate and save an index file
@@ -987,7 +990,8 @@ set to one of BCF_ERR* codes and must be checked before calling bcf_write().
      *  @fn:         Input VCF/BCF filename
      *  @fnidx:      Output filename, or NULL to add .csi/.tbi to @fn
      *  @min_shift:  Positive to generate CSI, or 0 to generate TBI
-     *  @n_threads:  Number of VCF/BCF decoder threads
+     *  @n_threads:  Number of threads to use; large BGZF files are read
+     *               in parallel pieces when this is more than 1
      *
      *  Returns 0 if successful, or negative if an error occurred.
      *
@@ -45,6 +45,7 @@ htslib_ksort_h = $(HTSPREFIX)htslib/ksort.h
 htslib_kstring_h = $(HTSPREFIX)htslib/kstring.h
 htslib_regidx_h = $(HTSPREFIX)htslib/regidx.h
 htslib_sam_h = $(HTSPREFIX)htslib/sam.h $(htslib_hts_h)
+htslib_sam_sort_h = $(HTSPREFIX)htslib/sam_sort.h $(htslib_hts_h) $(htslib_sam_h)
 htslib_synced_bcf_reader_h = $(HTSPREFIX)htslib/synced_bcf_reader.h $(htslib_hts_h) $(htslib_vcf_h) $(htslib_tbx_h)
 htslib_tbx_h = $(HTSPREFIX)htslib/tbx.h $(htslib_hts_h)
 htslib_thread_pool_h = $(HTSPREFIX)htslib/thread_pool.h
@@ -34,6 +34,10 @@ DEALINGS IN THE SOFTWARE.  */
 #include <assert.h>
 #include "htslib/hts.h"
 #include "htslib/sam.h"
+#include "simd_internal.h"
+
+// seq_nt16_int as a byte table, for hts_nibble_unpack()
+static const char nt16_int[16] = { 4, 0, 1, 4, 2, 4, 4, 4, 3, 4, 4, 4, 4, 4, 4, 4 };
 
 int sam_cap_mapq(bam1_t *b, const char *ref, int ref_len, int thres)
 {
@@ -203,8 +207,7 @@ int sam_prob_realn(bam1_t *b, const char *ref, int ref_len, int flag)
         tref = tseq + align_lqseq;
 
         memcpy(bq, qual, c->l_qseq); bq[c->l_qseq] = 0;
-        for (i = 0; i < c->l_qseq; ++i)
-            tseq[i] = seq_nt16_int[bam_seqi(seq, i)];
+        hts_nibble_unpack(seq, (char *)tseq, c->l_qseq, nt16_int);
         for (i = xb; i < xe; ++i) {
             if (i >= ref_len || ref[i] == '\0') { xe = i; break; }
             tref[i-xb] = seq_nt16_int[seq_nt16_table[(unsigned char)ref[i]]];
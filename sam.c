@@ -32,10 +32,13 @@ DEALINGS IN THE SOFTWARE.  */
 #include <errno.h>
 #include <zlib.h>
 #include <assert.h>
+#include <pthread.h>
 #include "htslib/sam.h"
 #include "htslib/bgzf.h"
+#include "htslib/thread_pool.h"
 #include "cram/cram.h"
 #include "hts_internal.h"
+#include "simd_internal.h"
 #include "htslib/hfile.h"
 #include "htslib/hts_endian.h"
 
@@ -355,6 +358,7 @@ bam1_t *bam_copy1(bam1_t *bdst, const bam1_t *bsrc)
 {
     uint8_t *data = bdst->data;
     int m_data = bdst->m_data;   // backup data and m_data
+    uint32_t data_gen = bdst->data_gen + 1;
     if (m_data < bsrc->l_data) { // double the capacity
         m_data = bsrc->l_data; kroundup32(m_data);
         data = (uint8_t*)realloc(data, m_data);
@@ -364,6 +368,7 @@ bam1_t *bam_copy1(bam1_t *bdst, const bam1_t *bsrc)
     // restore the backup
     bdst->m_data = m_data;
     bdst->data = data;
+    bdst->data_gen = data_gen;
     return bdst;
 }
 
@@ -375,6 +380,165 @@ bam1_t *bam_dup1(const bam1_t *bsrc)
     return bam_copy1(bdst, bsrc);
 }
 
+/*
+ * Record pools.  Structures are carved from slabs of BAM_POOL_SLAB elements
+ * and never freed individually.  Released records keep their data, and are
+ * filed by the size of their buffer (classes of 64 bytes, 128 bytes, ...)
+ * so that a later request can be given one that is already big enough.
+ * The buffers themselves come from malloc so that pooled records can still
+ * be passed to functions which realloc b->data.
+ *
+ * The element size is a parameter so that the pileup code can store its
+ * own bookkeeping after the bam1_t.
+ */
+
+#define BAM_POOL_SLAB   1024
+#define BAM_POOL_NCLASS 16
+
+struct bam_pool_t {
+    size_t elem_size;         // bytes per element, starting with a bam1_t
+    char **slabs;
+    int nslabs, mslabs;
+    int slab_used;            // elements handed out from slabs[nslabs-1]
+    size_t n_used;            // elements currently allocated
+    struct {
+        bam1_t **buf;
+        int n, m;
+    } free[BAM_POOL_NCLASS];
+};
+
+static bam_pool_t *bam_pool_init_size(size_t elem_size)
+{
+    bam_pool_t *pool = calloc(1, sizeof(*pool));
+    if (!pool) return NULL;
+    // Keep elements aligned for whatever follows the bam1_t
+    pool->elem_size = (elem_size + 15) & ~(size_t) 15;
+    pool->slab_used = BAM_POOL_SLAB;
+    return pool;
+}
+
+bam_pool_t *bam_pool_init(void)
+{
+    return bam_pool_init_size(sizeof(bam1_t));
+}
+
+void bam_pool_destroy(bam_pool_t *pool)
+{
+    int i, j;
+    if (!pool) return;
+    for (i = 0; i < pool->nslabs; i++) {
+        int n = i == pool->nslabs - 1 ? pool->slab_used : BAM_POOL_SLAB;
+        for (j = 0; j < n; j++)
+            free(((bam1_t *) (pool->slabs[i] + j * pool->elem_size))->data);
+        free(pool->slabs[i]);
+    }
+    free(pool->slabs);
+    for (i = 0; i < BAM_POOL_NCLASS; i++)
+        free(pool->free[i].buf);
+    free(pool);
+}
+
+// Free list for a buffer of m bytes.  Class c > 0 only holds buffers of
+// at least 64 << c bytes.
+static inline int bam_pool_class_of(size_t m)
+{
+    int c = 0;
+    for (m >>= 7; m && c < BAM_POOL_NCLASS - 1; m >>= 1)
+        c++;
+    return c;
+}
+
+// The first class whose buffers are all at least len bytes
+static inline int bam_pool_class_for(size_t len)
+{
+    int c = 0;
+    for (len = (len - 1) >> 6; len && c < BAM_POOL_NCLASS - 1; len >>= 1)
+        c++;
+    return c;
+}
+
+bam1_t *bam_pool_alloc(bam_pool_t *pool, size_t l_data)
+{
+    bam1_t *b = NULL;
+    uint8_t *data;
+    uint32_t m_data;
+    int c;
+
+    // Smallest class whose buffers are sure to be big enough, then
+    // anything larger, then anything at all
+    for (c = l_data ? bam_pool_class_for(l_data) : 0; c < BAM_POOL_NCLASS; c++)
+        if (pool->free[c].n) break;
+    if (c == BAM_POOL_NCLASS)
+        for (c = 0; c < BAM_POOL_NCLASS; c++)
+            if (pool->free[c].n) break;
+
+    if (c < BAM_POOL_NCLASS) {
+        b = pool->free[c].buf[--pool->free[c].n];
+    } else {
+        if (pool->slab_used == BAM_POOL_SLAB) {
+            if (pool->nslabs == pool->mslabs) {
+                int m = pool->mslabs ? pool->mslabs * 2 : 16;
+                char **s = realloc(pool->slabs, m * sizeof(*s));
+                if (!s) return NULL;
+                pool->slabs = s;
+                pool->mslabs = m;
+            }
+            if (!(pool->slabs[pool->nslabs] =
+                  calloc(BAM_POOL_SLAB, pool->elem_size)))
+                return NULL;
+            pool->nslabs++;
+            pool->slab_used = 0;
+        }
+        b = (bam1_t *) (pool->slabs[pool->nslabs - 1]
+                        + pool->slab_used++ * pool->elem_size);
+    }
+
+    data = b->data;
+    m_data = b->m_data;
+    memset(b, 0, pool->elem_size);
+    b->data = data;
+    b->m_data = m_data;
+    pool->n_used++;
+    return b;
+}
+
+void bam_pool_free(bam_pool_t *pool, bam1_t *b)
+{
+    int c;
+    if (!b) return;
+    c = bam_pool_class_of(b->m_data);
+    if (pool->free[c].n == pool->free[c].m) {
+        int m = pool->free[c].m ? pool->free[c].m * 2 : 256;
+        bam1_t **buf = realloc(pool->free[c].buf, m * sizeof(*buf));
+        if (!buf) {
+            // Can't file it, so just drop the buffer and leak the struct
+            // until the pool is destroyed
+            free(b->data);
+            b->data = NULL;
+            b->m_data = 0;
+            pool->n_used--;
+            return;
+        }
+        pool->free[c].buf = buf;
+        pool->free[c].m = m;
+    }
+    pool->free[c].buf[pool->free[c].n++] = b;
+    pool->n_used--;
+}
+
+bam1_t *bam_pool_dup1(bam_pool_t *pool, const bam1_t *bsrc)
+{
+    bam1_t *b;
+    if (!bsrc) return NULL;
+    if (!(b = bam_pool_alloc(pool, bsrc->l_data)))
+        return NULL;
+    if (realloc_bam_data(b, bsrc->l_data) < 0) {
+        bam_pool_free(pool, b);
+        return NULL;
+    }
+    return bam_copy1(b, bsrc);
+}
+
 void bam_cigar2rqlens(int n_cigar, const uint32_t *cigar, int *rlen, int *qlen)
 {
     int k;
@@ -474,10 +638,80 @@ static void swap_data(const bam1_core_t *c, int l_data, uint8_t *data, int is_ho
     for (i = 0; i < c->n_cigar; ++i) ed_swap_4p(&cigar[i]);
 }
 
-int bam_read1(BGZF *fp, bam1_t *b)
+static inline uint8_t *skip_aux(uint8_t *s, uint8_t *end);
+
+// Reads the rest of a record following its read name, leaving out the
+// parts that are not in fields (see enum sam_fields).  Records that may hold
+// their real CIGAR in a CG tag are read in full for bam_tag2cigar().
+static int bam_read1_rest(BGZF *fp, bam1_t *b, unsigned int fields)
+{
+    bam1_core_t *c = &b->core;
+    uint32_t *cigar, off = c->l_qname + c->n_cigar * 4;
+    ssize_t seq_len = (c->l_qseq + 1) >> 1, qual_len = c->l_qseq;
+    ssize_t aux_len = (ssize_t) b->l_data - off - seq_len - qual_len;
+
+    if (bgzf_read(fp, b->data + c->l_qname, off - c->l_qname)
+        != off - c->l_qname)
+        return -1;
+    if (fp->is_be) swap_data(c, b->l_data, b->data, 0);
+
+    cigar = bam_get_cigar(b);
+    if (c->n_cigar > 0 && c->tid >= 0 && c->pos >= 0
+        && bam_cigar_op(cigar[0]) == BAM_CSOFT_CLIP
+        && bam_cigar_oplen(cigar[0]) == c->l_qseq) {
+        ssize_t rest = b->l_data - off;
+        if (bgzf_read(fp, b->data + off, rest) != rest)
+            return -1;
+        return bam_tag2cigar(b, 0, 0) < 0 ? -1 : 0;
+    }
+
+    if (fields & (SAM_SEQ|SAM_QUAL)) {
+        if (bgzf_read(fp, b->data + off, seq_len) != seq_len)
+            return -1;
+        off += seq_len;
+        if (fields & SAM_QUAL) {
+            if (bgzf_read(fp, b->data + off, qual_len) != qual_len)
+                return -1;
+        } else {
+            if (bgzf_skip(fp, qual_len) != qual_len)
+                return -1;
+            memset(b->data + off, 0xff, qual_len);
+        }
+        off += qual_len;
+    } else {
+        if (bgzf_skip(fp, seq_len + qual_len) != seq_len + qual_len)
+            return -1;
+        c->l_qseq = 0;
+    }
+
+    if (!(fields & (SAM_AUX|SAM_RGAUX))) {
+        if (bgzf_skip(fp, aux_len) != aux_len)
+            return -1;
+        b->l_data = off;
+        return 0;
+    }
+
+    if (bgzf_read(fp, b->data + off, aux_len) != aux_len)
+        return -1;
+    b->l_data = off + aux_len;
+    if (!(fields & SAM_AUX)) { // keep only RG
+        uint8_t *rg = bam_aux_get(b, "RG"), *end = NULL;
+        if (rg)
+            end = skip_aux(rg, b->data + b->l_data);
+        if (end) {
+            memmove(b->data + off, rg - 2, end - (rg - 2));
+            off += end - (rg - 2);
+        }
+        b->l_data = off;
+    }
+    return 0;
+}
+
+// As bam_read1(), but only decodes the given fields.
+static int bam_read1_fields(BGZF *fp, bam1_t *b, unsigned int fields)
 {
     bam1_core_t *c = &b->core;
-    int32_t block_len, ret, i;
+    int32_t block_len, ret, i, l_qseq;
     uint32_t x[8], new_l_data;
     if ((ret = bgzf_read(fp, &block_len, 4)) != 4) {
         if (ret == 0) return -1; // normal end-of-file
@@ -506,16 +740,23 @@ int bam_read1(BGZF *fp, bam1_t *b)
         return -4;
     if (realloc_bam_data(b, new_l_data) < 0) return -4;
     b->l_data = new_l_data;
+    b->data_gen++;
 
     if (bgzf_read(fp, b->data, c->l_qname) != c->l_qname) return -4;
     for (i = 0; i < c->l_extranul; ++i) b->data[c->l_qname+i] = '\0';
     c->l_qname += c->l_extranul;
-    if (b->l_data < c->l_qname ||
-        bgzf_read(fp, b->data + c->l_qname, b->l_data - c->l_qname) != b->l_data - c->l_qname)
+    if (b->l_data < c->l_qname)
         return -4;
-    if (fp->is_be) swap_data(c, b->l_data, b->data, 0);
-    if (bam_tag2cigar(b, 0, 0) < 0)
+    l_qseq = c->l_qseq; // before bam_read1_rest() drops SEQ
+    if ((fields & (SAM_SEQ|SAM_QUAL|SAM_AUX)) == (SAM_SEQ|SAM_QUAL|SAM_AUX)) {
+        if (bgzf_read(fp, b->data + c->l_qname, b->l_data - c->l_qname) != b->l_data - c->l_qname)
+            return -4;
+        if (fp->is_be) swap_data(c, b->l_data, b->data, 0);
+        if (bam_tag2cigar(b, 0, 0) < 0)
+            return -4;
+    } else if (bam_read1_rest(fp, b, fields) < 0) {
         return -4;
+    }
 
     if (c->n_cigar > 0) { // recompute "bin" and check CIGAR-qlen consistency
         int rlen, qlen;
@@ -523,7 +764,7 @@ int bam_read1(BGZF *fp, bam1_t *b)
         if ((b->core.flag & BAM_FUNMAP)) rlen=1;
         b->core.bin = hts_reg2bin(b->core.pos, b->core.pos + rlen, 14, 5);
         // Sanity check for broken CIGAR alignments
-        if (c->l_qseq > 0 && !(c->flag & BAM_FUNMAP) && qlen != c->l_qseq) {
+        if (l_qseq > 0 && !(c->flag & BAM_FUNMAP) && qlen != l_qseq) {
             hts_log_error("CIGAR and query sequence lengths differ for %s",
                     bam_get_qname(b));
             return -4;
@@ -533,6 +774,11 @@ int bam_read1(BGZF *fp, bam1_t *b)
     return 4 + block_len;
 }
 
+int bam_read1(BGZF *fp, bam1_t *b)
+{
+    return bam_read1_fields(fp, b, INT_MAX);
+}
+
 int bam_write1(BGZF *fp, const bam1_t *b)
 {
     const bam1_core_t *c = &b->core;
@@ -609,7 +855,113 @@ static int bam_write_idx1(htsFile *fp, const bam1_t *b) {
  *** BAM indexing ***
  ********************/
 
-static hts_idx_t *sam_index(htsFile *fp, int min_shift)
+static int sam_read1_sam(htsFile *fp, bam_hdr_t *h, bam1_t *b);
+static int sam_parse1_fields(kstring_t *s, bam_hdr_t *h, bam1_t *b,
+                             unsigned int fields);
+
+// Indexing and iterators need the file offset of each record, so SAM text
+// is always parsed on the calling thread here.
+static inline int sam_read1_unthreaded(htsFile *fp, bam_hdr_t *h, bam1_t *b)
+{
+    return fp->format.format == sam
+        ? sam_read1_sam(fp, h, b)
+        : sam_read1(fp, h, b);
+}
+
+// Readers for hts_idx_build_shards()
+typedef struct {
+    bam_hdr_t *h;
+    int text;
+} sam_idx_reader_t;
+
+typedef struct {
+    bam1_t *b;
+    kstring_t line;
+} sam_idx_state_t;
+
+// Checks the fixed-length part of a BAM record for values that a real one
+// would not have, so that shards can find their first record.
+static int64_t bam_idx_check(void *data, const uint8_t *buf, size_t len)
+{
+    const bam_hdr_t *h = ((sam_idx_reader_t *) data)->h;
+    int64_t need;
+    int32_t block_len, tid, pos, mtid, mpos, l_seq;
+    uint32_t l_qname, n_cigar, i;
+
+    if (len < 36) return 0;
+    block_len = le_to_i32(buf);
+    tid = le_to_i32(buf + 4);
+    pos = le_to_i32(buf + 8);
+    l_qname = buf[12];
+    n_cigar = le_to_u32(buf + 16) & 0xffff;
+    l_seq = le_to_i32(buf + 20);
+    mtid = le_to_i32(buf + 24);
+    mpos = le_to_i32(buf + 28);
+
+    if (tid < -1 || tid >= h->n_targets || mtid < -1 || mtid >= h->n_targets
+        || pos < -1 || mpos < -1 || l_qname < 1 || l_seq < 0)
+        return -1;
+    need = 32 + (int64_t) l_qname + 4 * (int64_t) n_cigar
+        + ((int64_t) l_seq + 1) / 2 + l_seq;
+    if (block_len < need) return -1;
+
+    if (len < 36 + l_qname) return 0;
+    for (i = 0; i < l_qname - 1; i++)
+        if (buf[36 + i] == '\0') return -1;
+    if (buf[36 + l_qname - 1] != '\0') return -1;
+    return 4 + (int64_t) block_len;
+}
+
+static int sam_idx_read(void *data, BGZF *fp, void **state, hts_idx_rec_t *rec)
+{
+    sam_idx_reader_t *r = (sam_idx_reader_t *) data;
+    sam_idx_state_t *st = (sam_idx_state_t *) *state;
+    bam1_t *b;
+    int ret;
+
+    if (!st) {
+        if (!(st = calloc(1, sizeof(*st)))) return -2;
+        *state = st;
+        if (!(st->b = bam_init1())) return -2;
+    }
+    b = st->b;
+
+    if (r->text) {
+        if ((ret = bgzf_getline(fp, '\n', &st->line)) < 0)
+            return ret == -1 ? -1 : -2;
+        ret = sam_parse1_fields(&st->line, r->h, b,
+                                SAM_FLAG|SAM_RNAME|SAM_POS|SAM_CIGAR);
+        if (ret < 0) {
+            hts_log_warning("Parse error at offset %"PRIu64,
+                            (uint64_t) bgzf_tell(fp));
+            return r->h->ignore_sam_err ? 1 : -2;
+        }
+    } else {
+        ret = bam_read1_fields(fp, b, SAM_FLAG|SAM_RNAME|SAM_POS|SAM_CIGAR);
+        if (ret < 0) return ret;
+        if (b->core.tid  >= r->h->n_targets || b->core.tid  < -1 ||
+            b->core.mtid >= r->h->n_targets || b->core.mtid < -1)
+            return -3;
+    }
+
+    rec->tid = b->core.tid;
+    rec->beg = b->core.pos;
+    rec->end = bam_endpos(b);
+    rec->is_mapped = !(b->core.flag & BAM_FUNMAP);
+    return 0;
+}
+
+static void sam_idx_free_state(void *state)
+{
+    sam_idx_state_t *st = (sam_idx_state_t *) state;
+    if (!st) return;
+    bam_destroy1(st->b);
+    free(st->line.s);
+    free(st);
+}
+
+static hts_idx_t *sam_index(htsFile *fp, const char *fn, int min_shift,
+                            int n_threads)
 {
     int n_lvls, i, fmt, ret;
     bam1_t *b;
@@ -627,18 +979,29 @@ static hts_idx_t *sam_index(htsFile *fp, int min_shift)
     } else min_shift = 14, n_lvls = 5, fmt = HTS_FMT_BAI;
     idx = hts_idx_init(h->n_targets, fmt, bgzf_tell(fp->fp.bgzf), min_shift, n_lvls);
     b = bam_init1();
-    while ((ret = sam_read1(fp, h, b)) >= 0) {
+    if (n_threads > 1) {
+        sam_idx_reader_t data = { h, fp->format.format == sam };
+        hts_idx_reader_t reader = { data.text, bam_idx_check, sam_idx_read,
+                                    NULL, sam_idx_free_state, &data };
+        ret = hts_idx_build_shards(idx, fn, bgzf_tell(fp->fp.bgzf),
+                                   n_threads, &reader);
+        if (ret < 0) goto err;
+        if (ret == 0) goto done;
+    }
+    while ((ret = sam_read1_unthreaded(fp, h, b)) >= 0) {
         ret = hts_idx_push(idx, b->core.tid, b->core.pos, bam_endpos(b), bgzf_tell(fp->fp.bgzf), !(b->core.flag&BAM_FUNMAP));
         if (ret < 0) goto err; // unsorted
     }
     if (ret < -1) goto err; // corrupted BAM file
 
     hts_idx_finish(idx, bgzf_tell(fp->fp.bgzf));
+ done:
     bam_hdr_destroy(h);
     bam_destroy1(b);
     return idx;
 
 err:
+    bam_hdr_destroy(h);
     bam_destroy1(b);
     hts_idx_destroy(idx);
     return NULL;
@@ -668,7 +1031,7 @@ int sam_index_build3(const char *fn, const char *fnidx, int min_shift, int nthre
             ret = -1;
             break;
         }
-        idx = sam_index(fp, min_shift);
+        idx = sam_index(fp, fn, min_shift, nthreads);
         if (idx) {
             ret = hts_idx_save_as(idx, fn, fnidx, (min_shift > 0)? HTS_FMT_CSI : HTS_FMT_BAI);
             if (ret < 0) ret = -4;
@@ -758,7 +1121,7 @@ static int sam_readrec(BGZF *ignored, void *fpv, void *bv, int *tid, int *beg, i
     htsFile *fp = (htsFile *)fpv;
     bam1_t *b = bv;
     fp->line.l = 0;
-    int ret = sam_read1(fp, fp->bam_header, b);
+    int ret = sam_read1_unthreaded(fp, fp->bam_header, b);
     if (ret >= 0) {
         *tid = b->core.tid;
         *beg = b->core.pos;
@@ -773,7 +1136,7 @@ static int sam_readrec_rest(BGZF *ignored, void *fpv, void *bv, int *tid, int *b
     htsFile *fp = (htsFile *)fpv;
     bam1_t *b = bv;
     fp->line.l = 0;
-    int ret = sam_read1(fp, fp->bam_header, b);
+    int ret = sam_read1_unthreaded(fp, fp->bam_header, b);
     return ret;
 }
 
@@ -861,12 +1224,12 @@ static int64_t bam_ptell(void *fp)
     return bgzf_tell(fd);
 }
 
-hts_idx_t *sam_index_load2(htsFile *fp, const char *fn, const char *fnidx)
+hts_idx_t *sam_index_load3(htsFile *fp, const char *fn, const char *fnidx, int flags)
 {
     switch (fp->format.format) {
     case bam:
     case sam:
-        return fnidx? hts_idx_load2(fn, fnidx) : hts_idx_load(fn, HTS_FMT_BAI);
+        return hts_idx_load3(fn, fnidx, HTS_FMT_BAI, flags);
 
     case cram: {
         if (cram_index_load(fp->fp.cram, fn, fnidx) < 0) return NULL;
@@ -884,6 +1247,11 @@ hts_idx_t *sam_index_load2(htsFile *fp, const char *fn, const char *fnidx)
     }
 }
 
+hts_idx_t *sam_index_load2(htsFile *fp, const char *fn, const char *fnidx)
+{
+    return sam_index_load3(fp, fn, fnidx, 0);
+}
+
 hts_idx_t *sam_index_load(htsFile *fp, const char *fn)
 {
     return sam_index_load2(fp, fn, NULL);
@@ -1001,6 +1369,46 @@ hts_itr_t *sam_itr_regarray(const hts_idx_t *idx, bam_hdr_t *hdr, char **regarra
     return itr;
 }
 
+hts_itr_t *sam_itr_shard(const hts_idx_t *idx, const hts_shard_t *shard)
+{
+    const hts_cram_idx_t *cidx = (const hts_cram_idx_t *) idx;
+    cram_range r = { HTS_IDX_START, 0, 0 };
+    hts_itr_t *iter;
+
+    if (!cidx || !shard)
+        return NULL;
+    if (cidx->fmt != HTS_FMT_CRAI)
+        return hts_shard_itr(idx, shard, sam_readrec);
+
+    // CRAM goes through hts_itr_multi_next(), which can seek to and report
+    // the position of containers.  Clear any range left by an earlier query
+    // so that all records are decoded.
+    if (cram_set_option(cidx->cram, CRAM_OPT_RANGE, &r) < 0)
+        return NULL;
+    if (!(iter = calloc(1, sizeof(*iter))))
+        return NULL;
+    if (!(iter->off = malloc(sizeof(*iter->off)))) {
+        free(iter);
+        return NULL;
+    }
+    iter->is_cram = 1;
+    iter->multi = 1;
+    iter->by_offset = 1;
+    iter->readrec = cram_readrec;
+    iter->seek = cram_pseek;
+    iter->tell = cram_ptell;
+    iter->tid = shard->tid;
+    iter->beg = shard->pos;
+    iter->end = INT_MAX;
+    iter->i = -1;
+    iter->n_off = 1;
+    iter->off[0].u = shard->beg_off;
+    iter->off[0].v = shard->end_off;
+    iter->off[0].max = UINT64_MAX;
+    if (shard->beg_off >= shard->end_off) iter->finished = 1;
+    return iter;
+}
+
 hts_itr_t *sam_itr_regions(const hts_idx_t *idx, bam_hdr_t *hdr, hts_reglist_t *reglist, unsigned int regcount)
 {
     const hts_cram_idx_t *cidx = (const hts_cram_idx_t *) idx;
@@ -1016,6 +1424,47 @@ hts_itr_t *sam_itr_regions(const hts_idx_t *idx, bam_hdr_t *hdr, hts_reglist_t *
                    hts_itr_multi_bam, sam_readrec, bam_pseek, bam_ptell);
 }
 
+static htsFile *sam_itr_mt_open(htsFile *fp)
+{
+    htsFile *wfp = hts_open(fp->fn, "r");
+    bam_hdr_t *h;
+    if (!wfp) return NULL;
+    if (!(h = sam_hdr_read(wfp))) {
+        hts_close(wfp);
+        return NULL;
+    }
+    // SAM files keep their own reference, for parsing records
+    bam_hdr_destroy(h);
+    return wfp;
+}
+
+static void *sam_itr_mt_rec_init(void)
+{
+    return bam_init1();
+}
+
+static void sam_itr_mt_rec_destroy(void *r)
+{
+    bam_destroy1(r);
+}
+
+static int sam_itr_mt_rec_copy(void *dst, const void *src)
+{
+    return bam_copy1(dst, src) ? 0 : -1;
+}
+
+int sam_itr_set_thread_pool(htsFile *fp, hts_itr_t *itr, htsThreadPool *p)
+{
+    static const hts_itr_mt_ops_t ops = {
+        sam_itr_mt_open, sam_itr_mt_rec_init,
+        sam_itr_mt_rec_destroy, sam_itr_mt_rec_copy
+    };
+
+    if (!fp || !itr || !p) return -1;
+    if (fp->format.format != bam && fp->format.format != sam) return 0;
+    return hts_itr_multi_set_pool(fp, itr, p, &ops);
+}
+
 /**********************
  *** SAM header I/O ***
  **********************/
@@ -1428,44 +1877,13 @@ static inline int64_t STRTOUL64(const char *v, char **rv, int b) {
     return n;
 }
 
-int sam_parse1(kstring_t *s, bam_hdr_t *h, bam1_t *b)
+// As sam_parse1(), but only decodes the given fields.  Columns that are not
+// wanted are stepped over without being parsed.
+static int sam_parse1_fields(kstring_t *s, bam_hdr_t *h, bam1_t *b,
+                             unsigned int fields)
 {
 #define _read_token(_p) (_p); do { char *tab = strchr((_p), '\t'); if (!tab) goto err_ret; *tab = '\0'; (_p) = tab + 1; } while (0)
 
-#if HTS_ALLOW_UNALIGNED != 0 && ULONG_MAX == 0xffffffffffffffff
-
-// Macro that operates on 64-bits at a time.
-#define COPY_MINUS_N(to,from,n,l,failed)                        \
-    do {                                                        \
-        uint64_u *from8 = (uint64_u *)(from);                   \
-        uint64_u *to8 = (uint64_u *)(to);                       \
-        uint64_t uflow = 0;                                     \
-        size_t l8 = (l)>>3, i;                                  \
-        for (i = 0; i < l8; i++) {                              \
-            to8[i] = from8[i] - (n)*0x0101010101010101UL;       \
-            uflow |= to8[i];                                    \
-        }                                                       \
-        for (i<<=3; i < (l); ++i) {                             \
-            to[i] = from[i] - (n);                              \
-            uflow |= to[i];                                     \
-        }                                                       \
-        failed = (uflow & 0x8080808080808080UL) > 0;            \
-    } while (0)
-
-#else
-
-// Basic version which operates a byte at a time
-#define COPY_MINUS_N(to,from,n,l,failed) do {                \
-        uint8_t uflow = 0;                                   \
-        for (i = 0; i < (l); ++i) {                          \
-            (to)[i] = (from)[i] - (n);                       \
-            uflow |= (uint8_t) (to)[i];                      \
-        }                                                    \
-        failed = (uflow & 0x80) > 0;                         \
-    } while (0)
-
-#endif
-
 #define _get_mem(type_t, _x, _s, _l) ks_resize((_s), (_s)->l + (_l)); *(_x) = (type_t*)((_s)->s + (_s)->l); (_s)->l += (_l)
 #define _parse_err(cond, msg) do { if (cond) { hts_log_error(msg); goto err_ret; } } while (0)
 #define _parse_err_param(cond, msg, param) do { if (cond) { hts_log_error(msg, param); goto err_ret; } } while (0)
@@ -1479,6 +1897,7 @@ int sam_parse1(kstring_t *s, bam_hdr_t *h, bam1_t *b)
 
     str.l = b->l_data = 0;
     str.s = (char*)b->data; str.m = b->m_data;
+    b->data_gen++;
     memset(c, 0, 32);
     if (h->cigar_tab == 0) {
         h->cigar_tab = (int8_t*) malloc(128);
@@ -1576,40 +1995,60 @@ int sam_parse1(kstring_t *s, bam_hdr_t *h, bam1_t *b)
     // seq
     q = _read_token(p);
     if (strcmp(q, "*")) {
+        uint32_t *cigar = (uint32_t*)(str.s + c->l_qname);
         _parse_err(p - q - 1 > INT32_MAX, "read sequence is too long");
         c->l_qseq = p - q - 1;
-        i = bam_cigar2qlen(c->n_cigar, (uint32_t*)(str.s + c->l_qname));
+        i = bam_cigar2qlen(c->n_cigar, cigar);
         _parse_err(c->n_cigar && i != c->l_qseq, "CIGAR and query sequence are of different length");
-        i = (c->l_qseq + 1) >> 1;
-        _get_mem(uint8_t, &t, &str, i);
-
-        unsigned int lqs2 = c->l_qseq&~1, i;
-        for (i = 0; i < lqs2; i+=2)
-            t[i>>1] = (seq_nt16_table[(unsigned char)q[i]] << 4) | seq_nt16_table[(unsigned char)q[i+1]];
-        for (; i < c->l_qseq; ++i)
-            t[i>>1] = seq_nt16_table[(unsigned char)q[i]] << ((~i&1)<<2);
+        // The real CIGAR may be in a CG tag, which bam_tag2cigar() needs
+        // the whole record to move into place
+        if (c->n_cigar && c->tid >= 0 && c->pos >= 0
+            && bam_cigar_op(cigar[0]) == BAM_CSOFT_CLIP
+            && bam_cigar_oplen(cigar[0]) == c->l_qseq)
+            fields = INT_MAX;
+        if (fields & (SAM_SEQ|SAM_QUAL)) {
+            i = (c->l_qseq + 1) >> 1;
+            _get_mem(uint8_t, &t, &str, i);
+
+            hts_nibble_pack(q, t, c->l_qseq);
+        }
     } else c->l_qseq = 0;
     // qual
-    _get_mem(uint8_t, &t, &str, c->l_qseq);
-    if (p[0] == '*' && (p[1] == '\t' || p[1] == '\0')) {
-        memset(t, 0xff, c->l_qseq);
-        p += 2;
+    if (!(fields & (SAM_SEQ|SAM_QUAL))) {
+        c->l_qseq = 0;
+        q = strchr(p, '\t');
+        p = q ? q + 1 : s->s + s->l;
     } else {
-        int failed = 0;
-        _parse_err(s->l - (p - s->s) < c->l_qseq
-                   || (p[c->l_qseq] != '\t' && p[c->l_qseq] != '\0'),
-                   "SEQ and QUAL are of different length");
-        COPY_MINUS_N(t, p, 33, c->l_qseq, failed);
-        _parse_err(failed, "invalid QUAL character");
-        p += c->l_qseq + 1;
+        _get_mem(uint8_t, &t, &str, c->l_qseq);
+        if (p[0] == '*' && (p[1] == '\t' || p[1] == '\0')) {
+            memset(t, 0xff, c->l_qseq);
+            p += 2;
+        } else {
+            _parse_err(s->l - (p - s->s) < c->l_qseq
+                       || (p[c->l_qseq] != '\t' && p[c->l_qseq] != '\0'),
+                       "SEQ and QUAL are of different length");
+            if (fields & SAM_QUAL)
+                _parse_err(hts_qual_sub(t, p, c->l_qseq, 33),
+                           "invalid QUAL character");
+            else
+                memset(t, 0xff, c->l_qseq);
+            p += c->l_qseq + 1;
+        }
     }
     // aux
     q = p;
     p = s->s + s->l;
+    if (!(fields & (SAM_AUX|SAM_RGAUX)))
+        q = p;
     while (q < p) {
         uint8_t type;
         _parse_err(p - q < 5, "incomplete aux field");
         _parse_err(q[0] < '!' || q[1] < '!', "invalid aux tag id");
+        if (!(fields & SAM_AUX) && !(q[0] == 'R' && q[1] == 'G')) {
+            while (*q > '\t') { q++; } // not wanted, so skip to next tab
+            q++;
+            continue;
+        }
         kputsn_(q, 2, &str);
         q += 3; type = *q++; ++q; // q points to value
         if (type != 'Z' && type != 'H') // the only zero length acceptable fields
@@ -1729,77 +2168,878 @@ err_ret:
     return -2;
 }
 
-int sam_read1(htsFile *fp, bam_hdr_t *h, bam1_t *b)
+int sam_parse1(kstring_t *s, bam_hdr_t *h, bam1_t *b)
 {
-    switch (fp->format.format) {
-    case bam: {
-        int r = bam_read1(fp->fp.bgzf, b);
-        if (h && r >= 0) {
-            if (b->core.tid  >= h->n_targets || b->core.tid  < -1 ||
-                b->core.mtid >= h->n_targets || b->core.mtid < -1)
-                return -3;
-        }
-        return r;
-        }
+    return sam_parse1_fields(s, h, b, INT_MAX);
+}
 
-    case cram: {
-        int ret = cram_get_bam_seq(fp->fp.cram, &b);
-        if (ret < 0)
-            return cram_eof(fp->fp.cram) ? -1 : -2;
+/*
+ * Multi-threaded SAM reading and writing.
+ *
+ * A dispatcher thread reads the (possibly BGZF compressed) input in blocks
+ * of roughly SAM_NBYTES, ending on a line boundary, and queues each block
+ * as a job on the thread pool.  The jobs parse every line into an array of
+ * bam1_t structs which are then handed back to sam_read1() in order.
+ *
+ * Parse errors are not reported by the workers; instead the position of
+ * each bad line is recorded and the main thread logs the warning and
+ * returns the error (or skips it, if ignore_sam_err is set) at the same
+ * point in the record stream as the unthreaded code would.
+ *
+ * Writing works the other way around.  sam_write1() copies records into a
+ * batch of roughly SAM_NBYTES of BAM data, which is formatted to text by a
+ * job on the thread pool.  The formatted blocks are collected in order and
+ * written out by the calling thread whenever it queues another batch, and
+ * when the file is closed.
+ */
 
-        if (bam_tag2cigar(b, 1, 1) < 0)
-            return -2;
-        return ret;
+#define SAM_NBYTES 240000
+
+static int sam_format1_append(const bam_hdr_t *h, const bam1_t *b,
+                              kstring_t *str);
+
+// A block of input text
+typedef struct sp_lines {
+    struct SAM_state *fd;
+    char *data;
+    size_t data_size, alloc;
+    int status;              // -1 for EOF, -2 for read error
+    struct sp_lines *next;   // free list
+} sp_lines;
+
+// The parsed records from one block of text
+typedef struct sp_bams {
+    struct SAM_state *fd;    // used when writing
+    bam1_t *bams;
+    int nbams, abams;
+    int64_t nlines;          // lines consumed, including bad ones
+    int status;              // copied from sp_lines
+    int *err_idx;            // position in bams[] of each bad line
+    int64_t *err_line;       // and its line number within the block
+    int n_err, m_err;
+    struct sp_bams *next;    // free list
+} sp_bams;
+
+enum sam_cmd { SAM_NONE = 0, SAM_CLOSE };
+
+typedef struct SAM_state {
+    bam_hdr_t *h;            // owned by SAM_state when writing
+    hts_tpool *p;
+    int own_pool;            // size of pool to start, if owned by us
+    hts_tpool_process *q;
+    pthread_t dispatcher;
+    int dispatcher_started;
+
+    // Free lists, shared between the dispatcher, workers and main thread
+    pthread_mutex_t lines_m;
+    sp_lines *lines;
+    sp_bams *bams;
+
+    // Text left over from the previous block (or from sam_hdr_read)
+    kstring_t carry;
+
+    // Main thread's current block and read position within it, or the
+    // batch being filled when writing
+    sp_bams *curr_bams;
+    int curr_idx, curr_err;
+    size_t curr_bytes;       // BAM data in curr_bams (writing)
+    int64_t lineno;          // line number before the current block
+    int errcode;
+    unsigned int fields;     // fp->required_fields when reading started
+
+    pthread_mutex_t command_m;
+    enum sam_cmd command;
+} SAM_state;
+
+static void sam_free_lines(sp_lines *l) {
+    if (!l) return;
+    free(l->data);
+    free(l);
+}
+
+static void sam_free_bams(sp_bams *gb) {
+    int i;
+    if (!gb) return;
+    for (i = 0; i < gb->abams; i++)
+        free(gb->bams[i].data);
+    free(gb->bams);
+    free(gb->err_idx);
+    free(gb->err_line);
+    free(gb);
+}
+
+static void sam_recycle_lines(SAM_state *fd, sp_lines *l) {
+    pthread_mutex_lock(&fd->lines_m);
+    l->next = fd->lines;
+    fd->lines = l;
+    pthread_mutex_unlock(&fd->lines_m);
+}
+
+static void sam_recycle_bams(SAM_state *fd, sp_bams *gb) {
+    pthread_mutex_lock(&fd->lines_m);
+    gb->next = fd->bams;
+    fd->bams = gb;
+    pthread_mutex_unlock(&fd->lines_m);
+}
+
+// Job and result cleanup callbacks for hts_tpool_process_reset().
+static void sam_cleanup_lines(void *arg) {
+    sam_free_lines((sp_lines *)arg);
+}
+
+static void sam_cleanup_bams(void *arg) {
+    sam_free_bams((sp_bams *)arg);
+}
+
+static int sam_add_parse_err(sp_bams *gb, int64_t line) {
+    if (gb->n_err == gb->m_err) {
+        int m = gb->m_err ? gb->m_err * 2 : 8;
+        int *ei = realloc(gb->err_idx, m * sizeof(*ei));
+        if (!ei) return -1;
+        gb->err_idx = ei;
+        int64_t *el = realloc(gb->err_line, m * sizeof(*el));
+        if (!el) return -1;
+        gb->err_line = el;
+        gb->m_err = m;
     }
+    gb->err_idx[gb->n_err] = gb->nbams;
+    gb->err_line[gb->n_err++] = line;
+    return 0;
+}
 
-    case sam: {
-        int ret;
-err_recover:
-        if (fp->line.l == 0) {
-            ret = hts_getline(fp, KS_SEP_LINE, &fp->line);
-            if (ret < 0) return ret;
+// Worker: parses one block of lines into an array of bam1_t.
+static void *sam_parse_worker(void *arg) {
+    sp_lines *l = (sp_lines *)arg;
+    SAM_state *fd = l->fd;
+    sp_bams *gb;
+    char *cp = l->data, *end = l->data + l->data_size;
+
+    pthread_mutex_lock(&fd->lines_m);
+    if ((gb = fd->bams) != NULL)
+        fd->bams = gb->next;
+    pthread_mutex_unlock(&fd->lines_m);
+    if (!gb && !(gb = calloc(1, sizeof(*gb))))
+        goto err;
+    gb->nbams = 0;
+    gb->nlines = 0;
+    gb->n_err = 0;
+    gb->status = l->status;
+
+    while (cp < end) {
+        char *nl = memchr(cp, '\n', end - cp);
+        size_t len = nl ? nl - cp : end - cp;
+        kstring_t ks;
+
+        if (gb->nbams == gb->abams) {
+            int n = gb->abams ? gb->abams * 2 : 256;
+            bam1_t *b = realloc(gb->bams, n * sizeof(*b));
+            if (!b)
+                goto err;
+            memset(b + gb->abams, 0, (n - gb->abams) * sizeof(*b));
+            gb->bams = b;
+            gb->abams = n;
         }
-        ret = sam_parse1(&fp->line, h, b);
-        fp->line.l = 0;
-        if (ret < 0) {
-            hts_log_warning("Parse error at line %lld", (long long)fp->lineno);
-            if (h->ignore_sam_err) goto err_recover;
+
+        if (len && cp[len-1] == '\r')
+            len--;
+        cp[len] = '\0';
+        ks.s = cp;
+        ks.l = len;
+        ks.m = len + 1;
+        gb->nlines++;
+        if (sam_parse1_fields(&ks, fd->h, &gb->bams[gb->nbams],
+                              fd->fields) < 0) {
+            if (sam_add_parse_err(gb, gb->nlines) < 0)
+                goto err;
+        } else {
+            gb->nbams++;
         }
-        return ret;
+
+        cp = nl ? nl + 1 : end;
     }
 
-    default:
-        abort();
+    sam_recycle_lines(fd, l);
+    return gb;
+
+ err:
+    // Returning NULL makes the reader report an error
+    sam_recycle_lines(fd, l);
+    if (gb) sam_recycle_bams(fd, gb);
+    return NULL;
+}
+
+static enum sam_cmd sam_state_command(SAM_state *fd) {
+    enum sam_cmd c;
+    pthread_mutex_lock(&fd->command_m);
+    c = fd->command;
+    pthread_mutex_unlock(&fd->command_m);
+    return c;
+}
+
+static ssize_t sam_read_block(htsFile *fp, char *buf, size_t len) {
+    if (fp->format.compression == no_compression)
+        return hread(fp->fp.hfile, buf, len);
+    else
+        return bgzf_read(fp->fp.bgzf, buf, len);
+}
+
+// Stops the dispatcher on an error, making sure the reader sees it.  An
+// empty block marked as failed is queued after the ones already sent;
+// if even that is impossible the queue is shut down, which makes the
+// reader's wait for results return NULL.
+static void sam_dispatcher_fail(SAM_state *fd, sp_lines *l) {
+    if (l) {
+        l->data_size = 0;
+        l->status = -2;
+        if (hts_tpool_dispatch3(fd->p, fd->q, sam_parse_worker, l,
+                                sam_cleanup_lines, sam_cleanup_bams, 0) == 0)
+            return;
+        sam_free_lines(l);
     }
+    hts_tpool_process_shutdown(fd->q);
 }
 
-int sam_format1(const bam_hdr_t *h, const bam1_t *b, kstring_t *str)
-{
-    int i;
-    uint8_t *s, *end;
-    const bam1_core_t *c = &b->core;
+// Dispatcher thread: reads blocks of text ending on a newline.
+static void *sam_dispatcher_read(void *vp) {
+    htsFile *fp = vp;
+    SAM_state *fd = fp->state;
+    int status = 0;
+
+    while (status == 0 && sam_state_command(fd) == SAM_NONE) {
+        sp_lines *l;
+
+        pthread_mutex_lock(&fd->lines_m);
+        if ((l = fd->lines) != NULL)
+            fd->lines = l->next;
+        pthread_mutex_unlock(&fd->lines_m);
+        if (!l && !(l = calloc(1, sizeof(*l)))) {
+            sam_dispatcher_fail(fd, NULL);
+            break;
+        }
+        l->fd = fd;
+        l->status = 0;
+
+        if (l->alloc < fd->carry.l + SAM_NBYTES) {
+            size_t sz = fd->carry.l + SAM_NBYTES;
+            char *d = realloc(l->data, sz);
+            if (!d) {
+                sam_dispatcher_fail(fd, l);
+                break;
+            }
+            l->data = d;
+            l->alloc = sz;
+        }
+        memcpy(l->data, fd->carry.s, fd->carry.l);
+        l->data_size = fd->carry.l;
+        fd->carry.l = 0;
+
+        // Fill the block, then trim it back to the last newline.  Lines
+        // longer than the block grow it until a newline is found.
+        char *nl = NULL;
+        size_t searched = 0;
+        for (;;) {
+            ssize_t n = sam_read_block(fp, l->data + l->data_size,
+                                       l->alloc - l->data_size);
+            if (n < 0) { status = -2; break; }
+            if (n == 0) { status = -1; break; }
+            l->data_size += n;
+            if (l->data_size < l->alloc)
+                continue;
+
+            char *cp;
+            for (cp = l->data + l->data_size; cp > l->data + searched; )
+                if (*--cp == '\n') { nl = cp; break; }
+            if (nl)
+                break;
+            searched = l->data_size;
 
-    str->l = 0;
-    kputsn_(bam_get_qname(b), c->l_qname-1-c->l_extranul, str); kputc_('\t', str); // query name
-    kputw(c->flag, str); kputc_('\t', str); // flag
-    if (c->tid >= 0) { // chr
-        kputs(h->target_name[c->tid] , str);
-        kputc_('\t', str);
-    } else kputsn_("*\t", 2, str);
-    kputw(c->pos + 1, str); kputc_('\t', str); // pos
-    kputw(c->qual, str); kputc_('\t', str); // qual
-    if (c->n_cigar) { // cigar
-        uint32_t *cigar = bam_get_cigar(b);
-        for (i = 0; i < c->n_cigar; ++i) {
-            kputw(bam_cigar_oplen(cigar[i]), str);
-            kputc_(bam_cigar_opchr(cigar[i]), str);
+            char *d = realloc(l->data, l->alloc * 2);
+            if (!d) { status = -2; break; }
+            l->data = d;
+            l->alloc *= 2;
         }
-    } else kputc_('*', str);
-    kputc_('\t', str);
-    if (c->mtid < 0) kputsn_("*\t", 2, str); // mate chr
-    else if (c->mtid == c->tid) kputsn_("=\t", 2, str);
-    else {
-        kputs(h->target_name[c->mtid], str);
+
+        if (status == 0 && nl) {
+            size_t keep = nl + 1 - l->data;
+            if (kputsn(nl + 1, l->data_size - keep, &fd->carry) < 0)
+                status = -2;
+            l->data_size = keep;
+        }
+        // At EOF the final line may lack a newline; it is parsed as is.
+        l->status = status;
+
+        if (hts_tpool_dispatch3(fd->p, fd->q, sam_parse_worker, l,
+                                sam_cleanup_lines, sam_cleanup_bams, 0) < 0) {
+            sam_free_lines(l);
+            // Unless the queue is being shut down for sam_close()
+            if (sam_state_command(fd) == SAM_NONE)
+                sam_dispatcher_fail(fd, NULL);
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+static SAM_state *sam_state_init(htsFile *fp) {
+    SAM_state *fd;
+
+    if (!(fd = calloc(1, sizeof(*fd))))
+        return NULL;
+    pthread_mutex_init(&fd->lines_m, NULL);
+    pthread_mutex_init(&fd->command_m, NULL);
+    fp->state = fd;
+
+    return fd;
+}
+
+// Starts the pool requested by sam_set_threads(), if not already running.
+static int sam_state_start_pool(SAM_state *fd) {
+    if (fd->q)
+        return 0;
+    if (!(fd->p = hts_tpool_init(fd->own_pool)))
+        return -1;
+    if (!(fd->q = hts_tpool_process_init(fd->p, fd->own_pool * 2, 0)))
+        return -1;
+    return 0;
+}
+
+// Starts the dispatcher on the first read, once the header is known.
+static int sam_state_start(htsFile *fp, bam_hdr_t *h) {
+    SAM_state *fd = fp->state;
+
+    if (!h) {
+        errno = EINVAL;
+        return -2;
+    }
+
+    if (sam_state_start_pool(fd) < 0)
+        return -2;
+
+    // Workers call bam_name2id() concurrently, so build the dictionary
+    // up-front rather than lazily.
+    bam_name2id(h, "");
+    fd->h = h;
+    fd->fields = fp->required_fields;
+
+    // Any record line left by sam_hdr_read() is the first to be parsed.
+    if (fp->line.l) {
+        if (kputsn(fp->line.s, fp->line.l, &fd->carry) < 0
+            || kputc('\n', &fd->carry) < 0)
+            return -2;
+        fp->line.l = 0;
+        fp->lineno--;
+    }
+    fd->lineno = fp->lineno;
+
+    if (pthread_create(&fd->dispatcher, NULL, sam_dispatcher_read, fp) != 0)
+        return -2;
+    fd->dispatcher_started = 1;
+
+    return 0;
+}
+
+static int sam_read1_mt(htsFile *fp, bam_hdr_t *h, bam1_t *b) {
+    SAM_state *fd = fp->state;
+
+    if (!fd->dispatcher_started) {
+        int ret = sam_state_start(fp, h);
+        if (ret < 0)
+            return ret;
+    }
+
+    for (;;) {
+        sp_bams *gb = fd->curr_bams;
+
+        if (!gb) {
+            hts_tpool_result *r;
+
+            if (fd->errcode)
+                return fd->errcode;
+            if (!(r = hts_tpool_next_result_wait(fd->q)))
+                return (fd->errcode = -2);
+            gb = hts_tpool_result_data(r);
+            hts_tpool_delete_result(r, 0);
+            if (!gb)
+                return (fd->errcode = -2);
+            fd->curr_bams = gb;
+            fd->curr_idx = 0;
+            fd->curr_err = 0;
+        }
+
+        // Report any bad lines preceding the next record
+        if (fd->curr_err < gb->n_err
+            && gb->err_idx[fd->curr_err] == fd->curr_idx) {
+            fp->lineno = fd->lineno + gb->err_line[fd->curr_err++];
+            hts_log_warning("Parse error at line %lld", (long long)fp->lineno);
+            if (h->ignore_sam_err)
+                continue;
+            return -2;
+        }
+
+        if (fd->curr_idx < gb->nbams) {
+            bam1_t *src = &gb->bams[fd->curr_idx++];
+            // Swap rather than copy, leaving b's old buffer for reuse.
+            uint8_t *data = b->data;
+            uint32_t m_data = b->m_data;
+            b->core   = src->core;
+            b->l_data = src->l_data;
+            b->data   = src->data;
+            b->m_data = src->m_data;
+            src->data   = data;
+            src->m_data = m_data;
+            src->l_data = 0;
+            b->data_gen++;
+            fp->lineno++;
+            return 0;
+        }
+
+        // Block exhausted
+        fd->lineno += gb->nlines;
+        fp->lineno = fd->lineno;
+        fd->curr_bams = NULL;
+        if (gb->status < 0)
+            fd->errcode = gb->status;
+        sam_recycle_bams(fd, gb);
+    }
+}
+
+// Worker: formats a batch of bam1_t into a block of SAM text.
+static void *sam_format_worker(void *arg) {
+    sp_bams *gb = (sp_bams *)arg;
+    SAM_state *fd = gb->fd;
+    sp_lines *l;
+    kstring_t ks = { 0, 0, NULL };
+    int i;
+
+    pthread_mutex_lock(&fd->lines_m);
+    if ((l = fd->lines) != NULL)
+        fd->lines = l->next;
+    pthread_mutex_unlock(&fd->lines_m);
+    if (!l && !(l = calloc(1, sizeof(*l))))
+        goto err;
+    l->fd = fd;
+    l->status = 0;
+
+    // Format straight into the block's buffer, letting kstring grow it.
+    ks.s = l->data;
+    ks.m = l->alloc;
+    for (i = 0; i < gb->nbams; i++) {
+        if (sam_format1_append(fd->h, &gb->bams[i], &ks) < 0
+            || kputc('\n', &ks) < 0) {
+            l->data = ks.s;
+            l->alloc = ks.m;
+            goto err;
+        }
+    }
+    l->data = ks.s;
+    l->alloc = ks.m;
+    l->data_size = ks.l;
+
+    sam_recycle_bams(fd, gb);
+    return l;
+
+ err:
+    // Returning NULL makes the writer report an error
+    sam_recycle_bams(fd, gb);
+    if (l) sam_recycle_lines(fd, l);
+    return NULL;
+}
+
+static ssize_t sam_write_block(htsFile *fp, const char *buf, size_t len) {
+    if (fp->format.compression == no_compression)
+        return hwrite(fp->fp.hfile, buf, len);
+    else
+        return bgzf_write(fp->fp.bgzf, buf, len);
+}
+
+/*
+ * Writes out formatted blocks in order.  If wait is set, this blocks until
+ * one result (or all outstanding results, if wait is 2) has been written;
+ * otherwise only results that are already available are written.
+ *
+ * Returns 0 on success;
+ *        -1 on failure
+ */
+static int sam_write_results(htsFile *fp, int wait) {
+    SAM_state *fd = fp->state;
+    hts_tpool_result *r;
+
+    for (;;) {
+        if (wait == 2 && hts_tpool_process_empty(fd->q))
+            break;
+        r = wait ? hts_tpool_next_result_wait(fd->q)
+                 : hts_tpool_next_result(fd->q);
+        if (!r)
+            break;
+
+        sp_lines *l = hts_tpool_result_data(r);
+        hts_tpool_delete_result(r, 0);
+        if (!l) {
+            hts_log_error("Failed to format SAM records");
+            fd->errcode = -1;
+        } else {
+            if (!fd->errcode
+                && sam_write_block(fp, l->data, l->data_size) != l->data_size)
+                fd->errcode = -1;
+            sam_recycle_lines(fd, l);
+        }
+
+        if (wait == 1)
+            break;
+    }
+
+    return fd->errcode;
+}
+
+// Hands the current batch to the thread pool.
+static int sam_write_dispatch(htsFile *fp) {
+    SAM_state *fd = fp->state;
+    sp_bams *gb = fd->curr_bams;
+
+    if (!gb)
+        return 0;
+    fd->curr_bams = NULL;
+    fd->curr_bytes = 0;
+
+    // The calling thread is also the consumer of the results, so it must
+    // not block on a full queue.  Write a result out to make room instead.
+    while (hts_tpool_dispatch3(fd->p, fd->q, sam_format_worker, gb,
+                               sam_cleanup_bams, sam_cleanup_lines, 1) < 0) {
+        if (errno != EAGAIN || sam_write_results(fp, 1) < 0) {
+            sam_recycle_bams(fd, gb);
+            return -1;
+        }
+    }
+
+    return sam_write_results(fp, 0);
+}
+
+// Writes out everything queued so far.
+static int sam_write_flush(htsFile *fp) {
+    if (!((SAM_state *)fp->state)->q)
+        return 0;
+    if (sam_write_dispatch(fp) < 0)
+        return -1;
+    return sam_write_results(fp, 2);
+}
+
+static int sam_write1_mt(htsFile *fp, const bam_hdr_t *h, const bam1_t *b) {
+    SAM_state *fd = fp->state;
+    sp_bams *gb;
+
+    if (fd->errcode || sam_state_start_pool(fd) < 0)
+        return -1;
+
+    // Records may be formatted after the caller has freed the header
+    // (but before hts_close), so the workers use a copy.
+    if (!fd->h && !(fd->h = bam_hdr_dup(h)))
+        return -1;
+
+    if (!(gb = fd->curr_bams)) {
+        pthread_mutex_lock(&fd->lines_m);
+        if ((gb = fd->bams) != NULL)
+            fd->bams = gb->next;
+        pthread_mutex_unlock(&fd->lines_m);
+        if (!gb && !(gb = calloc(1, sizeof(*gb))))
+            return -1;
+        gb->fd = fd;
+        gb->nbams = 0;
+        fd->curr_bams = gb;
+    }
+
+    if (gb->nbams == gb->abams) {
+        int n = gb->abams ? gb->abams * 2 : 256;
+        bam1_t *nb = realloc(gb->bams, n * sizeof(*nb));
+        if (!nb)
+            return -1;
+        memset(nb + gb->abams, 0, (n - gb->abams) * sizeof(*nb));
+        gb->bams = nb;
+        gb->abams = n;
+    }
+    if (!bam_copy1(&gb->bams[gb->nbams], b))
+        return -1;
+    gb->nbams++;
+
+    fd->curr_bytes += b->l_data;
+    if (fd->curr_bytes >= SAM_NBYTES && sam_write_dispatch(fp) < 0)
+        return -1;
+
+    return 0;
+}
+
+/*
+ * Sets up multi-threaded SAM parsing or formatting using thread pool p.
+ * Reading is started on the first call to sam_read1(), so this may be
+ * called either before or after the header has been read.
+ *
+ * Returns 0 on success;
+ *        -1 on failure
+ */
+int sam_set_thread_pool(htsFile *fp, htsThreadPool *p) {
+    SAM_state *fd;
+
+    if (fp->state)
+        return 0;
+
+    if (!(fd = sam_state_init(fp)))
+        return -1;
+    fd->p = p->pool;
+    fd->q = hts_tpool_process_init(fd->p, p->qsize ? p->qsize
+                                   : hts_tpool_size(fd->p) * 2, 0);
+    if (!fd->q) {
+        sam_state_destroy(fp);
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * As sam_set_thread_pool(), but with a pool of n threads owned by fp.
+ * This is separate from any pool used for BGZF decompression.  The pool
+ * is not started until the first record is read or written, so text
+ * output that turns out not to be SAM does not pay for it.
+ */
+int sam_set_threads(htsFile *fp, int nthreads) {
+    SAM_state *fd;
+
+    if (nthreads <= 0 || fp->state)
+        return 0;
+    if (!(fd = sam_state_init(fp)))
+        return -1;
+    fd->own_pool = nthreads;
+
+    return 0;
+}
+
+
+/*
+ * Writes any pending records, stops any threads and frees the SAM state.
+ * This must be called before the underlying file is closed.
+ *
+ * Returns 0 on success;
+ *        -1 on failure
+ */
+int sam_state_destroy(htsFile *fp) {
+    SAM_state *fd = fp->state;
+    sp_lines *l, *ln;
+    sp_bams *gb, *gbn;
+    int ret = 0;
+
+    if (!fd)
+        return 0;
+
+    if (fp->is_write && sam_write_flush(fp) < 0)
+        ret = -1;
+
+    if (fd->dispatcher_started) {
+        pthread_mutex_lock(&fd->command_m);
+        fd->command = SAM_CLOSE;
+        pthread_mutex_unlock(&fd->command_m);
+        // Unblock the dispatcher if it is waiting for room in the queue
+        hts_tpool_wake_dispatch(fd->q);
+        pthread_join(fd->dispatcher, NULL);
+    }
+
+    // Discards queued jobs and results via the cleanup callbacks
+    if (fd->q)
+        hts_tpool_process_destroy(fd->q);
+    if (fd->own_pool && fd->p)
+        hts_tpool_destroy(fd->p);
+
+    for (l = fd->lines; l; l = ln) {
+        ln = l->next;
+        sam_free_lines(l);
+    }
+    sam_free_bams(fd->curr_bams);
+    for (gb = fd->bams; gb; gb = gbn) {
+        gbn = gb->next;
+        sam_free_bams(gb);
+    }
+    free(fd->carry.s);
+    if (fp->is_write)
+        bam_hdr_destroy(fd->h);
+    pthread_mutex_destroy(&fd->lines_m);
+    pthread_mutex_destroy(&fd->command_m);
+    free(fd);
+    fp->state = NULL;
+
+    return ret;
+}
+
+// The original single threaded SAM reader, also used by iterators.
+static int sam_read1_sam(htsFile *fp, bam_hdr_t *h, bam1_t *b) {
+    int ret;
+
+    if (fp->state && ((SAM_state *)fp->state)->dispatcher_started) {
+        hts_log_error("Random access is not possible once multi-threaded "
+                      "SAM reading has started");
+        return -2;
+    }
+
+err_recover:
+    if (fp->line.l == 0) {
+        ret = hts_getline(fp, KS_SEP_LINE, &fp->line);
+        if (ret < 0) return ret;
+    }
+    ret = sam_parse1_fields(&fp->line, h, b, fp->required_fields);
+    fp->line.l = 0;
+    if (ret < 0) {
+        hts_log_warning("Parse error at line %lld", (long long)fp->lineno);
+        if (h->ignore_sam_err) goto err_recover;
+    }
+    return ret;
+}
+
+int sam_read1(htsFile *fp, bam_hdr_t *h, bam1_t *b)
+{
+    switch (fp->format.format) {
+    case bam: {
+        int r = bam_read1_fields(fp->fp.bgzf, b, fp->required_fields);
+        if (h && r >= 0) {
+            if (b->core.tid  >= h->n_targets || b->core.tid  < -1 ||
+                b->core.mtid >= h->n_targets || b->core.mtid < -1)
+                return -3;
+        }
+        return r;
+        }
+
+    case cram: {
+        int ret = cram_get_bam_seq(fp->fp.cram, &b);
+        if (ret < 0)
+            return cram_eof(fp->fp.cram) ? -1 : -2;
+
+        if (bam_tag2cigar(b, 1, 1) < 0)
+            return -2;
+        return ret;
+    }
+
+    case sam:
+        if (fp->state)
+            return sam_read1_mt(fp, h, b);
+        return sam_read1_sam(fp, h, b);
+
+    default:
+        abort();
+    }
+}
+
+bam_batch_t *bam_batch_init(int max_recs, size_t max_bytes)
+{
+    bam_batch_t *batch;
+
+    if (max_recs <= 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+    if (!(batch = calloc(1, sizeof(*batch))))
+        return NULL;
+    if (!(batch->b = calloc(max_recs, sizeof(*batch->b)))) {
+        free(batch);
+        return NULL;
+    }
+    batch->max = max_recs;
+    batch->max_bytes = max_bytes;
+    return batch;
+}
+
+void bam_batch_destroy(bam_batch_t *batch)
+{
+    if (!batch) return;
+    free(batch->b);
+    free(batch->arena);
+    free(batch->tmp.data);
+    free(batch);
+}
+
+// Makes room for len more bytes in the arena.  The records already in the
+// batch are moved along with it.
+static int bam_batch_grow(bam_batch_t *batch, size_t len)
+{
+    size_t m = batch->l_arena + len, i;
+    uint8_t *arena;
+
+    if (m <= batch->m_arena) return 0;
+    if (m < len) {
+        errno = ENOMEM;
+        return -1;
+    }
+    m = m < SIZE_MAX / 2 ? m * 2 : m;
+    if (!(arena = malloc(m)))
+        return -1;
+    if (batch->l_arena)
+        memcpy(arena, batch->arena, batch->l_arena);
+    for (i = 0; i < batch->n; i++)
+        batch->b[i].data = arena + (batch->b[i].data - batch->arena);
+    free(batch->arena);
+    batch->arena = arena;
+    batch->m_arena = m;
+    return 0;
+}
+
+int sam_read_batch(samFile *fp, bam_hdr_t *h, bam_batch_t *batch)
+{
+    int ret = 0;
+
+    batch->n = 0;
+    batch->l_arena = 0;
+    while (batch->n < batch->max
+           && (batch->max_bytes == 0 || batch->l_arena < batch->max_bytes)) {
+        bam1_t *b = &batch->b[batch->n];
+
+        size_t len;
+
+        if ((ret = sam_read1(fp, h, &batch->tmp)) < 0)
+            break;
+        // Keeps each record's data 8-byte aligned, like a malloc()ed
+        // block, so that its CIGAR can be read as uint32_t
+        len = ((size_t) batch->tmp.l_data + 7) & ~(size_t) 7;
+        if (bam_batch_grow(batch, len) < 0) {
+            ret = -2;
+            break;
+        }
+        *b = batch->tmp;
+        b->data = batch->arena + batch->l_arena;
+        b->m_data = b->l_data;
+        memcpy(b->data, batch->tmp.data, b->l_data);
+        batch->l_arena += len;
+        batch->n++;
+    }
+
+    if (ret < -1)
+        return ret;
+    return batch->n > 0 ? batch->n : -1;
+}
+
+// As sam_format1(), but appends to str rather than replacing its contents.
+static int sam_format1_append(const bam_hdr_t *h, const bam1_t *b,
+                              kstring_t *str)
+{
+    int i;
+    uint8_t *s, *end;
+    const bam1_core_t *c = &b->core;
+
+    kputsn_(bam_get_qname(b), c->l_qname-1-c->l_extranul, str); kputc_('\t', str); // query name
+    kputw(c->flag, str); kputc_('\t', str); // flag
+    if (c->tid >= 0) { // chr
+        kputs(h->target_name[c->tid] , str);
+        kputc_('\t', str);
+    } else kputsn_("*\t", 2, str);
+    kputw(c->pos + 1, str); kputc_('\t', str); // pos
+    kputw(c->qual, str); kputc_('\t', str); // qual
+    if (c->n_cigar) { // cigar
+        uint32_t *cigar = bam_get_cigar(b);
+        for (i = 0; i < c->n_cigar; ++i) {
+            kputw(bam_cigar_oplen(cigar[i]), str);
+            kputc_(bam_cigar_opchr(cigar[i]), str);
+        }
+    } else kputc_('*', str);
+    kputc_('\t', str);
+    if (c->mtid < 0) kputsn_("*\t", 2, str); // mate chr
+    else if (c->mtid == c->tid) kputsn_("=\t", 2, str);
+    else {
+        kputs(h->target_name[c->mtid], str);
         kputc_('\t', str);
     }
     kputw(c->mpos + 1, str); kputc_('\t', str); // mate pos
@@ -1808,14 +3048,8 @@ int sam_format1(const bam_hdr_t *h, const bam1_t *b, kstring_t *str)
         uint8_t *s = bam_get_seq(b);
         ks_resize(str, str->l+2+2*c->l_qseq);
         char *cp = str->s + str->l;
-        int lq2 = c->l_qseq / 2;
-        for (i = 0; i < lq2; i++) {
-            uint8_t b = s[i];
-            cp[i*2+0] = "=ACMGRSVTWYHKDBN"[b>>4];
-            cp[i*2+1] = "=ACMGRSVTWYHKDBN"[b&0xf];
-        }
-        for (i *= 2; i < c->l_qseq; ++i)
-            cp[i] = "=ACMGRSVTWYHKDBN"[bam_seqi(s, i)];
+        hts_nibble_unpack(s, cp, c->l_qseq, seq_nt16_str);
+        i = c->l_qseq;
         cp[i++] = '\t';
         cp += i;
         s = bam_get_qual(b);
@@ -1823,8 +3057,8 @@ int sam_format1(const bam_hdr_t *h, const bam1_t *b, kstring_t *str)
         if (s[0] == 0xff) {
             cp[i++] = '*';
         } else {
-            for (i = 0; i < c->l_qseq; ++i)
-                cp[i]=s[i]+33;
+            hts_qual_add(cp, s, c->l_qseq, 33);
+            i = c->l_qseq;
         }
         cp[i] = 0;
         cp += i;
@@ -1963,10 +3197,16 @@ int sam_format1(const bam_hdr_t *h, const bam1_t *b, kstring_t *str)
     return -1;
 }
 
-int sam_write1(htsFile *fp, const bam_hdr_t *h, const bam1_t *b)
+int sam_format1(const bam_hdr_t *h, const bam1_t *b, kstring_t *str)
 {
-    switch (fp->format.format) {
-    case binary_format:
+    str->l = 0;
+    return sam_format1_append(h, b, str);
+}
+
+int sam_write1(htsFile *fp, const bam_hdr_t *h, const bam1_t *b)
+{
+    switch (fp->format.format) {
+    case binary_format:
         fp->format.category = sequence_data;
         fp->format.format = bam;
         /* fall-through */
@@ -1981,6 +3221,14 @@ int sam_write1(htsFile *fp, const bam_hdr_t *h, const bam1_t *b)
         fp->format.format = sam;
         /* fall-through */
     case sam:
+        if (fp->state) {
+            // Indexing needs the file offset after each record, so is
+            // done on this thread once the queued records are written.
+            if (!fp->idx)
+                return sam_write1_mt(fp, h, b);
+            if (sam_write_flush(fp) < 0)
+                return -1;
+        }
         if (sam_format1(h, b, &fp->line) < 0) return -1;
         kputc('\n', &fp->line);
         if (fp->format.compression == bgzf) {
@@ -2059,6 +3307,7 @@ int bam_aux_append(bam1_t *b, const char tag[2], char type, int len, const uint8
     if (new_len > INT32_MAX || new_len < b->l_data) goto nomem;
 
     if (realloc_bam_data(b, new_len) < 0) return -1;
+    b->data_gen++;
 
     b->data[b->l_data] = tag[0];
     b->data[b->l_data + 1] = tag[1];
@@ -2140,6 +3389,139 @@ uint8_t *bam_aux_get(const bam1_t *b, const char tag[2])
     errno = EINVAL;
     return NULL;
 }
+/*
+ * Aux tag index.  An open addressing hash table maps each tag to the offset
+ * of its type byte within b->data.  Slots are stamped with the generation
+ * in which they were filled, so moving on to a new record just needs the
+ * generation to be bumped rather than the table cleared.
+ */
+
+struct bam_aux_index_t {
+    // The record the table was built for, and its data_gen at the time
+    const bam1_t *b;
+    uint32_t data_gen;
+    int corrupt;       // fall back to bam_aux_get() if set
+
+    uint32_t gen;
+    uint32_t mask;     // table size - 1
+    struct {
+        uint32_t gen;
+        uint16_t tag;
+        uint32_t off;
+    } *slot;
+};
+
+bam_aux_index_t *bam_aux_index_init(void)
+{
+    bam_aux_index_t *idx = calloc(1, sizeof(*idx));
+    if (!idx) return NULL;
+    idx->mask = 63;
+    if (!(idx->slot = calloc(idx->mask + 1, sizeof(*idx->slot)))) {
+        free(idx);
+        return NULL;
+    }
+    return idx;
+}
+
+void bam_aux_index_destroy(bam_aux_index_t *idx)
+{
+    if (!idx) return;
+    free(idx->slot);
+    free(idx);
+}
+
+void bam_aux_index_reset(bam_aux_index_t *idx)
+{
+    idx->b = NULL;
+}
+
+static inline uint32_t aux_index_hash(uint16_t tag)
+{
+    return (tag * 2654435761U) >> 16;
+}
+
+// Adds tag at offset off, keeping the first if there are duplicates as
+// bam_aux_get() would.  The caller ensures there is a free slot.
+static void aux_index_put(bam_aux_index_t *idx, uint16_t tag, uint32_t off)
+{
+    uint32_t i = aux_index_hash(tag) & idx->mask;
+    while (idx->slot[i].gen == idx->gen) {
+        if (idx->slot[i].tag == tag)
+            return;
+        i = (i + 1) & idx->mask;
+    }
+    idx->slot[i].gen = idx->gen;
+    idx->slot[i].tag = tag;
+    idx->slot[i].off = off;
+}
+
+static int aux_index_build(bam_aux_index_t *idx, const bam1_t *b)
+{
+    uint8_t *s = bam_get_aux(b), *end = b->data + b->l_data;
+    uint32_t n = 0;
+
+    idx->b = b;
+    idx->data_gen = b->data_gen;
+    idx->corrupt = 0;
+
+    // Tables with a generation of zero are treated as empty, so reset
+    // the stamps if it wraps around
+    if (++idx->gen == 0) {
+        memset(idx->slot, 0, (idx->mask + 1) * sizeof(*idx->slot));
+        idx->gen = 1;
+    }
+
+    while (end - s >= 3) {
+        uint16_t tag = (uint16_t) s[0]<<8 | s[1];
+        uint8_t *e = skip_aux(s + 2, end);
+        if (!e || ((s[2] == 'Z' || s[2] == 'H') && e[-1] != '\0')) {
+            idx->corrupt = 1;
+            return 0;
+        }
+        if (++n > (idx->mask + 1) / 2) {
+            // Grow and start again
+            uint32_t m = (idx->mask + 1) * 2;
+            void *slot = calloc(m, sizeof(*idx->slot));
+            if (!slot) return -1;
+            free(idx->slot);
+            idx->slot = slot;
+            idx->mask = m - 1;
+            idx->gen = 0;
+            return aux_index_build(idx, b);
+        }
+        aux_index_put(idx, tag, s + 2 - b->data);
+        s = e;
+    }
+    if (s != end)
+        idx->corrupt = 1;
+    return 0;
+}
+
+uint8_t *bam_aux_index_get(bam_aux_index_t *idx, const bam1_t *b,
+                           const char tag[2])
+{
+    const uint8_t *t = (const uint8_t *) tag;
+    uint16_t y = (uint16_t) t[0]<<8 | t[1];
+    uint32_t i;
+
+    if (idx->b != b || idx->data_gen != b->data_gen) {
+        if (aux_index_build(idx, b) < 0) {
+            idx->b = NULL;
+            return bam_aux_get(b, tag);
+        }
+    }
+    if (idx->corrupt)
+        return bam_aux_get(b, tag);
+
+    for (i = aux_index_hash(y) & idx->mask; idx->slot[i].gen == idx->gen;
+         i = (i + 1) & idx->mask) {
+        if (idx->slot[i].tag == y)
+            return b->data + idx->slot[i].off;
+    }
+    errno = ENOENT;
+    return NULL;
+}
+
 // s MUST BE returned by bam_aux_get()
 int bam_aux_del(bam1_t *b, uint8_t *s)
 {
@@ -2151,6 +3533,7 @@ int bam_aux_del(bam1_t *b, uint8_t *s)
     if (s == NULL) goto bad_aux;
     memmove(p, s, l_aux - (s - aux));
     b->l_data -= s - p;
+    b->data_gen++;
     return 0;
 
  bad_aux:
@@ -2161,6 +3544,7 @@ int bam_aux_del(bam1_t *b, uint8_t *s)
 
 int bam_aux_update_str(bam1_t *b, const char tag[2], int len, const char *data)
 {
+    b->data_gen++;
     // FIXME: This is not at all efficient!
     uint8_t *s = bam_aux_get(b,tag);
     if (!s) {
@@ -2199,6 +3583,7 @@ int bam_aux_update_int(bam1_t *b, const char tag[2], int64_t val)
     uint32_t sz, old_sz = 0, new = 0;
     uint8_t *s, type;
 
+    b->data_gen++;
     if (val < INT32_MIN || val > UINT32_MAX) {
         errno = EOVERFLOW;
         return -1;
@@ -2265,6 +3650,7 @@ int bam_aux_update_float(bam1_t *b, const char tag[2], float val)
     uint8_t *s = bam_aux_get(b, tag);
     int shrink = 0, new = 0;
 
+    b->data_gen++;
     if (s) { // Tag present - what was it?
         switch (*s) {
             case 'f': break;
@@ -2303,6 +3689,7 @@ int bam_aux_update_array(bam1_t *b, const char tag[2],
     size_t old_sz = 0, new_sz;
     int new = 0;
 
+    b->data_gen++;
     if (s) { // Tag present
         if (*s != 'B') { errno = EINVAL; return -1; }
         old_sz = aux_type2size(s[1]);
@@ -2351,6 +3738,258 @@ int bam_aux_update_array(bam1_t *b, const char tag[2],
 #endif
 }
 
+/*
+ * Batched aux editing.  Each queued edit is kept as its tag and, for
+ * additions, the encoded type and value bytes in ed->vals.  Applying the
+ * edits builds the new aux block in ed->buf in one pass over the old one,
+ * and then copies it back into the record.
+ */
+
+typedef struct {
+    uint16_t tag;
+    int del, done;
+    size_t off, len;   // type and value within vals
+} aux_edit1_t;
+
+struct bam_aux_edit_t {
+    aux_edit1_t *e;
+    int n, m;
+    kstring_t vals;
+    kstring_t buf;
+};
+
+bam_aux_edit_t *bam_aux_edit_init(void)
+{
+    return calloc(1, sizeof(bam_aux_edit_t));
+}
+
+void bam_aux_edit_destroy(bam_aux_edit_t *ed)
+{
+    if (!ed) return;
+    free(ed->e);
+    free(ed->vals.s);
+    free(ed->buf.s);
+    free(ed);
+}
+
+void bam_aux_edit_reset(bam_aux_edit_t *ed)
+{
+    ed->n = 0;
+    ed->vals.l = 0;
+}
+
+// Finds or adds the edit for tag, leaving it with room for len bytes of
+// type and value.  Later edits to a tag replace earlier ones.
+static aux_edit1_t *aux_edit_slot(bam_aux_edit_t *ed, const char tag[2],
+                                  size_t len)
+{
+    uint16_t y = (uint16_t) (uint8_t) tag[0]<<8 | (uint8_t) tag[1];
+    aux_edit1_t *e;
+    int i;
+
+    for (i = 0; i < ed->n; i++)
+        if (ed->e[i].tag == y) break;
+    if (i == ed->n) {
+        if (ed->n == ed->m) {
+            int m = ed->m ? ed->m * 2 : 8;
+            aux_edit1_t *ne = realloc(ed->e, m * sizeof(*ne));
+            if (!ne) return NULL;
+            ed->e = ne;
+            ed->m = m;
+        }
+        ed->n++;
+    }
+    if (ks_resize(&ed->vals, ed->vals.l + len) < 0)
+        return NULL;
+
+    // The old value, if any, is simply abandoned in vals
+    e = &ed->e[i];
+    e->tag = y;
+    e->del = 0;
+    e->off = ed->vals.l;
+    e->len = len;
+    ed->vals.l += len;
+    return e;
+}
+
+int bam_aux_edit_set(bam_aux_edit_t *ed, const char tag[2], char type,
+                     int len, const uint8_t *data)
+{
+    aux_edit1_t *e;
+    uint8_t *s;
+
+    if (len < 0 || len > INT32_MAX - 3) {
+        errno = ENOMEM;
+        return -1;
+    }
+    if (!(e = aux_edit_slot(ed, tag, 1 + len)))
+        return -1;
+    s = (uint8_t *) ed->vals.s + e->off;
+    s[0] = type;
+#ifdef HTS_LITTLE_ENDIAN
+    memcpy(s + 1, data, len);
+#else
+    if (aux_to_le(type, s + 1, data, len) != 0) {
+        *e = ed->e[--ed->n];
+        errno = EINVAL;
+        return -1;
+    }
+#endif
+    return 0;
+}
+
+int bam_aux_edit_set_str(bam_aux_edit_t *ed, const char tag[2], int len,
+                         const char *data)
+{
+    return bam_aux_edit_set(ed, tag, 'Z', len, (const uint8_t *) data);
+}
+
+int bam_aux_edit_set_int(bam_aux_edit_t *ed, const char tag[2], int64_t val)
+{
+    aux_edit1_t *e;
+    uint8_t *s, type;
+    int sz;
+
+    if (val < INT32_MIN || val > UINT32_MAX) {
+        errno = EOVERFLOW;
+        return -1;
+    }
+    // As bam_aux_update_int()
+    if (val < INT16_MIN)       { type = 'i'; sz = 4; }
+    else if (val < INT8_MIN)   { type = 's'; sz = 2; }
+    else if (val < 0)          { type = 'c'; sz = 1; }
+    else if (val < UINT8_MAX)  { type = 'C'; sz = 1; }
+    else if (val < UINT16_MAX) { type = 'S'; sz = 2; }
+    else                       { type = 'I'; sz = 4; }
+
+    if (!(e = aux_edit_slot(ed, tag, 1 + sz)))
+        return -1;
+    s = (uint8_t *) ed->vals.s + e->off;
+    *s++ = type;
+    switch (sz) {
+        case 4:  u32_to_le(val, s); break;
+        case 2:  u16_to_le(val, s); break;
+        default: *s = val; break;
+    }
+    return 0;
+}
+
+int bam_aux_edit_set_float(bam_aux_edit_t *ed, const char tag[2], float val)
+{
+    aux_edit1_t *e = aux_edit_slot(ed, tag, 5);
+    if (!e) return -1;
+    ed->vals.s[e->off] = 'f';
+    float_to_le(val, (uint8_t *) ed->vals.s + e->off + 1);
+    return 0;
+}
+
+int bam_aux_edit_set_array(bam_aux_edit_t *ed, const char tag[2],
+                           uint8_t type, uint32_t items, const void *data)
+{
+    aux_edit1_t *e;
+    uint8_t *s;
+    size_t sz = aux_type2size(type);
+
+    if (sz < 1 || sz > 4) { errno = EINVAL; return -1; }
+    if (items > (INT32_MAX - 8) / sz) { errno = ENOMEM; return -1; }
+    sz *= items;
+
+    if (!(e = aux_edit_slot(ed, tag, 6 + sz)))
+        return -1;
+    s = (uint8_t *) ed->vals.s + e->off;
+    s[0] = 'B';
+    s[1] = type;
+    u32_to_le(items, s + 2);
+#ifdef HTS_LITTLE_ENDIAN
+    memcpy(s + 6, data, sz);
+#else
+    if (aux_to_le(type, s + 6, data, sz) != 0) {
+        *e = ed->e[--ed->n];
+        errno = EINVAL;
+        return -1;
+    }
+#endif
+    return 0;
+}
+
+int bam_aux_edit_del(bam_aux_edit_t *ed, const char tag[2])
+{
+    aux_edit1_t *e = aux_edit_slot(ed, tag, 0);
+    if (!e) return -1;
+    e->del = 1;
+    return 0;
+}
+
+int bam_aux_edit_apply(bam_aux_edit_t *ed, bam1_t *b)
+{
+    uint8_t *aux = bam_get_aux(b), *end = b->data + b->l_data, *s, *d;
+    size_t aux_off = aux - b->data, new_len;
+    int i;
+
+    if (ed->n == 0)
+        return 0;
+    for (i = 0; i < ed->n; i++)
+        ed->e[i].done = 0;
+
+    // Worst case is every existing tag kept and every edit appended
+    ed->buf.l = 0;
+    if (ks_resize(&ed->buf, (end - aux) + ed->vals.l + 2 * ed->n) < 0)
+        return -1;
+    d = (uint8_t *) ed->buf.s;
+
+    for (s = aux; s < end; ) {
+        uint16_t x;
+        uint8_t *e;
+        if (end - s < 3 || !(e = skip_aux(s + 2, end)))
+            goto bad_aux;
+        x = (uint16_t) s[0]<<8 | s[1];
+        for (i = 0; i < ed->n; i++)
+            if (ed->e[i].tag == x && !ed->e[i].done) break;
+        if (i == ed->n) { // untouched
+            memcpy(d, s, e - s);
+            d += e - s;
+        } else {          // replaced in place, or deleted
+            aux_edit1_t *ae = &ed->e[i];
+            ae->done = 1;
+            if (!ae->del) {
+                *d++ = s[0];
+                *d++ = s[1];
+                memcpy(d, ed->vals.s + ae->off, ae->len);
+                d += ae->len;
+            }
+        }
+        s = e;
+    }
+
+    // New tags go on the end, in the order they were first set
+    for (i = 0; i < ed->n; i++) {
+        aux_edit1_t *ae = &ed->e[i];
+        if (ae->done || ae->del)
+            continue;
+        *d++ = ae->tag >> 8;
+        *d++ = ae->tag & 0xff;
+        memcpy(d, ed->vals.s + ae->off, ae->len);
+        d += ae->len;
+    }
+
+    new_len = aux_off + (d - (uint8_t *) ed->buf.s);
+    if (new_len > INT32_MAX) {
+        errno = ENOMEM;
+        return -1;
+    }
+    if (realloc_bam_data(b, new_len) < 0)
+        return -1;
+    memcpy(b->data + aux_off, ed->buf.s, new_len - aux_off);
+    b->l_data = new_len;
+    b->data_gen++;
+    return 0;
+
+ bad_aux:
+    hts_log_error("Corrupted aux data for read %s", bam_get_qname(b));
+    errno = EINVAL;
+    return -1;
+}
+
 static inline int64_t get_int_aux_val(uint8_t type, const uint8_t *s,
                                       uint32_t idx)
 {
@@ -2570,9 +4209,9 @@ char *bam_flag2str(int flag)
 
 #include <assert.h>
 
-/*******************
- *** Memory pool ***
- *******************/
+/**********************
+ *** CIGAR resolver ***
+ **********************/
 
 typedef struct {
     int k, x, y, end;
@@ -2580,55 +4219,6 @@ typedef struct {
 
 static cstate_t g_cstate_null = { -1, 0, 0, 0 };
 
-typedef struct __linkbuf_t {
-    bam1_t b;
-    int32_t beg, end;
-    cstate_t s;
-    struct __linkbuf_t *next;
-    bam_pileup_cd cd;
-} lbnode_t;
-
-typedef struct {
-    int cnt, n, max;
-    lbnode_t **buf;
-} mempool_t;
-
-static mempool_t *mp_init(void)
-{
-    mempool_t *mp;
-    mp = (mempool_t*)calloc(1, sizeof(mempool_t));
-    return mp;
-}
-static void mp_destroy(mempool_t *mp)
-{
-    int k;
-    for (k = 0; k < mp->n; ++k) {
-        free(mp->buf[k]->b.data);
-        free(mp->buf[k]);
-    }
-    free(mp->buf);
-    free(mp);
-}
-static inline lbnode_t *mp_alloc(mempool_t *mp)
-{
-    ++mp->cnt;
-    if (mp->n == 0) return (lbnode_t*)calloc(1, sizeof(lbnode_t));
-    else return mp->buf[--mp->n];
-}
-static inline void mp_free(mempool_t *mp, lbnode_t *p)
-{
-    --mp->cnt; p->next = 0; // clear lbnode_t::next here
-    if (mp->n == mp->max) {
-        mp->max = mp->max? mp->max<<1 : 256;
-        mp->buf = (lbnode_t**)realloc(mp->buf, sizeof(lbnode_t*) * mp->max);
-    }
-    mp->buf[mp->n++] = p;
-}
-
-/**********************
- *** CIGAR resolver ***
- **********************/
-
 /* s->k: the index of the CIGAR operator that has just been processed.
    s->x: the reference coordinate of the start of s->k
    s->y: the query coordiante of the start of s->k
@@ -2791,26 +4381,107 @@ int bam_plp_insertion(const bam_pileup1_t *p, kstring_t *ins, int *del_len) {
     return indel;
 }
 
+/********************
+ *** Region lists ***
+ ********************/
+
+typedef struct {
+    int tid;
+    int64_t beg, end;
+} plp_region_t;
+
+static int plp_region_cmp(const void *av, const void *bv)
+{
+    const plp_region_t *a = av, *b = bv;
+    if (a->tid != b->tid) return a->tid < b->tid ? -1 : 1;
+    return (a->beg > b->beg) - (a->beg < b->beg);
+}
+
+// Copies the intervals of a region list, sorted and with overlapping ones
+// merged.  Returns the number of intervals, or -1 on error.
+static int plp_regions_flatten(const hts_reglist_t *reg, int count,
+                               plp_region_t **out)
+{
+    plp_region_t *r = NULL;
+    size_t n = 0, i, j;
+    int k;
+
+    for (k = 0; k < count; k++)
+        if (reg[k].tid >= 0) n += reg[k].count;
+    if (n > INT_MAX || (n && !(r = malloc(n * sizeof(*r)))))
+        return -1;
+    for (k = 0, n = 0; k < count; k++) {
+        if (reg[k].tid < 0) continue;
+        for (i = 0; i < reg[k].count; i++) {
+            if (reg[k].intervals[i].end <= reg[k].intervals[i].beg) continue;
+            r[n].tid = reg[k].tid;
+            r[n].beg = reg[k].intervals[i].beg;
+            r[n].end = reg[k].intervals[i].end;
+            n++;
+        }
+    }
+    qsort(r, n, sizeof(*r), plp_region_cmp);
+    for (i = 0, j = 0; i < n; i++) {
+        if (j > 0 && r[j-1].tid == r[i].tid && r[j-1].end >= r[i].beg) {
+            if (r[j-1].end < r[i].end) r[j-1].end = r[i].end;
+        } else {
+            r[j++] = r[i];
+        }
+    }
+    *out = r;
+    return j;
+}
+
 /***********************
  *** Pileup iterator ***
  ***********************/
 
-// Dictionary of overlapping reads
-KHASH_MAP_INIT_STR(olap_hash, lbnode_t *)
+// Dictionary of reads waiting for an overlapping mate.  The key's hash is
+// worked out once per read, from the name and the leftmost position of the
+// template (which both mates know), and kept so khash never recomputes it.
+typedef struct {
+    const char *qname;
+    int32_t pos;
+    khint32_t hash;
+} olap_key_t;
+
+#define olap_key_hash(k) ((k).hash)
+#define olap_key_equal(a, b) \
+    ((a).hash == (b).hash && (a).pos == (b).pos && strcmp((a).qname, (b).qname) == 0)
+KHASH_INIT(olap_hash, olap_key_t, bam1_t *, 1, olap_key_hash, olap_key_equal)
 typedef khash_t(olap_hash) olap_hash_t;
 
+/*
+ * The reads held by the iterator, both those covering the current position
+ * and those read in ahead of it, are kept in file order in a set of
+ * parallel arrays, from index first to first + n_rd - 1.  plp[] doubles as
+ * the result, so a read's entry carries over from one position to the next
+ * and resolve_cigar2() is only needed at next[], the first position where
+ * something other than qpos can change: the last base of the current CIGAR
+ * operation and the one after.  Reads that have finished are noticed on
+ * the way and then all dropped together.
+ *
+ * With a region mask set, the position jumps straight from the end of one
+ * region to the start of the next, and reads that end in between are
+ * dropped without ever being resolved.  Reads spanning the gap catch up
+ * one CIGAR operation at a time rather than one base at a time.
+ */
 struct __bam_plp_t {
-    mempool_t *mp;
-    lbnode_t *head, *tail;
+    bam_pool_t *mp;             // the records; plp[].b points into this
+    bam_pileup1_t *plp;
+    cstate_t *s;
+    int32_t *tids, *beg, *end, *next;
+    int first, n_rd, m_rd;
     int32_t tid, pos, max_tid, max_pos;
-    int is_eof, max_plp, error, maxcnt;
+    int is_eof, error, maxcnt;
     uint64_t id;
-    bam_pileup1_t *plp;
     // for the "auto" interface only
     bam1_t *b;
     bam_plp_auto_f func;
     void *data;
     olap_hash_t *overlaps;
+    plp_region_t *reg;          // region mask, sorted and merged
+    int n_reg, i_reg;           // i_reg: first region not before tid/pos
 
     // For notification of creation and destruction events
     // and associated client-owned pointer.
@@ -2822,8 +4493,11 @@ bam_plp_t bam_plp_init(bam_plp_auto_f func, void *data)
 {
     bam_plp_t iter;
     iter = (bam_plp_t)calloc(1, sizeof(struct __bam_plp_t));
-    iter->mp = mp_init();
-    iter->head = iter->tail = mp_alloc(iter->mp);
+    if (!iter) return NULL;
+    if (!(iter->mp = bam_pool_init())) {
+        free(iter);
+        return NULL;
+    }
     iter->max_tid = iter->max_pos = -1;
     iter->maxcnt = 8000;
     if (func) {
@@ -2842,15 +4516,16 @@ int bam_plp_init_overlaps(bam_plp_t iter)
 
 void bam_plp_destroy(bam_plp_t iter)
 {
-    lbnode_t *p, *pnext;
     if ( iter->overlaps ) kh_destroy(olap_hash, iter->overlaps);
-    for (p = iter->head; p != NULL; p = pnext) {
-        pnext = p->next;
-        mp_free(iter->mp, p);
-    }
-    mp_destroy(iter->mp);
+    free(iter->reg);
+    bam_pool_destroy(iter->mp);
     if (iter->b) bam_destroy1(iter->b);
     free(iter->plp);
+    free(iter->s);
+    free(iter->tids);
+    free(iter->beg);
+    free(iter->end);
+    free(iter->next);
     free(iter);
 }
 
@@ -2868,203 +4543,191 @@ void bam_plp_destructor(bam_plp_t plp,
 //---  Tweak overlapping reads
 //---------------------------------
 
-/**
- *  cigar_iref2iseq_set()  - find the first CMATCH setting the ref and the read index
- *  cigar_iref2iseq_next() - get the next CMATCH base
- *  @cigar:       pointer to current cigar block (rw)
- *  @cigar_max:   pointer just beyond the last cigar block
- *  @icig:        position within the current cigar block (rw)
- *  @iseq:        position in the sequence (rw)
- *  @iref:        position with respect to the beginning of the read (iref_pos - b->core.pos) (rw)
- *
- *  Returns BAM_CMATCH, -1 when there is no more cigar to process or the requested position is not covered,
- *  or -2 on error.
- */
-static inline int cigar_iref2iseq_set(uint32_t **cigar, uint32_t *cigar_max, int *icig, int *iseq, int *iref)
-{
-    int pos = *iref;
-    if ( pos < 0 ) return -1;
-    *icig = 0;
-    *iseq = 0;
-    *iref = 0;
-    while ( *cigar<cigar_max )
-    {
-        int cig  = (**cigar) & BAM_CIGAR_MASK;
-        int ncig = (**cigar) >> BAM_CIGAR_SHIFT;
-
-        if ( cig==BAM_CSOFT_CLIP ) { (*cigar)++; *iseq += ncig; *icig = 0; continue; }
-        if ( cig==BAM_CHARD_CLIP || cig==BAM_CPAD ) { (*cigar)++; *icig = 0; continue; }
-        if ( cig==BAM_CMATCH || cig==BAM_CEQUAL || cig==BAM_CDIFF )
-        {
-            pos -= ncig;
-            if ( pos < 0 ) { *icig = ncig + pos; *iseq += *icig; *iref += *icig; return BAM_CMATCH; }
-            (*cigar)++; *iseq += ncig; *icig = 0; *iref += ncig;
-            continue;
-        }
-        if ( cig==BAM_CINS ) { (*cigar)++; *iseq += ncig; *icig = 0; continue; }
-        if ( cig==BAM_CDEL || cig==BAM_CREF_SKIP )
-        {
-            pos -= ncig;
-            if ( pos<0 ) pos = 0;
-            (*cigar)++; *icig = 0; *iref += ncig;
-            continue;
+// Finds the next run of bases aligned to the reference (M, = or X) in a
+// CIGAR, starting from *cigar with the given reference and query offsets.
+// Returns the run's length (updating *ref and *seq to its start and
+// advancing *cigar past it), 0 at the end of the CIGAR or -1 on error.
+static inline int olap_next_match(const uint32_t **cigar,
+                                  const uint32_t *cigar_max,
+                                  int32_t *ref, int *seq)
+{
+    while (*cigar < cigar_max) {
+        int op = bam_cigar_op(**cigar), len = bam_cigar_oplen(**cigar);
+        (*cigar)++;
+        switch (op) {
+        case BAM_CMATCH: case BAM_CEQUAL: case BAM_CDIFF:
+            if (len > 0) return len;
+            break;
+        case BAM_CINS: case BAM_CSOFT_CLIP:
+            *seq += len;
+            break;
+        case BAM_CDEL: case BAM_CREF_SKIP:
+            *ref += len;
+            break;
+        case BAM_CHARD_CLIP: case BAM_CPAD:
+            break;
+        default:
+            hts_log_error("Unexpected cigar %d", op);
+            return -1;
         }
-        hts_log_error("Unexpected cigar %d", cig);
-        return -2;
     }
-    *iseq = -1;
-    return -1;
+    return 0;
 }
-static inline int cigar_iref2iseq_next(uint32_t **cigar, uint32_t *cigar_max, int *icig, int *iseq, int *iref)
+
+// Resolves one run of bases aligned to the same reference positions in
+// both reads.  Long runs are unpacked a buffer at a time and compared with
+// a vector kernel; short ones aren't worth the calls, so are done here
+// with the same rules as hts_qual_overlap().
+static void olap_tweak_run(bam1_t *a, int a_iseq, bam1_t *b, int b_iseq,
+                           int len)
 {
-    while ( *cigar < cigar_max )
-    {
-        int cig  = (**cigar) & BAM_CIGAR_MASK;
-        int ncig = (**cigar) >> BAM_CIGAR_SHIFT;
+    static const char nt16_ident[16] = {
+        0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15
+    };
+    uint8_t a_base[257], b_base[257];
+    uint8_t *a_seq = bam_get_seq(a), *b_seq = bam_get_seq(b);
+    uint8_t *a_qual = bam_get_qual(a), *b_qual = bam_get_qual(b);
 
-        if ( cig==BAM_CMATCH || cig==BAM_CEQUAL || cig==BAM_CDIFF )
-        {
-            if ( *icig >= ncig - 1 ) { *icig = 0;  (*cigar)++; continue; }
-            (*iseq)++; (*icig)++; (*iref)++;
-            return BAM_CMATCH;
-        }
-        if ( cig==BAM_CDEL || cig==BAM_CREF_SKIP ) { (*cigar)++; (*iref) += ncig; *icig = 0; continue; }
-        if ( cig==BAM_CINS ) { (*cigar)++; *iseq += ncig; *icig = 0; continue; }
-        if ( cig==BAM_CSOFT_CLIP ) { (*cigar)++; *iseq += ncig; *icig = 0; continue; }
-        if ( cig==BAM_CHARD_CLIP || cig==BAM_CPAD ) { (*cigar)++; *icig = 0; continue; }
-        hts_log_error("Unexpected cigar %d", cig);
-        return -2;
+    if (len < 128) {
+        int i;
+        for (i = 0; i < len; i++) {
+            uint8_t *qa = &a_qual[a_iseq + i], *qb = &b_qual[b_iseq + i];
+            if (bam_seqi(a_seq, a_iseq + i) == bam_seqi(b_seq, b_iseq + i)) {
+                *qa = *qa + *qb > 200 ? 200 : *qa + *qb;
+                *qb = 0;
+            } else if (*qa >= *qb) {
+                *qa = (*qa * 205) >> 8;  // 0.8 * qa, rounded down
+                *qb = 0;
+            } else {
+                *qb = (*qb * 205) >> 8;
+                *qa = 0;
+            }
+        }
+        return;
+    }
+
+    while (len > 0) {
+        int n = len < 256 ? len : 256;
+        // Unpacking starts on a byte boundary, so may give one extra base
+        hts_nibble_unpack(a_seq + a_iseq/2, (char *) a_base, n + (a_iseq&1),
+                          nt16_ident);
+        hts_nibble_unpack(b_seq + b_iseq/2, (char *) b_base, n + (b_iseq&1),
+                          nt16_ident);
+        hts_qual_overlap(a_qual + a_iseq, b_qual + b_iseq,
+                         a_base + (a_iseq&1), b_base + (b_iseq&1), n);
+        a_iseq += n;
+        b_iseq += n;
+        len -= n;
     }
-    *iseq = -1;
-    *iref = -1;
-    return -1;
 }
 
+// Adjusts the qualities of the bases where a and b, b starting no earlier
+// than a, align to the same reference positions.  Indels are left alone.
 static int tweak_overlap_quality(bam1_t *a, bam1_t *b)
 {
-    uint32_t *a_cigar = bam_get_cigar(a), *a_cigar_max = a_cigar + a->core.n_cigar;
-    uint32_t *b_cigar = bam_get_cigar(b), *b_cigar_max = b_cigar + b->core.n_cigar;
-    int a_icig = 0, a_iseq = 0;
-    int b_icig = 0, b_iseq = 0;
-    uint8_t *a_qual = bam_get_qual(a), *b_qual = bam_get_qual(b);
-    uint8_t *a_seq  = bam_get_seq(a), *b_seq = bam_get_seq(b);
+    const uint32_t *a_cigar = bam_get_cigar(a), *a_cigar_max = a_cigar + a->core.n_cigar;
+    const uint32_t *b_cigar = bam_get_cigar(b), *b_cigar_max = b_cigar + b->core.n_cigar;
+    int32_t a_ref = a->core.pos, b_ref = b->core.pos;
+    int a_seq = 0, b_seq = 0, a_len, b_len;
 
-    int iref   = b->core.pos;
-    int a_iref = iref - a->core.pos;
-    int b_iref = iref - b->core.pos;
-    int a_ret = cigar_iref2iseq_set(&a_cigar, a_cigar_max, &a_icig, &a_iseq, &a_iref);
-    if ( a_ret<0 ) return a_ret<-1 ? -1:0;  // no overlap or error
-    int b_ret = cigar_iref2iseq_set(&b_cigar, b_cigar_max, &b_icig, &b_iseq, &b_iref);
-    if ( b_ret<0 ) return b_ret<-1 ? -1:0;  // no overlap or error
+    if (b->core.pos < a->core.pos) return 0;
 
     #if DBG
         fprintf(stderr,"tweak %s  n_cigar=%d %d  .. %d-%d vs %d-%d\n", bam_get_qname(a), a->core.n_cigar, b->core.n_cigar,
             a->core.pos+1,a->core.pos+bam_cigar2rlen(a->core.n_cigar,bam_get_cigar(a)), b->core.pos+1, b->core.pos+bam_cigar2rlen(b->core.n_cigar,bam_get_cigar(b)));
     #endif
 
-    int err = 0;
-    while ( 1 )
-    {
-        // Increment reference position
-        while ( a_ret >= 0 && a_iref>=0 && a_iref < iref - a->core.pos )
-            a_ret = cigar_iref2iseq_next(&a_cigar, a_cigar_max, &a_icig, &a_iseq, &a_iref);
-        if ( a_ret<0 ) { err = a_ret<-1?-1:0; break; }   // done
-        if ( iref < a_iref + a->core.pos ) iref = a_iref + a->core.pos;
-
-        while ( b_ret >= 0 && b_iref>=0 && b_iref < iref - b->core.pos )
-            b_ret = cigar_iref2iseq_next(&b_cigar, b_cigar_max, &b_icig, &b_iseq, &b_iref);
-        if ( b_ret<0 ) { err = b_ret<-1?-1:0; break; }  // done
-        if ( iref < b_iref + b->core.pos ) iref = b_iref + b->core.pos;
-
-        iref++;
-        if ( a_iref+a->core.pos != b_iref+b->core.pos ) continue;   // only CMATCH positions, don't know what to do with indels
-
-        if ( bam_seqi(a_seq,a_iseq) == bam_seqi(b_seq,b_iseq) )
-        {
-            #if DBG
-                fprintf(stderr,"%c",seq_nt16_str[bam_seqi(a_seq,a_iseq)]);
-            #endif
-            // we are very confident about this base
-            int qual = a_qual[a_iseq] + b_qual[b_iseq];
-            a_qual[a_iseq] = qual>200 ? 200 : qual;
-            b_qual[b_iseq] = 0;
-        }
-        else
-        {
-            if ( a_qual[a_iseq] >= b_qual[b_iseq] )
-            {
-                #if DBG
-                    fprintf(stderr,"[%c/%c]",seq_nt16_str[bam_seqi(a_seq,a_iseq)],tolower_c(seq_nt16_str[bam_seqi(b_seq,b_iseq)]));
-                #endif
-                a_qual[a_iseq] = 0.8 * a_qual[a_iseq];  // not so confident about a_qual anymore given the mismatch
-                b_qual[b_iseq] = 0;
-            }
-            else
-            {
-                #if DBG
-                    fprintf(stderr,"[%c/%c]",tolower_c(seq_nt16_str[bam_seqi(a_seq,a_iseq)]),seq_nt16_str[bam_seqi(b_seq,b_iseq)]);
-                #endif
-                b_qual[b_iseq] = 0.8 * b_qual[b_iseq];
-                a_qual[a_iseq] = 0;
-            }
+    a_len = olap_next_match(&a_cigar, a_cigar_max, &a_ref, &a_seq);
+    b_len = olap_next_match(&b_cigar, b_cigar_max, &b_ref, &b_seq);
+    while (a_len > 0 && b_len > 0) {
+        int32_t beg = a_ref > b_ref ? a_ref : b_ref;
+        int32_t end = a_ref + a_len < b_ref + b_len ? a_ref + a_len : b_ref + b_len;
+        if (beg < end)
+            olap_tweak_run(a, a_seq + (beg - a_ref), b, b_seq + (beg - b_ref),
+                           end - beg);
+
+        // Move on whichever run finishes first
+        if (a_ref + a_len <= b_ref + b_len) {
+            a_ref += a_len; a_seq += a_len;
+            a_len = olap_next_match(&a_cigar, a_cigar_max, &a_ref, &a_seq);
+        } else {
+            b_ref += b_len; b_seq += b_len;
+            b_len = olap_next_match(&b_cigar, b_cigar_max, &b_ref, &b_seq);
         }
     }
-    #if DBG
-        fprintf(stderr,"\n");
-    #endif
-    return err;
+    return a_len < 0 || b_len < 0 ? -1 : 0;
+}
+
+// Only properly paired reads with the mate on the same reference are
+// considered.  Of those, the one starting first (either, if they start
+// together) waits in the hash for its mate if the mate starts before it
+// ends, and the other looks for it there.  Most reads therefore never
+// touch the hash.
+static inline int overlap_paired(const bam1_t *b)
+{
+    return (b->core.flag & (BAM_FPROPER_PAIR|BAM_FMUNMAP)) == BAM_FPROPER_PAIR
+        && b->core.tid == b->core.mtid;
+}
+
+static inline int overlap_waits(const bam1_t *b, int32_t end)
+{
+    return b->core.mpos >= b->core.pos && b->core.mpos < end;
+}
+
+static inline olap_key_t overlap_key(const bam1_t *b)
+{
+    olap_key_t k;
+    k.qname = bam_get_qname(b);
+    k.pos = b->core.pos < b->core.mpos ? b->core.pos : b->core.mpos;
+    k.hash = kh_str_hash_func(k.qname) ^ __ac_Wang_hash((khint_t) k.pos);
+    return k;
 }
 
 // Fix overlapping reads. Simple soft-clipping did not give good results.
 // Lowering qualities of unwanted bases is more selective and works better.
 //
 // Returns 0 on success, -1 on failure
-static int overlap_push(bam_plp_t iter, lbnode_t *node)
+static int overlap_push(bam_plp_t iter, bam1_t *b, int32_t end)
 {
-    if ( !iter->overlaps ) return 0;
-
-    // mapped mates and paired reads only
-    if ( node->b.core.flag&BAM_FMUNMAP || !(node->b.core.flag&BAM_FPROPER_PAIR) ) return 0;
+    if ( !iter->overlaps || !overlap_paired(b) ) return 0;
 
-    // no overlap possible, unless some wild cigar
-    if ( node->b.core.tid != node->b.core.mtid
-         || (abs(node->b.core.isize) >= 2*node->b.core.l_qseq
-         && node->b.core.mpos >= node->end) // for those wild cigars
-       ) return 0;
+    int waits = overlap_waits(b, end);
+    if ( !waits && b->core.mpos > b->core.pos ) return 0;
 
-    khiter_t kitr = kh_get(olap_hash, iter->overlaps, bam_get_qname(&node->b));
-    if ( kitr==kh_end(iter->overlaps) )
+    olap_key_t k = overlap_key(b);
+    khiter_t kitr;
+    if ( b->core.mpos <= b->core.pos )
     {
-        // Only add reads where the mate is still to arrive
-        if (node->b.core.mpos >= node->b.core.pos) {
-            int ret;
-            kitr = kh_put(olap_hash, iter->overlaps, bam_get_qname(&node->b), &ret);
-            if (ret < 0) return -1;
-            kh_value(iter->overlaps, kitr) = node;
+        kitr = kh_get(olap_hash, iter->overlaps, k);
+        if ( kitr!=kh_end(iter->overlaps) )
+        {
+            bam1_t *a = kh_value(iter->overlaps, kitr);
+            int err = tweak_overlap_quality(a, b);
+            kh_del(olap_hash, iter->overlaps, kitr);
+            return err;
         }
     }
-    else
+    if ( waits )
     {
-        lbnode_t *a = kh_value(iter->overlaps, kitr);
-        int err = tweak_overlap_quality(&a->b, &node->b);
-        kh_del(olap_hash, iter->overlaps, kitr);
-        assert(a->end-1 == a->s.end);
-        a->end = bam_endpos(&a->b);
-        a->s.end = a->end - 1;
-        return err;
+        int ret;
+        kitr = kh_put(olap_hash, iter->overlaps, k, &ret);
+        if (ret < 0) return -1;
+        kh_value(iter->overlaps, kitr) = b;
     }
     return 0;
 }
 
-static void overlap_remove(bam_plp_t iter, const bam1_t *b)
+// Forgets b if it is still waiting for its mate
+static void overlap_remove(bam_plp_t iter, const bam1_t *b, int32_t end)
 {
     if ( !iter->overlaps ) return;
 
     khiter_t kitr;
     if ( b )
     {
-        kitr = kh_get(olap_hash, iter->overlaps, bam_get_qname(b));
-        if ( kitr!=kh_end(iter->overlaps) )
+        if ( !overlap_paired(b) || !overlap_waits(b, end) ) return;
+        kitr = kh_get(olap_hash, iter->overlaps, overlap_key(b));
+        if ( kitr!=kh_end(iter->overlaps) && kh_value(iter->overlaps, kitr)==b )
             kh_del(olap_hash, iter->overlaps, kitr);
     }
     else
@@ -3077,6 +4740,147 @@ static void overlap_remove(bam_plp_t iter, const bam1_t *b)
 
 
 
+static inline void plp_move(bam_plp_t iter, int to, int from)
+{
+    iter->plp[to]  = iter->plp[from];
+    iter->s[to]    = iter->s[from];
+    iter->tids[to] = iter->tids[from];
+    iter->beg[to]  = iter->beg[from];
+    iter->end[to]  = iter->end[from];
+    iter->next[to] = iter->next[from];
+}
+
+// Makes room for another read at the end of the arrays, either by moving
+// the reads back to the start if enough have been dropped from the front,
+// or by growing them.
+static int plp_grow(bam_plp_t iter)
+{
+    int m = iter->m_rd ? iter->m_rd * 2 : 256, i;
+    bam_pileup1_t *plp;
+    cstate_t *s;
+    int32_t *tids, *beg, *end, *next;
+
+    if (iter->first > 0 && iter->first >= iter->m_rd / 4) {
+        for (i = 0; i < iter->n_rd; i++)
+            plp_move(iter, i, iter->first + i);
+        iter->first = 0;
+        return 0;
+    }
+
+    if (!(plp = realloc(iter->plp, m * sizeof(*plp)))) return -1;
+    iter->plp = plp;
+    if (!(s = realloc(iter->s, m * sizeof(*s)))) return -1;
+    iter->s = s;
+    if (!(tids = realloc(iter->tids, m * sizeof(*tids)))) return -1;
+    iter->tids = tids;
+    if (!(beg = realloc(iter->beg, m * sizeof(*beg)))) return -1;
+    iter->beg = beg;
+    if (!(end = realloc(iter->end, m * sizeof(*end)))) return -1;
+    iter->end = end;
+    if (!(next = realloc(iter->next, m * sizeof(*next)))) return -1;
+    iter->next = next;
+    iter->m_rd = m;
+    return 0;
+}
+
+// Drops a finished read, leaving a gap in the arrays
+static inline void plp_drop(bam_plp_t iter, int i)
+{
+    bam1_t *b = iter->plp[i].b;
+    overlap_remove(iter, b, iter->end[i]);
+    if (iter->plp_destruct)
+        iter->plp_destruct(iter->data, b, &iter->plp[i].cd);
+    bam_pool_free(iter->mp, b);
+    iter->plp[i].b = NULL;
+}
+
+// Brings the entries of the reads covering the current position up to
+// date and drops any that have finished, then returns how many are left
+// covering it.  They are always at the front.
+static int plp_column(bam_plp_t iter)
+{
+    int32_t pos = iter->pos;
+    int lo = iter->first, hi = lo + iter->n_rd, n, i, j;
+    int n_dead = 0, first_dead = 0, last_dead = 0;
+
+    for (i = lo; i < hi; i++) {
+        bam_pileup1_t *p = &iter->plp[i];
+        cstate_t *s = &iter->s[i];
+        if (iter->tids[i] > iter->tid
+            || (iter->tids[i] == iter->tid && iter->beg[i] > pos))
+            break; // this and the rest are still to come
+        if (iter->tids[i] == iter->tid && iter->end[i] > pos) {
+            if (pos < iter->next[i]) {
+                // Inside the same operation, and not at either end of the read
+                if (!p->is_del)
+                    p->qpos = s->y + (pos - s->x);
+                p->is_head = 0;
+            } else {
+                int32_t last;
+                // More than once only if positions have been skipped
+                do {
+                    resolve_cigar2(p, pos, s);
+                    last = s->x + bam_cigar_oplen(bam_get_cigar(p->b)[s->k]) - 1;
+                } while (last < pos);
+                iter->next[i] = last > pos ? last : pos + 1;
+            }
+            continue;
+        }
+        plp_drop(iter, i);
+        if (!n_dead++) first_dead = i;
+        last_dead = i;
+    }
+    n = i - lo - n_dead;
+    if (!n_dead)
+        return n;
+
+    // Reads tend to finish in the order they started, so rather than
+    // always closing the gaps from the back, the reads in front of them
+    // are moved up if there are fewer of those.
+    if (last_dead - lo < hi - first_dead) {
+        for (i = j = last_dead; i >= lo; i--)
+            if (iter->plp[i].b) plp_move(iter, j--, i);
+        iter->first += n_dead;
+    } else {
+        for (i = j = first_dead; i < hi; i++)
+            if (iter->plp[i].b) plp_move(iter, j++, i);
+    }
+    iter->n_rd -= n_dead;
+    return n;
+}
+
+// Moves tid and pos on to the first position at or after them inside the
+// region mask.  Returns 0 if they were already inside, 1 if they moved or
+// -1 if there are no regions left.
+static int plp_region_skip(bam_plp_t iter)
+{
+    const plp_region_t *r = iter->reg;
+    int i = iter->i_reg;
+
+    while (i < iter->n_reg && (r[i].tid < iter->tid
+                               || (r[i].tid == iter->tid && r[i].end <= iter->pos)))
+        i++;
+    iter->i_reg = i;
+    if (i == iter->n_reg)
+        return -1;
+    if (r[i].tid == iter->tid && r[i].beg <= iter->pos)
+        return 0;
+    iter->tid = r[i].tid;
+    iter->pos = r[i].beg;
+    return 1;
+}
+
+// Drops all the reads once past the last region, and stops the auto
+// interface from reading any more
+static void plp_regions_done(bam_plp_t iter)
+{
+    int i;
+    for (i = iter->first; i < iter->first + iter->n_rd; i++)
+        plp_drop(iter, i);
+    iter->first = iter->n_rd = 0;
+    iter->is_eof = 1;
+}
+
 // Prepares next pileup position in bam records collected by bam_plp_auto -> user func -> bam_plp_push. Returns
 // pointer to the piled records if next position is ready or NULL if there is not enough records in the
 // buffer yet (the current position is still the maximum position across all buffered reads).
@@ -3084,50 +4888,43 @@ const bam_pileup1_t *bam_plp_next(bam_plp_t iter, int *_tid, int *_pos, int *_n_
 {
     if (iter->error) { *_n_plp = -1; return NULL; }
     *_n_plp = 0;
-    if (iter->is_eof && iter->head == iter->tail) return NULL;
+    if (iter->is_eof && iter->n_rd == 0) return NULL;
     while (iter->is_eof || iter->max_tid > iter->tid || (iter->max_tid == iter->tid && iter->max_pos > iter->pos)) {
-        int n_plp = 0;
-        // write iter->plp at iter->pos
-        lbnode_t **pptr = &iter->head;
-        while (*pptr != iter->tail) {
-            lbnode_t *p = *pptr;
-            if (p->b.core.tid < iter->tid || (p->b.core.tid == iter->tid && p->end <= iter->pos)) { // then remove
-                overlap_remove(iter, &p->b);
-                if (iter->plp_destruct)
-                    iter->plp_destruct(iter->data, &p->b, &p->cd);
-                *pptr = p->next; mp_free(iter->mp, p);
-            }
-            else {
-                if (p->b.core.tid == iter->tid && p->beg <= iter->pos) { // here: p->end > pos; then add to pileup
-                    if (n_plp == iter->max_plp) { // then double the capacity
-                        iter->max_plp = iter->max_plp? iter->max_plp<<1 : 256;
-                        iter->plp = (bam_pileup1_t*)realloc(iter->plp, sizeof(bam_pileup1_t) * iter->max_plp);
-                    }
-                    iter->plp[n_plp].b = &p->b;
-                    iter->plp[n_plp].cd = p->cd;
-                    if (resolve_cigar2(iter->plp + n_plp, iter->pos, &p->s)) ++n_plp; // actually always true...
-                }
-                pptr = &(*pptr)->next;
+        int n_plp;
+        int32_t head_tid, head_beg;
+        if (iter->n_reg) {
+            int ret = plp_region_skip(iter);
+            if (ret < 0) { // past the last region; nothing more to report
+                plp_regions_done(iter);
+                return NULL;
             }
+            if (ret > 0) continue; // the reads at the new position may not all be in
         }
+        // write iter->plp at iter->pos
+        n_plp = plp_column(iter);
         *_n_plp = n_plp; *_tid = iter->tid; *_pos = iter->pos;
         // update iter->tid and iter->pos
-        if (iter->head != iter->tail) {
-            if (iter->tid > iter->head->b.core.tid) {
+        if (iter->n_rd) {
+            head_tid = iter->tids[iter->first];
+            head_beg = iter->beg[iter->first];
+            if (iter->tid > head_tid) {
                 hts_log_error("Unsorted input. Pileup aborts");
                 iter->error = 1;
                 *_n_plp = -1;
                 return NULL;
             }
+        } else {
+            head_tid = iter->max_tid;
+            head_beg = iter->max_pos;
         }
-        if (iter->tid < iter->head->b.core.tid) { // come to a new reference sequence
-            iter->tid = iter->head->b.core.tid; iter->pos = iter->head->beg; // jump to the next reference
-        } else if (iter->pos < iter->head->beg) { // here: tid == head->b.core.tid
-            iter->pos = iter->head->beg; // jump to the next position
+        if (iter->tid < head_tid) { // come to a new reference sequence
+            iter->tid = head_tid; iter->pos = head_beg; // jump to the next reference
+        } else if (iter->pos < head_beg) { // here: tid == head_tid
+            iter->pos = head_beg; // jump to the next position
         } else ++iter->pos; // scan contiguously
         // return
-        if (n_plp) return iter->plp;
-        if (iter->is_eof && iter->head == iter->tail) break;
+        if (n_plp) return iter->plp + iter->first;
+        if (iter->is_eof && iter->n_rd == 0) break;
     }
     return NULL;
 }
@@ -3136,41 +4933,54 @@ int bam_plp_push(bam_plp_t iter, const bam1_t *b)
 {
     if (iter->error) return -1;
     if (b) {
-        if (b->core.tid < 0) { overlap_remove(iter, b); return 0; }
+        bam1_t *rec;
+        int32_t end;
+        if (b->core.tid < 0) return 0;
         // Skip only unmapped reads here, any additional filtering must be done in iter->func
-        if (b->core.flag & BAM_FUNMAP) { overlap_remove(iter, b); return 0; }
-        if (iter->tid == b->core.tid && iter->pos == b->core.pos && iter->mp->cnt > iter->maxcnt)
-        {
-            overlap_remove(iter, b);
+        if (b->core.flag & BAM_FUNMAP) return 0;
+        if (iter->tid == b->core.tid && iter->pos == b->core.pos && iter->n_rd >= iter->maxcnt)
             return 0;
+        if (b->core.tid < iter->max_tid) {
+            hts_log_error("The input is not sorted (chromosomes out of order)");
+            iter->error = 1;
+            return -1;
         }
-        bam_copy1(&iter->tail->b, b);
-#ifndef BAM_NO_ID
-        iter->tail->b.id = iter->id++;
-#endif
-        iter->tail->beg = b->core.pos;
-        iter->tail->end = bam_endpos(b);
-        if (overlap_push(iter, iter->tail) < 0) {
+        if ((b->core.tid == iter->max_tid) && (b->core.pos < iter->max_pos)) {
+            hts_log_error("The input is not sorted (reads out of order)");
             iter->error = 1;
             return -1;
         }
-        iter->tail->s = g_cstate_null; iter->tail->s.end = iter->tail->end - 1; // initialize cstate_t
-        if (b->core.tid < iter->max_tid) {
-            hts_log_error("The input is not sorted (chromosomes out of order)");
+        if ((iter->first + iter->n_rd == iter->m_rd && plp_grow(iter) < 0)
+            || !(rec = bam_pool_dup1(iter->mp, b))) {
             iter->error = 1;
             return -1;
         }
-        if ((b->core.tid == iter->max_tid) && (iter->tail->beg < iter->max_pos)) {
-            hts_log_error("The input is not sorted (reads out of order)");
+#ifndef BAM_NO_ID
+        rec->id = iter->id++;
+#endif
+        end = bam_endpos(b);
+        if (overlap_push(iter, rec, end) < 0) {
+            overlap_remove(iter, rec, end);
+            bam_pool_free(iter->mp, rec);
             iter->error = 1;
             return -1;
         }
-        iter->max_tid = b->core.tid; iter->max_pos = iter->tail->beg;
-        if (iter->tail->end > iter->pos || iter->tail->b.core.tid > iter->tid) {
+        iter->max_tid = b->core.tid; iter->max_pos = b->core.pos;
+        if (b->core.tid > iter->tid || (b->core.tid == iter->tid && end > iter->pos)) {
+            int n = iter->first + iter->n_rd++;
+            bam_pileup1_t *p = &iter->plp[n];
+            memset(p, 0, sizeof(*p));
+            p->b = rec;
+            iter->s[n] = g_cstate_null; iter->s[n].end = end - 1; // initialize cstate_t
+            iter->tids[n] = b->core.tid;
+            iter->beg[n] = b->core.pos;
+            iter->end[n] = end;
+            iter->next[n] = b->core.pos;
             if (iter->plp_construct)
-                iter->plp_construct(iter->data, b, &iter->tail->cd);
-            iter->tail->next = mp_alloc(iter->mp);
-            iter->tail = iter->tail->next;
+                iter->plp_construct(iter->data, b, &p->cd);
+        } else {
+            overlap_remove(iter, rec, end);
+            bam_pool_free(iter->mp, rec);
         }
     } else iter->is_eof = 1;
     return 0;
@@ -3205,15 +5015,14 @@ const bam_pileup1_t *bam_plp_auto(bam_plp_t iter, int *_tid, int *_pos, int *_n_
 
 void bam_plp_reset(bam_plp_t iter)
 {
-    overlap_remove(iter, NULL);
+    overlap_remove(iter, NULL, 0);
     iter->max_tid = iter->max_pos = -1;
     iter->tid = iter->pos = 0;
     iter->is_eof = 0;
-    while (iter->head != iter->tail) {
-        lbnode_t *p = iter->head;
-        iter->head = p->next;
-        mp_free(iter->mp, p);
-    }
+    iter->i_reg = 0;
+    while (iter->n_rd > 0)
+        bam_pool_free(iter->mp, iter->plp[iter->first + --iter->n_rd].b);
+    iter->first = 0;
 }
 
 void bam_plp_set_maxcnt(bam_plp_t iter, int maxcnt)
@@ -3221,34 +5030,141 @@ void bam_plp_set_maxcnt(bam_plp_t iter, int maxcnt)
     iter->maxcnt = maxcnt;
 }
 
+int bam_plp_set_regions(bam_plp_t iter, const hts_reglist_t *reg, int count)
+{
+    plp_region_t *r = NULL;
+    int n = plp_regions_flatten(reg, count, &r);
+
+    if (n < 0)
+        return -1;
+    free(iter->reg);
+    iter->reg = r;
+    iter->n_reg = n;
+    iter->i_reg = 0;
+    return 0;
+}
+
 /************************
  *** Mpileup iterator ***
  ************************/
 
+/*
+ * Inputs are merged with a binary heap ordered on the position of each
+ * one's next pileup, so a call only advances the inputs at the position it
+ * returned last time.  The caller's n_plp and plp arrays are cleared in
+ * full each time, as they may not be the ones passed before even if they
+ * are at the same addresses.
+ *
+ * With prefetch threads, each input's reads are fetched ahead in batches,
+ * filling one buffer while the pileup works through the other.  The read
+ * functions usually block waiting for BGZF or SAM decoding on another
+ * pool, so they get a pool of their own; were they run on that same
+ * pool, they could take every worker and leave the decoding jobs that
+ * would unblock them with nowhere to run.
+ */
+
+#define MPLP_PREFETCH_BATCH 64
+
+typedef struct {
+    struct __bam_mplp_t *mplp;
+    bam_plp_auto_f func;
+    void *data;
+    bam1_t **front, **back;
+    int n_front, i_front, ret_front;
+    int n_back, ret_back;
+    int pending;            // a job is filling back
+} mplp_prefetch_t;
+
 struct __bam_mplp_t {
     int n;
-    uint64_t min, *pos;
+    uint64_t *pos;
     bam_plp_t *iter;
     int *n_plp;
     const bam_pileup1_t **plp;
+    int *heap, n_heap;      // inputs with more data, by pos[]
+    int *curr, n_curr;      // inputs at the position last returned
+    // Prefetching
+    mplp_prefetch_t *pf;
+    hts_tpool *pool;        // owned; only runs prefetch jobs
+    hts_tpool_process *q;
+    int pf_batch, pf_started;
+    pthread_mutex_t pf_lock;
+    pthread_cond_t pf_done;
 };
 
+// Ties are broken on the input number, so that inputs at the same position
+// come out, and are moved on, in the same order as they were given
+static inline int mplp_before(bam_mplp_t iter, int a, int b)
+{
+    return iter->pos[a] < iter->pos[b] || (iter->pos[a] == iter->pos[b] && a < b);
+}
+
+static void mplp_heap_push(bam_mplp_t iter, int i)
+{
+    int k = iter->n_heap++;
+    while (k > 0) {
+        int parent = (k - 1) / 2;
+        if (mplp_before(iter, iter->heap[parent], i)) break;
+        iter->heap[k] = iter->heap[parent];
+        k = parent;
+    }
+    iter->heap[k] = i;
+}
+
+static int mplp_heap_pop(bam_mplp_t iter)
+{
+    int top = iter->heap[0], last = iter->heap[--iter->n_heap], k = 0;
+    for (;;) {
+        int c = 2 * k + 1;
+        if (c >= iter->n_heap) break;
+        if (c + 1 < iter->n_heap && mplp_before(iter, iter->heap[c + 1], iter->heap[c]))
+            c++;
+        if (mplp_before(iter, last, iter->heap[c])) break;
+        iter->heap[k] = iter->heap[c];
+        k = c;
+    }
+    if (iter->n_heap) iter->heap[k] = last;
+    return top;
+}
+
+static void mplp_restart(bam_mplp_t iter)
+{
+    int i;
+    iter->n_heap = 0;
+    for (i = 0; i < iter->n; ++i) {
+        iter->curr[i] = i;
+        iter->n_plp[i] = 0;
+        iter->plp[i] = NULL;
+    }
+    iter->n_curr = iter->n;
+}
+
 bam_mplp_t bam_mplp_init(int n, bam_plp_auto_f func, void **data)
 {
     int i;
     bam_mplp_t iter;
     iter = (bam_mplp_t)calloc(1, sizeof(struct __bam_mplp_t));
+    if (!iter) return NULL;
     iter->pos = (uint64_t*)calloc(n, sizeof(uint64_t));
     iter->n_plp = (int*)calloc(n, sizeof(int));
     iter->plp = (const bam_pileup1_t**)calloc(n, sizeof(bam_pileup1_t*));
     iter->iter = (bam_plp_t*)calloc(n, sizeof(bam_plp_t));
+    iter->heap = (int*)calloc(n, sizeof(int));
+    iter->curr = (int*)calloc(n, sizeof(int));
     iter->n = n;
-    iter->min = (uint64_t)-1;
+    if (!iter->pos || !iter->n_plp || !iter->plp || !iter->iter
+        || !iter->heap || !iter->curr)
+        goto fail;
     for (i = 0; i < n; ++i) {
-        iter->iter[i] = bam_plp_init(func, data[i]);
-        iter->pos[i] = iter->min;
+        if (!(iter->iter[i] = bam_plp_init(func, data[i])))
+            goto fail;
     }
+    mplp_restart(iter);
     return iter;
+
+ fail:
+    bam_mplp_destroy(iter);
+    return NULL;
 }
 
 int bam_mplp_init_overlaps(bam_mplp_t iter)
@@ -3266,49 +5182,234 @@ void bam_mplp_set_maxcnt(bam_mplp_t iter, int maxcnt)
         iter->iter[i]->maxcnt = maxcnt;
 }
 
+int bam_mplp_set_regions(bam_mplp_t iter, const hts_reglist_t *reg, int count)
+{
+    int i;
+    for (i = 0; i < iter->n; ++i)
+        if (bam_plp_set_regions(iter->iter[i], reg, count) < 0)
+            return -1;
+    return 0;
+}
+
+// Fills pf->back with the next batch of reads; run on the thread pool
+static void *mplp_prefetch_job(void *arg)
+{
+    mplp_prefetch_t *pf = (mplp_prefetch_t *) arg;
+    struct __bam_mplp_t *iter = pf->mplp;
+    int n, ret = 0;
+
+    for (n = 0; n < iter->pf_batch; n++) {
+        if ((ret = pf->func(pf->data, pf->back[n])) < 0)
+            break;
+    }
+
+    pthread_mutex_lock(&iter->pf_lock);
+    pf->n_back = n;
+    pf->ret_back = ret < 0 ? ret : 0;
+    pf->pending = 0;
+    pthread_cond_broadcast(&iter->pf_done);
+    pthread_mutex_unlock(&iter->pf_lock);
+    return NULL;
+}
+
+static int mplp_prefetch_dispatch(mplp_prefetch_t *pf)
+{
+    struct __bam_mplp_t *iter = pf->mplp;
+    pf->pending = 1;
+    if (hts_tpool_dispatch(iter->pool, iter->q, mplp_prefetch_job, pf) < 0) {
+        pf->pending = 0;
+        return -1;
+    }
+    return 0;
+}
+
+// Waits for all outstanding jobs and discards what they read, so the
+// inputs can be repositioned.
+static void mplp_prefetch_stop(bam_mplp_t iter)
+{
+    int i;
+    if (!iter->pf) return;
+    pthread_mutex_lock(&iter->pf_lock);
+    for (i = 0; i < iter->n; i++) {
+        while (iter->pf[i].pending)
+            pthread_cond_wait(&iter->pf_done, &iter->pf_lock);
+    }
+    pthread_mutex_unlock(&iter->pf_lock);
+    for (i = 0; i < iter->n; i++) {
+        mplp_prefetch_t *pf = &iter->pf[i];
+        pf->n_front = pf->i_front = pf->ret_front = 0;
+        pf->n_back = pf->ret_back = 0;
+    }
+    iter->pf_started = 0;
+}
+
+// The bam_plp_auto_f used for each input when prefetching
+static int mplp_prefetch_read(void *data, bam1_t *b)
+{
+    mplp_prefetch_t *pf = (mplp_prefetch_t *) data;
+    bam1_t **tmp_buf, tmp;
+
+    if (pf->i_front == pf->n_front) {
+        if (pf->ret_front < 0)
+            return pf->ret_front;
+        pthread_mutex_lock(&pf->mplp->pf_lock);
+        while (pf->pending)
+            pthread_cond_wait(&pf->mplp->pf_done, &pf->mplp->pf_lock);
+        pthread_mutex_unlock(&pf->mplp->pf_lock);
+
+        tmp_buf = pf->front; pf->front = pf->back; pf->back = tmp_buf;
+        pf->n_front = pf->n_back;
+        pf->ret_front = pf->ret_back;
+        pf->i_front = 0;
+        if (pf->ret_front == 0 && mplp_prefetch_dispatch(pf) < 0)
+            return -2;
+        if (pf->n_front == 0)
+            return pf->ret_front;
+    }
+
+    // Swap rather than copy; the old buffers get reused for a later batch
+    tmp = *b;
+    *b = *pf->front[pf->i_front];
+    *pf->front[pf->i_front++] = tmp;
+    return 0;
+}
+
+static void mplp_prefetch_free(bam_mplp_t iter)
+{
+    int i, j;
+    if (!iter->pf) return;
+    mplp_prefetch_stop(iter);
+    for (i = 0; i < iter->n; i++) {
+        mplp_prefetch_t *pf = &iter->pf[i];
+        for (j = 0; j < iter->pf_batch; j++) {
+            if (pf->front) bam_destroy1(pf->front[j]);
+            if (pf->back) bam_destroy1(pf->back[j]);
+        }
+        free(pf->front);
+        free(pf->back);
+        // Hand the input back to its own reader
+        iter->iter[i]->func = pf->func;
+        iter->iter[i]->data = pf->data;
+    }
+    if (iter->q) hts_tpool_process_destroy(iter->q);
+    if (iter->pool) hts_tpool_destroy(iter->pool);
+    pthread_mutex_destroy(&iter->pf_lock);
+    pthread_cond_destroy(&iter->pf_done);
+    free(iter->pf);
+    iter->pf = NULL;
+    iter->q = NULL;
+    iter->pool = NULL;
+}
+
+int bam_mplp_set_threads(bam_mplp_t iter, int nthreads, int batch)
+{
+    int i, j;
+
+    mplp_prefetch_free(iter);
+    if (nthreads <= 0)
+        return 0;
+    if (batch <= 0)
+        batch = MPLP_PREFETCH_BATCH;
+
+    if (!(iter->pf = calloc(iter->n, sizeof(*iter->pf))))
+        return -1;
+    pthread_mutex_init(&iter->pf_lock, NULL);
+    pthread_cond_init(&iter->pf_done, NULL);
+    iter->pf_batch = batch;
+    iter->pf_started = 0;
+    for (i = 0; i < iter->n; i++) {
+        iter->pf[i].mplp = iter;
+        iter->pf[i].func = iter->iter[i]->func;
+        iter->pf[i].data = iter->iter[i]->data;
+    }
+    if (!(iter->pool = hts_tpool_init(nthreads)))
+        goto fail;
+    // Each input has at most one job queued, so dispatch never blocks.
+    // The workers only take jobs while the queue size exceeds the number
+    // of running threads, so allow for that too.
+    if (!(iter->q = hts_tpool_process_init(iter->pool, iter->n + nthreads, 1)))
+        goto fail;
+
+    for (i = 0; i < iter->n; i++) {
+        mplp_prefetch_t *pf = &iter->pf[i];
+        if (!(pf->front = calloc(batch, sizeof(bam1_t *)))
+            || !(pf->back = calloc(batch, sizeof(bam1_t *))))
+            goto fail;
+        for (j = 0; j < batch; j++) {
+            if (!(pf->front[j] = bam_init1()) || !(pf->back[j] = bam_init1()))
+                goto fail;
+        }
+    }
+    for (i = 0; i < iter->n; i++) {
+        iter->iter[i]->func = mplp_prefetch_read;
+        iter->iter[i]->data = &iter->pf[i];
+    }
+    return 0;
+
+ fail:
+    mplp_prefetch_free(iter);
+    return -1;
+}
+
 void bam_mplp_destroy(bam_mplp_t iter)
 {
     int i;
-    for (i = 0; i < iter->n; ++i) bam_plp_destroy(iter->iter[i]);
+    if (!iter) return;
+    mplp_prefetch_free(iter);
+    if (iter->iter)
+        for (i = 0; i < iter->n; ++i)
+            if (iter->iter[i]) bam_plp_destroy(iter->iter[i]);
     free(iter->iter); free(iter->pos); free(iter->n_plp); free(iter->plp);
+    free(iter->heap); free(iter->curr);
     free(iter);
 }
 
 int bam_mplp_auto(bam_mplp_t iter, int *_tid, int *_pos, int *n_plp, const bam_pileup1_t **plp)
 {
-    int i, ret = 0;
-    uint64_t new_min = (uint64_t)-1;
-    for (i = 0; i < iter->n; ++i) {
-        if (iter->pos[i] == iter->min) {
-            int tid, pos;
-            iter->plp[i] = bam_plp_auto(iter->iter[i], &tid, &pos, &iter->n_plp[i]);
-            if ( iter->iter[i]->error ) return -1;
-            iter->pos[i] = iter->plp[i] ? (uint64_t)tid<<32 | pos : 0;
+    int i, j;
+    uint64_t min;
+
+    if (iter->pf && !iter->pf_started) {
+        for (i = 0; i < iter->n; ++i)
+            if (mplp_prefetch_dispatch(&iter->pf[i]) < 0) return -1;
+        iter->pf_started = 1;
+    }
+
+    // Move on the inputs that were returned last time
+    for (j = 0; j < iter->n_curr; ++j) {
+        int tid, pos;
+        i = iter->curr[j];
+        iter->plp[i] = bam_plp_auto(iter->iter[i], &tid, &pos, &iter->n_plp[i]);
+        if ( iter->iter[i]->error ) return -1;
+        if (iter->plp[i]) {
+            iter->pos[i] = (uint64_t)tid<<32 | (uint32_t)pos;
+            mplp_heap_push(iter, i);
         }
-        if (iter->plp[i] && iter->pos[i] < new_min) new_min = iter->pos[i];
     }
-    iter->min = new_min;
-    if (new_min == (uint64_t)-1) return 0;
-    *_tid = new_min>>32; *_pos = (uint32_t)new_min;
-    for (i = 0; i < iter->n; ++i) {
-        if (iter->pos[i] == iter->min) { // FIXME: valgrind reports "uninitialised value(s) at this line"
-            n_plp[i] = iter->n_plp[i], plp[i] = iter->plp[i];
-            ++ret;
-        } else n_plp[i] = 0, plp[i] = 0;
+
+    memset(n_plp, 0, iter->n * sizeof(*n_plp));
+    memset(plp, 0, iter->n * sizeof(*plp));
+    iter->n_curr = 0;
+    if (!iter->n_heap) return 0;
+
+    min = iter->pos[iter->heap[0]];
+    *_tid = min>>32; *_pos = (uint32_t)min;
+    while (iter->n_heap && iter->pos[iter->heap[0]] == min) {
+        i = mplp_heap_pop(iter);
+        iter->curr[iter->n_curr++] = i;
+        n_plp[i] = iter->n_plp[i];
+        plp[i] = iter->plp[i];
     }
-    return ret;
+    return iter->n_curr;
 }
 
 void bam_mplp_reset(bam_mplp_t iter)
 {
     int i;
-    iter->min = (uint64_t)-1;
-    for (i = 0; i < iter->n; ++i) {
+    mplp_prefetch_stop(iter);
+    for (i = 0; i < iter->n; ++i)
         bam_plp_reset(iter->iter[i]);
-        iter->pos[i] = (uint64_t)-1;
-        iter->n_plp[i] = 0;
-        iter->plp[i] = NULL;
-    }
+    mplp_restart(iter);
 }
 
 void bam_mplp_constructor(bam_mplp_t iter,
@@ -3325,4 +5426,946 @@ void bam_mplp_destructor(bam_mplp_t iter,
         bam_plp_destructor(iter->iter[i], func);
 }
 
+/***********************
+ *** Columnar pileup ***
+ ***********************/
+
+// The arrays share one allocation, widest type first
+static int plp_cols_grow(bam_plp_cols_t *c, int n)
+{
+    int m = n < 64 ? 64 : n;
+    kroundup32(m);
+    uint8_t *mem = realloc(c->qpos, (size_t) m * (2*sizeof(int32_t) + 4));
+    if (!mem) return -1;
+    c->qpos  = (int32_t *) mem;
+    c->indel = c->qpos + m;
+    c->base  = (uint8_t *) (c->indel + m);
+    c->qual  = c->base + m;
+    c->mapq  = c->qual + m;
+    c->flags = c->mapq + m;
+    c->m = m;
+    return 0;
+}
+
+int bam_plp_cols_fill(bam_plp_cols_t *c, const bam_pileup1_t *plp, int n)
+{
+    int i;
+    if (n > c->m && plp_cols_grow(c, n) < 0) return -1;
+    for (i = 0; i < n; i++) {
+        const bam_pileup1_t *p = &plp[i];
+        const bam1_t *b = p->b;
+        uint8_t fl = (bam_is_rev(b) ? BAM_PLP_REV : 0)
+            | (p->is_del ? BAM_PLP_DEL : 0)
+            | (p->is_refskip ? BAM_PLP_REFSKIP : 0)
+            | (p->is_head ? BAM_PLP_HEAD : 0)
+            | (p->is_tail ? BAM_PLP_TAIL : 0);
+        if (p->is_del) {
+            c->base[i] = 0;
+            c->qual[i] = 0;
+        } else {
+            c->base[i] = bam_seqi(bam_get_seq(b), p->qpos);
+            c->qual[i] = bam_get_qual(b)[p->qpos];
+        }
+        c->mapq[i]  = b->core.qual;
+        c->flags[i] = fl;
+        c->qpos[i]  = p->qpos;
+        c->indel[i] = p->indel;
+    }
+    c->n = n;
+    return 0;
+}
+
+int bam_plp_auto_cols(bam_plp_t iter, int *tid, int *pos, bam_plp_cols_t *c)
+{
+    int n;
+    const bam_pileup1_t *plp = bam_plp_auto(iter, tid, pos, &n);
+    if (!plp) {
+        c->n = 0;
+        return n < 0 ? -1 : 0;
+    }
+    return bam_plp_cols_fill(c, plp, n) < 0 ? -1 : n;
+}
+
+int bam_plp_cols_errmod(const bam_plp_cols_t *c, int min_baseq, uint16_t *bases)
+{
+    int i, k = 0;
+    for (i = 0; i < c->n; i++) {
+        int q = c->qual[i];
+        if ((c->flags[i] & (BAM_PLP_DEL|BAM_PLP_REFSKIP)) || q < min_baseq)
+            continue;
+        if (c->mapq[i] != 255 && q > c->mapq[i]) q = c->mapq[i];
+        if (q > 63) q = 63;
+        bases[k++] = q << 5 | (c->flags[i] & BAM_PLP_REV ? 16 : 0)
+            | seq_nt16_int[c->base[i]];
+    }
+    return k;
+}
+
+void bam_plp_cols_free(bam_plp_cols_t *c)
+{
+    free(c->qpos);
+    memset(c, 0, sizeof(*c));
+}
+
+/*********************
+ *** Depth counter ***
+ *********************/
+
+/*
+ * Each read adds +1 where a covered stretch of the reference starts and -1
+ * where it ends to a difference array, which is then summed one window at
+ * a time.  The array spans two windows, so that reads starting in the
+ * current window almost always fit; changes further ahead than that wait
+ * in a heap.  Arrays are indexed by position and then input, [i*n + k].
+ */
+
+#define DEPTH_WINDOW_MAX (1<<16)
+#define DEPTH_WINDOW_MIN 1024
+
+typedef struct {
+    int64_t pos;
+    int k, delta;
+} depth_event_t;
+
+
+struct __bam_depth_t {
+    int n;
+    bam_plp_auto_f func;
+    void **data;
+    bam1_t **b;                 // next read for each input
+    int *state;                 // 1 if b[k] holds a read, 0 if not, -1 at end
+    int *last_tid;
+    int64_t *last_pos;
+    int min_mapq, min_baseq, deletions;
+    uint32_t flag_skip;
+    plp_region_t *reg;          // sorted and merged
+    int n_reg, out_reg, *in_reg;
+    // Window being filled
+    int tid, win;
+    int64_t beg, max_end, used;
+    int *diff, *run, *depth;
+    depth_event_t *ev;          // heap of changes beyond the array
+    int n_ev, m_ev;
+    // Window being returned
+    int w_tid;
+    int64_t w_beg, w_len, w_pos;
+    // Span being returned by bam_depth_auto()
+    int a_tid;
+    int64_t a_beg, a_len, a_pos;
+    const int *a_depth;
+    int error;
+};
+
+bam_depth_t bam_depth_init(int n, bam_plp_auto_f func, void **data)
+{
+    bam_depth_t iter;
+    int k;
+
+    if (n <= 0) return NULL;
+    if (!(iter = calloc(1, sizeof(*iter)))) return NULL;
+    iter->n = n;
+    iter->func = func;
+    iter->flag_skip = BAM_FUNMAP;
+    iter->win = (1<<20) / n;
+    if (iter->win > DEPTH_WINDOW_MAX) iter->win = DEPTH_WINDOW_MAX;
+    if (iter->win < DEPTH_WINDOW_MIN) iter->win = DEPTH_WINDOW_MIN;
+    iter->data = calloc(n, sizeof(*iter->data));
+    iter->b = calloc(n, sizeof(*iter->b));
+    iter->state = calloc(n, sizeof(*iter->state));
+    iter->last_tid = calloc(n, sizeof(*iter->last_tid));
+    iter->last_pos = calloc(n, sizeof(*iter->last_pos));
+    iter->in_reg = calloc(n, sizeof(*iter->in_reg));
+    iter->run = calloc(n, sizeof(*iter->run));
+    iter->diff = calloc((size_t) 2 * iter->win * n, sizeof(*iter->diff));
+    iter->depth = calloc((size_t) iter->win * n, sizeof(*iter->depth));
+    if (!iter->data || !iter->b || !iter->state || !iter->last_tid
+        || !iter->last_pos || !iter->in_reg || !iter->run || !iter->diff
+        || !iter->depth)
+        goto fail;
+    for (k = 0; k < n; k++) {
+        iter->data[k] = data[k];
+        if (!(iter->b[k] = bam_init1()))
+            goto fail;
+    }
+    bam_depth_reset(iter);
+    return iter;
+
+ fail:
+    bam_depth_destroy(iter);
+    return NULL;
+}
+
+void bam_depth_destroy(bam_depth_t iter)
+{
+    int k;
+    if (!iter) return;
+    if (iter->b) {
+        for (k = 0; k < iter->n; k++)
+            if (iter->b[k]) bam_destroy1(iter->b[k]);
+    }
+    free(iter->data); free(iter->b); free(iter->state);
+    free(iter->last_tid); free(iter->last_pos); free(iter->in_reg);
+    free(iter->run); free(iter->diff); free(iter->depth);
+    free(iter->ev); free(iter->reg);
+    free(iter);
+}
+
+void bam_depth_reset(bam_depth_t iter)
+{
+    int k;
+    for (k = 0; k < iter->n; k++) {
+        iter->state[k] = 0;
+        iter->last_tid[k] = -1;
+        iter->last_pos[k] = -1;
+        iter->in_reg[k] = 0;
+        iter->run[k] = 0;
+    }
+    memset(iter->diff, 0, iter->used * iter->n * sizeof(*iter->diff));
+    iter->used = 0;
+    iter->n_ev = 0;
+    iter->tid = -1;
+    iter->beg = iter->max_end = 0;
+    iter->out_reg = 0;
+    iter->w_len = iter->w_pos = 0;
+    iter->a_len = iter->a_pos = 0;
+    iter->error = 0;
+}
+
+void bam_depth_set_filter(bam_depth_t iter, int min_mapq, int min_baseq,
+                          uint32_t flag_skip)
+{
+    iter->min_mapq = min_mapq;
+    iter->min_baseq = min_baseq;
+    iter->flag_skip = flag_skip;
+}
+
+void bam_depth_set_deletions(bam_depth_t iter, int count)
+{
+    iter->deletions = count != 0;
+}
+
+int bam_depth_set_regions(bam_depth_t iter, const hts_reglist_t *reg, int count)
+{
+    plp_region_t *r = NULL;
+    int n = plp_regions_flatten(reg, count, &r), k;
+
+    if (n < 0)
+        return -1;
+    free(iter->reg);
+    iter->reg = r;
+    iter->n_reg = n;
+    iter->out_reg = 0;
+    for (k = 0; k < iter->n; k++)
+        iter->in_reg[k] = 0;
+    return 0;
+}
+
+// Whether b overlaps a region, moving on the input's region cursor
+static int depth_in_regions(bam_depth_t iter, int k, const bam1_t *b)
+{
+    const plp_region_t *r = iter->reg;
+    int i = iter->in_reg[k], tid = b->core.tid;
+    int64_t pos = b->core.pos;
+
+    while (i < iter->n_reg
+           && (r[i].tid < tid || (r[i].tid == tid && r[i].end <= pos)))
+        i++;
+    iter->in_reg[k] = i;
+    return i < iter->n_reg && r[i].tid == tid && r[i].beg < bam_endpos(b);
+}
+
+// Reads the next wanted record for input k
+static int depth_fetch(bam_depth_t iter, int k)
+{
+    bam1_t *b = iter->b[k];
+    int ret;
+
+    for (;;) {
+        if ((ret = iter->func(iter->data[k], b)) < 0) {
+            if (ret < -1) {
+                iter->error = 1;
+                return -1;
+            }
+            iter->state[k] = -1;
+            return 0;
+        }
+        if (b->core.tid < 0 || (b->core.flag & (BAM_FUNMAP | iter->flag_skip))
+            || b->core.qual < iter->min_mapq)
+            continue;
+        if (b->core.tid < iter->last_tid[k]) {
+            hts_log_error("The input is not sorted (chromosomes out of order)");
+            iter->error = 1;
+            return -1;
+        }
+        if (b->core.tid == iter->last_tid[k] && b->core.pos < iter->last_pos[k]) {
+            hts_log_error("The input is not sorted (reads out of order)");
+            iter->error = 1;
+            return -1;
+        }
+        iter->last_tid[k] = b->core.tid;
+        iter->last_pos[k] = b->core.pos;
+        if (iter->n_reg && !depth_in_regions(iter, k, b))
+            continue;
+        iter->state[k] = 1;
+        return 0;
+    }
+}
+
+static int depth_event_push(bam_depth_t iter, int64_t pos, int k, int delta)
+{
+    depth_event_t *ev;
+    int i;
+
+    if (iter->n_ev == iter->m_ev) {
+        int m = iter->m_ev ? iter->m_ev * 2 : 256;
+        if (!(ev = realloc(iter->ev, m * sizeof(*ev))))
+            return -1;
+        iter->ev = ev;
+        iter->m_ev = m;
+    }
+    ev = iter->ev;
+    for (i = iter->n_ev++; i > 0 && ev[(i - 1) / 2].pos > pos; i = (i - 1) / 2)
+        ev[i] = ev[(i - 1) / 2];
+    ev[i].pos = pos;
+    ev[i].k = k;
+    ev[i].delta = delta;
+    return 0;
+}
+
+static void depth_event_pop(bam_depth_t iter)
+{
+    depth_event_t *ev = iter->ev, last = ev[--iter->n_ev];
+    int i = 0, c;
+
+    while ((c = 2 * i + 1) < iter->n_ev) {
+        if (c + 1 < iter->n_ev && ev[c + 1].pos < ev[c].pos) c++;
+        if (last.pos <= ev[c].pos) break;
+        ev[i] = ev[c];
+        i = c;
+    }
+    ev[i] = last;
+}
+
+static inline int depth_event(bam_depth_t iter, int64_t pos, int k, int delta)
+{
+    int64_t off = pos - iter->beg;
+    if (off >= 2 * (int64_t) iter->win)
+        return depth_event_push(iter, pos, k, delta);
+    iter->diff[off * iter->n + k] += delta;
+    if (iter->used <= off) iter->used = off + 1;
+    return 0;
+}
+
+// Counts input k as covering [beg, end)
+static int depth_span(bam_depth_t iter, int k, int64_t beg, int64_t end)
+{
+    if (end <= iter->beg) return 0;
+    if (beg < iter->beg) beg = iter->beg;
+    if (depth_event(iter, beg, k, 1) < 0 || depth_event(iter, end, k, -1) < 0)
+        return -1;
+    if (iter->max_end < end) iter->max_end = end;
+    return 0;
+}
+
+// Adds [beg, end) to the stretch in *rbeg, *rend if it follows on,
+// otherwise counts that stretch and starts a new one
+static inline int depth_extend(bam_depth_t iter, int k, int64_t *rbeg,
+                               int64_t *rend, int64_t beg, int64_t end)
+{
+    if (beg == *rend) {
+        *rend = end;
+        return 0;
+    }
+    if (*rend > *rbeg && depth_span(iter, k, *rbeg, *rend) < 0)
+        return -1;
+    *rbeg = beg;
+    *rend = end;
+    return 0;
+}
+
+static int depth_add_read(bam_depth_t iter, int k, const bam1_t *b)
+{
+    const uint32_t *cigar = bam_get_cigar(b);
+    const uint8_t *qual = bam_get_qual(b);
+    int64_t pos = b->core.pos, rbeg = -1, rend = -1;
+    int32_t qpos = 0, l_qseq = b->core.l_qseq;
+    int use_qual = iter->min_baseq > 0 && l_qseq > 0 && qual[0] != 0xff;
+    uint32_t i;
+
+    for (i = 0; i < b->core.n_cigar; i++) {
+        int32_t len = bam_cigar_oplen(cigar[i]), j, s;
+        switch (bam_cigar_op(cigar[i])) {
+        case BAM_CMATCH: case BAM_CEQUAL: case BAM_CDIFF:
+            if (use_qual && qpos + len <= l_qseq) {
+                for (j = 0; j < len; ) {
+                    while (j < len && qual[qpos + j] < iter->min_baseq) j++;
+                    for (s = j; j < len && qual[qpos + j] >= iter->min_baseq; j++)
+                        ;
+                    if (j > s && depth_extend(iter, k, &rbeg, &rend,
+                                              pos + s, pos + j) < 0)
+                        return -1;
+                }
+            } else if (depth_extend(iter, k, &rbeg, &rend, pos, pos + len) < 0) {
+                return -1;
+            }
+            pos += len;
+            qpos += len;
+            break;
+        case BAM_CDEL:
+            if (iter->deletions
+                && depth_extend(iter, k, &rbeg, &rend, pos, pos + len) < 0)
+                return -1;
+            pos += len;
+            break;
+        case BAM_CREF_SKIP:
+            pos += len;
+            break;
+        case BAM_CINS: case BAM_CSOFT_CLIP:
+            qpos += len;
+            break;
+        default:
+            break;
+        }
+    }
+    if (rend > rbeg && depth_span(iter, k, rbeg, rend) < 0)
+        return -1;
+    return 0;
+}
+
+// Sums the next window with any coverage into iter->depth.
+// Returns 1 on success, 0 at the end or -1 on error.
+static int depth_fill(bam_depth_t iter)
+{
+    int n = iter->n, win = iter->win, k;
+    int64_t i, len, lim, end;
+
+    for (;;) {
+        if (iter->max_end <= iter->beg) {
+            // Nothing pending, so start again at the next read
+            int tid = INT_MAX;
+            int64_t pos = INT64_MAX;
+            for (k = 0; k < n; k++) {
+                if (iter->state[k] == 0 && depth_fetch(iter, k) < 0)
+                    return -1;
+                if (iter->state[k] == 1) {
+                    const bam1_core_t *c = &iter->b[k]->core;
+                    if (c->tid < tid || (c->tid == tid && c->pos < pos)) {
+                        tid = c->tid;
+                        pos = c->pos;
+                    }
+                }
+            }
+            if (tid == INT_MAX) return 0;
+            iter->tid = tid;
+            iter->beg = iter->max_end = pos;
+        }
+
+        end = iter->beg + win;
+        for (k = 0; k < n; k++) {
+            for (;;) {
+                const bam1_core_t *c;
+                if (iter->state[k] == 0 && depth_fetch(iter, k) < 0)
+                    return -1;
+                if (iter->state[k] != 1) break;
+                c = &iter->b[k]->core;
+                if (c->tid != iter->tid || c->pos >= end) break;
+                if (depth_add_read(iter, k, iter->b[k]) < 0) {
+                    iter->error = 1;
+                    return -1;
+                }
+                iter->state[k] = 0;
+            }
+        }
+
+        len = iter->max_end - iter->beg;
+        if (len > win) len = win;
+        lim = iter->used < win ? iter->used : win;
+        for (i = 0; i < len; i++) {
+            const int *d = iter->diff + i * n;
+            int *o = iter->depth + i * n;
+            for (k = 0; k < n; k++)
+                o[k] = iter->run[k] += d[k];
+        }
+        for (; i < lim; i++) {
+            const int *d = iter->diff + i * n;
+            for (k = 0; k < n; k++)
+                iter->run[k] += d[k];
+        }
+
+        // Slide the difference array along by a window
+        if (iter->used > win) {
+            memmove(iter->diff, iter->diff + (size_t) win * n,
+                    (iter->used - win) * n * sizeof(*iter->diff));
+            memset(iter->diff + (iter->used - win) * n, 0,
+                   (size_t) win * n * sizeof(*iter->diff));
+            iter->used -= win;
+        } else {
+            memset(iter->diff, 0, iter->used * n * sizeof(*iter->diff));
+            iter->used = 0;
+        }
+        iter->w_tid = iter->tid;
+        iter->w_beg = iter->beg;
+        iter->beg += win;
+        while (iter->n_ev && iter->ev[0].pos < iter->beg + 2 * (int64_t) win) {
+            depth_event_t *e = &iter->ev[0];
+            int64_t off = e->pos - iter->beg;
+            iter->diff[off * n + e->k] += e->delta;
+            if (iter->used <= off) iter->used = off + 1;
+            depth_event_pop(iter);
+        }
+
+        if (len > 0) {
+            iter->w_len = len;
+            iter->w_pos = 0;
+            return 1;
+        }
+    }
+}
+
+// Finds the next part of the current window to return
+static int depth_next_span(bam_depth_t iter, int64_t *beg, int64_t *len)
+{
+    int64_t pos = iter->w_beg + iter->w_pos, w_end = iter->w_beg + iter->w_len;
+
+    if (iter->w_pos >= iter->w_len)
+        return 0;
+    if (!iter->n_reg) {
+        *beg = pos;
+        *len = iter->w_len - iter->w_pos;
+        iter->w_pos = iter->w_len;
+        return 1;
+    }
+    while (iter->out_reg < iter->n_reg) {
+        const plp_region_t *r = &iter->reg[iter->out_reg];
+        if (r->tid < iter->w_tid || (r->tid == iter->w_tid && r->end <= pos)) {
+            iter->out_reg++;
+            continue;
+        }
+        if (r->tid > iter->w_tid || r->beg >= w_end)
+            break;
+        *beg = r->beg > pos ? r->beg : pos;
+        *len = (r->end < w_end ? r->end : w_end) - *beg;
+        iter->w_pos = *beg + *len - iter->w_beg;
+        return 1;
+    }
+    iter->w_pos = iter->w_len;
+    return 0;
+}
+
+int bam_depth_next(bam_depth_t iter, int *tid, int *beg, int *len,
+                   const int **depth)
+{
+    int64_t b, l;
+    int ret;
+
+    if (iter->error) return -1;
+    while (!depth_next_span(iter, &b, &l)) {
+        if ((ret = depth_fill(iter)) <= 0)
+            return ret;
+    }
+    *tid = iter->w_tid;
+    *beg = b;
+    *len = l;
+    *depth = iter->depth + (b - iter->w_beg) * iter->n;
+    return l;
+}
+
+int bam_depth_auto(bam_depth_t iter, int *tid, int *pos, const int **depth)
+{
+    int n = iter->n, k, nz, ret;
+
+    for (;;) {
+        while (iter->a_pos < iter->a_len) {
+            const int *d = iter->a_depth + iter->a_pos * n;
+            for (k = 0, nz = 0; k < n; k++)
+                nz += d[k] != 0;
+            if (nz) {
+                *tid = iter->a_tid;
+                *pos = iter->a_beg + iter->a_pos++;
+                *depth = d;
+                return nz;
+            }
+            iter->a_pos++;
+        }
+        if ((ret = bam_depth_next(iter, &iter->a_tid, &k, &nz, &iter->a_depth)) <= 0)
+            return ret;
+        iter->a_beg = k;
+        iter->a_len = nz;
+        iter->a_pos = 0;
+    }
+}
+
+/*****************************
+ *** Region-sharded pileup ***
+ *****************************/
+
+/*
+ * The regions (or all references) are cut into windows, and each window's
+ * pileup is run as a separate job with its own iterator over the window.
+ * Reads that span a window boundary are returned by the queries for both
+ * windows, and each job only reports the columns inside its own window,
+ * so the columns are the same as those of a single pileup.  Job results
+ * come back through the pool's ordered queue.  Each worker thread uses its
+ * own handle on the file, which is kept for later jobs.
+ */
+
+#define PPLP_WINDOW (1<<20)
+
+typedef struct {
+    htsFile *fp;
+    hts_idx_t *idx;             // only for CRAM, whose index is per handle
+} pplp_handle_t;
+
+typedef struct pplp_job_t {
+    struct __bam_pplp_t *pp;
+    int tid, beg, end;
+    kstring_t out;
+    int ret;
+    struct pplp_job_t *next;
+} pplp_job_t;
+
+struct __bam_pplp_t {
+    htsFile *fp;
+    bam_hdr_t *hdr;
+    hts_idx_t *idx;
+    hts_tpool *pool;
+    plp_region_t *reg;
+    int n_reg, window, overlaps;
+    int (*filter)(void *data, bam1_t *b);
+    bam_pplp_column_f column;   // set for the duration of bam_pplp_run()
+    void *data;
+    pthread_mutex_t lock;       // protects handles
+    pplp_handle_t *handles;     // spare handles for the workers
+    int n_handles;
+};
+
+typedef struct {
+    struct __bam_pplp_t *pp;
+    htsFile *fp;
+    hts_itr_t *itr;
+} pplp_reader_t;
+
+// Covers every reference in the header
+static int pplp_all_regions(bam_pplp_t pp)
+{
+    int tid;
+    plp_region_t *r = malloc((pp->hdr->n_targets + 1) * sizeof(*r));
+    if (!r) return -1;
+    for (tid = 0; tid < pp->hdr->n_targets; tid++) {
+        r[tid].tid = tid;
+        r[tid].beg = 0;
+        r[tid].end = pp->hdr->target_len[tid];
+    }
+    free(pp->reg);
+    pp->reg = r;
+    pp->n_reg = pp->hdr->n_targets;
+    return 0;
+}
+
+bam_pplp_t bam_pplp_init(htsFile *fp, bam_hdr_t *hdr, hts_idx_t *idx,
+                         htsThreadPool *p)
+{
+    bam_pplp_t pp;
+
+    if (!fp || !hdr || !idx) return NULL;
+    if (p && p->pool && !fp->fn) {
+        hts_log_error("The file name is needed to read it from several threads");
+        return NULL;
+    }
+    if (!(pp = calloc(1, sizeof(*pp)))) return NULL;
+    pp->fp = fp;
+    pp->hdr = hdr;
+    pp->idx = idx;
+    pp->window = PPLP_WINDOW;
+    if (pthread_mutex_init(&pp->lock, NULL) != 0) {
+        free(pp);
+        return NULL;
+    }
+    if (p && p->pool) {
+        pp->pool = p->pool;
+        if (!(pp->handles = calloc(hts_tpool_size(p->pool), sizeof(*pp->handles))))
+            goto fail;
+    }
+    if (pplp_all_regions(pp) < 0)
+        goto fail;
+    return pp;
+
+ fail:
+    bam_pplp_destroy(pp);
+    return NULL;
+}
+
+void bam_pplp_destroy(bam_pplp_t pp)
+{
+    if (!pp) return;
+    while (pp->n_handles > 0) {
+        pplp_handle_t *h = &pp->handles[--pp->n_handles];
+        if (h->idx) hts_idx_destroy(h->idx);
+        hts_close(h->fp);
+    }
+    free(pp->handles);
+    free(pp->reg);
+    pthread_mutex_destroy(&pp->lock);
+    free(pp);
+}
+
+int bam_pplp_set_regions(bam_pplp_t pp, const hts_reglist_t *reg, int count)
+{
+    plp_region_t *r = NULL;
+    int n, i;
+
+    if (count <= 0)
+        return pplp_all_regions(pp);
+    if ((n = plp_regions_flatten(reg, count, &r)) < 0)
+        return -1;
+    // Regions such as "chr1" run to INT_MAX
+    for (i = 0; i < n; i++) {
+        if (r[i].tid < pp->hdr->n_targets && r[i].end > pp->hdr->target_len[r[i].tid])
+            r[i].end = pp->hdr->target_len[r[i].tid];
+    }
+    free(pp->reg);
+    pp->reg = r;
+    pp->n_reg = n;
+    return 0;
+}
+
+void bam_pplp_set_window(bam_pplp_t pp, int len)
+{
+    pp->window = len > 0 ? len : PPLP_WINDOW;
+}
+
+void bam_pplp_init_overlaps(bam_pplp_t pp)
+{
+    pp->overlaps = 1;
+}
+
+void bam_pplp_set_filter(bam_pplp_t pp, int (*filter)(void *data, bam1_t *b))
+{
+    pp->filter = filter;
+}
+
+static int pplp_get_handle(bam_pplp_t pp, pplp_handle_t *h)
+{
+    bam_hdr_t *hdr;
+
+    if (!pp->pool) {
+        // Run serially on the caller's own handle
+        h->fp = pp->fp;
+        h->idx = NULL;
+        return 0;
+    }
+
+    pthread_mutex_lock(&pp->lock);
+    if (pp->n_handles > 0) {
+        *h = pp->handles[--pp->n_handles];
+        pthread_mutex_unlock(&pp->lock);
+        return 0;
+    }
+    pthread_mutex_unlock(&pp->lock);
+
+    h->idx = NULL;
+    if (!(h->fp = hts_open(pp->fp->fn, "r")))
+        return -1;
+    if ((pp->fp->fn_aux && hts_set_fai_filename(h->fp, pp->fp->fn_aux) < 0)
+        || !(hdr = sam_hdr_read(h->fp)))
+        goto fail;
+    bam_hdr_destroy(hdr);
+    if (h->fp->format.format == cram
+        && !(h->idx = sam_index_load(h->fp, pp->fp->fn)))
+        goto fail;
+    return 0;
+
+ fail:
+    hts_close(h->fp);
+    h->fp = NULL;
+    return -1;
+}
+
+static void pplp_put_handle(bam_pplp_t pp, pplp_handle_t *h)
+{
+    if (!pp->pool || !h->fp) return;
+    pthread_mutex_lock(&pp->lock);
+    pp->handles[pp->n_handles++] = *h;
+    pthread_mutex_unlock(&pp->lock);
+}
+
+static int pplp_read(void *data, bam1_t *b)
+{
+    pplp_reader_t *rd = (pplp_reader_t *) data;
+    int ret, r;
+
+    for (;;) {
+        if ((ret = sam_itr_next(rd->fp, rd->itr, b)) < 0 || !rd->pp->filter)
+            return ret;
+        if ((r = rd->pp->filter(rd->pp->data, b)) < 0)
+            return -2;
+        if (r == 0)
+            return ret;
+    }
+}
+
+// Runs the pileup for one window, collecting the column output in job->out
+static void *pplp_window(void *arg)
+{
+    pplp_job_t *job = (pplp_job_t *) arg;
+    bam_pplp_t pp = job->pp;
+    pplp_handle_t h = { NULL, NULL };
+    pplp_reader_t rd = { pp, NULL, NULL };
+    bam_plp_t plp = NULL;
+    const bam_pileup1_t *p;
+    hts_pair32_t span = { job->beg, job->end };
+    hts_reglist_t win = { NULL, &span, job->tid, 1, job->beg, job->end };
+    int tid, pos, n = 0, ret = -1;
+
+    job->out.l = 0;
+    if (pplp_get_handle(pp, &h) < 0)
+        goto out;
+    rd.fp = h.fp;
+    if (!(rd.itr = sam_itr_queryi(h.idx ? h.idx : pp->idx, job->tid,
+                                  job->beg, job->end)))
+        goto out;
+    if (!(plp = bam_plp_init(pplp_read, &rd)))
+        goto out;
+    // Whether the limit drops a read depends on every read still held
+    // from before it, which a window cannot know, so there is none
+    bam_plp_set_maxcnt(plp, INT_MAX);
+    if (pp->overlaps && bam_plp_init_overlaps(plp) < 0)
+        goto out;
+    // Skips the start of reads overlapping the window's left edge
+    if (bam_plp_set_regions(plp, &win, 1) < 0)
+        goto out;
+
+    while ((p = bam_plp_auto(plp, &tid, &pos, &n)) != NULL) {
+        if (pp->column(pp->data, &job->out, tid, pos, n, p) < 0)
+            goto out;
+    }
+    if (n < 0)
+        goto out;
+    ret = 0;
+
+ out:
+    if (plp) bam_plp_destroy(plp);
+    hts_itr_destroy(rd.itr);
+    pplp_put_handle(pp, &h);
+    job->ret = ret;
+    return job;
+}
+
+// Sets up job for the next window, returning 0 when there are no more
+static int pplp_next_window(bam_pplp_t pp, int *ri, int64_t *pos,
+                            pplp_job_t *job)
+{
+    while (*ri < pp->n_reg) {
+        const plp_region_t *r = &pp->reg[*ri];
+        if (*pos < r->beg) *pos = r->beg;
+        if (*pos >= r->end) {
+            (*ri)++;
+            *pos = 0;
+            continue;
+        }
+        job->tid = r->tid;
+        job->beg = *pos;
+        job->end = r->end - *pos > pp->window ? *pos + pp->window : r->end;
+        *pos = job->end;
+        return 1;
+    }
+    return 0;
+}
+
+static int pplp_output(bam_pplp_t pp, pplp_job_t *job, bam_pplp_output_f output)
+{
+    if (job->ret < 0) {
+        hts_log_error("Pileup failed in %s:%d-%d",
+                      pp->hdr->target_name[job->tid], job->beg + 1, job->end);
+        return -1;
+    }
+    if (output && output(pp->data, &job->out, job->tid, job->beg, job->end) < 0)
+        return -1;
+    return 0;
+}
+
+int bam_pplp_run(bam_pplp_t pp, bam_pplp_column_f column,
+                 bam_pplp_output_f output, void *data)
+{
+    hts_tpool_process *q = NULL;
+    hts_tpool_result *res;
+    pplp_job_t *free_jobs = NULL, *job;
+    int ri = 0, n_flight = 0, max_flight, more = 1, ret = -1;
+    int64_t pos = 0;
+
+    pp->column = column;
+    pp->data = data;
+
+    if (!pp->pool) {
+        if (!(job = calloc(1, sizeof(*job))))
+            return -1;
+        job->pp = pp;
+        while (pplp_next_window(pp, &ri, &pos, job)) {
+            if (pplp_output(pp, pplp_window(job), output) < 0)
+                goto out;
+        }
+        ret = 0;
+        free_jobs = job;
+        goto out;
+    }
+
+    // Results are bounded by max_flight, so the queue never fills up
+    max_flight = 2 * hts_tpool_size(pp->pool);
+    if (!(q = hts_tpool_process_init(pp->pool, max_flight, 0)))
+        return -1;
+    for (;;) {
+        while (more && n_flight < max_flight) {
+            if ((job = free_jobs) != NULL)
+                free_jobs = job->next;
+            else if (!(job = calloc(1, sizeof(*job))))
+                goto out;
+            job->pp = pp;
+            if (!(more = pplp_next_window(pp, &ri, &pos, job))) {
+                job->next = free_jobs;
+                free_jobs = job;
+                break;
+            }
+            if (hts_tpool_dispatch(pp->pool, q, pplp_window, job) < 0) {
+                job->next = free_jobs;
+                free_jobs = job;
+                goto out;
+            }
+            n_flight++;
+        }
+        if (n_flight == 0)
+            break;
+        if (!(res = hts_tpool_next_result_wait(q)))
+            goto out;
+        job = hts_tpool_result_data(res);
+        hts_tpool_delete_result(res, 0);
+        n_flight--;
+        job->next = free_jobs;
+        free_jobs = job;
+        if (pplp_output(pp, job, output) < 0)
+            goto out;
+    }
+    ret = 0;
+
+ out:
+    if (q) {
+        // Let the jobs still running finish before they are freed
+        while (n_flight > 0 && (res = hts_tpool_next_result_wait(q)) != NULL) {
+            job = hts_tpool_result_data(res);
+            hts_tpool_delete_result(res, 0);
+            job->next = free_jobs;
+            free_jobs = job;
+            n_flight--;
+        }
+        hts_tpool_process_destroy(q);
+    }
+    while ((job = free_jobs) != NULL) {
+        free_jobs = job->next;
+        free(job->out.s);
+        free(job);
+    }
+    pp->column = NULL;
+    pp->data = NULL;
+    return ret;
+}
+
 #endif // ~!defined(BAM_NO_PILEUP)
@@ -0,0 +1,794 @@
+/*  sam_sort.c -- external merge sort of alignment records.
+
+    Copyright (C) 2019 Genome Research Ltd.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.  */
+
+/*
+ * Records are copied into a buffer until the memory budget is reached.
+ * The buffer is then sorted and written out as a run to a temporary BGZF
+ * file.  When a thread pool is supplied the budget is split between two
+ * buffers, so one can be sorted on the pool while the caller fills the
+ * other; the temporary files are compressed and, during the merge,
+ * decompressed by the same pool.
+ *
+ * Sorting works on an array of sort_elem_t, which hold a precomputed
+ * coordinate key.  Coordinate order is a plain LSD radix sort on that key.
+ * Name and tag order need string comparisons, so use a merge sort instead.
+ * Both are stable, and the final merge breaks ties by run number, so
+ * records that compare equal come out in the order they were added.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "htslib/sam_sort.h"
+#include "htslib/bgzf.h"
+#include "htslib/thread_pool.h"
+#include "htslib/kstring.h"
+#include "htslib/hts_log.h"
+#include "textutils_internal.h"
+
+#define SORT_DEFAULT_MEM ((size_t) 768 << 20)
+#define SORT_CHUNK_SIZE  (1 << 20)
+
+typedef struct {
+    uint64_t key;           // see sort_coord_key()
+    const uint8_t *tag;     // SAM_SORT_TAG value, or NULL if absent
+    bam1_t *b;
+} sort_elem_t;
+
+// A buffer of records waiting to be sorted.  Record data is stored in a
+// list of chunks, which are kept and reused after the buffer is written.
+typedef struct {
+    struct sam_sorter_t *s;
+    bam1_t *recs;
+    size_t n, m;
+    sort_elem_t *e, *tmp;   // both m long
+    uint8_t **chunk;
+    size_t *chunk_len;
+    int nchunk, mchunk, cur_chunk;
+    size_t chunk_used;
+    size_t mem;             // bytes counted against the budget
+} sort_buf_t;
+
+// One input to the final merge
+typedef struct {
+    BGZF *fp;               // temporary file, or NULL for an in-memory run
+    sort_buf_t *buf;        // in-memory run
+    size_t next;
+    bam1_t *b;              // current record of a file run
+    sort_elem_t e;          // current record
+} sort_run_t;
+
+struct sam_sorter_t {
+    sam_sort_opts opts;
+    int32_t n_targets;
+    size_t buf_mem;         // budget per buffer
+    sort_buf_t buf[2];
+    int cur;                // buffer being filled
+    int pending;            // buf[!cur] is being sorted on the pool
+    int file_threads;       // use the pool for temporary file I/O
+    hts_tpool_process *q;
+    char *prefix;
+    char **fn;              // temporary files, in the order written
+    int nfn, mfn;
+    sort_run_t *run;
+    int nrun;
+    int *heap, nheap;
+    int state;              // 0 adding, 1 merging, -1 failed
+};
+
+static pthread_mutex_t sort_serial_lock = PTHREAD_MUTEX_INITIALIZER;
+static int sort_serial = 0;
+
+/*
+ * Comparisons
+ */
+
+// Unmapped reads (tid -1) become 0xffffffff and so sort last
+static inline uint64_t sort_coord_key(const bam1_t *b)
+{
+    return (uint64_t)(uint32_t) b->core.tid << 32
+        | (uint64_t)(uint32_t)(b->core.pos + 1) << 1
+        | (bam_is_rev(b) ? 1 : 0);
+}
+
+static inline void sort_elem_init(const sam_sorter_t *s, sort_elem_t *e,
+                                  bam1_t *b)
+{
+    e->b = b;
+    e->key = sort_coord_key(b);
+    e->tag = s->opts.order == SAM_SORT_TAG ? bam_aux_get(b, s->opts.tag) : NULL;
+}
+
+// Compares names with embedded numbers in numeric order, as samtools does
+static int strnum_cmp(const char *a, const char *b)
+{
+    const char *pa = a, *pb = b;
+    while (*pa && *pb) {
+        if (isdigit_c(*pa) && isdigit_c(*pb)) {
+            while (*pa == '0') ++pa;
+            while (*pb == '0') ++pb;
+            while (isdigit_c(*pa) && isdigit_c(*pb) && *pa == *pb) ++pa, ++pb;
+            if (isdigit_c(*pa) && isdigit_c(*pb)) {
+                int i = 0;
+                while (isdigit_c(pa[i]) && isdigit_c(pb[i])) ++i;
+                return isdigit_c(pa[i]) ? 1 : isdigit_c(pb[i]) ? -1
+                    : (int) (unsigned char) *pa - (int) (unsigned char) *pb;
+            } else if (isdigit_c(*pa)) {
+                return 1;
+            } else if (isdigit_c(*pb)) {
+                return -1;
+            } else if (pa - a != pb - b) {
+                return pa - a < pb - b ? 1 : -1;
+            }
+        } else {
+            if (*pa != *pb)
+                return (int) (unsigned char) *pa - (int) (unsigned char) *pb;
+            ++pa; ++pb;
+        }
+    }
+    return *pa ? 1 : *pb ? -1 : 0;
+}
+
+static int sort_cmp_name(const sort_elem_t *a, const sort_elem_t *b)
+{
+    int t = strnum_cmp(bam_get_qname(a->b), bam_get_qname(b->b));
+    if (t) return t;
+    return (int) (a->b->core.flag & (BAM_FREAD1|BAM_FREAD2))
+        - (int) (b->b->core.flag & (BAM_FREAD1|BAM_FREAD2));
+}
+
+// Missing tags sort first, then numbers, then characters and strings
+static int sort_tag_class(const uint8_t *t)
+{
+    if (!t) return 0;
+    switch (*t) {
+    case 'c': case 'C': case 's': case 'S': case 'i': case 'I':
+    case 'f': case 'd':
+        return 1;
+    case 'A': case 'Z': case 'H':
+        return 2;
+    default:
+        return 3;
+    }
+}
+
+static int sort_cmp_tag(const sort_elem_t *a, const sort_elem_t *b)
+{
+    int ca = sort_tag_class(a->tag), cb = sort_tag_class(b->tag);
+    if (ca != cb) return ca < cb ? -1 : 1;
+    if (ca == 1) {
+        if (*a->tag == 'f' || *a->tag == 'd'
+            || *b->tag == 'f' || *b->tag == 'd') {
+            double x = bam_aux2f(a->tag), y = bam_aux2f(b->tag);
+            if (x != y) return x < y ? -1 : 1;
+        } else {
+            int64_t x = bam_aux2i(a->tag), y = bam_aux2i(b->tag);
+            if (x != y) return x < y ? -1 : 1;
+        }
+    } else if (ca == 2) {
+        const char *x = (const char *) a->tag + 1;
+        const char *y = (const char *) b->tag + 1;
+        size_t lx = *a->tag == 'A' ? 1 : strlen(x);
+        size_t ly = *b->tag == 'A' ? 1 : strlen(y);
+        int t = memcmp(x, y, lx < ly ? lx : ly);
+        if (t) return t;
+        if (lx != ly) return lx < ly ? -1 : 1;
+    }
+    return (a->key > b->key) - (a->key < b->key);
+}
+
+static inline int sort_cmp(const sam_sorter_t *s,
+                           const sort_elem_t *a, const sort_elem_t *b)
+{
+    switch (s->opts.order) {
+    case SAM_SORT_NAME: return sort_cmp_name(a, b);
+    case SAM_SORT_TAG:  return sort_cmp_tag(a, b);
+    default:            return (a->key > b->key) - (a->key < b->key);
+    }
+}
+
+/*
+ * In-memory sorting.  Both functions sort n elements of e using tmp as
+ * scratch space, and return whichever of the two holds the result.
+ */
+
+static sort_elem_t *sort_radix(sort_elem_t *e, sort_elem_t *tmp, size_t n)
+{
+    size_t count[8][256];
+    size_t i;
+    int d;
+
+    if (n < 2) return e;
+    memset(count, 0, sizeof(count));
+    for (i = 0; i < n; i++) {
+        uint64_t k = e[i].key;
+        for (d = 0; d < 8; d++)
+            count[d][(k >> (d * 8)) & 0xff]++;
+    }
+
+    for (d = 0; d < 8; d++) {
+        size_t *c = count[d], sum = 0, t;
+        sort_elem_t *swap;
+        int j;
+
+        // Skip digits that are the same for every key
+        if (c[(e[0].key >> (d * 8)) & 0xff] == n)
+            continue;
+        for (j = 0; j < 256; j++) {
+            t = c[j]; c[j] = sum; sum += t;
+        }
+        for (i = 0; i < n; i++)
+            tmp[c[(e[i].key >> (d * 8)) & 0xff]++] = e[i];
+        swap = e; e = tmp; tmp = swap;
+    }
+    return e;
+}
+
+static sort_elem_t *sort_merge(const sam_sorter_t *s, sort_elem_t *e,
+                               sort_elem_t *tmp, size_t n)
+{
+    const size_t ins = 16;
+    size_t i, j, w;
+
+    // Insertion sort short runs, then merge them bottom up
+    for (i = 0; i < n; i += ins) {
+        size_t end = i + ins < n ? i + ins : n;
+        for (j = i + 1; j < end; j++) {
+            sort_elem_t x = e[j];
+            size_t k = j;
+            while (k > i && sort_cmp(s, &e[k-1], &x) > 0) {
+                e[k] = e[k-1];
+                k--;
+            }
+            e[k] = x;
+        }
+    }
+
+    for (w = ins; w < n; w *= 2) {
+        sort_elem_t *swap;
+        for (i = 0; i < n; i += 2 * w) {
+            size_t mid = i + w < n ? i + w : n;
+            size_t hi = i + 2 * w < n ? i + 2 * w : n;
+            size_t x = i, y = mid, k = i;
+            while (x < mid && y < hi)
+                tmp[k++] = sort_cmp(s, &e[y], &e[x]) < 0 ? e[y++] : e[x++];
+            while (x < mid) tmp[k++] = e[x++];
+            while (y < hi)  tmp[k++] = e[y++];
+        }
+        swap = e; e = tmp; tmp = swap;
+    }
+    return e;
+}
+
+static void sort_buf_sort(sort_buf_t *buf)
+{
+    const sam_sorter_t *s = buf->s;
+    sort_elem_t *res;
+    size_t i;
+
+    for (i = 0; i < buf->n; i++)
+        sort_elem_init(s, &buf->e[i], &buf->recs[i]);
+
+    if (s->opts.order == SAM_SORT_COORD)
+        res = sort_radix(buf->e, buf->tmp, buf->n);
+    else
+        res = sort_merge(s, buf->e, buf->tmp, buf->n);
+
+    if (res != buf->e) {
+        buf->tmp = buf->e;
+        buf->e = res;
+    }
+}
+
+static void *sort_buf_job(void *arg)
+{
+    sort_buf_sort((sort_buf_t *) arg);
+    return arg;
+}
+
+/*
+ * Record buffers
+ */
+
+static inline size_t sort_rec_mem(const bam1_t *b)
+{
+    return sizeof(bam1_t) + 2 * sizeof(sort_elem_t)
+        + (((size_t) b->l_data + 7) & ~(size_t) 7);
+}
+
+static uint8_t *sort_buf_alloc(sort_buf_t *buf, size_t len)
+{
+    uint8_t *p;
+    size_t sz;
+
+    while (buf->cur_chunk < buf->nchunk) {
+        if (buf->chunk_used + len <= buf->chunk_len[buf->cur_chunk]) {
+            p = buf->chunk[buf->cur_chunk] + buf->chunk_used;
+            buf->chunk_used += len;
+            return p;
+        }
+        buf->cur_chunk++;
+        buf->chunk_used = 0;
+    }
+
+    if (buf->nchunk == buf->mchunk) {
+        int m = buf->mchunk ? buf->mchunk * 2 : 16;
+        uint8_t **c = realloc(buf->chunk, m * sizeof(*c));
+        size_t *l;
+        if (!c) return NULL;
+        buf->chunk = c;
+        l = realloc(buf->chunk_len, m * sizeof(*l));
+        if (!l) return NULL;
+        buf->chunk_len = l;
+        buf->mchunk = m;
+    }
+
+    sz = len > SORT_CHUNK_SIZE ? len : SORT_CHUNK_SIZE;
+    if (!(p = malloc(sz))) return NULL;
+    buf->chunk[buf->nchunk] = p;
+    buf->chunk_len[buf->nchunk] = sz;
+    buf->cur_chunk = buf->nchunk++;
+    buf->chunk_used = len;
+    return p;
+}
+
+static int sort_buf_add(sort_buf_t *buf, const bam1_t *b)
+{
+    size_t len = ((size_t) b->l_data + 7) & ~(size_t) 7;
+    bam1_t *r;
+    uint8_t *data;
+
+    if (buf->n == buf->m) {
+        size_t m = buf->m ? buf->m * 2 : 1024;
+        bam1_t *recs = realloc(buf->recs, m * sizeof(*recs));
+        sort_elem_t *e;
+        if (!recs) return -1;
+        buf->recs = recs;
+        if (!(e = realloc(buf->e, m * sizeof(*e)))) return -1;
+        buf->e = e;
+        if (!(e = realloc(buf->tmp, m * sizeof(*e)))) return -1;
+        buf->tmp = e;
+        buf->m = m;
+    }
+
+    if (!(data = sort_buf_alloc(buf, len ? len : 8))) return -1;
+    memcpy(data, b->data, b->l_data);
+    r = &buf->recs[buf->n++];
+    *r = *b;
+    r->data = data;
+    r->m_data = b->l_data;
+    buf->mem += sort_rec_mem(b);
+    return 0;
+}
+
+static void sort_buf_reset(sort_buf_t *buf)
+{
+    buf->n = 0;
+    buf->mem = 0;
+    buf->cur_chunk = 0;
+    buf->chunk_used = 0;
+}
+
+static void sort_buf_free(sort_buf_t *buf)
+{
+    int i;
+    for (i = 0; i < buf->nchunk; i++)
+        free(buf->chunk[i]);
+    free(buf->chunk);
+    free(buf->chunk_len);
+    free(buf->recs);
+    free(buf->e);
+    free(buf->tmp);
+}
+
+/*
+ * Temporary files.  These hold the in-memory form of each record rather
+ * than BAM, which saves converting in both directions.  They are only ever
+ * read back by the process that wrote them.
+ */
+
+static int sort_write_rec(BGZF *fp, const bam1_t *b)
+{
+    if (bgzf_write(fp, &b->core, sizeof(b->core)) != sizeof(b->core)
+        || bgzf_write(fp, &b->l_data, sizeof(b->l_data)) != sizeof(b->l_data)
+        || bgzf_write(fp, b->data, b->l_data) != b->l_data)
+        return -1;
+    return 0;
+}
+
+// Returns 0 on success, -1 at the end of the file, < -1 on error
+static int sort_read_rec(BGZF *fp, bam1_t *b)
+{
+    bam1_core_t c;
+    int l_data;
+    ssize_t r;
+
+    if ((r = bgzf_read(fp, &c, sizeof(c))) == 0)
+        return -1;
+    if (r != sizeof(c)
+        || bgzf_read(fp, &l_data, sizeof(l_data)) != sizeof(l_data)
+        || l_data < 0)
+        return -2;
+    if ((uint32_t) l_data > b->m_data) {
+        uint32_t m = l_data;
+        uint8_t *data;
+        kroundup32(m);
+        if (!(data = realloc(b->data, m))) return -2;
+        b->data = data;
+        b->m_data = m;
+    }
+    if (bgzf_read(fp, b->data, l_data) != l_data)
+        return -2;
+    b->core = c;
+    b->l_data = l_data;
+    b->data_gen++;
+    return 0;
+}
+
+// Writes a sorted buffer to a new temporary file, then empties it
+static int sort_spill(sam_sorter_t *s, sort_buf_t *buf)
+{
+    kstring_t fn = { 0, 0, NULL };
+    char mode[4] = "wx1";
+    BGZF *fp = NULL;
+    size_t i;
+
+    if (s->nfn == s->mfn) {
+        int m = s->mfn ? s->mfn * 2 : 16;
+        char **f = realloc(s->fn, m * sizeof(*f));
+        if (!f) return -1;
+        s->fn = f;
+        s->mfn = m;
+    }
+    if (ksprintf(&fn, "%s.%04d.tmp", s->prefix, s->nfn) < 0)
+        return -1;
+
+    mode[2] = '0' + s->opts.level;
+    if (!(fp = bgzf_open(fn.s, mode))) {
+        hts_log_error("Couldn't create temporary file \"%s\": %s",
+                      fn.s, strerror(errno));
+        free(fn.s);
+        return -1;
+    }
+    s->fn[s->nfn++] = fn.s;
+
+    if (s->file_threads
+        && bgzf_thread_pool(fp, s->opts.pool->pool, s->opts.pool->qsize) < 0)
+        goto fail;
+    for (i = 0; i < buf->n; i++)
+        if (sort_write_rec(fp, buf->e[i].b) < 0) goto fail;
+    if (bgzf_close(fp) < 0) {
+        fp = NULL;
+        goto fail;
+    }
+
+    sort_buf_reset(buf);
+    return 0;
+
+ fail:
+    hts_log_error("Failed to write temporary file \"%s\"", fn.s);
+    if (fp) bgzf_close(fp);
+    return -1;
+}
+
+// Waits for the sort of buf[!cur] on the thread pool to finish
+static int sort_wait(sam_sorter_t *s)
+{
+    hts_tpool_result *r = hts_tpool_next_result_wait(s->q);
+    if (!r) return -1;
+    hts_tpool_delete_result(r, 0);
+    s->pending = 0;
+    return 0;
+}
+
+// Called when the current buffer is full
+static int sort_flush(sam_sorter_t *s)
+{
+    sort_buf_t *buf = &s->buf[s->cur];
+
+    if (!s->q) {
+        sort_buf_sort(buf);
+        return sort_spill(s, buf);
+    }
+
+    if (s->pending) {
+        if (sort_wait(s) < 0 || sort_spill(s, &s->buf[!s->cur]) < 0)
+            return -1;
+    }
+    if (hts_tpool_dispatch(s->opts.pool->pool, s->q, sort_buf_job, buf) < 0)
+        return -1;
+    s->pending = 1;
+    s->cur = !s->cur;
+    return 0;
+}
+
+/*
+ * Merging
+ */
+
+static inline int sort_heap_lt(const sam_sorter_t *s, int a, int b)
+{
+    int t = sort_cmp(s, &s->run[a].e, &s->run[b].e);
+    return t < 0 || (t == 0 && a < b);
+}
+
+static void sort_heap_down(sam_sorter_t *s, int i)
+{
+    int *h = s->heap, n = s->nheap, x = h[i];
+    for (;;) {
+        int c = 2 * i + 1;
+        if (c >= n) break;
+        if (c + 1 < n && sort_heap_lt(s, h[c+1], h[c])) c++;
+        if (!sort_heap_lt(s, h[c], x)) break;
+        h[i] = h[c];
+        i = c;
+    }
+    h[i] = x;
+}
+
+// Moves a run on to its next record.  Returns as sort_read_rec().
+static int sort_run_next(sam_sorter_t *s, sort_run_t *r)
+{
+    int ret;
+
+    if (!r->fp) {
+        if (r->next >= r->buf->n) return -1;
+        r->e = r->buf->e[r->next++];
+        return 0;
+    }
+
+    if ((ret = sort_read_rec(r->fp, r->b)) < 0)
+        return ret;
+    sort_elem_init(s, &r->e, r->b);
+    return 0;
+}
+
+static int sort_add_run(sam_sorter_t *s, BGZF *fp, sort_buf_t *buf)
+{
+    sort_run_t *r = &s->run[s->nrun];
+    int ret;
+
+    r->fp = fp;
+    r->buf = buf;
+    r->next = 0;
+    if (fp && !(r->b = bam_init1())) {
+        bgzf_close(fp);
+        r->fp = NULL;
+        return -1;
+    }
+    s->nrun++;
+
+    if ((ret = sort_run_next(s, r)) < -1) return -1;
+    if (ret == 0) s->heap[s->nheap++] = s->nrun - 1;
+    return 0;
+}
+
+/*
+ * Public interface
+ */
+
+sam_sorter_t *sam_sorter_init(const bam_hdr_t *h, const sam_sort_opts *opts)
+{
+    sam_sorter_t *s;
+    kstring_t prefix = { 0, 0, NULL };
+    int serial;
+
+    if (opts->order == SAM_SORT_TAG && !(opts->tag[0] && opts->tag[1])) {
+        hts_log_error("No tag given for sorting by tag");
+        errno = EINVAL;
+        return NULL;
+    }
+    if (opts->order != SAM_SORT_COORD && opts->order != SAM_SORT_NAME
+        && opts->order != SAM_SORT_TAG) {
+        hts_log_error("Unknown sort order %d", (int) opts->order);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    if (!(s = calloc(1, sizeof(*s))))
+        return NULL;
+    s->opts = *opts;
+    if (!s->opts.max_mem) s->opts.max_mem = SORT_DEFAULT_MEM;
+    if (s->opts.level < 0) s->opts.level = 1;
+    if (s->opts.level > 9) s->opts.level = 9;
+    if (s->opts.pool && !s->opts.pool->pool) s->opts.pool = NULL;
+    s->n_targets = h ? h->n_targets : -1;
+    s->buf[0].s = s->buf[1].s = s;
+
+    if (s->opts.pool) {
+        s->q = hts_tpool_process_init(s->opts.pool->pool, 2, 0);
+        if (!s->q) goto fail;
+        s->buf_mem = s->opts.max_mem / 2;
+        // Starting BGZF threads costs more than they save on tiny runs
+        s->file_threads = s->buf_mem >= SORT_CHUNK_SIZE;
+    } else {
+        s->buf_mem = s->opts.max_mem;
+    }
+
+    pthread_mutex_lock(&sort_serial_lock);
+    serial = sort_serial++;
+    pthread_mutex_unlock(&sort_serial_lock);
+
+    if (s->opts.tmp_prefix) {
+        kputs(s->opts.tmp_prefix, &prefix);
+    } else {
+        const char *dir = getenv("TMPDIR");
+        ksprintf(&prefix, "%s/htslib-sort", dir && *dir ? dir : "/tmp");
+    }
+    if (ksprintf(&prefix, ".%d.%d", (int) getpid(), serial) < 0)
+        goto fail;
+    s->prefix = ks_release(&prefix);
+    s->opts.tmp_prefix = NULL;  // not owned; the copy is in s->prefix
+
+    return s;
+
+ fail:
+    free(prefix.s);
+    sam_sorter_destroy(s);
+    return NULL;
+}
+
+int sam_sorter_add(sam_sorter_t *s, const bam1_t *b)
+{
+    sort_buf_t *buf;
+
+    if (s->state != 0) {
+        if (s->state > 0)
+            hts_log_error("Records added after sam_sorter_finish()");
+        return -1;
+    }
+    if (b->core.tid < -1
+        || (s->n_targets >= 0 && b->core.tid >= s->n_targets)) {
+        hts_log_error("Record \"%s\" has invalid reference id %d",
+                      bam_get_qname(b), b->core.tid);
+        goto fail;
+    }
+
+    buf = &s->buf[s->cur];
+    if (buf->n > 0 && buf->mem + sort_rec_mem(b) > s->buf_mem) {
+        if (sort_flush(s) < 0) goto fail;
+        buf = &s->buf[s->cur];
+    }
+    if (sort_buf_add(buf, b) < 0) goto fail;
+    return 0;
+
+ fail:
+    s->state = -1;
+    return -1;
+}
+
+int sam_sorter_finish(sam_sorter_t *s)
+{
+    int had_pending = s->pending, i;
+
+    if (s->state != 0) return -1;
+
+    // Sort the last buffer here while any pending one finishes on the pool
+    sort_buf_sort(&s->buf[s->cur]);
+    if (s->pending && sort_wait(s) < 0) goto fail;
+
+    s->run = calloc(s->nfn + 2, sizeof(*s->run));
+    s->heap = malloc((s->nfn + 2) * sizeof(*s->heap));
+    if (!s->run || !s->heap) goto fail;
+
+    // Runs are numbered in the order their records were added
+    for (i = 0; i < s->nfn; i++) {
+        BGZF *fp = bgzf_open(s->fn[i], "r");
+        if (!fp) {
+            hts_log_error("Couldn't open temporary file \"%s\": %s",
+                          s->fn[i], strerror(errno));
+            goto fail;
+        }
+        if (s->file_threads
+            && bgzf_thread_pool(fp, s->opts.pool->pool,
+                                s->opts.pool->qsize) < 0) {
+            bgzf_close(fp);
+            goto fail;
+        }
+        if (sort_add_run(s, fp, NULL) < 0) {
+            hts_log_error("Failed to read temporary file \"%s\"", s->fn[i]);
+            goto fail;
+        }
+    }
+    if (had_pending && sort_add_run(s, NULL, &s->buf[!s->cur]) < 0)
+        goto fail;
+    if (sort_add_run(s, NULL, &s->buf[s->cur]) < 0)
+        goto fail;
+
+    for (i = s->nheap / 2 - 1; i >= 0; i--)
+        sort_heap_down(s, i);
+
+    s->state = 1;
+    return 0;
+
+ fail:
+    s->state = -1;
+    return -1;
+}
+
+int sam_sorter_next(sam_sorter_t *s, bam1_t *b)
+{
+    sort_run_t *r;
+    int ret;
+
+    if (s->state != 1) {
+        if (s->state == 0)
+            hts_log_error("Records requested before sam_sorter_finish()");
+        return -2;
+    }
+    if (s->nheap == 0)
+        return -1;
+
+    r = &s->run[s->heap[0]];
+    if (!bam_copy1(b, r->e.b))
+        goto fail;
+    if ((ret = sort_run_next(s, r)) < -1) {
+        hts_log_error("Failed to read temporary file");
+        goto fail;
+    }
+    if (ret == -1)
+        s->heap[0] = s->heap[--s->nheap];
+    if (s->nheap > 1)
+        sort_heap_down(s, 0);
+    return 0;
+
+ fail:
+    s->state = -1;
+    return -2;
+}
+
+void sam_sorter_destroy(sam_sorter_t *s)
+{
+    int i;
+
+    if (!s) return;
+
+    // The pool may still be using one of the buffers
+    if (s->pending) sort_wait(s);
+    if (s->q) hts_tpool_process_destroy(s->q);
+
+    for (i = 0; i < s->nrun; i++) {
+        if (s->run[i].fp) bgzf_close(s->run[i].fp);
+        if (s->run[i].b) bam_destroy1(s->run[i].b);
+    }
+    free(s->run);
+    free(s->heap);
+
+    for (i = 0; i < s->nfn; i++) {
+        if (unlink(s->fn[i]) < 0)
+            hts_log_warning("Couldn't remove temporary file \"%s\": %s",
+                            s->fn[i], strerror(errno));
+        free(s->fn[i]);
+    }
+    free(s->fn);
+    free(s->prefix);
+
+    sort_buf_free(&s->buf[0]);
+    sort_buf_free(&s->buf[1]);
+    free(s);
+}
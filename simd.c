@@ -0,0 +1,778 @@
+/*  simd.c -- vectorised sequence and quality conversion kernels.
+
+    Copyright (C) 2019 Genome Research Ltd.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.  */
+
+/*
+ * Each kernel has a portable C version and, where the compiler allows it,
+ * SSSE3 and AVX2 versions on x86 (built with target attributes so the rest
+ * of the library does not need special compiler flags) and a NEON version
+ * on 64-bit ARM.  The x86 versions are chosen at run time with
+ * __builtin_cpu_supports().
+ *
+ * The vector code relies on 16 entry table lookups (pshufb / tbl).  Packing
+ * converts characters with seq_nt16_table, which only has interesting values
+ * in the 0x30-0x7f range with the lower and upper case rows being the same,
+ * so it can be done with three such lookups.  This is checked when the
+ * tables are built and the portable code is used if it no longer holds.
+ */
+
+#include <config.h>
+
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "htslib/hts.h"
+#include "htslib/hts_endian.h"
+#include "simd_internal.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) \
+    && ((defined(__clang__) && __clang_major__ >= 4) \
+        || (!defined(__clang__) && defined(__GNUC__) && __GNUC__ >= 5))
+#define HTS_BUILD_X86_SIMD 1
+#include <immintrin.h>
+#endif
+
+#if defined(__aarch64__) && defined(__ARM_NEON)
+#define HTS_BUILD_NEON 1
+#include <arm_neon.h>
+#endif
+
+// Nibble bit-reversal, which is also the nt16 complement
+static const uint8_t nt16_comp[16] = {
+    0, 8, 4, 12, 2, 10, 6, 14, 1, 9, 5, 13, 3, 11, 7, 15
+};
+
+// seq_nt16_table rows for characters 0x30-0x3f, 0x40-0x4f and 0x50-0x5f
+static uint8_t pack_lut[3][16];
+static int pack_lut_ok;
+
+/* ---------------------------------------------------------------------- */
+/* Portable versions */
+
+static void nibble_unpack_c(const uint8_t *nib, char *out, size_t len,
+                            const char lut[16]) {
+    size_t i, len2 = len / 2;
+
+    for (i = 0; i < len2; i++) {
+        uint8_t b = nib[i];
+        out[i*2+0] = lut[b >> 4];
+        out[i*2+1] = lut[b & 0xf];
+    }
+    if (len & 1)
+        out[i*2] = lut[nib[i] >> 4];
+}
+
+static void nibble_pack_c(const char *seq, uint8_t *nib, size_t len) {
+    const uint8_t *s = (const uint8_t *)seq;
+    size_t i, len2 = len & ~(size_t)1;
+
+    for (i = 0; i < len2; i += 2)
+        nib[i>>1] = (seq_nt16_table[s[i]] << 4) | seq_nt16_table[s[i+1]];
+    if (len & 1)
+        nib[i>>1] = seq_nt16_table[s[i]] << 4;
+}
+
+static void nibble_revcomp_c(const uint8_t *nib, uint8_t *out, size_t len) {
+    size_t i, nb = (len + 1) / 2;
+
+    for (i = 0; i < nb; i++) {
+        uint8_t b = nib[nb - 1 - i];
+        out[i] = (nt16_comp[b & 0xf] << 4) | nt16_comp[b >> 4];
+    }
+}
+
+// Fixes up the reversal of an odd length sequence, which leaves the
+// padding nibble at the start.
+static void nibble_revcomp_shift(uint8_t *out, size_t len) {
+    size_t i, nb = (len + 1) / 2;
+
+    if (!(len & 1))
+        return;
+    for (i = 0; i + 1 < nb; i++)
+        out[i] = (out[i] << 4) | (out[i+1] >> 4);
+    out[i] <<= 4;
+}
+
+static void nibble_revcomp_c_full(const uint8_t *nib, uint8_t *out,
+                                  size_t len) {
+    nibble_revcomp_c(nib, out, len);
+    nibble_revcomp_shift(out, len);
+}
+
+static void qual_add_c(char *out, const uint8_t *qual, size_t len,
+                       uint8_t offset) {
+    size_t i;
+    for (i = 0; i < len; i++)
+        out[i] = qual[i] + offset;
+}
+
+static int qual_sub_c(uint8_t *out, const char *str, size_t len,
+                      uint8_t offset) {
+    size_t i = 0;
+    uint8_t uflow = 0;
+
+#if HTS_ALLOW_UNALIGNED != 0
+    // Eight at a time; there is no borrow between bytes as long as no
+    // byte underflows, and if one does the top bit check catches it.
+    const uint64_u *from8 = (const uint64_u *)str;
+    uint64_u *to8 = (uint64_u *)out;
+    uint64_t uflow8 = 0;
+    for (; i < len / 8; i++) {
+        to8[i] = from8[i] - offset * 0x0101010101010101ULL;
+        uflow8 |= to8[i];
+    }
+    if (uflow8 & 0x8080808080808080ULL)
+        uflow = 0x80;
+    i *= 8;
+#endif
+
+    for (; i < len; i++) {
+        out[i] = str[i] - offset;
+        uflow |= out[i];
+    }
+
+    return (uflow & 0x80) != 0;
+}
+
+// 0.8 * q rounded down is (q * 205) >> 8 for all 8-bit q
+static void qual_overlap_c(uint8_t *a_qual, uint8_t *b_qual,
+                           const uint8_t *a_base, const uint8_t *b_base,
+                           size_t len) {
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        unsigned int qa = a_qual[i], qb = b_qual[i];
+        if (a_base[i] == b_base[i]) {
+            a_qual[i] = qa + qb > 200 ? 200 : qa + qb;
+            b_qual[i] = 0;
+        } else if (qa >= qb) {
+            a_qual[i] = (qa * 205) >> 8;
+            b_qual[i] = 0;
+        } else {
+            a_qual[i] = 0;
+            b_qual[i] = (qb * 205) >> 8;
+        }
+    }
+}
+
+/* ---------------------------------------------------------------------- */
+/* x86 SSSE3 and AVX2 versions */
+
+#ifdef HTS_BUILD_X86_SIMD
+
+__attribute__((target("ssse3")))
+static void nibble_unpack_ssse3(const uint8_t *nib, char *out, size_t len,
+                                const char lut[16]) {
+    const __m128i t = _mm_loadu_si128((const __m128i *)lut);
+    const __m128i m = _mm_set1_epi8(0x0f);
+    size_t i, n = len / 32;
+
+    for (i = 0; i < n; i++) {
+        __m128i v  = _mm_loadu_si128((const __m128i *)(nib + i*16));
+        __m128i hi = _mm_shuffle_epi8(t, _mm_and_si128(_mm_srli_epi16(v, 4), m));
+        __m128i lo = _mm_shuffle_epi8(t, _mm_and_si128(v, m));
+        _mm_storeu_si128((__m128i *)(out + i*32),      _mm_unpacklo_epi8(hi, lo));
+        _mm_storeu_si128((__m128i *)(out + i*32 + 16), _mm_unpackhi_epi8(hi, lo));
+    }
+    nibble_unpack_c(nib + n*16, out + n*32, len - n*32, lut);
+}
+
+// Converts 16 characters to nt16 codes, one per byte.
+__attribute__((target("ssse3")))
+static inline __m128i nt16_codes_ssse3(__m128i v, __m128i l3, __m128i l4,
+                                       __m128i l5) {
+    const __m128i m = _mm_set1_epi8(0x0f);
+    __m128i lo = _mm_and_si128(v, m);
+    __m128i hi = _mm_and_si128(_mm_srli_epi16(v, 4), m);
+    __m128i hs = _mm_and_si128(hi, _mm_set1_epi8(0x0d)); // fold lower case
+    __m128i s3 = _mm_cmpeq_epi8(hi, _mm_set1_epi8(3));
+    __m128i s4 = _mm_cmpeq_epi8(hs, _mm_set1_epi8(4));
+    __m128i s5 = _mm_cmpeq_epi8(hs, _mm_set1_epi8(5));
+    __m128i r  = _mm_andnot_si128(_mm_or_si128(s3, _mm_or_si128(s4, s5)),
+                                  _mm_set1_epi8(15));
+    r = _mm_or_si128(r, _mm_and_si128(s3, _mm_shuffle_epi8(l3, lo)));
+    r = _mm_or_si128(r, _mm_and_si128(s4, _mm_shuffle_epi8(l4, lo)));
+    r = _mm_or_si128(r, _mm_and_si128(s5, _mm_shuffle_epi8(l5, lo)));
+    return r;
+}
+
+__attribute__((target("ssse3")))
+static void nibble_pack_ssse3(const char *seq, uint8_t *nib, size_t len) {
+    const __m128i l3 = _mm_loadu_si128((const __m128i *)pack_lut[0]);
+    const __m128i l4 = _mm_loadu_si128((const __m128i *)pack_lut[1]);
+    const __m128i l5 = _mm_loadu_si128((const __m128i *)pack_lut[2]);
+    const __m128i w  = _mm_set1_epi16(0x0110); // first * 16 + second
+    size_t i, n = len / 32;
+
+    for (i = 0; i < n; i++) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(seq + i*32));
+        __m128i b = _mm_loadu_si128((const __m128i *)(seq + i*32 + 16));
+        a = _mm_maddubs_epi16(nt16_codes_ssse3(a, l3, l4, l5), w);
+        b = _mm_maddubs_epi16(nt16_codes_ssse3(b, l3, l4, l5), w);
+        _mm_storeu_si128((__m128i *)(nib + i*16), _mm_packus_epi16(a, b));
+    }
+    nibble_pack_c(seq + n*32, nib + n*16, len - n*32);
+}
+
+__attribute__((target("ssse3")))
+static void nibble_revcomp_ssse3(const uint8_t *nib, uint8_t *out,
+                                 size_t len) {
+    const __m128i t = _mm_loadu_si128((const __m128i *)nt16_comp);
+    const __m128i m = _mm_set1_epi8(0x0f);
+    const __m128i rev = _mm_setr_epi8(15, 14, 13, 12, 11, 10, 9, 8,
+                                      7, 6, 5, 4, 3, 2, 1, 0);
+    size_t i, nb = (len + 1) / 2, n = nb / 16;
+
+    for (i = 0; i < n; i++) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(nib + nb - (i+1)*16));
+        v = _mm_shuffle_epi8(v, rev);
+        __m128i lo = _mm_shuffle_epi8(t, _mm_and_si128(v, m));
+        __m128i hi = _mm_shuffle_epi8(t, _mm_and_si128(_mm_srli_epi16(v, 4), m));
+        _mm_storeu_si128((__m128i *)(out + i*16),
+                         _mm_or_si128(_mm_slli_epi16(lo, 4), hi));
+    }
+    // Remaining bytes are at the start of the input
+    nibble_revcomp_c(nib, out + n*16, (nb - n*16) * 2);
+    nibble_revcomp_shift(out, len);
+}
+
+__attribute__((target("ssse3")))
+static void qual_add_ssse3(char *out, const uint8_t *qual, size_t len,
+                           uint8_t offset) {
+    const __m128i o = _mm_set1_epi8(offset);
+    size_t i, n = len / 16;
+
+    for (i = 0; i < n; i++) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(qual + i*16));
+        _mm_storeu_si128((__m128i *)(out + i*16), _mm_add_epi8(v, o));
+    }
+    qual_add_c(out + n*16, qual + n*16, len - n*16, offset);
+}
+
+__attribute__((target("ssse3")))
+static int qual_sub_ssse3(uint8_t *out, const char *str, size_t len,
+                          uint8_t offset) {
+    const __m128i o = _mm_set1_epi8(offset);
+    __m128i uflow = _mm_setzero_si128();
+    size_t i, n = len / 16;
+
+    for (i = 0; i < n; i++) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(str + i*16));
+        v = _mm_sub_epi8(v, o);
+        uflow = _mm_or_si128(uflow, v);
+        _mm_storeu_si128((__m128i *)(out + i*16), v);
+    }
+    return _mm_movemask_epi8(uflow)
+        | qual_sub_c(out + n*16, str + n*16, len - n*16, offset);
+}
+
+__attribute__((target("ssse3")))
+static void qual_overlap_ssse3(uint8_t *a_qual, uint8_t *b_qual,
+                               const uint8_t *a_base, const uint8_t *b_base,
+                               size_t len) {
+    const __m128i cap = _mm_set1_epi8((char) 200);
+    const __m128i k = _mm_set1_epi16(205);
+    const __m128i z = _mm_setzero_si128();
+    size_t i, n = len / 16;
+
+    for (i = 0; i < n; i++) {
+        __m128i qa = _mm_loadu_si128((const __m128i *)(a_qual + i*16));
+        __m128i qb = _mm_loadu_si128((const __m128i *)(b_qual + i*16));
+        __m128i eq = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(a_base + i*16)),
+                                    _mm_loadu_si128((const __m128i *)(b_base + i*16)));
+        __m128i mx = _mm_max_epu8(qa, qb);
+        __m128i ge = _mm_cmpeq_epi8(mx, qa);
+        __m128i sum = _mm_min_epu8(_mm_adds_epu8(qa, qb), cap);
+        // 0.8 times the larger quality, for a mismatch
+        __m128i lo = _mm_srli_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(mx, z), k), 8);
+        __m128i hi = _mm_srli_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(mx, z), k), 8);
+        __m128i d = _mm_packus_epi16(lo, hi);
+        _mm_storeu_si128((__m128i *)(a_qual + i*16),
+                         _mm_or_si128(_mm_and_si128(eq, sum),
+                                      _mm_andnot_si128(eq, _mm_and_si128(ge, d))));
+        _mm_storeu_si128((__m128i *)(b_qual + i*16),
+                         _mm_andnot_si128(_mm_or_si128(eq, ge), d));
+    }
+    qual_overlap_c(a_qual + n*16, b_qual + n*16, a_base + n*16, b_base + n*16,
+                   len - n*16);
+}
+
+__attribute__((target("avx2")))
+static void nibble_unpack_avx2(const uint8_t *nib, char *out, size_t len,
+                               const char lut[16]) {
+    const __m256i t = _mm256_broadcastsi128_si256(
+        _mm_loadu_si128((const __m128i *)lut));
+    const __m256i m = _mm256_set1_epi8(0x0f);
+    size_t i, n = len / 64;
+
+    for (i = 0; i < n; i++) {
+        __m256i v  = _mm256_loadu_si256((const __m256i *)(nib + i*32));
+        __m256i hi = _mm256_shuffle_epi8(t, _mm256_and_si256(_mm256_srli_epi16(v, 4), m));
+        __m256i lo = _mm256_shuffle_epi8(t, _mm256_and_si256(v, m));
+        // Interleaving works within 128-bit lanes, so put them back in order
+        __m256i a  = _mm256_unpacklo_epi8(hi, lo);
+        __m256i b  = _mm256_unpackhi_epi8(hi, lo);
+        _mm256_storeu_si256((__m256i *)(out + i*64),
+                            _mm256_permute2x128_si256(a, b, 0x20));
+        _mm256_storeu_si256((__m256i *)(out + i*64 + 32),
+                            _mm256_permute2x128_si256(a, b, 0x31));
+    }
+    nibble_unpack_ssse3(nib + n*32, out + n*64, len - n*64, lut);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i nt16_codes_avx2(__m256i v, __m256i l3, __m256i l4,
+                                      __m256i l5) {
+    const __m256i m = _mm256_set1_epi8(0x0f);
+    __m256i lo = _mm256_and_si256(v, m);
+    __m256i hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), m);
+    __m256i hs = _mm256_and_si256(hi, _mm256_set1_epi8(0x0d));
+    __m256i s3 = _mm256_cmpeq_epi8(hi, _mm256_set1_epi8(3));
+    __m256i s4 = _mm256_cmpeq_epi8(hs, _mm256_set1_epi8(4));
+    __m256i s5 = _mm256_cmpeq_epi8(hs, _mm256_set1_epi8(5));
+    __m256i r  = _mm256_andnot_si256(_mm256_or_si256(s3, _mm256_or_si256(s4, s5)),
+                                     _mm256_set1_epi8(15));
+    r = _mm256_or_si256(r, _mm256_and_si256(s3, _mm256_shuffle_epi8(l3, lo)));
+    r = _mm256_or_si256(r, _mm256_and_si256(s4, _mm256_shuffle_epi8(l4, lo)));
+    r = _mm256_or_si256(r, _mm256_and_si256(s5, _mm256_shuffle_epi8(l5, lo)));
+    return r;
+}
+
+__attribute__((target("avx2")))
+static void nibble_pack_avx2(const char *seq, uint8_t *nib, size_t len) {
+    const __m256i l3 = _mm256_broadcastsi128_si256(
+        _mm_loadu_si128((const __m128i *)pack_lut[0]));
+    const __m256i l4 = _mm256_broadcastsi128_si256(
+        _mm_loadu_si128((const __m128i *)pack_lut[1]));
+    const __m256i l5 = _mm256_broadcastsi128_si256(
+        _mm_loadu_si128((const __m128i *)pack_lut[2]));
+    const __m256i w  = _mm256_set1_epi16(0x0110);
+    size_t i, n = len / 64;
+
+    for (i = 0; i < n; i++) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(seq + i*64));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(seq + i*64 + 32));
+        a = _mm256_maddubs_epi16(nt16_codes_avx2(a, l3, l4, l5), w);
+        b = _mm256_maddubs_epi16(nt16_codes_avx2(b, l3, l4, l5), w);
+        // packus also works per lane, giving 64-bit blocks a0 b0 a1 b1
+        _mm256_storeu_si256((__m256i *)(nib + i*32),
+                            _mm256_permute4x64_epi64(_mm256_packus_epi16(a, b),
+                                                     0xd8));
+    }
+    nibble_pack_ssse3(seq + n*64, nib + n*32, len - n*64);
+}
+
+__attribute__((target("avx2")))
+static void nibble_revcomp_avx2(const uint8_t *nib, uint8_t *out,
+                                size_t len) {
+    const __m256i t = _mm256_broadcastsi128_si256(
+        _mm_loadu_si128((const __m128i *)nt16_comp));
+    const __m256i m = _mm256_set1_epi8(0x0f);
+    const __m256i rev = _mm256_setr_epi8(15, 14, 13, 12, 11, 10, 9, 8,
+                                         7, 6, 5, 4, 3, 2, 1, 0,
+                                         15, 14, 13, 12, 11, 10, 9, 8,
+                                         7, 6, 5, 4, 3, 2, 1, 0);
+    size_t i, nb = (len + 1) / 2, n = nb / 32;
+
+    for (i = 0; i < n; i++) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(nib + nb - (i+1)*32));
+        v = _mm256_shuffle_epi8(v, rev);
+        v = _mm256_permute2x128_si256(v, v, 0x01);
+        __m256i lo = _mm256_shuffle_epi8(t, _mm256_and_si256(v, m));
+        __m256i hi = _mm256_shuffle_epi8(t, _mm256_and_si256(_mm256_srli_epi16(v, 4), m));
+        _mm256_storeu_si256((__m256i *)(out + i*32),
+                            _mm256_or_si256(_mm256_slli_epi16(lo, 4), hi));
+    }
+    nibble_revcomp_c(nib, out + n*32, (nb - n*32) * 2);
+    nibble_revcomp_shift(out, len);
+}
+
+__attribute__((target("avx2")))
+static void qual_add_avx2(char *out, const uint8_t *qual, size_t len,
+                          uint8_t offset) {
+    const __m256i o = _mm256_set1_epi8(offset);
+    size_t i, n = len / 32;
+
+    for (i = 0; i < n; i++) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(qual + i*32));
+        _mm256_storeu_si256((__m256i *)(out + i*32), _mm256_add_epi8(v, o));
+    }
+    qual_add_c(out + n*32, qual + n*32, len - n*32, offset);
+}
+
+__attribute__((target("avx2")))
+static int qual_sub_avx2(uint8_t *out, const char *str, size_t len,
+                         uint8_t offset) {
+    const __m256i o = _mm256_set1_epi8(offset);
+    __m256i uflow = _mm256_setzero_si256();
+    size_t i, n = len / 32;
+
+    for (i = 0; i < n; i++) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(str + i*32));
+        v = _mm256_sub_epi8(v, o);
+        uflow = _mm256_or_si256(uflow, v);
+        _mm256_storeu_si256((__m256i *)(out + i*32), v);
+    }
+    return _mm256_movemask_epi8(uflow)
+        | qual_sub_c(out + n*32, str + n*32, len - n*32, offset);
+}
+
+__attribute__((target("avx2")))
+static void qual_overlap_avx2(uint8_t *a_qual, uint8_t *b_qual,
+                              const uint8_t *a_base, const uint8_t *b_base,
+                              size_t len) {
+    const __m256i cap = _mm256_set1_epi8((char) 200);
+    const __m256i k = _mm256_set1_epi16(205);
+    const __m256i z = _mm256_setzero_si256();
+    size_t i, n = len / 32;
+
+    for (i = 0; i < n; i++) {
+        __m256i qa = _mm256_loadu_si256((const __m256i *)(a_qual + i*32));
+        __m256i qb = _mm256_loadu_si256((const __m256i *)(b_qual + i*32));
+        __m256i eq = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(a_base + i*32)),
+                                       _mm256_loadu_si256((const __m256i *)(b_base + i*32)));
+        __m256i mx = _mm256_max_epu8(qa, qb);
+        __m256i ge = _mm256_cmpeq_epi8(mx, qa);
+        __m256i sum = _mm256_min_epu8(_mm256_adds_epu8(qa, qb), cap);
+        // The unpacks and pack work within each 128-bit lane, so cancel out
+        __m256i lo = _mm256_srli_epi16(_mm256_mullo_epi16(_mm256_unpacklo_epi8(mx, z), k), 8);
+        __m256i hi = _mm256_srli_epi16(_mm256_mullo_epi16(_mm256_unpackhi_epi8(mx, z), k), 8);
+        __m256i d = _mm256_packus_epi16(lo, hi);
+        _mm256_storeu_si256((__m256i *)(a_qual + i*32),
+                            _mm256_or_si256(_mm256_and_si256(eq, sum),
+                                            _mm256_andnot_si256(eq, _mm256_and_si256(ge, d))));
+        _mm256_storeu_si256((__m256i *)(b_qual + i*32),
+                            _mm256_andnot_si256(_mm256_or_si256(eq, ge), d));
+    }
+    qual_overlap_c(a_qual + n*32, b_qual + n*32, a_base + n*32, b_base + n*32,
+                   len - n*32);
+}
+
+#endif // HTS_BUILD_X86_SIMD
+
+/* ---------------------------------------------------------------------- */
+/* ARM NEON versions */
+
+#ifdef HTS_BUILD_NEON
+
+static void nibble_unpack_neon(const uint8_t *nib, char *out, size_t len,
+                               const char lut[16]) {
+    const uint8x16_t t = vld1q_u8((const uint8_t *)lut);
+    const uint8x16_t m = vdupq_n_u8(0x0f);
+    size_t i, n = len / 32;
+
+    for (i = 0; i < n; i++) {
+        uint8x16_t v = vld1q_u8(nib + i*16);
+        uint8x16x2_t r;
+        r.val[0] = vqtbl1q_u8(t, vshrq_n_u8(v, 4));
+        r.val[1] = vqtbl1q_u8(t, vandq_u8(v, m));
+        vst2q_u8((uint8_t *)out + i*32, r); // stores interleaved
+    }
+    nibble_unpack_c(nib + n*16, out + n*32, len - n*32, lut);
+}
+
+static inline uint8x16_t nt16_codes_neon(uint8x16_t v, uint8x16_t l3,
+                                         uint8x16_t l4, uint8x16_t l5) {
+    uint8x16_t lo = vandq_u8(v, vdupq_n_u8(0x0f));
+    uint8x16_t hi = vshrq_n_u8(v, 4);
+    uint8x16_t hs = vandq_u8(hi, vdupq_n_u8(0x0d));
+    uint8x16_t r  = vdupq_n_u8(15);
+    r = vbslq_u8(vceqq_u8(hi, vdupq_n_u8(3)), vqtbl1q_u8(l3, lo), r);
+    r = vbslq_u8(vceqq_u8(hs, vdupq_n_u8(4)), vqtbl1q_u8(l4, lo), r);
+    r = vbslq_u8(vceqq_u8(hs, vdupq_n_u8(5)), vqtbl1q_u8(l5, lo), r);
+    return r;
+}
+
+static void nibble_pack_neon(const char *seq, uint8_t *nib, size_t len) {
+    const uint8x16_t l3 = vld1q_u8(pack_lut[0]);
+    const uint8x16_t l4 = vld1q_u8(pack_lut[1]);
+    const uint8x16_t l5 = vld1q_u8(pack_lut[2]);
+    size_t i, n = len / 32;
+
+    for (i = 0; i < n; i++) {
+        // Loads even characters into val[0] and odd ones into val[1]
+        uint8x16x2_t v = vld2q_u8((const uint8_t *)seq + i*32);
+        uint8x16_t a = nt16_codes_neon(v.val[0], l3, l4, l5);
+        uint8x16_t b = nt16_codes_neon(v.val[1], l3, l4, l5);
+        vst1q_u8(nib + i*16, vorrq_u8(vshlq_n_u8(a, 4), b));
+    }
+    nibble_pack_c(seq + n*32, nib + n*16, len - n*32);
+}
+
+static void nibble_revcomp_neon(const uint8_t *nib, uint8_t *out,
+                                size_t len) {
+    size_t i, nb = (len + 1) / 2, n = nb / 16;
+
+    for (i = 0; i < n; i++) {
+        uint8x16_t v = vld1q_u8(nib + nb - (i+1)*16);
+        v = vrev64q_u8(v);
+        v = vextq_u8(v, v, 8);
+        // Reversing all the bits swaps the nibbles and complements them
+        vst1q_u8(out + i*16, vrbitq_u8(v));
+    }
+    nibble_revcomp_c(nib, out + n*16, (nb - n*16) * 2);
+    nibble_revcomp_shift(out, len);
+}
+
+static void qual_add_neon(char *out, const uint8_t *qual, size_t len,
+                          uint8_t offset) {
+    const uint8x16_t o = vdupq_n_u8(offset);
+    size_t i, n = len / 16;
+
+    for (i = 0; i < n; i++)
+        vst1q_u8((uint8_t *)out + i*16, vaddq_u8(vld1q_u8(qual + i*16), o));
+    qual_add_c(out + n*16, qual + n*16, len - n*16, offset);
+}
+
+static int qual_sub_neon(uint8_t *out, const char *str, size_t len,
+                         uint8_t offset) {
+    const uint8x16_t o = vdupq_n_u8(offset);
+    uint8x16_t uflow = vdupq_n_u8(0);
+    size_t i, n = len / 16;
+
+    for (i = 0; i < n; i++) {
+        uint8x16_t v = vsubq_u8(vld1q_u8((const uint8_t *)str + i*16), o);
+        uflow = vorrq_u8(uflow, v);
+        vst1q_u8(out + i*16, v);
+    }
+    return (vmaxvq_u8(uflow) & 0x80)
+        | qual_sub_c(out + n*16, str + n*16, len - n*16, offset);
+}
+
+static void qual_overlap_neon(uint8_t *a_qual, uint8_t *b_qual,
+                              const uint8_t *a_base, const uint8_t *b_base,
+                              size_t len) {
+    const uint8x16_t cap = vdupq_n_u8(200);
+    const uint8x8_t k = vdup_n_u8(205);
+    size_t i, n = len / 16;
+
+    for (i = 0; i < n; i++) {
+        uint8x16_t qa = vld1q_u8(a_qual + i*16);
+        uint8x16_t qb = vld1q_u8(b_qual + i*16);
+        uint8x16_t eq = vceqq_u8(vld1q_u8(a_base + i*16), vld1q_u8(b_base + i*16));
+        uint8x16_t ge = vcgeq_u8(qa, qb);
+        uint8x16_t mx = vmaxq_u8(qa, qb);
+        uint8x16_t sum = vminq_u8(vqaddq_u8(qa, qb), cap);
+        uint8x16_t d = vcombine_u8(vshrn_n_u16(vmull_u8(vget_low_u8(mx), k), 8),
+                                   vshrn_n_u16(vmull_u8(vget_high_u8(mx), k), 8));
+        vst1q_u8(a_qual + i*16, vbslq_u8(eq, sum, vandq_u8(ge, d)));
+        vst1q_u8(b_qual + i*16, vbicq_u8(d, vorrq_u8(eq, ge)));
+    }
+    qual_overlap_c(a_qual + n*16, b_qual + n*16, a_base + n*16, b_base + n*16,
+                   len - n*16);
+}
+
+#endif // HTS_BUILD_NEON
+
+/* ---------------------------------------------------------------------- */
+/* Selection */
+
+static void nibble_unpack_init(const uint8_t *nib, char *out, size_t len,
+                               const char lut[16]);
+static void nibble_pack_init(const char *seq, uint8_t *nib, size_t len);
+static void nibble_revcomp_init(const uint8_t *nib, uint8_t *out, size_t len);
+static void qual_add_init(char *out, const uint8_t *qual, size_t len,
+                          uint8_t offset);
+static int qual_sub_init(uint8_t *out, const char *str, size_t len,
+                         uint8_t offset);
+static void qual_overlap_init(uint8_t *a_qual, uint8_t *b_qual,
+                              const uint8_t *a_base, const uint8_t *b_base,
+                              size_t len);
+
+void (*hts_nibble_unpack)(const uint8_t *nib, char *out, size_t len,
+                          const char lut[16]) = nibble_unpack_init;
+void (*hts_nibble_pack)(const char *seq, uint8_t *nib, size_t len)
+    = nibble_pack_init;
+void (*hts_nibble_revcomp)(const uint8_t *nib, uint8_t *out, size_t len)
+    = nibble_revcomp_init;
+void (*hts_qual_add)(char *out, const uint8_t *qual, size_t len,
+                     uint8_t offset) = qual_add_init;
+int (*hts_qual_sub)(uint8_t *out, const char *str, size_t len,
+                    uint8_t offset) = qual_sub_init;
+void (*hts_qual_overlap)(uint8_t *a_qual, uint8_t *b_qual,
+                         const uint8_t *a_base, const uint8_t *b_base,
+                         size_t len) = qual_overlap_init;
+
+static pthread_once_t simd_once = PTHREAD_ONCE_INIT;
+static enum hts_simd_level simd_level = HTS_SIMD_NONE;
+
+int hts_simd_supported(enum hts_simd_level level) {
+    switch (level) {
+    case HTS_SIMD_NONE:
+        return 1;
+#ifdef HTS_BUILD_X86_SIMD
+    case HTS_SIMD_SSSE3:
+        return __builtin_cpu_supports("ssse3");
+    case HTS_SIMD_AVX2:
+        return __builtin_cpu_supports("avx2");
+#endif
+#ifdef HTS_BUILD_NEON
+    case HTS_SIMD_NEON:
+        return 1;
+#endif
+    default:
+        return 0;
+    }
+}
+
+static void simd_select(enum hts_simd_level level) {
+    void (*unpack)(const uint8_t *, char *, size_t, const char *)
+        = nibble_unpack_c;
+    void (*pack)(const char *, uint8_t *, size_t) = nibble_pack_c;
+    void (*revcomp)(const uint8_t *, uint8_t *, size_t)
+        = nibble_revcomp_c_full;
+    void (*qadd)(char *, const uint8_t *, size_t, uint8_t) = qual_add_c;
+    int (*qsub)(uint8_t *, const char *, size_t, uint8_t) = qual_sub_c;
+    void (*qolap)(uint8_t *, uint8_t *, const uint8_t *, const uint8_t *,
+                  size_t) = qual_overlap_c;
+
+    switch (level) {
+#ifdef HTS_BUILD_X86_SIMD
+    case HTS_SIMD_SSSE3:
+        unpack = nibble_unpack_ssse3;
+        if (pack_lut_ok) pack = nibble_pack_ssse3;
+        revcomp = nibble_revcomp_ssse3;
+        qadd = qual_add_ssse3;
+        qsub = qual_sub_ssse3;
+        qolap = qual_overlap_ssse3;
+        break;
+    case HTS_SIMD_AVX2:
+        unpack = nibble_unpack_avx2;
+        if (pack_lut_ok) pack = nibble_pack_avx2;
+        revcomp = nibble_revcomp_avx2;
+        qadd = qual_add_avx2;
+        qsub = qual_sub_avx2;
+        qolap = qual_overlap_avx2;
+        break;
+#endif
+#ifdef HTS_BUILD_NEON
+    case HTS_SIMD_NEON:
+        unpack = nibble_unpack_neon;
+        if (pack_lut_ok) pack = nibble_pack_neon;
+        revcomp = nibble_revcomp_neon;
+        qadd = qual_add_neon;
+        qsub = qual_sub_neon;
+        qolap = qual_overlap_neon;
+        break;
+#endif
+    default:
+        level = HTS_SIMD_NONE;
+        break;
+    }
+
+    hts_nibble_unpack = unpack;
+    hts_nibble_pack = pack;
+    hts_nibble_revcomp = revcomp;
+    hts_qual_add = qadd;
+    hts_qual_sub = qsub;
+    hts_qual_overlap = qolap;
+    simd_level = level;
+}
+
+static void simd_init(void) {
+    int i, j;
+
+    // Check seq_nt16_table has the shape the vector packing code expects
+    pack_lut_ok = 1;
+    for (i = 0; i < 256; i++) {
+        int hi = i >> 4;
+        if (hi >= 4 && hi <= 7) {
+            if (seq_nt16_table[i] != seq_nt16_table[i & ~0x20])
+                pack_lut_ok = 0;
+        } else if (hi != 3 && seq_nt16_table[i] != 15) {
+            pack_lut_ok = 0;
+        }
+    }
+    for (i = 0; i < 3; i++)
+        for (j = 0; j < 16; j++)
+            pack_lut[i][j] = seq_nt16_table[0x30 + i*16 + j];
+
+    if (hts_simd_supported(HTS_SIMD_AVX2))
+        simd_select(HTS_SIMD_AVX2);
+    else if (hts_simd_supported(HTS_SIMD_SSSE3))
+        simd_select(HTS_SIMD_SSSE3);
+    else if (hts_simd_supported(HTS_SIMD_NEON))
+        simd_select(HTS_SIMD_NEON);
+    else
+        simd_select(HTS_SIMD_NONE);
+}
+
+enum hts_simd_level hts_simd_get_level(void) {
+    pthread_once(&simd_once, simd_init);
+    return simd_level;
+}
+
+int hts_simd_set_level(enum hts_simd_level level) {
+    pthread_once(&simd_once, simd_init);
+    if (!hts_simd_supported(level))
+        return -1;
+    simd_select(level);
+    return 0;
+}
+
+const char *hts_simd_level_name(enum hts_simd_level level) {
+    switch (level) {
+    case HTS_SIMD_NONE:  return "none";
+    case HTS_SIMD_SSSE3: return "ssse3";
+    case HTS_SIMD_AVX2:  return "avx2";
+    case HTS_SIMD_NEON:  return "neon";
+    default:             return "unknown";
+    }
+}
+
+// Initial values of the kernel pointers; these select the real kernels
+// and then pass the call on.
+static void nibble_unpack_init(const uint8_t *nib, char *out, size_t len,
+                               const char lut[16]) {
+    pthread_once(&simd_once, simd_init);
+    hts_nibble_unpack(nib, out, len, lut);
+}
+
+static void nibble_pack_init(const char *seq, uint8_t *nib, size_t len) {
+    pthread_once(&simd_once, simd_init);
+    hts_nibble_pack(seq, nib, len);
+}
+
+static void nibble_revcomp_init(const uint8_t *nib, uint8_t *out,
+                                size_t len) {
+    pthread_once(&simd_once, simd_init);
+    hts_nibble_revcomp(nib, out, len);
+}
+
+static void qual_add_init(char *out, const uint8_t *qual, size_t len,
+                          uint8_t offset) {
+    pthread_once(&simd_once, simd_init);
+    hts_qual_add(out, qual, len, offset);
+}
+
+static int qual_sub_init(uint8_t *out, const char *str, size_t len,
+                         uint8_t offset) {
+    pthread_once(&simd_once, simd_init);
+    return hts_qual_sub(out, str, len, offset);
+}
+
+static void qual_overlap_init(uint8_t *a_qual, uint8_t *b_qual,
+                              const uint8_t *a_base, const uint8_t *b_base,
+                              size_t len) {
+    pthread_once(&simd_once, simd_init);
+    hts_qual_overlap(a_qual, b_qual, a_base, b_base, len);
+}
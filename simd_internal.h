@@ -0,0 +1,106 @@
+/*  simd_internal.h -- vectorised sequence and quality conversion kernels.
+
+    Copyright (C) 2019 Genome Research Ltd.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.  */
+
+#ifndef HTSLIB_SIMD_INTERNAL_H
+#define HTSLIB_SIMD_INTERNAL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * The kernels below are function pointers which are set on first use to
+ * the fastest implementation supported by the CPU.  They are called just
+ * like ordinary functions.  None of them allow the input and output
+ * buffers to overlap.
+ */
+
+/// Expand 4-bit packed bases using a 16 entry lookup table
+/** Writes @p len bytes to @p out, with each nibble of @p nib (high nibble
+    first) replaced by lut[nibble].  Passing seq_nt16_str as @p lut gives
+    the usual base letters.  @p out is not NUL terminated.
+*/
+extern void (*hts_nibble_unpack)(const uint8_t *nib, char *out, size_t len,
+                                 const char lut[16]);
+
+/// Pack a string of bases into 4-bit codes
+/** Each character is converted with seq_nt16_table, two to a byte with the
+    first in the high nibble.  If @p len is odd the last low nibble is zero.
+*/
+extern void (*hts_nibble_pack)(const char *seq, uint8_t *nib, size_t len);
+
+/// Reverse complement a 4-bit packed sequence of @p len bases
+extern void (*hts_nibble_revcomp)(const uint8_t *nib, uint8_t *out,
+                                  size_t len);
+
+/// Add @p offset to each of @p len quality values, e.g. 33 for SAM text
+extern void (*hts_qual_add)(char *out, const uint8_t *qual, size_t len,
+                            uint8_t offset);
+
+/// Subtract @p offset from each of @p len quality characters
+/** @return 0 on success, or non-zero if any result has its top bit set
+    (i.e. a character was below @p offset or far above the valid range).
+*/
+extern int (*hts_qual_sub)(uint8_t *out, const char *str, size_t len,
+                           uint8_t offset);
+
+/// Resolve the qualities of bases seen by both reads of an overlapping pair
+/** For each of the @p len positions, @p a_base and @p b_base hold the two
+    reads' bases (one per byte, any consistent coding) and @p a_qual and
+    @p b_qual their qualities, which are updated in place.  If the bases
+    agree, a gets the sum of the qualities, capped at 200, and b gets 0.
+    Otherwise the read with the lower quality gets 0 and the other keeps
+    80% of its own, with a winning ties.
+*/
+extern void (*hts_qual_overlap)(uint8_t *a_qual, uint8_t *b_qual,
+                                const uint8_t *a_base, const uint8_t *b_base,
+                                size_t len);
+
+enum hts_simd_level {
+    HTS_SIMD_NONE = 0,   ///< Portable C
+    HTS_SIMD_SSSE3,      ///< x86 SSSE3
+    HTS_SIMD_AVX2,       ///< x86 AVX2
+    HTS_SIMD_NEON        ///< ARMv8 Advanced SIMD
+};
+
+/// Returns non-zero if @p level is both compiled in and supported by the CPU
+int hts_simd_supported(enum hts_simd_level level);
+
+/// Returns the level currently in use
+enum hts_simd_level hts_simd_get_level(void);
+
+/// Switch all kernels to @p level, mainly for testing and benchmarking
+/** @return 0 on success, -1 if the level is not supported
+ */
+int hts_simd_set_level(enum hts_simd_level level);
+
+/// Returns a short name for @p level, e.g. "avx2"
+const char *hts_simd_level_name(enum hts_simd_level level);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -361,6 +361,7 @@ static int usage(FILE *fp, int status)
     fprintf(fp, "   -p, --preset STR           gff, bed, sam, vcf\n");
     fprintf(fp, "   -s, --sequence INT         column number for sequence names (suppressed by -p) [1]\n");
     fprintf(fp, "   -S, --skip-lines INT       skip first INT lines [0]\n");
+    fprintf(fp, "   -@, --threads INT          number of additional threads to use [0]\n");
     fprintf(fp, "\n");
     fprintf(fp, "Querying and other options:\n");
     fprintf(fp, "   -h, --print-header         print also the header lines\n");
@@ -376,6 +377,7 @@ static int usage(FILE *fp, int status)
 int main(int argc, char *argv[])
 {
     int c, detect = 1, min_shift = 0, is_force = 0, list_chroms = 0, do_csi = 0;
+    int n_threads = 0;
     tbx_conf_t conf = tbx_conf_gff;
     char *reheader = NULL;
     args_t args;
@@ -398,6 +400,7 @@ int main(int argc, char *argv[])
         {"preset", required_argument, NULL, 'p'},
         {"sequence", required_argument, NULL, 's'},
         {"skip-lines", required_argument, NULL, 'S'},
+        {"threads", required_argument, NULL, '@'},
         {"list-chroms", no_argument, NULL, 'l'},
         {"reheader", required_argument, NULL, 'r'},
         {"version", no_argument, NULL, 1},
@@ -405,7 +408,7 @@ int main(int argc, char *argv[])
     };
 
     char *tmp;
-    while ((c = getopt_long(argc, argv, "hH?0b:c:e:fm:p:s:S:lr:CR:T:", loptions,NULL)) >= 0)
+    while ((c = getopt_long(argc, argv, "hH?0b:c:e:fm:p:s:S:lr:CR:T:@:", loptions,NULL)) >= 0)
     {
         switch (c)
         {
@@ -453,6 +456,10 @@ int main(int argc, char *argv[])
                 if ( *tmp ) error("Could not parse argument: -S %s\n", optarg);
                 detect = 0;
                 break;
+            case '@':
+                n_threads = strtol(optarg,&tmp,10);
+                if ( *tmp ) error("Could not parse argument: -@ %s\n", optarg);
+                break;
             case 1:
                 printf(
 "tabix (htslib) %s\n"
@@ -539,16 +546,16 @@ int main(int argc, char *argv[])
     {
         if ( ftype==IS_BCF )
         {
-            if ( bcf_index_build(fname, min_shift)!=0 ) error("bcf_index_build failed: %s\n", fname);
+            if ( bcf_index_build3(fname, NULL, min_shift, n_threads)!=0 ) error("bcf_index_build failed: %s\n", fname);
             return 0;
         }
         if ( ftype==IS_BAM )
         {
-            if ( bam_index_build(fname, min_shift)!=0 ) error("bam_index_build failed: %s\n", fname);
+            if ( sam_index_build3(fname, NULL, min_shift, n_threads)!=0 ) error("bam_index_build failed: %s\n", fname);
             return 0;
         }
 
-        switch (ret = tbx_index_build(fname, min_shift, &conf))
+        switch (ret = tbx_index_build3(fname, NULL, min_shift, n_threads, &conf))
         {
             case 0:
                 return 0;
@@ -560,7 +567,7 @@ int main(int argc, char *argv[])
     }
     else    // TBI index
     {
-        switch (ret = tbx_index_build(fname, min_shift, &conf))
+        switch (ret = tbx_index_build3(fname, NULL, min_shift, n_threads, &conf))
         {
             case 0:
                 return 0;
@@ -166,6 +166,81 @@ static inline int get_intv(tbx_t *tbx, kstring_t *str, tbx_intv_t *intv, int is_
     }
 }
 
+// Readers for hts_idx_build_shards().  Each shard gives ids to the sequence
+// names it sees in its own tbx_t, and these are translated to ids in the
+// real one in file order, so names are numbered as if read serially.
+typedef struct {
+    tbx_t *tbx;
+    kstring_t str;
+} tbx_idx_state_t;
+
+static int tbx_idx_read(void *data, BGZF *fp, void **state, hts_idx_rec_t *rec)
+{
+    tbx_t *tbx = (tbx_t *) data;
+    tbx_idx_state_t *st = (tbx_idx_state_t *) *state;
+    tbx_intv_t intv;
+    int ret;
+
+    if (!st) {
+        if (!(st = calloc(1, sizeof(*st)))) return -2;
+        *state = st;
+        if (!(st->tbx = calloc(1, sizeof(tbx_t)))) return -2;
+        st->tbx->conf = tbx->conf;
+    }
+
+    if ((ret = bgzf_getline(fp, '\n', &st->str)) < 0)
+        return ret == -1 ? -1 : -2;
+    if (st->str.s[0] == tbx->conf.meta_char) return 1;
+    ret = get_intv(st->tbx, &st->str, &intv, 1);
+    if (ret < -1) return -2;  // Out of memory
+    if (ret < 0) return 1;    // Skip unparsable lines
+    rec->tid = intv.tid;
+    rec->beg = intv.beg;
+    rec->end = intv.end;
+    rec->is_mapped = 1;
+    return 0;
+}
+
+static int tbx_idx_finish(void *data, void *state, hts_idx_rec_t *rec, size_t n)
+{
+    tbx_idx_state_t *st = (tbx_idx_state_t *) state;
+    khash_t(s2i) *d;
+    khint_t k;
+    const char **names;
+    int *tids;
+    size_t i, n_names;
+
+    if (!st || !st->tbx->dict) return 0;
+    d = (khash_t(s2i) *) st->tbx->dict;
+    n_names = kh_size(d);
+    names = malloc(n_names * sizeof(*names) + 1);
+    tids = malloc(n_names * sizeof(*tids) + 1);
+    if (!names || !tids) goto fail;
+    for (k = kh_begin(d); k != kh_end(d); ++k)
+        if (kh_exist(d, k)) names[kh_val(d, k)] = kh_key(d, k);
+    for (i = 0; i < n_names; i++)
+        if ((tids[i] = get_tid((tbx_t *) data, names[i], 1)) < 0) goto fail;
+    for (i = 0; i < n; i++)
+        rec[i].tid = tids[rec[i].tid];
+    free(names);
+    free(tids);
+    return 0;
+
+ fail:
+    free(names);
+    free(tids);
+    return -1;
+}
+
+static void tbx_idx_free_state(void *state)
+{
+    tbx_idx_state_t *st = (tbx_idx_state_t *) state;
+    if (!st) return;
+    if (st->tbx) tbx_destroy(st->tbx);
+    free(st->str.s);
+    free(st);
+}
+
 /*
  * Called by tabix iterator to read the next record.
  * Returns    >=  0 on success
@@ -220,7 +295,8 @@ static int tbx_set_meta(tbx_t *tbx)
     return 0;
 }
 
-tbx_t *tbx_index(BGZF *fp, int min_shift, const tbx_conf_t *conf)
+tbx_t *tbx_index_threads(BGZF *fp, const char *fn, int min_shift,
+                         int n_threads, const tbx_conf_t *conf)
 {
     tbx_t *tbx;
     kstring_t str;
@@ -245,6 +321,15 @@ tbx_t *tbx_index(BGZF *fp, int min_shift, const tbx_conf_t *conf)
             tbx->idx = hts_idx_init(0, fmt, last_off, min_shift, n_lvls);
             if (!tbx->idx) goto fail;
             first = 1;
+            if (n_threads > 1) {
+                hts_idx_reader_t reader = { 1, NULL, tbx_idx_read,
+                                            tbx_idx_finish, tbx_idx_free_state,
+                                            tbx };
+                ret = hts_idx_build_shards(tbx->idx, fn, last_off, n_threads,
+                                           &reader);
+                if (ret < 0) goto fail;
+                if (ret == 0) goto done;
+            }
         }
         ret = get_intv(tbx, &str, &intv, 1);
         if (ret < -1) goto fail;  // Out of memory
@@ -257,9 +342,10 @@ tbx_t *tbx_index(BGZF *fp, int min_shift, const tbx_conf_t *conf)
     if (ret < -1) goto fail;
     if ( !tbx->idx ) tbx->idx = hts_idx_init(0, fmt, last_off, min_shift, n_lvls);   // empty file
     if (!tbx->idx) goto fail;
+    if (hts_idx_finish(tbx->idx, bgzf_tell(fp)) != 0) goto fail;
+ done:
     if ( !tbx->dict ) tbx->dict = kh_init(s2i);
     if (!tbx->dict) goto fail;
-    if (hts_idx_finish(tbx->idx, bgzf_tell(fp)) != 0) goto fail;
     if (tbx_set_meta(tbx) != 0) goto fail;
     free(str.s);
     return tbx;
@@ -270,6 +356,11 @@ tbx_t *tbx_index(BGZF *fp, int min_shift, const tbx_conf_t *conf)
     return NULL;
 }
 
+tbx_t *tbx_index(BGZF *fp, int min_shift, const tbx_conf_t *conf)
+{
+    return tbx_index_threads(fp, NULL, min_shift, 0, conf);
+}
+
 void tbx_destroy(tbx_t *tbx)
 {
     khash_t(s2i) *d = (khash_t(s2i)*)tbx->dict;
@@ -292,7 +383,7 @@ int tbx_index_build3(const char *fn, const char *fnidx, int min_shift, int n_thr
     if ((fp = bgzf_open(fn, "r")) == 0) return -1;
     if ( n_threads ) bgzf_mt(fp, n_threads, 256);
     if ( bgzf_compression(fp) != bgzf ) { bgzf_close(fp); return -2; }
-    tbx = tbx_index(fp, min_shift, conf);
+    tbx = tbx_index_threads(fp, fn, min_shift, n_threads, conf);
     bgzf_close(fp);
     if ( !tbx ) return -1;
     ret = hts_idx_save_as(tbx->idx, fn, fnidx, min_shift > 0? HTS_FMT_CSI : HTS_FMT_TBI);
@@ -310,14 +401,14 @@ int tbx_index_build(const char *fn, int min_shift, const tbx_conf_t *conf)
     return tbx_index_build3(fn, NULL, min_shift, 0, conf);
 }
 
-tbx_t *tbx_index_load2(const char *fn, const char *fnidx)
+tbx_t *tbx_index_load3(const char *fn, const char *fnidx, int flags)
 {
     tbx_t *tbx;
     uint8_t *meta;
     char *nm, *p;
     uint32_t l_meta, l_nm;
     tbx = (tbx_t*)calloc(1, sizeof(tbx_t));
-    tbx->idx = fnidx? hts_idx_load2(fn, fnidx) : hts_idx_load(fn, HTS_FMT_TBI);
+    tbx->idx = hts_idx_load3(fn, fnidx, HTS_FMT_TBI, flags);
     if ( !tbx->idx )
     {
         free(tbx);
@@ -355,6 +446,11 @@ tbx_t *tbx_index_load2(const char *fn, const char *fnidx)
     return NULL;
 }
 
+tbx_t *tbx_index_load2(const char *fn, const char *fnidx)
+{
+    return tbx_index_load3(fn, fnidx, 0);
+}
+
 tbx_t *tbx_index_load(const char *fn)
 {
     return tbx_index_load2(fn, NULL);
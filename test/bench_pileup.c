@@ -0,0 +1,493 @@
+/* test/bench_pileup.c -- pileup engine benchmark
+
+   Copyright (C) 2019 Genome Research Ltd.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Times the pileup iterators over synthetic reads for a range of depths,
+ * read lengths and indel rates.  The reads are made up front and kept in
+ * memory, so the figures are for the pileup rather than BAM decoding; the
+ * only extra work is copying each read into the bam1_t the read function
+ * fills.  They can also be written out as BAM files with -o.
+ *
+ * Reads come in proper pairs whose mates overlap by half a read, with
+ * bases from a random reference and about 1% of them changed.  Each
+ * configuration covers about the same number of bases, so the reference
+ * gets shorter as the depth goes up.  The reads depend only on the seed
+ * and the configuration, not on which other configurations are run.
+ * There is no limit on the depth (see bam_plp_set_maxcnt()).
+ *
+ * The modes are:
+ *   plp    bam_plp_auto()
+ *   mplp   bam_mplp_auto() over several inputs, each at the given depth
+ *   olap   bam_plp_auto() with overlap detection
+ *   ins    bam_plp_auto(), fetching each insertion with bam_plp_insertion()
+ *
+ * Output is one tab-separated line per configuration, preceded by a
+ * header line starting with '#'.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <time.h>
+
+#include "htslib/sam.h"
+#include "htslib/kstring.h"
+#include "htslib/hts_os.h"
+
+enum mode { M_PLP, M_MPLP, M_OLAP, M_INS, M_MAX };
+static const char *mode_names[M_MAX] = { "plp", "mplp", "olap", "ins" };
+
+typedef struct {
+    double depth, indel;
+    int len, n_inputs;
+} bench_conf;
+
+// The reads for one input, handed out in order by bench_read()
+typedef struct {
+    bam1_t **b;
+    int n, m, i;
+} bench_input;
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int bench_read(void *data, bam1_t *b) {
+    bench_input *in = (bench_input *) data;
+    if (in->i == in->n)
+        return -1;
+    return bam_copy1(b, in->b[in->i++]) ? 0 : -2;
+}
+
+static int cmp_read(const void *av, const void *bv) {
+    const bam1_t *a = *(const bam1_t **) av, *b = *(const bam1_t **) bv;
+    if (a->core.pos != b->core.pos)
+        return a->core.pos < b->core.pos ? -1 : 1;
+    return strcmp(bam_get_qname(a), bam_get_qname(b));
+}
+
+// Makes the CIGAR, bases and qualities of a read starting at pos.  Indels
+// are never put at the start or in the last few bases of a read, or next
+// to each other.
+static int make_alignment(kstring_t *cig, kstring_t *seq, kstring_t *qual,
+                          const char *ref, int64_t ref_len, int64_t pos,
+                          int len, double indel) {
+    int q = 0, m = 0, l, r = 0;
+
+    cig->l = seq->l = qual->l = 0;
+    while (q < len) {
+        if (m > 0 && q < len - 8 && drand48() < indel) {
+            l = 1 + lrand48() % 4;
+            r |= ksprintf(cig, "%dM", m);
+            m = 0;
+            if (lrand48() & 1) {
+                r |= ksprintf(cig, "%dI", l);
+                for (; l > 0; l--, q++) {
+                    r |= kputc("ACGT"[lrand48() & 3], seq);
+                    r |= kputc('!' + 20 + lrand48() % 21, qual);
+                }
+            } else {
+                r |= ksprintf(cig, "%dD", l);
+                pos += l;
+            }
+            continue;
+        }
+        r |= kputc(drand48() < 0.01 ? "ACGT"[lrand48() & 3]
+                   : ref[pos++ % ref_len], seq);
+        r |= kputc('!' + 20 + lrand48() % 21, qual);
+        q++, m++;
+    }
+    r |= ksprintf(cig, "%dM", m);
+    return r < 0 ? -1 : 0;
+}
+
+// Makes one input's reads at the configured depth over the first span
+// bases of the reference, sorted by position
+static int make_input(bench_input *in, const bench_conf *c, bam_hdr_t *h,
+                      const char *ref, int64_t ref_len, int64_t span) {
+    kstring_t line = { 0, 0, NULL }, cig = { 0, 0, NULL };
+    kstring_t seq = { 0, 0, NULL }, qual = { 0, 0, NULL };
+    int flen = c->len + c->len / 2, k, ret = -1;
+    long n_pairs = c->depth * span / (2 * c->len), i;
+
+    if (n_pairs < 1) n_pairs = 1;
+    if (n_pairs > INT_MAX / 2)
+        return -1;
+    in->n = in->i = 0;
+    in->m = 2 * n_pairs;
+    if (!(in->b = calloc(in->m, sizeof(*in->b))))
+        return -1;
+    for (i = 0; i < n_pairs; i++) {
+        int64_t pos[2];
+        pos[0] = lrand48() % (span - flen + 1);
+        pos[1] = pos[0] + flen - c->len;
+        for (k = 0; k < 2; k++) {
+            bam1_t *b;
+            line.l = 0;
+            if (make_alignment(&cig, &seq, &qual, ref, ref_len, pos[k],
+                               c->len, c->indel) < 0
+                || ksprintf(&line, "r%ld\t%d\tref\t%"PRId64"\t60\t%s\t=\t%"PRId64
+                            "\t%d\t%s\t%s", i, k ? 147 : 99, pos[k] + 1, cig.s,
+                            pos[!k] + 1, k ? -flen : flen, seq.s, qual.s) < 0)
+                goto out;
+            if (!(b = bam_init1()))
+                goto out;
+            in->b[in->n++] = b;
+            if (sam_parse1(&line, h, b) < 0)
+                goto out;
+        }
+    }
+    qsort(in->b, in->n, sizeof(*in->b), cmp_read);
+    ret = 0;
+
+ out:
+    free(line.s);
+    free(cig.s);
+    free(seq.s);
+    free(qual.s);
+    return ret;
+}
+
+static void free_input(bench_input *in) {
+    int i;
+    for (i = 0; i < in->n; i++)
+        bam_destroy1(in->b[i]);
+    free(in->b);
+    memset(in, 0, sizeof(*in));
+}
+
+static int write_input(const bench_input *in, bam_hdr_t *h, const char *fn) {
+    samFile *fp = sam_open(fn, "wb");
+    int i, ret = 0;
+
+    if (!fp) {
+        perror(fn);
+        return -1;
+    }
+    if (sam_hdr_write(fp, h) < 0)
+        ret = -1;
+    for (i = 0; i < in->n && ret == 0; i++)
+        if (sam_write1(fp, h, in->b[i]) < 0)
+            ret = -1;
+    if (sam_close(fp) < 0)
+        ret = -1;
+    if (ret < 0)
+        fprintf(stderr, "Couldn't write \"%s\"\n", fn);
+    return ret;
+}
+
+// Runs one pileup over the inputs, returning the elapsed time or -1 on
+// error.  *sink gets a value that depends on the columns so that the work
+// cannot be optimised away.
+static double run_mode(enum mode mode, bench_input *in, int n_inputs,
+                       long *n_pos, long *sink) {
+    bam_plp_t plp = NULL;
+    bam_mplp_t mplp = NULL;
+    const bam_pileup1_t *p, **plps = NULL;
+    int *n_plp = NULL;
+    void **data = NULL;
+    kstring_t ks = { 0, 0, NULL };
+    int tid, pos, n = 0, i, k;
+    double t = -1;
+
+    for (k = 0; k < n_inputs; k++)
+        in[k].i = 0;
+    *n_pos = 0;
+    if (mode == M_MPLP) {
+        plps = calloc(n_inputs, sizeof(*plps));
+        n_plp = calloc(n_inputs, sizeof(*n_plp));
+        data = calloc(n_inputs, sizeof(*data));
+        if (!plps || !n_plp || !data)
+            goto out;
+        for (k = 0; k < n_inputs; k++)
+            data[k] = &in[k];
+        if (!(mplp = bam_mplp_init(n_inputs, bench_read, data)))
+            goto out;
+        bam_mplp_set_maxcnt(mplp, INT_MAX);
+    } else {
+        if (!(plp = bam_plp_init(bench_read, in)))
+            goto out;
+        bam_plp_set_maxcnt(plp, INT_MAX);
+        if (mode == M_OLAP && bam_plp_init_overlaps(plp) < 0)
+            goto out;
+    }
+
+    t = now();
+    if (mode == M_MPLP) {
+        while ((n = bam_mplp_auto(mplp, &tid, &pos, n_plp, plps)) > 0) {
+            for (k = 0; k < n_inputs; k++)
+                *sink += n_plp[k];
+            ++*n_pos;
+        }
+    } else {
+        while ((p = bam_plp_auto(plp, &tid, &pos, &n)) != NULL) {
+            if (mode == M_INS) {
+                for (i = 0; i < n; i++) {
+                    if (p[i].indel <= 0)
+                        continue;
+                    if (bam_plp_insertion(&p[i], &ks, NULL) < 0) {
+                        n = -1;
+                        break;
+                    }
+                    *sink += ks.l;
+                }
+                if (n < 0)
+                    break;
+            }
+            *sink += n;
+            ++*n_pos;
+        }
+    }
+    t = n < 0 ? -1 : now() - t;
+
+ out:
+    if (plp) bam_plp_destroy(plp);
+    if (mplp) bam_mplp_destroy(mplp);
+    free(plps);
+    free(n_plp);
+    free(data);
+    free(ks.s);
+    return t;
+}
+
+/* Parses a comma separated list of numbers.  Returns count or -1 */
+static int parse_list(const char *str, double *vals, int max) {
+    int n = 0;
+    char *end;
+    while (*str && n < max) {
+        vals[n++] = strtod(str, &end);
+        if (end == str || (*end && *end != ','))
+            return -1;
+        str = *end ? end + 1 : end;
+    }
+    return n;
+}
+
+/* Parses a comma separated list of mode names.  Returns a bit set or -1 */
+static int parse_modes(const char *str) {
+    int modes = 0, m;
+    size_t l;
+    while (*str) {
+        l = strcspn(str, ",");
+        for (m = 0; m < M_MAX; m++)
+            if (strlen(mode_names[m]) == l && strncmp(str, mode_names[m], l) == 0)
+                break;
+        if (m == M_MAX)
+            return -1;
+        modes |= 1 << m;
+        str += l + (str[l] == ',');
+    }
+    return modes;
+}
+
+static void usage(FILE *fp) {
+    fprintf(fp,
+"Usage: bench_pileup [options]\n"
+"Options:\n"
+"  -d LIST   Depths [10,100,1000,10000,50000]\n"
+"  -l LIST   Read lengths [150,10000]\n"
+"  -i LIST   Indel rates per base [0,0.01]\n"
+"  -m LIST   Modes: plp, mplp, olap, ins [all]\n"
+"  -n INT    Inputs for mplp, each at the full depth [4]\n"
+"  -b FLOAT  Bases per input for each configuration, in millions [10]\n"
+"  -r INT    Runs of each configuration; the fastest is reported [3]\n"
+"  -s INT    Random seed [1]\n"
+"  -o STR    Also write the reads to STR-<depth>-<length>-<indel>-<input>.bam\n"
+"\n"
+"Output columns are mode, inputs, depth, read length, indel rate, reads,\n"
+"pileup positions, elapsed seconds, positions per second and reads per\n"
+"second.  Configurations that would need over five times the requested\n"
+"bases (long reads at high depth) are skipped.\n");
+}
+
+int main(int argc, char **argv) {
+    double depths[64] = {10, 100, 1000, 10000, 50000};
+    double lens[64] = {150, 10000};
+    double indels[64] = {0, 0.01};
+    int ndepths = 5, nlens = 2, nindels = 2, modes = (1 << M_MAX) - 1;
+    int n_inputs = 4, runs = 3, opt, di, li, ii, k, m;
+    double mbases = 10;
+    long seed = 1, sink = 0;
+    const char *prefix = NULL;
+
+    while ((opt = getopt(argc, argv, "d:l:i:m:n:b:r:s:o:h")) >= 0) {
+        switch (opt) {
+        case 'd':
+            if ((ndepths = parse_list(optarg, depths, 64)) <= 0) {
+                usage(stderr);
+                return 1;
+            }
+            break;
+        case 'l':
+            if ((nlens = parse_list(optarg, lens, 64)) <= 0) {
+                usage(stderr);
+                return 1;
+            }
+            break;
+        case 'i':
+            if ((nindels = parse_list(optarg, indels, 64)) <= 0) {
+                usage(stderr);
+                return 1;
+            }
+            break;
+        case 'm':
+            if ((modes = parse_modes(optarg)) <= 0) {
+                usage(stderr);
+                return 1;
+            }
+            break;
+        case 'n': n_inputs = atoi(optarg); break;
+        case 'b': mbases   = atof(optarg); break;
+        case 'r': runs     = atoi(optarg); break;
+        case 's': seed     = atol(optarg); break;
+        case 'o': prefix   = optarg; break;
+        case 'h': usage(stdout); return 0;
+        default:  usage(stderr); return 1;
+        }
+    }
+    if (n_inputs < 1 || runs < 1 || mbases <= 0) {
+        usage(stderr);
+        return 1;
+    }
+
+    printf("#mode\tinputs\tdepth\tread_len\tindel_rate\treads\tpositions"
+           "\tsecs\tpositions_per_sec\treads_per_sec\n");
+
+    for (di = 0; di < ndepths; di++) {
+        for (li = 0; li < nlens; li++) {
+            for (ii = 0; ii < nindels; ii++) {
+                bench_conf c;
+                bench_input *in = NULL;
+                bam_hdr_t *h = NULL;
+                char *ref = NULL, hdr[100];
+                int64_t span, ref_len, i;
+                int n_in, failed = 0;
+
+                c.depth = depths[di];
+                c.len = (int) lens[li];
+                c.indel = indels[ii];
+                c.n_inputs = (modes & (1 << M_MPLP)) ? n_inputs : 1;
+                if (c.depth <= 0 || c.len < 16 || c.indel < 0) {
+                    usage(stderr);
+                    return 1;
+                }
+
+                // Room for pairs of reads, and for deletions at the end
+                span = mbases * 1e6 / c.depth;
+                if (span < 3 * c.len)
+                    span = 3 * c.len;
+                if (span * c.depth > 5 * mbases * 1e6) {
+                    fprintf(stderr, "Skipping depth %g, read length %d: "
+                            "needs %.0f million bases per input\n",
+                            c.depth, c.len, span * c.depth / 1e6);
+                    continue;
+                }
+                ref_len = span + 2 * c.len;
+
+                hts_srand48(seed);
+                snprintf(hdr, sizeof(hdr),
+                         "@HD\tVN:1.6\tSO:coordinate\n@SQ\tSN:ref\tLN:%"PRId64"\n",
+                         ref_len);
+                h = sam_hdr_parse(strlen(hdr), hdr);
+                ref = malloc(ref_len);
+                in = calloc(c.n_inputs, sizeof(*in));
+                if (!h || !ref || !in) {
+                    fprintf(stderr, "Out of memory\n");
+                    return 1;
+                }
+                h->l_text = strlen(hdr);
+                h->text = strdup(hdr);
+                if (!h->text) {
+                    fprintf(stderr, "Out of memory\n");
+                    return 1;
+                }
+                for (i = 0; i < ref_len; i++)
+                    ref[i] = "ACGT"[lrand48() & 3];
+                for (n_in = 0; n_in < c.n_inputs; n_in++) {
+                    if (make_input(&in[n_in], &c, h, ref, ref_len, span) < 0) {
+                        fprintf(stderr, "Couldn't make the reads\n");
+                        n_in++;
+                        failed = 1;
+                        break;
+                    }
+                    if (prefix) {
+                        char fn[1024];
+                        snprintf(fn, sizeof(fn), "%s-%g-%d-%g-%d.bam",
+                                 prefix, c.depth, c.len, c.indel, n_in);
+                        if (write_input(&in[n_in], h, fn) < 0) {
+                            n_in++;
+                            failed = 1;
+                            break;
+                        }
+                    }
+                }
+
+                for (m = 0; m < M_MAX && !failed; m++) {
+                    int n = m == M_MPLP ? c.n_inputs : 1, run;
+                    long reads = 0, n_pos = 0;
+                    double best = -1, t;
+
+                    if (!(modes & (1 << m)))
+                        continue;
+                    for (k = 0; k < n; k++)
+                        reads += in[k].n;
+                    for (run = 0; run < runs; run++) {
+                        if ((t = run_mode(m, in, n, &n_pos, &sink)) < 0) {
+                            fprintf(stderr, "Benchmark failed for %s, depth %g, "
+                                    "read length %d\n", mode_names[m],
+                                    c.depth, c.len);
+                            failed = 1;
+                            break;
+                        }
+                        if (best < 0 || t < best)
+                            best = t;
+                    }
+                    if (failed)
+                        break;
+                    printf("%s\t%d\t%g\t%d\t%g\t%ld\t%ld\t%.4f\t%.0f\t%.0f\n",
+                           mode_names[m], n, c.depth, c.len, c.indel, reads,
+                           n_pos, best, n_pos / best, reads / best);
+                    fflush(stdout);
+                }
+
+                for (k = 0; k < n_in; k++)
+                    free_input(&in[k]);
+                free(in);
+                free(ref);
+                bam_hdr_destroy(h);
+                if (failed)
+                    return 1;
+            }
+        }
+    }
+
+    return sink == -1; // never true, but keeps sink live
+}
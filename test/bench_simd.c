@@ -0,0 +1,218 @@
+/* test/bench_simd.c -- sequence and quality conversion kernel benchmark
+
+   Copyright (C) 2019 Genome Research Ltd.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Times each of the kernels in simd_internal.h at every SIMD level the
+ * CPU supports, for a range of sequence lengths.  Each configuration
+ * converts the same random read many times over, so the figures are for
+ * data that is already in cache.
+ *
+ * Output is one tab-separated line per configuration, preceded by a
+ * header line starting with '#'.  The speedup column is relative to the
+ * portable C version at the same length.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "htslib/hts.h"
+#include "simd_internal.h"
+
+enum kernel { K_UNPACK, K_PACK, K_REVCOMP, K_QUAL_ADD, K_QUAL_SUB,
+              K_QUAL_OVERLAP, K_MAX };
+static const char *kernel_names[K_MAX] = {
+    "unpack", "pack", "revcomp", "qual_add", "qual_sub", "qual_overlap"
+};
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+typedef struct {
+    char *seq, *seq2, *qstr, *text;
+    uint8_t *nib, *qual, *out;
+} bench_buf;
+
+// Runs one kernel iter times.  Returns a value that depends on the output
+// so that the work cannot be optimised away.
+static unsigned run_kernel(enum kernel k, bench_buf *b, size_t len,
+                           long iter) {
+    unsigned sink = 0;
+    long i;
+
+    for (i = 0; i < iter; i++) {
+        switch (k) {
+        case K_UNPACK:
+            hts_nibble_unpack(b->nib, b->text, len, seq_nt16_str);
+            sink += (unsigned char)b->text[i % len];
+            break;
+        case K_PACK:
+            hts_nibble_pack(b->seq, b->out, len);
+            sink += b->out[i % ((len + 1) / 2)];
+            break;
+        case K_REVCOMP:
+            hts_nibble_revcomp(b->nib, b->out, len);
+            sink += b->out[i % ((len + 1) / 2)];
+            break;
+        case K_QUAL_ADD:
+            hts_qual_add(b->text, b->qual, len, 33);
+            sink += (unsigned char)b->text[i % len];
+            break;
+        case K_QUAL_SUB:
+            sink += hts_qual_sub(b->out, b->qstr, len, 33);
+            sink += b->out[i % len];
+            break;
+        case K_QUAL_OVERLAP:
+            // The qualities are updated in place, which is fine for timing
+            hts_qual_overlap(b->qual, b->out, (uint8_t *)b->seq,
+                             (uint8_t *)b->seq2, len);
+            sink += b->qual[i % len];
+            break;
+        default:
+            break;
+        }
+    }
+
+    return sink;
+}
+
+/* Parses a comma separated list of numbers.  Returns count or -1 */
+static int parse_list(const char *str, long *vals, int max) {
+    int n = 0;
+    char *end;
+    while (*str && n < max) {
+        vals[n++] = strtol(str, &end, 10);
+        if (end == str || (*end && *end != ','))
+            return -1;
+        str = *end ? end + 1 : end;
+    }
+    return n;
+}
+
+static void usage(FILE *fp) {
+    fprintf(fp,
+"Usage: bench_simd [options]\n"
+"Options:\n"
+"  -l LIST   Sequence lengths [50,150,1000,10000,100000]\n"
+"  -b INT    Bases to convert per configuration, in millions [200]\n"
+"\n"
+"Output columns are kernel, SIMD level, sequence length, number of calls,\n"
+"elapsed seconds, millions of bases per second and the speedup over the\n"
+"portable C version.\n");
+}
+
+int main(int argc, char **argv) {
+    long lens[64] = {50, 150, 1000, 10000, 100000};
+    int nlens = 5, opt, li, lvl;
+    double mbases = 200;
+    volatile unsigned sink = 0;
+    enum kernel k;
+
+    while ((opt = getopt(argc, argv, "l:b:h")) >= 0) {
+        switch (opt) {
+        case 'l':
+            if ((nlens = parse_list(optarg, lens, 64)) <= 0) {
+                usage(stderr);
+                return 1;
+            }
+            break;
+        case 'b': mbases = atof(optarg); break;
+        case 'h': usage(stdout); return 0;
+        default:  usage(stderr); return 1;
+        }
+    }
+
+    printf("#kernel\tlevel\tlen\tcalls\tsecs\tMbases_per_sec\tspeedup\n");
+
+    for (li = 0; li < nlens; li++) {
+        size_t len = lens[li], i;
+        long iter;
+        bench_buf b;
+
+        if (lens[li] < 1) {
+            usage(stderr);
+            return 1;
+        }
+        iter = mbases * 1e6 / len;
+        if (iter < 1) iter = 1;
+
+        b.seq  = malloc(len);
+        b.seq2 = malloc(len);
+        b.qstr = malloc(len);
+        b.text = malloc(len);
+        b.nib  = malloc(len);
+        b.qual = malloc(len);
+        b.out  = malloc(len);
+        if (!b.seq || !b.seq2 || !b.qstr || !b.text || !b.nib || !b.qual || !b.out) {
+            fprintf(stderr, "Out of memory\n");
+            return 1;
+        }
+        srand(len);
+        for (i = 0; i < len; i++) {
+            b.seq[i]  = "ACGTN"[rand() % 5];
+            b.qual[i] = rand() % 42;
+            b.qstr[i] = b.qual[i] + 33;
+            // The other read of an overlapping pair, with a few differences
+            b.seq2[i] = rand() % 20 ? b.seq[i] : "ACGTN"[rand() % 5];
+            b.out[i]  = rand() % 42;
+        }
+        hts_nibble_pack(b.seq, b.nib, len);
+
+        for (k = 0; k < K_MAX; k++) {
+            double base_rate = 0;
+            for (lvl = HTS_SIMD_NONE; lvl <= HTS_SIMD_NEON; lvl++) {
+                double t, rate;
+                if (hts_simd_set_level(lvl) < 0)
+                    continue;
+                sink += run_kernel(k, &b, len, iter / 10 + 1); // warm up
+                t = now();
+                sink += run_kernel(k, &b, len, iter);
+                t = now() - t;
+                rate = (double)len * iter / t / 1e6;
+                if (lvl == HTS_SIMD_NONE)
+                    base_rate = rate;
+                printf("%s\t%s\t%zu\t%ld\t%.4f\t%.1f\t%.2f\n",
+                       kernel_names[k], hts_simd_level_name(lvl), len, iter,
+                       t, rate, base_rate > 0 ? rate / base_rate : 0);
+                fflush(stdout);
+            }
+        }
+
+        free(b.seq);
+        free(b.seq2);
+        free(b.qstr);
+        free(b.text);
+        free(b.nib);
+        free(b.qual);
+        free(b.out);
+    }
+
+    return 0;
+}
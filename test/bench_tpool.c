@@ -0,0 +1,319 @@
+/* test/bench_tpool.c -- thread pool throughput and latency benchmark
+
+   Copyright (C) 2019 Genome Research Ltd.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Measures jobs per second and job latency for the thread pool over a
+ * range of job sizes and worker counts, for both ordered (results pulled
+ * back in dispatch order) and unordered (input only) process queues.
+ *
+ * Jobs spin on the CPU for the requested time rather than sleeping, so
+ * the figures reflect scheduling overhead and scaling rather than timer
+ * resolution.  Latency is measured from just before dispatch to the point
+ * the result is consumed (ordered) or the job finishes (unordered).
+ *
+ * Output is one tab-separated line per configuration, preceded by a
+ * header line starting with '#'.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "htslib/thread_pool.h"
+
+typedef struct {
+    int ordered;
+    int nthreads;
+    double job_us;
+    int batch;
+    int qmult;
+    int njobs;
+} bench_conf;
+
+typedef struct {
+    const bench_conf *c;
+    hts_tpool *p;
+    hts_tpool_process *q;
+    double *t_disp, *t_done;
+    void **args;
+    int failed;
+} bench_run;
+
+typedef struct {
+    bench_run *r;
+    int idx;
+} bench_job;
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void *bench_work(void *arg) {
+    bench_job *j = (bench_job *)arg;
+    double end, t;
+
+    // Spin rather than sleep so short jobs are not rounded up by the timer.
+    end = now() + j->r->c->job_us * 1e-6;
+    do {
+        t = now();
+    } while (t < end);
+
+    if (!j->r->c->ordered)
+        j->r->t_done[j->idx] = t;
+
+    return j;
+}
+
+/* Dispatches all jobs, in batches if requested.  Returns 0 on success. */
+static int bench_dispatch(bench_run *r) {
+    const bench_conf *c = r->c;
+    int i, k, n;
+
+    for (i = 0; i < c->njobs; i += n) {
+        n = c->njobs - i < c->batch ? c->njobs - i : c->batch;
+        double t = now();
+        for (k = 0; k < n; k++)
+            r->t_disp[i + k] = t;
+
+        if (c->batch == 1) {
+            if (hts_tpool_dispatch(r->p, r->q, bench_work, r->args[i]) < 0)
+                return -1;
+            continue;
+        }
+
+        for (k = 0; k < n; ) {
+            int added = hts_tpool_dispatch_batch(r->p, r->q, bench_work,
+                                                 r->args + i + k, n - k,
+                                                 NULL, NULL, 0);
+            if (added < 0)
+                return -1;
+            k += added;
+        }
+    }
+
+    return 0;
+}
+
+static void *bench_dispatch_thread(void *arg) {
+    bench_run *r = (bench_run *)arg;
+    if (bench_dispatch(r) < 0)
+        r->failed = 1;
+    return NULL;
+}
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static double percentile(const double *sorted, int n, double pc) {
+    int i = (int)(pc / 100.0 * (n - 1) + 0.5);
+    return sorted[i < n ? i : n - 1];
+}
+
+static int bench_one(const bench_conf *c) {
+    bench_run r = { c, NULL, NULL, NULL, NULL, NULL, 0 };
+    bench_job *jobs = NULL;
+    double *lat = NULL, t_start, elapsed;
+    int i, ret = -1;
+
+    r.t_disp = malloc(c->njobs * sizeof(*r.t_disp));
+    r.t_done = malloc(c->njobs * sizeof(*r.t_done));
+    r.args   = malloc(c->njobs * sizeof(*r.args));
+    jobs     = malloc(c->njobs * sizeof(*jobs));
+    lat      = malloc(c->njobs * sizeof(*lat));
+    if (!r.t_disp || !r.t_done || !r.args || !jobs || !lat)
+        goto err;
+
+    for (i = 0; i < c->njobs; i++) {
+        jobs[i].r = &r;
+        jobs[i].idx = i;
+        r.args[i] = &jobs[i];
+    }
+
+    if (!(r.p = hts_tpool_init(c->nthreads)))
+        goto err;
+    if (!(r.q = hts_tpool_process_init(r.p, c->nthreads * c->qmult,
+                                       !c->ordered)))
+        goto err;
+
+    t_start = now();
+    if (c->ordered) {
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, bench_dispatch_thread, &r) != 0)
+            goto err;
+        for (i = 0; i < c->njobs; i++) {
+            hts_tpool_result *res = hts_tpool_next_result_wait(r.q);
+            if (!res)
+                break;
+            bench_job *j = (bench_job *)hts_tpool_result_data(res);
+            r.t_done[j->idx] = now();
+            hts_tpool_delete_result(res, 0);
+        }
+        pthread_join(tid, NULL);
+        if (i < c->njobs || r.failed)
+            goto err;
+    } else {
+        if (bench_dispatch(&r) < 0)
+            goto err;
+        hts_tpool_process_flush(r.q);
+    }
+    elapsed = now() - t_start;
+
+    for (i = 0; i < c->njobs; i++)
+        lat[i] = (r.t_done[i] - r.t_disp[i]) * 1e6;
+    qsort(lat, c->njobs, sizeof(*lat), cmp_double);
+
+    printf("%s\t%d\t%g\t%d\t%d\t%d\t%.4f\t%.1f\t%.1f\t%.1f\t%.1f\t%.1f\n",
+           c->ordered ? "ordered" : "unordered", c->nthreads, c->job_us,
+           c->batch, c->nthreads * c->qmult, c->njobs, elapsed,
+           c->njobs / elapsed,
+           percentile(lat, c->njobs, 50), percentile(lat, c->njobs, 99),
+           percentile(lat, c->njobs, 99.9), lat[c->njobs - 1]);
+    fflush(stdout);
+    ret = 0;
+
+ err:
+    if (r.q) hts_tpool_process_destroy(r.q);
+    if (r.p) hts_tpool_destroy(r.p);
+    free(r.t_disp);
+    free(r.t_done);
+    free(r.args);
+    free(jobs);
+    free(lat);
+    return ret;
+}
+
+/* Parses a comma separated list of numbers.  Returns count or -1 */
+static int parse_list(const char *str, double *vals, int max) {
+    int n = 0;
+    char *end;
+    while (*str && n < max) {
+        vals[n++] = strtod(str, &end);
+        if (end == str || (*end && *end != ','))
+            return -1;
+        str = *end ? end + 1 : end;
+    }
+    return n;
+}
+
+static void usage(FILE *fp) {
+    fprintf(fp,
+"Usage: bench_tpool [options]\n"
+"Options:\n"
+"  -t LIST   Worker thread counts [1,2,4,8,16,32,64,128]\n"
+"  -s LIST   Job sizes in microseconds [1,10,100,1000,10000]\n"
+"  -m MODE   ordered, unordered or both [both]\n"
+"  -b INT    Dispatch jobs in batches of this size [1]\n"
+"  -q INT    Queue size as a multiple of thread count [2]\n"
+"  -T FLOAT  Target seconds of work per worker thread [0.5]\n"
+"  -n INT    Fixed number of jobs per configuration (overrides -T)\n"
+"\n"
+"Output columns are mode, threads, job size (us), batch size, queue size,\n"
+"number of jobs, elapsed seconds, jobs per second and latency (us) at the\n"
+"50th, 99th and 99.9th percentiles and maximum.\n");
+}
+
+int main(int argc, char **argv) {
+    double threads[64] = {1, 2, 4, 8, 16, 32, 64, 128};
+    double sizes[64] = {1, 10, 100, 1000, 10000};
+    int nthreads = 8, nsizes = 5, modes = 3, batch = 1, qmult = 2, njobs = 0;
+    double target = 0.5;
+    int opt, ti, si, m;
+
+    while ((opt = getopt(argc, argv, "t:s:m:b:q:T:n:h")) >= 0) {
+        switch (opt) {
+        case 't':
+            if ((nthreads = parse_list(optarg, threads, 64)) <= 0) {
+                usage(stderr);
+                return 1;
+            }
+            break;
+        case 's':
+            if ((nsizes = parse_list(optarg, sizes, 64)) <= 0) {
+                usage(stderr);
+                return 1;
+            }
+            break;
+        case 'm':
+            if (strcmp(optarg, "ordered") == 0)        modes = 1;
+            else if (strcmp(optarg, "unordered") == 0) modes = 2;
+            else if (strcmp(optarg, "both") == 0)      modes = 3;
+            else { usage(stderr); return 1; }
+            break;
+        case 'b': batch  = atoi(optarg); break;
+        case 'q': qmult  = atoi(optarg); break;
+        case 'T': target = atof(optarg); break;
+        case 'n': njobs  = atoi(optarg); break;
+        case 'h': usage(stdout); return 0;
+        default:  usage(stderr); return 1;
+        }
+    }
+    if (batch < 1 || qmult < 1) {
+        usage(stderr);
+        return 1;
+    }
+
+    printf("#mode\tthreads\tjob_us\tbatch\tqsize\tjobs\tsecs\tjobs_per_sec"
+           "\tlat_p50_us\tlat_p99_us\tlat_p999_us\tlat_max_us\n");
+
+    for (m = 0; m < 2; m++) {
+        if (!(modes & (1 << m)))
+            continue;
+        for (ti = 0; ti < nthreads; ti++) {
+            for (si = 0; si < nsizes; si++) {
+                bench_conf c;
+                c.ordered  = (m == 0);
+                c.nthreads = (int)threads[ti];
+                c.job_us   = sizes[si];
+                c.batch    = batch;
+                c.qmult    = qmult;
+                c.njobs    = njobs;
+                if (c.nthreads < 1)
+                    continue;
+                if (!c.njobs) {
+                    // Enough jobs to keep every worker busy for the target
+                    // time, within sensible limits.
+                    double n = target * 1e6 * c.nthreads
+                        / (c.job_us > 1 ? c.job_us : 1);
+                    c.njobs = n < 100 ? 100 : n > 1000000 ? 1000000 : (int)n;
+                }
+                if (bench_one(&c) < 0) {
+                    fprintf(stderr, "Benchmark failed for %s, %d threads, "
+                            "%g us\n", c.ordered ? "ordered" : "unordered",
+                            c.nthreads, c.job_us);
+                    return 1;
+                }
+            }
+        }
+    }
+
+    return 0;
+}
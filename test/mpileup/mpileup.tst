@@ -52,6 +52,8 @@ P mp_P.out $pileup -m mp_P.sam
 # Insertions followed by deletions
 P mp_ID.out $pileup mp_ID.sam
 P mp_ID.out $pileup -m mp_ID.sam
+P mp_ID_reg.out $pileup -r z:4-5 -r z:9-10 -r z:12 mp_ID.sam
+P mp_ID_reg.out $pileup -m -r z:4-5 -r z:9-10 -r z:12 mp_ID.sam
 
 # Ref skips
 P mp_N.out $pileup mp_N.sam
@@ -60,6 +62,31 @@ P mp_N.out $pileup -m mp_N.sam
 # Ref skips and deletions
 P mp_N2.out $pileup mp_N2.sam
 P mp_N2.out $pileup -m mp_N2.sam
+P mp_N2.out $pileup -m -@ 2 mp_N2.sam
+
+# Several inputs, with and without read-ahead on prefetch threads, and with
+# the inputs decoded on a shared pool as well
+P mp_N2PD.out $pileup -m mp_N2.sam mp_P.sam mp_D.sam
+P mp_N2PD.out $pileup -m -@ 2 mp_N2.sam mp_P.sam mp_D.sam
+P mp_N2PD.out $pileup -m -@ 2 -P 2 mp_N2.sam mp_P.sam mp_D.sam
+P mp_N2PD.out $pileup -m -@ 1 -P 1 mp_N2.sam mp_P.sam mp_D.sam
+P mp_N2PD_reg.out $pileup -m -r z:3-5 -r z:4-6 -r z:12 mp_N2.sam mp_P.sam mp_D.sam
+P mp_N2PD_reg.out $pileup -m -@ 2 -r z:3-5 -r z:4-6 -r z:12 mp_N2.sam mp_P.sam mp_D.sam
+
+# Overlapping pairs
+P mp_olap.out $pileup -o mp_olap.sam
+P mp_olap.out $pileup -m -o mp_olap.sam
+P mp_olap_reg.out $pileup -o -r z:6-7 -r z:13-14 mp_olap.sam
+
+# Columnar output
+P mp_ID_cols.out $pileup -c mp_ID.sam
+P mp_P_cols.out $pileup -c mp_P.sam
+P mp_olap_cols.out $pileup -c -o mp_olap.sam
+
+# Depth counter
+P mp_ID_depth.out $pileup -d mp_ID.sam
+P mp_N2PD_depth.out $pileup -d mp_N2.sam mp_P.sam mp_D.sam
+P mp_N2PD_depth_reg.out $pileup -d -r z:3-5 -r z:4-6 -r z:12 mp_N2.sam mp_P.sam mp_D.sam
 
 # Various combinations of insertions, deletions and pads
 P c1#pad1.out $pileup c1#pad1.sam
@@ -47,8 +47,10 @@ samtools mpileup -B -Q 0 in.bam | perl -lane \
 #include <errno.h>
 #include <ctype.h>
 #include <unistd.h>
+#include <limits.h>
 #include "htslib/sam.h"
 #include "htslib/kstring.h"
+#include "htslib/thread_pool.h"
 
 #define MIN(a,b) ((a)<(b)?(a):(b))
 
@@ -58,6 +60,13 @@ typedef struct ptest_t {
     bam_hdr_t *fp_hdr;
 } ptest_t;
 
+static int overlaps = 0;
+static int no_maxcnt = 0;
+
+static int skipaln(void *data, bam1_t *b) {
+    return (b->core.flag & (BAM_FUNMAP | BAM_FSECONDARY | BAM_FQCFAIL | BAM_FDUP)) != 0;
+}
+
 static int readaln(void *data, bam1_t *b) {
     ptest_t *g = (ptest_t*)data;
     int ret;
@@ -65,29 +74,31 @@ static int readaln(void *data, bam1_t *b) {
     while (1) {
         ret = sam_read1(g->fp, g->fp_hdr, b);
         if (ret < 0) break;
-        if ( b->core.flag & (BAM_FUNMAP | BAM_FSECONDARY | BAM_FQCFAIL | BAM_FDUP) ) continue;
+        if (skipaln(NULL, b)) continue;
         break;
     }
 
     return ret;
 }
 
-static int print_pileup_seq(const bam_pileup1_t *p, int n) {
+static int format_pileup_seq(kstring_t *out, const bam_pileup1_t *p, int n) {
     kstring_t ks = { 0, 0, NULL };
-    int i;
+    int i, r = 0;
 
     for (i = 0; i < n; i++, p++) {
         uint8_t *seq = bam_get_seq(p->b);
         int del_len, is_rev = bam_is_rev(p->b);
 
-        if (p->is_head)
-            putchar('^'), putchar('!'+MIN(p->b->core.qual,93));
+        if (p->is_head) {
+            r |= kputc('^', out);
+            r |= kputc('!'+MIN(p->b->core.qual,93), out);
+        }
 
         if (p->is_del)
-            putchar(p->is_refskip ? (is_rev ? '<' : '>') : '*');
+            r |= kputc(p->is_refskip ? (is_rev ? '<' : '>') : '*', out);
         else {
             unsigned char c = seq_nt16_str[bam_seqi(seq, p->qpos)];
-            putchar(is_rev ? tolower(c) : toupper(c));
+            r |= kputc(is_rev ? tolower(c) : toupper(c), out);
         }
 
         del_len = -p->indel;
@@ -97,37 +108,72 @@ static int print_pileup_seq(const bam_pileup1_t *p, int n) {
                 perror("bam_plp_insertion");
                 goto fail;
             }
-            printf("%+d(", len);
+            r |= ksprintf(out, "%+d(", len);
             for (j = 0; j < len; j++)
-                putchar(is_rev ?
-                        tolower((uint8_t) ks.s[j]) :
-                        toupper((uint8_t) ks.s[j]));
-            putchar(')');
+                r |= kputc(is_rev ?
+                           tolower((uint8_t) ks.s[j]) :
+                           toupper((uint8_t) ks.s[j]), out);
+            r |= kputc(')', out);
         }
         if (del_len > 0) {
-            printf("-%d()", del_len);
+            r |= ksprintf(out, "-%d()", del_len);
         }
         if (p->is_tail)
-            putchar('$');
+            r |= kputc('$', out);
     }
     free(ks.s);
-    return 0;
+    return r < 0 ? -1 : 0;
 
  fail:
     free(ks.s);
     return -1;
 }
 
-static int test_pileup(ptest_t *input) {
+// Overlap detection changes base qualities, so they are shown too
+static int format_pileup_qual(kstring_t *out, const bam_pileup1_t *p, int n) {
+    int i, r = kputc('\t', out);
+
+    for (i = 0; i < n; i++, p++)
+        r |= kputc(p->is_del ? '!' : '!'+MIN(bam_get_qual(p->b)[p->qpos],93), out);
+    return r < 0 ? -1 : 0;
+}
+
+static int print_pileup_seq(const bam_pileup1_t *p, int n) {
+    kstring_t out = { 0, 0, NULL };
+    int ret = format_pileup_seq(&out, p, n);
+    if (ret == 0 && overlaps)
+        ret = format_pileup_qual(&out, p, n);
+    if (ret == 0 && out.l)
+        fwrite(out.s, 1, out.l, stdout);
+    free(out.s);
+    return ret;
+}
+
+static int test_pileup(ptest_t *input, char **regs, int nregs) {
     bam_plp_t plp = NULL;
+    hts_reglist_t *reglist = NULL;
     const bam_pileup1_t *p;
-    int tid, pos, n = 0;
+    int tid, pos, n = 0, nreglist = 0;
 
     plp = bam_plp_init(readaln, input);
     if (!plp) {
         perror("bam_plp_init");
         goto fail;
     }
+    if (overlaps && bam_plp_init_overlaps(plp) < 0) {
+        perror("bam_plp_init_overlaps");
+        goto fail;
+    }
+    if (no_maxcnt)
+        bam_plp_set_maxcnt(plp, INT_MAX);
+    if (nregs) {
+        reglist = hts_reglist_create(regs, nregs, &nreglist, input->fp_hdr,
+                                     (hts_name2id_f) bam_name2id);
+        if (!reglist || bam_plp_set_regions(plp, reglist, nreglist) < 0) {
+            fprintf(stderr, "Couldn't set up the regions\n");
+            goto fail;
+        }
+    }
     while ((p = bam_plp_auto(plp, &tid, &pos, &n)) != 0) {
         if (tid < 0) break;
         if (tid >= input->fp_hdr->n_targets) {
@@ -150,101 +196,377 @@ static int test_pileup(ptest_t *input) {
     }
 
     bam_plp_destroy(plp);
+    if (reglist) hts_reglist_free(reglist, nreglist);
     return 0;
 
  fail:
     bam_plp_destroy(plp);
+    if (reglist) hts_reglist_free(reglist, nreglist);
     return -1;
 }
 
-static int test_mpileup(ptest_t *input) {
-    bam_mplp_t iter = NULL;
-    const bam_pileup1_t *pileups[1] = { NULL };
-    int n_plp[1] = { 0 };
-    int tid, pos, n = 0;
+// The same column from the separate arrays of bam_plp_auto_cols().  These
+// only hold indel lengths, so inserted bases are not shown, and the
+// qualities and positions in the reads are always listed.
+static int format_pileup_cols(kstring_t *out, const bam_plp_cols_t *c) {
+    int i, r = 0;
+
+    for (i = 0; i < c->n; i++) {
+        int is_rev = c->flags[i] & BAM_PLP_REV;
+        if (c->flags[i] & BAM_PLP_HEAD) {
+            r |= kputc('^', out);
+            r |= kputc('!'+MIN(c->mapq[i],93), out);
+        }
+        if (c->flags[i] & BAM_PLP_DEL)
+            r |= kputc(c->flags[i] & BAM_PLP_REFSKIP ? (is_rev ? '<' : '>') : '*', out);
+        else
+            r |= kputc((is_rev ? tolower : toupper)(seq_nt16_str[c->base[i]]), out);
+        if (c->indel[i] > 0)
+            r |= ksprintf(out, "+%d", c->indel[i]);
+        else if (c->indel[i] < 0)
+            r |= ksprintf(out, "%d", c->indel[i]);
+        if (c->flags[i] & BAM_PLP_TAIL)
+            r |= kputc('$', out);
+    }
+    r |= kputc('\t', out);
+    for (i = 0; i < c->n; i++)
+        r |= kputc('!'+MIN(c->qual[i],93), out);
+    r |= kputc('\t', out);
+    for (i = 0; i < c->n; i++)
+        r |= ksprintf(out, i ? ",%d" : "%d", c->qpos[i]);
+    return r < 0 ? -1 : 0;
+}
+
+static int test_pileup_cols(ptest_t *input) {
+    bam_plp_t plp = NULL;
+    bam_plp_cols_t cols = { 0 };
+    kstring_t out = { 0, 0, NULL };
+    int tid, pos, n, ret = -1;
+
+    plp = bam_plp_init(readaln, input);
+    if (!plp) {
+        perror("bam_plp_init");
+        goto out;
+    }
+    if (overlaps && bam_plp_init_overlaps(plp) < 0) {
+        perror("bam_plp_init_overlaps");
+        goto out;
+    }
+    while ((n = bam_plp_auto_cols(plp, &tid, &pos, &cols)) > 0) {
+        out.l = 0;
+        if (ksprintf(&out, "%s\t%d\t%d\t", input->fp_hdr->target_name[tid],
+                     pos+1, n) < 0
+            || format_pileup_cols(&out, &cols) < 0
+            || kputc('\n', &out) < 0) {
+            perror("format_pileup_cols");
+            goto out;
+        }
+        fwrite(out.s, 1, out.l, stdout);
+    }
+    if (n < 0) {
+        fprintf(stderr, "bam_plp_auto_cols failed for \"%s\"\n", input->fname);
+        goto out;
+    }
+    ret = 0;
 
-    iter = bam_mplp_init(1, readaln, (void **) &input);
+ out:
+    bam_plp_destroy(plp);
+    bam_plp_cols_free(&cols);
+    free(out.s);
+    return ret;
+}
+
+// With several inputs, each line has a count and bases for every input
+static int test_mpileup(ptest_t *input, int n, int nthreads,
+                        char **regs, int nregs) {
+    bam_mplp_t iter = NULL;
+    hts_reglist_t *reglist = NULL;
+    const bam_pileup1_t **pileups = calloc(n, sizeof(*pileups));
+    int *n_plp = calloc(n, sizeof(*n_plp));
+    void **data = calloc(n, sizeof(*data));
+    int tid, pos, i, nreglist = 0, ret = -1;
+
+    if (!pileups || !n_plp || !data) {
+        perror("test_mpileup");
+        goto out;
+    }
+    for (i = 0; i < n; i++)
+        data[i] = &input[i];
+    iter = bam_mplp_init(n, readaln, data);
     if (!iter) {
         perror("bam_plp_init");
-        goto fail;
+        goto out;
     }
-    while ((n = bam_mplp_auto(iter, &tid, &pos, n_plp, pileups)) > 0) {
+    if (overlaps && bam_mplp_init_overlaps(iter) < 0) {
+        perror("bam_mplp_init_overlaps");
+        goto out;
+    }
+    if (nregs) {
+        reglist = hts_reglist_create(regs, nregs, &nreglist, input->fp_hdr,
+                                     (hts_name2id_f) bam_name2id);
+        if (!reglist || bam_mplp_set_regions(iter, reglist, nreglist) < 0) {
+            fprintf(stderr, "Couldn't set up the regions\n");
+            goto out;
+        }
+    }
+    if (nthreads > 0 && bam_mplp_set_threads(iter, nthreads, 2) < 0) {
+        fprintf(stderr, "Couldn't set up the prefetch threads\n");
+        goto out;
+    }
+    // The arrays are scribbled on between calls, as callers may reuse them
+    // for other things; bam_mplp_auto() must set every entry
+    for (;;) {
+        memset(n_plp, 0x55, n * sizeof(*n_plp));
+        memset(pileups, 0x55, n * sizeof(*pileups));
+        if ((i = bam_mplp_auto(iter, &tid, &pos, n_plp, pileups)) <= 0)
+            break;
         if (tid < 0) break;
         if (tid >= input->fp_hdr->n_targets) {
             fprintf(stderr,
                     "bam_mplp_auto returned tid %d >= header n_targets %d\n",
                     tid, input->fp_hdr->n_targets);
-            goto fail;
+            goto out;
         }
 
-        printf("%s\t%d\t%d\t", input->fp_hdr->target_name[tid], pos+1, n_plp[0]);
-
-        if (print_pileup_seq(pileups[0], n_plp[0]) < 0)
-            goto fail;
-
+        printf("%s\t%d", input->fp_hdr->target_name[tid], pos+1);
+        for (i = 0; i < n; i++) {
+            printf("\t%d\t", n_plp[i]);
+            if (print_pileup_seq(pileups[i], n_plp[i]) < 0)
+                goto out;
+        }
         putchar('\n');
     }
-    if (n < 0) {
+    if (i < 0) {
         fprintf(stderr, "bam_plp_auto failed for \"%s\"\n", input->fname);
-        goto fail;
+        goto out;
     }
+    ret = 0;
 
+ out:
     bam_mplp_destroy(iter);
+    if (reglist) hts_reglist_free(reglist, nreglist);
+    free(pileups);
+    free(n_plp);
+    free(data);
+    return ret;
+}
+
+static int sharded_column(void *data, kstring_t *out, int tid, int pos,
+                          int n, const bam_pileup1_t *plp) {
+    ptest_t *input = (ptest_t *) data;
+    if (ksprintf(out, "%s\t%d\t%d\t", input->fp_hdr->target_name[tid], pos+1, n) < 0
+        || format_pileup_seq(out, plp, n) < 0
+        || (overlaps && format_pileup_qual(out, plp, n) < 0)
+        || kputc('\n', out) < 0)
+        return -1;
     return 0;
+}
 
- fail:
-    bam_mplp_destroy(iter);
-    return -1;
+static int sharded_output(void *data, kstring_t *out, int tid, int beg, int end) {
+    return out->l && fwrite(out->s, 1, out->l, stdout) != out->l ? -1 : 0;
 }
 
-int main(int argc, char **argv) {
-    ptest_t g = { NULL, NULL, NULL };
-    int use_mpileup = 0, opt;
+// The same output as test_pileup(), but from windows of an indexed file
+static int test_sharded(ptest_t *input, int window, int nthreads) {
+    bam_pplp_t pp = NULL;
+    hts_idx_t *idx = NULL;
+    htsThreadPool p = { NULL, 0 };
+    int ret = -1;
+
+    if (!(idx = sam_index_load(input->fp, input->fname))) {
+        fprintf(stderr, "Couldn't load the index for \"%s\"\n", input->fname);
+        goto out;
+    }
+    if (nthreads > 0 && !(p.pool = hts_tpool_init(nthreads))) {
+        fprintf(stderr, "Couldn't set up the thread pool\n");
+        goto out;
+    }
+    if (!(pp = bam_pplp_init(input->fp, input->fp_hdr, idx, &p))) {
+        perror("bam_pplp_init");
+        goto out;
+    }
+    bam_pplp_set_window(pp, window);
+    bam_pplp_set_filter(pp, skipaln);
+    if (overlaps)
+        bam_pplp_init_overlaps(pp);
+    if (bam_pplp_run(pp, sharded_column, sharded_output, input) < 0) {
+        fprintf(stderr, "bam_pplp_run failed for \"%s\"\n", input->fname);
+        goto out;
+    }
+    ret = 0;
+
+ out:
+    bam_pplp_destroy(pp);
+    if (p.pool) hts_tpool_destroy(p.pool);
+    if (idx) hts_idx_destroy(idx);
+    return ret;
+}
+
+// Depths counting deletions, so they match the non-refskip pileup counts
+static int test_depth(ptest_t *input, int n, char **regs, int nregs) {
+    bam_depth_t iter = NULL;
+    hts_reglist_t *reglist = NULL;
+    void **data = calloc(n, sizeof(*data));
+    const int *depth;
+    int tid, pos, i, nreglist = 0, ret = -1;
+
+    if (!data) {
+        perror("test_depth");
+        goto out;
+    }
+    for (i = 0; i < n; i++)
+        data[i] = &input[i];
+    iter = bam_depth_init(n, readaln, data);
+    if (!iter) {
+        perror("bam_depth_init");
+        goto out;
+    }
+    bam_depth_set_deletions(iter, 1);
+    if (nregs) {
+        reglist = hts_reglist_create(regs, nregs, &nreglist, input->fp_hdr,
+                                     (hts_name2id_f) bam_name2id);
+        if (!reglist || bam_depth_set_regions(iter, reglist, nreglist) < 0) {
+            fprintf(stderr, "Couldn't set up the regions\n");
+            goto out;
+        }
+    }
+    while ((i = bam_depth_auto(iter, &tid, &pos, &depth)) > 0) {
+        printf("%s\t%d", input->fp_hdr->target_name[tid], pos+1);
+        for (i = 0; i < n; i++)
+            printf("\t%d", depth[i]);
+        putchar('\n');
+    }
+    if (i < 0) {
+        fprintf(stderr, "bam_depth_auto failed for \"%s\"\n", input->fname);
+        goto out;
+    }
+    ret = 0;
+
+ out:
+    bam_depth_destroy(iter);
+    if (reglist) hts_reglist_free(reglist, nreglist);
+    free(data);
+    return ret;
+}
 
-    while ((opt = getopt(argc, argv, "m")) != -1) {
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [-o] [-M] [-c | -r region...] <sorted.sam>\n"
+            "       %s [-o] -m [-@ threads] [-P threads] [-r region]... <sorted.sam>...\n"
+            "       %s [-o] -w window [-@ threads] <indexed.bam>\n"
+            "       %s -d [-r region]... <sorted.sam>...\n",
+            prog, prog, prog, prog);
+}
+
+int main(int argc, char **argv) {
+    ptest_t *g = NULL;
+    char **regs = NULL;
+    int use_mpileup = 0, use_depth = 0, nthreads = 0, nregs = 0, window = 0;
+    int use_cols = 0, decode_threads = 0;
+    htsThreadPool pool = { NULL, 0 };
+    int opt, n = 0, i, ret = EXIT_FAILURE;
+
+    if (!(regs = calloc(argc, sizeof(*regs)))) {
+        perror("pileup");
+        return EXIT_FAILURE;
+    }
+    while ((opt = getopt(argc, argv, "m@:P:dr:w:ocM")) != -1) {
         switch (opt) {
         case 'm':
             use_mpileup = 1;
             break;
+        case 'd':
+            use_depth = 1;
+            break;
+        case 'r':
+            regs[nregs++] = optarg;
+            break;
+        case 'w':
+            window = atoi(optarg);
+            break;
+        case 'o':
+            overlaps = 1;
+            break;
+        case 'c':
+            use_cols = 1;
+            break;
+        case 'M':
+            // No depth limit, as for the sharded driver
+            no_maxcnt = 1;
+            break;
+        case '@':
+            nthreads = atoi(optarg);
+            break;
+        case 'P':
+            // Decode all the inputs on one shared pool
+            decode_threads = atoi(optarg);
+            break;
         default:
-            fprintf(stderr, "Usage: %s [-m] <sorted.sam>\n", argv[0]);
-            return EXIT_FAILURE;
+            usage(argv[0]);
+            goto out;
         }
     }
 
-    if (optind >= argc) {
-        fprintf(stderr, "Usage: %s [-m] <sorted.sam>\n", argv[0]);
-        return EXIT_FAILURE;
+    if (optind >= argc || (!use_mpileup && !use_depth && argc - optind > 1)) {
+        usage(argv[0]);
+        goto out;
     }
 
-    g.fname = argv[optind];
-    g.fp = sam_open(g.fname, "r");
-    if (!g.fp) {
-        fprintf(stderr, "Couldn't open \"%s\" : %s", g.fname, strerror(errno));
-        goto fail;
+    if (!(g = calloc(argc - optind, sizeof(*g)))) {
+        perror("pileup");
+        goto out;
     }
-    g.fp_hdr = sam_hdr_read(g.fp);
-    if (!g.fp_hdr) {
-        fprintf(stderr, "Couldn't read header from \"%s\" : %s",
-                g.fname, strerror(errno));
-        goto fail;
+    if (decode_threads > 0 && !(pool.pool = hts_tpool_init(decode_threads))) {
+        perror("pileup");
+        goto out;
+    }
+    for (n = 0; n < argc - optind; n++) {
+        ptest_t *in = &g[n];
+        in->fname = argv[optind + n];
+        in->fp = sam_open(in->fname, "r");
+        if (!in->fp) {
+            fprintf(stderr, "Couldn't open \"%s\" : %s", in->fname, strerror(errno));
+            goto out;
+        }
+        in->fp_hdr = sam_hdr_read(in->fp);
+        if (!in->fp_hdr) {
+            fprintf(stderr, "Couldn't read header from \"%s\" : %s",
+                    in->fname, strerror(errno));
+            n++;
+            goto out;
+        }
+        if (pool.pool && hts_set_thread_pool(in->fp, &pool) < 0) {
+            fprintf(stderr, "Couldn't set thread pool for \"%s\"\n", in->fname);
+            n++;
+            goto out;
+        }
     }
 
-    if (use_mpileup) {
-        if (test_mpileup(&g) < 0)
-            goto fail;
+    if (window > 0) {
+        if (test_sharded(g, window, nthreads) < 0)
+            goto out;
+    } else if (use_depth) {
+        if (test_depth(g, n, regs, nregs) < 0)
+            goto out;
+    } else if (use_mpileup) {
+        if (test_mpileup(g, n, nthreads, regs, nregs) < 0)
+            goto out;
+    } else if (use_cols) {
+        if (test_pileup_cols(g) < 0)
+            goto out;
     } else {
-        if (test_pileup(&g) < 0)
-            goto fail;
+        if (test_pileup(g, regs, nregs) < 0)
+            goto out;
     }
+    ret = EXIT_SUCCESS;
 
-    bam_hdr_destroy(g.fp_hdr);
-    sam_close(g.fp);
-
-    return EXIT_SUCCESS;
-
- fail:
-    if (g.fp_hdr) bam_hdr_destroy(g.fp_hdr);
-    if (g.fp) sam_close(g.fp);
-    return EXIT_FAILURE;
+ out:
+    for (i = 0; i < n; i++) {
+        if (g[i].fp_hdr) bam_hdr_destroy(g[i].fp_hdr);
+        if (g[i].fp) sam_close(g[i].fp);
+    }
+    if (pool.pool) hts_tpool_destroy(pool.pool);
+    free(g);
+    free(regs);
+    return ret;
 }
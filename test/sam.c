@@ -30,7 +30,9 @@ DEALINGS IN THE SOFTWARE.  */
 #include <string.h>
 #include <stdint.h>
 #include <inttypes.h>
+#include <limits.h>
 #include <math.h>
+#include <errno.h>
 
 // Suppress message for faidx_fetch_nseq(), which we're intentionally testing
 #include "htslib/hts_defs.h"
@@ -40,6 +42,7 @@ DEALINGS IN THE SOFTWARE.  */
 #include "htslib/sam.h"
 #include "htslib/faidx.h"
 #include "htslib/kstring.h"
+#include "simd_internal.h"
 
 int status;
 
@@ -214,6 +217,169 @@ static int test_update_array(bam1_t *aln, const char target_id[2],
     return 0;
 }
 
+// Checks that bam_aux_index_get() agrees with bam_aux_get() for each of
+// the given tags, including after the record has been edited
+static void check_aux_index(bam1_t *aln, const char **tags, int ntags)
+{
+    bam_aux_index_t *idx = bam_aux_index_init();
+    int i, pass, val = 42;
+
+    if (!idx) {
+        fail("bam_aux_index_init failed");
+        return;
+    }
+    for (pass = 0; pass < 3; pass++) {
+        for (i = 0; i < ntags; i++) {
+            uint8_t *a = bam_aux_get(aln, tags[i]);
+            uint8_t *b = bam_aux_index_get(idx, aln, tags[i]);
+            if (a != b)
+                fail("bam_aux_index_get(%s) disagrees with bam_aux_get "
+                     "on pass %d", tags[i], pass);
+        }
+        if (pass == 0) {
+            if (bam_aux_append(aln, "QQ", 'i', 4, (uint8_t *) &val) < 0)
+                fail("bam_aux_append failed");
+        } else if (pass == 1) {
+            uint8_t *p = bam_aux_get(aln, tags[0]);
+            if (!p || bam_aux_del(aln, p) < 0)
+                fail("bam_aux_del failed");
+        }
+    }
+    bam_aux_index_destroy(idx);
+}
+
+// Checks bam_aux_index_get() after edits that move and replace tags while
+// leaving the data length and pointer as they were
+static void check_aux_index_moved(bam1_t *aln)
+{
+    bam_aux_index_t *idx = bam_aux_index_init();
+    static const char *tags[] = { "AA", "BB", "CC" };
+    int32_t one = 1, two = 2, three = 3;
+    uint8_t *data, *p;
+    int l_data, i, step;
+
+    if (!idx) {
+        fail("bam_aux_index_init failed");
+        return;
+    }
+    if (bam_aux_append(aln, "AA", 'i', 4, (uint8_t *) &one) < 0
+        || bam_aux_append(aln, "BB", 'i', 4, (uint8_t *) &two) < 0)
+        fail("bam_aux_append failed");
+    data = aln->data;
+    l_data = aln->l_data;
+    for (step = 0; step < 3; step++) {
+        for (i = 0; i < 3; i++) {
+            uint8_t *a = bam_aux_get(aln, tags[i]);
+            uint8_t *b = bam_aux_index_get(idx, aln, tags[i]);
+            if (a != b)
+                fail("bam_aux_index_get(%s) disagrees with bam_aux_get "
+                     "after %d moves", tags[i], step);
+        }
+        if (step == 0) {
+            // Move AA after BB
+            if (!(p = bam_aux_get(aln, "AA")) || bam_aux_del(aln, p) < 0
+                || bam_aux_append(aln, "AA", 'i', 4, (uint8_t *) &one) < 0)
+                fail("moving AA failed");
+        } else if (step == 1) {
+            // Replace BB with CC
+            if (!(p = bam_aux_get(aln, "BB")) || bam_aux_del(aln, p) < 0
+                || bam_aux_append(aln, "CC", 'i', 4, (uint8_t *) &three) < 0)
+                fail("replacing BB failed");
+        }
+        if (aln->data != data || aln->l_data != l_data)
+            fail("aux edits moved or resized the data");
+    }
+    bam_aux_index_destroy(idx);
+}
+
+// Checks bam_aux_index_get() when a same-sized edit leaves a tag's old
+// offset just after two bytes of another tag's value that spell its name
+static void check_aux_index_stale(bam1_t *aln)
+{
+    bam_aux_index_t *idx = bam_aux_index_init();
+    int32_t val = 0x00414100; // Stored as 00 'A' 'A' 00
+    uint8_t *p;
+
+    if (!idx) {
+        fail("bam_aux_index_init failed");
+        return;
+    }
+    if (bam_aux_append(aln, "XX", 'A', 1, (uint8_t *) "c") < 0
+        || bam_aux_append(aln, "AA", 'i', 4, (uint8_t *) &val) < 0)
+        fail("bam_aux_append failed");
+    if (bam_aux_index_get(idx, aln, "AA") != bam_aux_get(aln, "AA"))
+        fail("bam_aux_index_get(AA) disagrees with bam_aux_get");
+    // Swap XX:A:c for ZZ:Z:"", which moves AA back by four bytes
+    if (!(p = bam_aux_get(aln, "XX")) || bam_aux_del(aln, p) < 0
+        || bam_aux_append(aln, "ZZ", 'Z', 1, (uint8_t *) "") < 0)
+        fail("replacing XX failed");
+    if (bam_aux_index_get(idx, aln, "AA") != bam_aux_get(aln, "AA"))
+        fail("bam_aux_index_get(AA) disagrees with bam_aux_get after edit");
+    if (bam_aux_index_get(idx, aln, "XX") != NULL || errno != ENOENT)
+        fail("bam_aux_index_get(XX) found a deleted tag");
+    bam_aux_index_destroy(idx);
+}
+
+// Checks that a batch of edits gives the same result as making the same
+// changes one at a time
+static void check_aux_edit1(void)
+{
+    static const char sam[] = "data:,"
+"@SQ\tSN:one\tLN:1000\n"
+"r1\t0\tone\t500\t20\t8M\t*\t0\t0\tATGCATGC\tqqqqqqqq\tXA:i:1\tXZ:Z:hello\tXB:B:c,1,2\tXf:f:1.5\tXE:i:100000\n";
+    samFile *in = sam_open(sam, "r");
+    bam_hdr_t *header = in ? sam_hdr_read(in) : NULL;
+    bam1_t *a = bam_init1(), *b = NULL;
+    bam_aux_edit_t *ed = bam_aux_edit_init();
+    kstring_t ks1 = { 0, 0, NULL }, ks2 = { 0, 0, NULL };
+    int16_t arr[3] = { -1, 300, 7 };
+    uint8_t *p;
+
+    if (!header || !a || !ed || sam_read1(in, header, a) < 0
+        || !(b = bam_dup1(a))) {
+        fail("couldn't set up bam_aux_edit test");
+        goto err;
+    }
+
+    if (bam_aux_update_int(a, "XA", 70000) < 0
+        || bam_aux_update_str(a, "XZ", 6, "world") < 0
+        || !(p = bam_aux_get(a, "XB")) || bam_aux_del(a, p) < 0
+        || bam_aux_update_float(a, "Xf", 2.5) < 0
+        || bam_aux_update_int(a, "NN", 5) < 0
+        || bam_aux_update_array(a, "NA", 's', 3, arr) < 0
+        || bam_aux_update_str(a, "NZ", 4, "new") < 0
+        || !(p = bam_aux_get(a, "XE")) || bam_aux_del(a, p) < 0)
+        fail("single aux edits failed");
+
+    if (bam_aux_edit_set_int(ed, "XA", 3) < 0 // overridden below
+        || bam_aux_edit_set_int(ed, "XA", 70000) < 0
+        || bam_aux_edit_set_str(ed, "XZ", 6, "world") < 0
+        || bam_aux_edit_del(ed, "XB") < 0
+        || bam_aux_edit_set_float(ed, "Xf", 2.5) < 0
+        || bam_aux_edit_set_int(ed, "NN", 5) < 0
+        || bam_aux_edit_set_array(ed, "NA", 's', 3, arr) < 0
+        || bam_aux_edit_set(ed, "NZ", 'Z', 4, (const uint8_t *) "new") < 0
+        || bam_aux_edit_del(ed, "XE") < 0
+        || bam_aux_edit_del(ed, "NO") < 0
+        || bam_aux_edit_apply(ed, b) < 0)
+        fail("batched aux edits failed");
+
+    if (sam_format1(header, a, &ks1) < 0 || sam_format1(header, b, &ks2) < 0)
+        fail("sam_format1 failed");
+    else if (strcmp(ks1.s, ks2.s) != 0)
+        fail("batched aux edits gave \"%s\", expected \"%s\"",
+             ks2.s, ks1.s);
+
+ err:
+    free(ks1.s);
+    free(ks2.s);
+    bam_aux_edit_destroy(ed);
+    bam_destroy1(a);
+    bam_destroy1(b);
+    bam_hdr_destroy(header);
+    if (in) sam_close(in);
+}
+
 static int aux_fields1(void)
 {
     static const char sam[] = "data:,"
@@ -256,6 +422,28 @@ static int aux_fields1(void)
     size_t nvals, i;
 
     if (sam_read1(in, header, aln) >= 0) {
+        static const char *tags[] = {
+            "XA", "Xi", "Xf", "Xd", "XZ", "XH", "XB", "B0", "B1", "B2", "B3",
+            "B4", "B5", "Bf", "ZZ", "F2", "Y1", "Y2", "Y3", "Y4", "Y5", "Y6",
+            "Y7", "Y8", "T0", "T5", "TW", "QQ", "NO"
+        };
+        bam1_t *copy = bam_dup1(aln);
+        // Enough tags to make the index grow
+        for (i = 0; copy && i < 40; i++) {
+            char tag[3] = { 'T', '0' + i, 0 };
+            int32_t ival = i;
+            if (bam_aux_append(copy, tag, 'i', 4, (uint8_t *) &ival) < 0)
+                fail("bam_aux_append failed");
+        }
+        check_aux_index(copy, tags, sizeof(tags) / sizeof(tags[0]));
+        bam_destroy1(copy);
+        if ((copy = bam_dup1(aln)) != NULL)
+            check_aux_index_moved(copy);
+        bam_destroy1(copy);
+        if ((copy = bam_dup1(aln)) != NULL)
+            check_aux_index_stale(copy);
+        bam_destroy1(copy);
+
         if ((p = check_bam_aux_get(aln, "XA", 'A')) && bam_aux2A(p) != 'k')
             fail("XA field is '%c', expected 'k'", bam_aux2A(p));
 
@@ -520,7 +708,7 @@ static void samrecord_layout(void)
 
     size_t bam1_t_size, bam1_t_size2;
 
-    bam1_t_size = 36 + sizeof (int) + 4 + sizeof (char *);
+    bam1_t_size = 36 + sizeof (int) + 4 + 4 + sizeof (char *);
 #ifndef BAM_NO_ID
     bam1_t_size += 8;
 #endif
@@ -541,6 +729,217 @@ static void samrecord_layout(void)
                          "test/sam_alignment.tmp.sam_", "w", NULL);
 }
 
+// Reads each record of fname with the given required_fields and checks
+// that it formats to the expected text
+static void check_required_fields2(const char *fname, unsigned int fields,
+                                   const char *expected)
+{
+    samFile *in = sam_open(fname, "r");
+    bam_hdr_t *header = NULL;
+    bam1_t *aln = bam_init1();
+    kstring_t ks = { 0, 0, NULL };
+
+    if (!in || !aln) {
+        fail("couldn't open %s", fname);
+        goto err;
+    }
+    if (hts_set_opt(in, CRAM_OPT_REQUIRED_FIELDS, fields) < 0) {
+        fail("setting required_fields for %s", fname);
+        goto err;
+    }
+    if (!(header = sam_hdr_read(in))) {
+        fail("reading header from %s", fname);
+        goto err;
+    }
+    if (sam_read1(in, header, aln) < 0) {
+        fail("can't read record from %s", fname);
+        goto err;
+    }
+    if (sam_format1(header, aln, &ks) < 0)
+        fail("can't format record from %s", fname);
+    else if (strcmp(ks.s, expected) != 0)
+        fail("%s with required_fields 0x%x gave \"%s\", expected \"%s\"",
+             fname, fields, ks.s, expected);
+
+ err:
+    free(ks.s);
+    bam_destroy1(aln);
+    bam_hdr_destroy(header);
+    if (in) sam_close(in);
+}
+
+static void check_required_fields1(void)
+{
+    static const char sam[] = "data:,"
+"@SQ\tSN:one\tLN:1000\n"
+"@RG\tID:g1\n"
+"r1\t0\tone\t500\t20\t4M\t*\t0\t0\tATGC\tqqqq\tXA:i:1\tRG:Z:g1\tXZ:Z:x\n";
+    static const struct {
+        unsigned int fields;
+        const char *expected;
+    } tests[] = {
+        { INT_MAX, "r1\t0\tone\t500\t20\t4M\t*\t0\t0\tATGC\tqqqq\tXA:i:1\tRG:Z:g1\tXZ:Z:x" },
+        { SAM_QNAME|SAM_POS|SAM_CIGAR,
+          "r1\t0\tone\t500\t20\t4M\t*\t0\t0\t*\t*" },
+        { SAM_SEQ, "r1\t0\tone\t500\t20\t4M\t*\t0\t0\tATGC\t*" },
+        { SAM_SEQ|SAM_QUAL, "r1\t0\tone\t500\t20\t4M\t*\t0\t0\tATGC\tqqqq" },
+        { SAM_RGAUX, "r1\t0\tone\t500\t20\t4M\t*\t0\t0\t*\t*\tRG:Z:g1" },
+        { SAM_AUX, "r1\t0\tone\t500\t20\t4M\t*\t0\t0\t*\t*\tXA:i:1\tRG:Z:g1\tXZ:Z:x" },
+    };
+    const char *bam = "test/sam_required_fields.tmp.bam";
+    size_t i;
+
+    copy_check_alignment(sam, "SAM", bam, "wb", NULL);
+    for (i = 0; i < sizeof(tests) / sizeof(tests[0]); i++) {
+        check_required_fields2(sam, tests[i].fields, tests[i].expected);
+        check_required_fields2(bam, tests[i].fields, tests[i].expected);
+    }
+}
+
+// Checks that sam_read_batch() returns the same records as sam_read1()
+static void check_read_batch1(const char *fname, int max_recs,
+                              size_t max_bytes)
+{
+    samFile *in = sam_open(fname, "r"), *in2 = sam_open(fname, "r");
+    bam_hdr_t *header = in ? sam_hdr_read(in) : NULL;
+    bam_hdr_t *header2 = in2 ? sam_hdr_read(in2) : NULL;
+    bam_batch_t *batch = bam_batch_init(max_recs, max_bytes);
+    bam1_t *aln = bam_init1();
+    int i, n, total = 0;
+
+    if (!header || !header2 || !batch || !aln) {
+        fail("couldn't set up batch reading of %s", fname);
+        goto err;
+    }
+
+    while ((n = sam_read_batch(in, header, batch)) > 0) {
+        if (n != batch->n || n > max_recs)
+            fail("sam_read_batch returned %d, batch has %d", n, batch->n);
+        for (i = 0; i < batch->n; i++) {
+            const bam1_t *b = &batch->b[i];
+            if (sam_read1(in2, header2, aln) < 0) {
+                fail("%s: batch has more records than sam_read1", fname);
+                goto err;
+            }
+            if (memcmp(&b->core, &aln->core, sizeof(b->core)) != 0
+                || b->l_data != aln->l_data
+                || memcmp(b->data, aln->data, b->l_data) != 0)
+                fail("%s: batched record %d differs", fname, total + i);
+            if ((uintptr_t) b->data % 8 != 0)
+                fail("%s: batched record %d is misaligned", fname, total + i);
+        }
+        total += n;
+    }
+    if (n < -1)
+        fail("sam_read_batch failed on %s", fname);
+    if (sam_read1(in2, header2, aln) != -1)
+        fail("%s: batch reading stopped early after %d records", fname, total);
+
+ err:
+    bam_destroy1(aln);
+    bam_batch_destroy(batch);
+    bam_hdr_destroy(header);
+    bam_hdr_destroy(header2);
+    if (in) sam_close(in);
+    if (in2) sam_close(in2);
+}
+
+// Checks the q<<5 | strand<<4 | base words made for errmod_cal()
+static void check_plp_cols_errmod1(void)
+{
+    enum { N = 9 };
+    uint8_t base[N] = { 1, 2, 4, 8, 15, 1, 0, 0, 1 };
+    uint8_t qual[N] = { 30, 50, 70, 70, 30, 5, 40, 40, 10 };
+    uint8_t mapq[N] = { 60, 20, 255, 100, 60, 60, 60, 60, 60 };
+    uint8_t flags[N] = { 0, BAM_PLP_REV, 0, BAM_PLP_REV, 0, 0, BAM_PLP_DEL,
+                         BAM_PLP_DEL | BAM_PLP_REFSKIP, 0 };
+    int32_t qpos[N] = { 0 }, indel[N] = { 0 };
+    bam_plp_cols_t c = { N, N, base, qual, mapq, flags, qpos, indel };
+    // A, q30; C reverse, capped by MAPQ 20; G, capped at 63 with MAPQ 255;
+    // T reverse, capped at 63; N as 4; then A at exactly min_baseq.
+    // The low quality base, deletion and reference skip are left out.
+    static const uint16_t expected[] = {
+        30<<5 | 0, 20<<5 | 16 | 1, 63<<5 | 2, 63<<5 | 16 | 3, 30<<5 | 4,
+        10<<5 | 0
+    };
+    uint16_t out[N];
+    int n, i;
+
+    n = bam_plp_cols_errmod(&c, 10, out);
+    if (n != sizeof(expected) / sizeof(expected[0])) {
+        fail("bam_plp_cols_errmod returned %d bases, expected %d", n,
+             (int) (sizeof(expected) / sizeof(expected[0])));
+        return;
+    }
+    for (i = 0; i < n; i++)
+        if (out[i] != expected[i])
+            fail("bam_plp_cols_errmod base %d is %#x, expected %#x",
+                 i, out[i], expected[i]);
+
+    // With no minimum the low quality base is kept, but not the others
+    n = bam_plp_cols_errmod(&c, 0, out);
+    if (n != 7 || out[5] != (5<<5 | 0))
+        fail("bam_plp_cols_errmod with min_baseq 0 returned %d bases", n);
+}
+
+static void check_bam_pool1(void)
+{
+    enum { NRECS = 3000 };
+    static const char sam[] = "data:,"
+"@SQ\tSN:one\tLN:1000\n"
+"r1\t0\tone\t500\t20\t8M\t*\t0\t0\tATGCATGC\tqqqqqqqq\tXA:i:1\n";
+    samFile *in = sam_open(sam, "r");
+    bam_hdr_t *header = in ? sam_hdr_read(in) : NULL;
+    bam1_t *aln = bam_init1(), *recs[NRECS], *b;
+    bam_pool_t *pool = bam_pool_init();
+    int i, val;
+
+    if (!header || !aln || !pool || sam_read1(in, header, aln) < 0) {
+        fail("couldn't set up bam_pool test");
+        goto err;
+    }
+
+    // More records than fit in one slab, some of them grown after allocation
+    for (i = 0; i < NRECS; i++) {
+        if (!(recs[i] = bam_pool_dup1(pool, aln))) {
+            fail("bam_pool_dup1 failed");
+            goto err;
+        }
+        val = i;
+        if (i % 3 == 0
+            && bam_aux_append(recs[i], "XN", 'i', 4, (uint8_t *) &val) < 0)
+            fail("bam_aux_append to pooled record failed");
+    }
+    for (i = 0; i < NRECS; i++) {
+        uint8_t *p = bam_aux_get(recs[i], "XN");
+        if (recs[i]->l_data < aln->l_data
+            || memcmp(recs[i]->data, aln->data, aln->l_data) != 0)
+            fail("pooled record %d is corrupt", i);
+        if (i % 3 == 0 && (!p || bam_aux2i(p) != i))
+            fail("pooled record %d has lost its XN tag", i);
+    }
+
+    // Released records are reused, and come back empty
+    for (i = 0; i < NRECS; i += 2)
+        bam_pool_free(pool, recs[i]);
+    for (i = 0; i < NRECS; i += 2) {
+        if (!(b = bam_pool_alloc(pool, 100))) {
+            fail("bam_pool_alloc failed");
+            goto err;
+        }
+        if (b->l_data != 0 || b->core.l_qseq != 0 || b->core.tid != 0)
+            fail("bam_pool_alloc returned a record that is not empty");
+        recs[i] = bam_copy1(b, aln);
+    }
+    bam_pool_free(pool, recs[1]);
+
+ err:
+    bam_pool_destroy(pool);
+    bam_destroy1(aln);
+    bam_hdr_destroy(header);
+    if (in) sam_close(in);
+}
+
 static void faidx1(const char *filename)
 {
     int n, n_exp = 0, n_fq_exp = 0;
@@ -589,6 +988,119 @@ static void check_enum1(void)
     if (bgzf != 2) fail("bgzf is %d", bgzf);
 }
 
+// Compares the vector kernels at each supported level with the portable C
+static void check_simd1(void)
+{
+    enum { MAXLEN = 1100 };
+    static char seq[MAXLEN], text[2][MAXLEN];
+    static uint8_t nib[MAXLEN], out[2][MAXLEN], qual[MAXLEN];
+    static uint8_t base[2][MAXLEN], bq[2][MAXLEN], qa[2][MAXLEN], qb[2][MAXLEN];
+    int level, pass;
+    size_t len, i;
+
+    srand(1234);
+    for (i = 0; i < MAXLEN; i++) {
+        seq[i] = rand() & 0xff;   // includes characters that aren't bases
+        nib[i] = rand() & 0xff;
+        qual[i] = rand() % 94;
+        // Overlapping bases agree about half the time, and quals often tie
+        base[0][i] = rand() & 3;
+        base[1][i] = rand() & 1 ? base[0][i] : rand() & 15;
+        bq[0][i] = rand() & 0xff;
+        bq[1][i] = rand() & 3 ? rand() & 0xff : bq[0][i];
+    }
+
+    // The portable version against the obvious code
+    hts_simd_set_level(HTS_SIMD_NONE);
+    hts_nibble_pack(seq, out[0], MAXLEN);
+    for (i = 0; i < MAXLEN; i++)
+        if (bam_seqi(out[0], i) != seq_nt16_table[(unsigned char) seq[i]])
+            fail("hts_nibble_pack base %zu", i);
+    memcpy(qa[0], bq[0], MAXLEN);
+    memcpy(qb[0], bq[1], MAXLEN);
+    hts_qual_overlap(qa[0], qb[0], base[0], base[1], MAXLEN);
+    for (i = 0; i < MAXLEN; i++) {
+        int a = bq[0][i], b = bq[1][i];
+        uint8_t ea = 0, eb = 0;
+        if (base[0][i] == base[1][i]) ea = a + b > 200 ? 200 : a + b;
+        else if (a >= b) ea = 0.8 * a;
+        else eb = 0.8 * b;
+        if (qa[0][i] != ea || qb[0][i] != eb)
+            fail("hts_qual_overlap position %zu", i);
+    }
+
+    for (level = HTS_SIMD_SSSE3; level <= HTS_SIMD_NEON; level++) {
+        if (!hts_simd_supported(level)) continue;
+        const char *name = hts_simd_level_name(level);
+
+        for (len = 0; len < MAXLEN; len += len < 300 ? 1 : 97) {
+            size_t nb = (len + 1) / 2;
+            int r[2];
+
+            for (pass = 0; pass < 2; pass++) {
+                hts_simd_set_level(pass ? level : HTS_SIMD_NONE);
+                memset(text[pass], 0, MAXLEN);
+                hts_nibble_unpack(nib, text[pass], len, seq_nt16_str);
+            }
+            if (memcmp(text[0], text[1], MAXLEN) != 0)
+                fail("%s hts_nibble_unpack length %zu", name, len);
+
+            for (pass = 0; pass < 2; pass++) {
+                hts_simd_set_level(pass ? level : HTS_SIMD_NONE);
+                memset(out[pass], 0, MAXLEN);
+                hts_nibble_pack(seq, out[pass], len);
+            }
+            if (memcmp(out[0], out[1], MAXLEN) != 0)
+                fail("%s hts_nibble_pack length %zu", name, len);
+
+            for (pass = 0; pass < 2; pass++) {
+                hts_simd_set_level(pass ? level : HTS_SIMD_NONE);
+                memset(out[pass], 0, MAXLEN);
+                hts_nibble_revcomp(nib, out[pass], len);
+            }
+            if (memcmp(out[0], out[1], nb) != 0)
+                fail("%s hts_nibble_revcomp length %zu", name, len);
+            for (i = 0; i < len; i++)
+                if (bam_seqi(out[1], i) != seq_nt16_table[(unsigned char) "=TGKCYSBAWRDMHVN"[bam_seqi(nib, len - 1 - i)]])
+                    break;
+            if (i < len)
+                fail("%s hts_nibble_revcomp length %zu base %zu", name, len, i);
+
+            for (pass = 0; pass < 2; pass++) {
+                hts_simd_set_level(pass ? level : HTS_SIMD_NONE);
+                memset(text[pass], 0, MAXLEN);
+                hts_qual_add(text[pass], qual, len, 33);
+            }
+            if (memcmp(text[0], text[1], MAXLEN) != 0)
+                fail("%s hts_qual_add length %zu", name, len);
+
+            // Valid, then with one out of range character near the end
+            for (i = 0; i < 2 && len; i++) {
+                if (i) text[0][len - 1] = ' ';
+                for (pass = 0; pass < 2; pass++) {
+                    hts_simd_set_level(pass ? level : HTS_SIMD_NONE);
+                    r[pass] = hts_qual_sub(out[pass], text[0], len, 33) != 0;
+                }
+                if (r[0] != (int) i || r[1] != (int) i
+                    || (!i && memcmp(out[0], out[1], len) != 0))
+                    fail("%s hts_qual_sub length %zu", name, len);
+            }
+
+            for (pass = 0; pass < 2; pass++) {
+                hts_simd_set_level(pass ? level : HTS_SIMD_NONE);
+                memcpy(qa[pass], bq[0], MAXLEN);
+                memcpy(qb[pass], bq[1], MAXLEN);
+                hts_qual_overlap(qa[pass], qb[pass], base[0], base[1], len);
+            }
+            if (memcmp(qa[0], qa[1], MAXLEN) != 0
+                || memcmp(qb[0], qb[1], MAXLEN) != 0)
+                fail("%s hts_qual_overlap length %zu", name, len);
+        }
+    }
+
+    hts_simd_set_level(HTS_SIMD_NONE);
+}
+
 int main(int argc, char **argv)
 {
     int i;
@@ -599,6 +1111,14 @@ int main(int argc, char **argv)
     iterators1();
     samrecord_layout();
     check_enum1();
+    check_simd1();
+    check_required_fields1();
+    check_bam_pool1();
+    check_plp_cols_errmod1();
+    check_aux_edit1();
+    check_read_batch1("test/sam_alignment.tmp.bam", 2, 0);
+    check_read_batch1("test/sam_alignment.tmp.sam_", 100, 1);
+    check_read_batch1("test/ce#5b.sam", 3, 0);
     for (i = 1; i < argc; i++) faidx1(argv[i]);
 
     return status;
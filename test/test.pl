@@ -655,6 +655,71 @@ sub test_index
     unlink("$$opts{tmp}/index.vcf.gz.tbi");
     test_compare($opts,"$$opts{path}/test_index -t $$opts{tmp}/index.vcf.gz", "$$opts{tmp}/index.vcf.gz.tbi", "$$opts{path}/index.vcf.gz.tbi", gz=>1);
 
+    # Multi-threaded indexing must give the same result as single threaded.
+    # The files are uncompressed so that they span enough BGZF blocks.
+    test_index_threads($opts, "$$opts{path}/ce#1000.sam", "index_mt.bam", "-l 0 -b", [ "-b", "-c" ]);
+    test_index_threads($opts, "$$opts{path}/ce#1000.sam", "index_mt.sam.gz", "-l 0 -z", [ "-b", "-c" ]);
+    my $vcf = "$$opts{tmp}/index_mt.vcf";
+    open(my $fh, '>', $vcf) or error("$vcf: $!");
+    print $fh "##fileformat=VCFv4.2\n";
+    print $fh "##contig=<ID=$_,length=100000000>\n" for (1..4);
+    print $fh "##INFO=<ID=END,Number=1,Type=Integer,Description=\"End position\">\n";
+    print $fh "#CHROM\tPOS\tID\tREF\tALT\tQUAL\tFILTER\tINFO\n";
+    for my $chr (3, 1, 4, 2) {
+        for my $i (1..2000) {
+            my $pos = $i * 997 + ($i % 7) * 13;
+            my $info = $i % 50 ? "." : "END=" . ($pos + 25000);
+            print $fh "$chr\t$pos\t.\tACGT\tA\t50\tPASS\t$info\n";
+        }
+    }
+    close($fh) or error("$vcf: $!");
+    test_index_threads($opts, $vcf, "index_mt.bcf", "-l 0 -b", [ "-c" ]);
+    test_index_threads($opts, $vcf, "index_mt.vcf.gz", "-l 0 -z", [ "-c", "-t" ]);
+
+    # Reading every shard of a file must give back all of its records
+    my $sam = "$$opts{tmp}/shard.sam";
+    open($fh, '>', $sam) or error("$sam: $!");
+    print $fh "\@SQ\tSN:chr$_\tLN:2000000\n" for (1..3);
+    my $seq = "ACGTTGCA" x 8;
+    my $qual = "I" x length($seq);
+    for my $tid (1..3) {
+        for my $i (1..3000) {
+            my $pos = $i * 577 + ($i % 5) * 11;
+            print $fh "r$tid.$i\t", ($i % 2 ? 0 : 16), "\tchr$tid\t$pos\t60\t64M\t*\t0\t0\t$seq\t$qual\tNM:i:", $i % 3, "\n";
+        }
+    }
+    print $fh "u$_\t4\t*\t0\t0\t*\t*\t0\t0\t$seq\t$qual\n" for (1..300);
+    close($fh) or error("$sam: $!");
+    _cmd("$$opts{path}/test_view -l 0 -b $sam > $$opts{tmp}/shard.bam");
+    _cmd("$$opts{path}/test_index -b $$opts{tmp}/shard.bam");
+    _cmd("$$opts{path}/test_view -C -o no_ref=1 -o seqs_per_slice=200 $sam > $$opts{tmp}/shard.cram");
+    _cmd("$$opts{path}/test_index $$opts{tmp}/shard.cram");
+    test_shards($opts, "$$opts{tmp}/$_") for ("shard.bam", "shard.cram", "index_mt.bcf", "index_mt.vcf.gz");
+
+    # Multi-region iteration must give the same reads with threads
+    my @regs = map { my $c = $_; map { "chr$c:" . ($_ * 15013 + 1) . "-" . ($_ * 15013 + 400) } (0..115) } (1..3);
+    push @regs, "chr2:100000-300000", "chr2:250000-260000", "*";
+    test_multi_region_threads($opts, "shard.bam", \@regs);
+
+    # Sharding a pileup into windows must not change the columns, even
+    # where the depth is over the default limit of a single pileup
+    test_pileup_windows($opts, "shard.bam");
+    my $deep = "$$opts{tmp}/deep.sam";
+    open($fh, '>', $deep) or error("$deep: $!");
+    print $fh "\@SQ\tSN:chr1\tLN:5000\n";
+    for my $pos (960..1040) {
+        print $fh "d$pos.$_\t", ($_ % 2 ? 0 : 16), "\tchr1\t$pos\t60\t64M\t*\t0\t0\t$seq\t$qual\n" for (1..150);
+    }
+    close($fh) or error("$deep: $!");
+    _cmd("$$opts{path}/test_view -l 0 -b $deep > $$opts{tmp}/deep.bam");
+    _cmd("$$opts{path}/test_index -b $$opts{tmp}/deep.bam");
+    test_pileup_windows($opts, "deep.bam");
+
+    # Lazy and cached index loading must give the same queries
+    test_idx_load($opts, "shard.bam", "bai");
+    test_idx_load($opts, "index_mt.bcf", "csi");
+    test_idx_load($opts, "index_mt.vcf.gz", "tbi");
+
     # Tabix and custom index names
     _cmd("$$opts{bin}/tabix -fp vcf $$opts{tmp}/index.vcf.gz");
     my $wtmp = $$opts{tmp};
@@ -664,6 +729,72 @@ sub test_index
     test_cmd($opts,out=>'tabix.out',cmd=>"$$opts{bin}/tabix $wtmp/index.vcf.gz##idx##$wtmp/index.vcf.gz.tbi 1:10000060-10000060");
 }
 
+sub test_shards
+{
+    my ($opts, $fn) = @_;
+    my $cmd = "$$opts{path}/test_shard $fn";
+    print "test_shards:\n\t$cmd\n";
+    my ($ret, $out) = _cmd($cmd);
+    if ($ret) { failed($opts, "test_shards", $out); return; }
+    passed($opts, "test_shards");
+}
+
+sub test_multi_region_threads
+{
+    my ($opts, $fn, $regs) = @_;
+    my $in = "$$opts{tmp}/$fn";
+    my $out = "$$opts{tmp}/$fn.regions";
+    my $args = join(" ", map { "'$_'" } @$regs);
+
+    _cmd("$$opts{path}/test_view -M $in $args > $out.serial");
+    for my $nthreads (1, 4) {
+        test_compare($opts, "$$opts{path}/test_view -@ $nthreads -M $in $args > $out", "$out.serial", $out);
+    }
+    # Forcing each query plan must not change which reads are returned
+    for my $plan (1, 2, 3) {
+        test_compare($opts, "$$opts{path}/test_view -P $plan -M $in $args > $out", "$out.serial", $out);
+    }
+}
+
+sub test_pileup_windows
+{
+    my ($opts, $fn) = @_;
+    my $in = "$$opts{tmp}/$fn";
+    my $out = "$$opts{tmp}/$fn.pileup";
+
+    for my $args ("", "-o") {
+        _cmd("$$opts{path}/pileup -M $args $in > $out.serial");
+        for my $shard ("-w 1000", "-w 97 -@ 4", "-w 100000 -@ 2") {
+            test_compare($opts, "$$opts{path}/pileup $args $shard $in > $out", "$out.serial", $out);
+        }
+    }
+}
+
+sub test_idx_load
+{
+    my ($opts, $fn, $fmt) = @_;
+    my $cmd = "$$opts{path}/test_idx_load $$opts{tmp}/$fn $fmt";
+    print "test_idx_load:\n\t$cmd\n";
+    my ($ret, $out) = _cmd($cmd);
+    if ($ret) { failed($opts, "test_idx_load", $out); return; }
+    passed($opts, "test_idx_load");
+}
+
+sub test_index_threads
+{
+    my ($opts, $in, $out, $view_args, $index_args) = @_;
+    my $fn = "$$opts{tmp}/$out";
+    my %suffix = ( "-b" => "bai", "-c" => "csi", "-t" => "tbi" );
+
+    _cmd("$$opts{path}/test_view $view_args '$in' > $fn");
+    for my $arg (@$index_args) {
+        my $idx = "$fn.$suffix{$arg}";
+        _cmd("$$opts{path}/test_index $arg $fn");
+        rename($idx, "$idx.serial");
+        test_compare($opts, "$$opts{path}/test_index $arg -@ 4 $fn", "$idx.serial", $idx, $arg eq "-b" ? () : (gz=>1));
+    }
+}
+
 sub test_vcf_api
 {
     my ($opts,%args) = @_;
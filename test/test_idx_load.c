@@ -0,0 +1,156 @@
+/*  test/test_idx_load.c -- hts_idx_load3() test harness.
+
+    Copyright (C) 2019 Genome Research Ltd.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.  */
+
+/*
+ * Loads an index normally, lazily, through the cache file (twice, so
+ * that the cache is first made and then used) and through the shared
+ * index cache, and checks that every way gives the same statistics and
+ * the same iterator chunks for a series of regions.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+#include "htslib/hts.h"
+
+static const char *any_name(void *data, int tid) {
+    return "x";
+}
+
+static int check_itr(const hts_idx_t *a, const hts_idx_t *b,
+                     int tid, int beg, int end) {
+    hts_itr_t *ia = hts_itr_query(a, tid, beg, end, NULL);
+    hts_itr_t *ib = hts_itr_query(b, tid, beg, end, NULL);
+    int i, ret = -1;
+
+    if (!ia || !ib) {
+        if (!ia && !ib) ret = 0;
+        goto out;
+    }
+    if (ia->n_off != ib->n_off || ia->finished != ib->finished
+        || ia->read_rest != ib->read_rest || ia->curr_off != ib->curr_off)
+        goto out;
+    for (i = 0; i < ia->n_off; i++)
+        if (ia->off[i].u != ib->off[i].u || ia->off[i].v != ib->off[i].v)
+            goto out;
+    ret = 0;
+
+ out:
+    if (ret < 0)
+        fprintf(stderr, "Iterators differ for %d:%d-%d\n", tid, beg, end);
+    hts_itr_destroy(ia);
+    hts_itr_destroy(ib);
+    return ret;
+}
+
+static int compare(const hts_idx_t *a, const hts_idx_t *b) {
+    static const int special[] = { HTS_IDX_START, HTS_IDX_NOCOOR, HTS_IDX_REST };
+    const char **na, **nb;
+    uint64_t ma, ua, mb, ub;
+    int n, tid, pos, i, ret = 0;
+
+    na = hts_idx_seqnames(a, &n, any_name, NULL);
+    nb = hts_idx_seqnames(b, &i, any_name, NULL);
+    free(na);
+    free(nb);
+    if (n != i) {
+        fprintf(stderr, "Got %d names, expected %d\n", i, n);
+        return -1;
+    }
+    if (hts_idx_get_n_no_coor(a) != hts_idx_get_n_no_coor(b)) {
+        fprintf(stderr, "Unplaced read counts differ\n");
+        return -1;
+    }
+    for (i = 0; i < sizeof(special) / sizeof(special[0]); i++)
+        if (check_itr(a, b, special[i], 0, 0) < 0) ret = -1;
+
+    for (tid = 0; tid < 64; tid++) {
+        int ra = hts_idx_get_stat(a, tid, &ma, &ua);
+        int rb = hts_idx_get_stat(b, tid, &mb, &ub);
+        if (ra != rb || ma != mb || ua != ub) {
+            fprintf(stderr, "Statistics for %d differ\n", tid);
+            ret = -1;
+        }
+        if (check_itr(a, b, tid, 0, INT_MAX) < 0) ret = -1;
+        for (pos = 0; pos < 3000000; pos += 77777)
+            if (check_itr(a, b, tid, pos, pos + 50000) < 0) ret = -1;
+    }
+    return ret;
+}
+
+int main(int argc, char **argv) {
+    static const int flags[] = { HTS_IDX_LAZY, HTS_IDX_CACHE, HTS_IDX_CACHE };
+    static const char *names[] = { "lazy", "cache (new)", "cache (reused)" };
+    hts_idx_t *ref;
+    int fmt, i, failed = 0;
+
+    fmt = argc != 3 ? -1
+        : strcmp(argv[2], "bai") == 0 ? HTS_FMT_BAI
+        : strcmp(argv[2], "tbi") == 0 ? HTS_FMT_TBI
+        : strcmp(argv[2], "csi") == 0 ? HTS_FMT_CSI : -1;
+    if (fmt < 0) {
+        fprintf(stderr, "Usage: test_idx_load in.{bam,bcf,vcf.gz} bai|csi|tbi\n");
+        return EXIT_FAILURE;
+    }
+
+    if (!(ref = hts_idx_load3(argv[1], NULL, fmt, 0))) {
+        fprintf(stderr, "Couldn't load the index for \"%s\"\n", argv[1]);
+        return EXIT_FAILURE;
+    }
+
+    for (i = 0; i < sizeof(flags) / sizeof(flags[0]); i++) {
+        hts_idx_t *idx = hts_idx_load3(argv[1], NULL, fmt, flags[i]);
+        if (!idx || compare(ref, idx) < 0) {
+            fprintf(stderr, "Failed: %s loading of \"%s\"\n", names[i], argv[1]);
+            failed++;
+        }
+        hts_idx_destroy(idx);
+    }
+
+    // With sharing enabled, loading again gives the same copy
+    hts_idx_set_shared_limit(1 << 30);
+    for (i = 0; i < 2; i++) {
+        hts_idx_t *idx = hts_idx_load3(argv[1], NULL, fmt, flags[i]);
+        hts_idx_t *idx2 = hts_idx_load3(argv[1], NULL, fmt, 0);
+        if (!idx || idx != idx2 || compare(ref, idx) < 0) {
+            fprintf(stderr, "Failed: shared loading of \"%s\"\n", argv[1]);
+            failed++;
+        }
+        hts_idx_destroy(idx);
+        hts_idx_destroy(idx2);
+        // Drop the unused copy, so the next round loads it afresh
+        hts_idx_set_shared_limit(0);
+        hts_idx_set_shared_limit(1 << 30);
+    }
+    hts_idx_set_shared_limit(0);
+    hts_idx_destroy(ref);
+
+    if (failed) {
+        fprintf(stderr, "%d index loading tests failed\n", failed);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
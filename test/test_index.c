@@ -35,18 +35,20 @@ void usage(FILE *fp) {
     fprintf(fp, "  -c       Use CSI index (BAM, SAM, VCF, BCF)\n");
     fprintf(fp, "  -t       Use TBI index (VCF) \n");
     fprintf(fp, "  -m bits  Adjust min_shift; implies CSI\n");
+    fprintf(fp, "  -@ INT   Number of threads to use\n");
     fprintf(fp, "\nThe default index format is CSI for sam/bam/vcf/bcf and CRAI for crams\n");
     exit(fp == stderr ? 1 : 0);
 }
 
 int main(int argc, char **argv) {
-    int c, min_shift = 14;
+    int c, min_shift = 14, nthreads = 0;
 
-    while ((c = getopt(argc, argv, "bctm:")) >= 0) {
+    while ((c = getopt(argc, argv, "bctm:@:")) >= 0) {
         switch (c) {
         case 't': case 'b': min_shift = 0; break;
         case 'c': min_shift = 14; break;
         case 'm': min_shift = atoi(optarg); break;
+        case '@': nthreads = atoi(optarg); break;
         case 'h': usage(stdout);
         default:  usage(stderr);
         }
@@ -64,9 +66,9 @@ int main(int argc, char **argv) {
     if (in->format.format == sam ||
         in->format.format == bam ||
         in->format.format == cram) {
-        ret = sam_index_build(argv[optind], min_shift);
+        ret = sam_index_build3(argv[optind], NULL, min_shift, nthreads);
     } else {
-        ret = bcf_index_build(argv[optind], min_shift);
+        ret = bcf_index_build3(argv[optind], NULL, min_shift, nthreads);
     }
 
     if (ret < 0) {
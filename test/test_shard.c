@@ -0,0 +1,296 @@
+/*  test/test_shard.c -- hts_idx_shards() test harness.
+
+    Copyright (C) 2019 Genome Research Ltd.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.  */
+
+/*
+ * Reads an indexed file from start to end, then splits it into shards in
+ * several ways and reads each shard with its iterator.  Taken in order,
+ * the shards must give back exactly the records read sequentially, and
+ * their record counts must add up to the totals in the index.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "htslib/sam.h"
+#include "htslib/vcf.h"
+#include "htslib/tbx.h"
+#include "htslib/kstring.h"
+#include "htslib/kseq.h"
+
+typedef struct {
+    kstring_t *r;
+    size_t n, m;
+} rec_list;
+
+enum kind { SAM_KIND, BCF_KIND, VCF_KIND };
+
+typedef struct {
+    enum kind kind;
+    htsFile *fp;
+    bam_hdr_t *sam_hdr;
+    bcf_hdr_t *bcf_hdr;
+    hts_idx_t *idx;
+    tbx_t *tbx;
+    bam1_t *b;
+    bcf1_t *v;
+    kstring_t str;
+} reader;
+
+// Records are compared as flat strings of their in-memory contents
+static int push(rec_list *l, const void *a, size_t la,
+                const void *b, size_t lb) {
+    kstring_t *s;
+    if (l->n == l->m) {
+        size_t m = l->m ? l->m * 2 : 256;
+        kstring_t *nr = realloc(l->r, m * sizeof(*nr));
+        if (!nr) return -1;
+        l->r = nr;
+        l->m = m;
+    }
+    s = &l->r[l->n];
+    s->l = s->m = 0;
+    s->s = NULL;
+    if (kputsn(a, la, s) < 0 || kputsn(b, lb, s) < 0) {
+        free(s->s);
+        return -1;
+    }
+    l->n++;
+    return 0;
+}
+
+static int push_current(reader *rd, rec_list *l) {
+    switch (rd->kind) {
+    case SAM_KIND:
+        return push(l, &rd->b->core, sizeof(rd->b->core),
+                    rd->b->data, rd->b->l_data);
+    case BCF_KIND:
+        return push(l, rd->v->shared.s, rd->v->shared.l,
+                    rd->v->indiv.s, rd->v->indiv.l);
+    default:
+        return push(l, rd->str.s, rd->str.l, "", 0);
+    }
+}
+
+static void clear(rec_list *l) {
+    size_t i;
+    for (i = 0; i < l->n; i++)
+        free(l->r[i].s);
+    l->n = 0;
+}
+
+static int reader_open(reader *rd, const char *fn) {
+    memset(rd, 0, sizeof(*rd));
+    if (!(rd->fp = hts_open(fn, "r"))) return -1;
+    switch (rd->fp->format.format) {
+    case sam: case bam: case cram:
+        rd->kind = SAM_KIND;
+        if (!(rd->sam_hdr = sam_hdr_read(rd->fp))) return -1;
+        if (!(rd->b = bam_init1())) return -1;
+        rd->idx = sam_index_load(rd->fp, fn);
+        break;
+    case bcf:
+        rd->kind = BCF_KIND;
+        if (!(rd->bcf_hdr = bcf_hdr_read(rd->fp))) return -1;
+        if (!(rd->v = bcf_init())) return -1;
+        rd->idx = bcf_index_load(fn);
+        break;
+    case vcf:
+        rd->kind = VCF_KIND;
+        if (!(rd->tbx = tbx_index_load(fn))) return -1;
+        rd->idx = rd->tbx->idx;
+        break;
+    default:
+        return -1;
+    }
+    return rd->idx ? 0 : -1;
+}
+
+static void reader_close(reader *rd) {
+    if (rd->tbx)
+        tbx_destroy(rd->tbx);
+    else if (rd->idx)
+        hts_idx_destroy(rd->idx);
+    if (rd->sam_hdr) bam_hdr_destroy(rd->sam_hdr);
+    if (rd->bcf_hdr) bcf_hdr_destroy(rd->bcf_hdr);
+    if (rd->b) bam_destroy1(rd->b);
+    if (rd->v) bcf_destroy(rd->v);
+    if (rd->fp) hts_close(rd->fp);
+    free(rd->str.s);
+}
+
+static int read_all(reader *rd, rec_list *l) {
+    int r;
+    for (;;) {
+        switch (rd->kind) {
+        case SAM_KIND: r = sam_read1(rd->fp, rd->sam_hdr, rd->b); break;
+        case BCF_KIND: r = bcf_read(rd->fp, rd->bcf_hdr, rd->v); break;
+        default:
+            r = hts_getline(rd->fp, KS_SEP_LINE, &rd->str);
+            if (r >= 0 && rd->str.s[0] == '#') continue;
+            break;
+        }
+        if (r < 0) break;
+        if (push_current(rd, l) < 0) return -2;
+    }
+    return r < -1 ? -2 : 0;
+}
+
+static int read_shard(reader *rd, const hts_shard_t *shard, rec_list *l) {
+    hts_itr_t *itr;
+    int r;
+
+    switch (rd->kind) {
+    case SAM_KIND: itr = sam_itr_shard(rd->idx, shard); break;
+    case BCF_KIND: itr = bcf_itr_shard(rd->idx, shard); break;
+    default:       itr = tbx_itr_shard(rd->tbx, shard); break;
+    }
+    if (!itr) return -2;
+    for (;;) {
+        switch (rd->kind) {
+        case SAM_KIND: r = sam_itr_next(rd->fp, itr, rd->b); break;
+        case BCF_KIND: r = bcf_itr_next(rd->fp, itr, rd->v); break;
+        default:       r = tbx_itr_next(rd->fp, rd->tbx, itr, &rd->str); break;
+        }
+        if (r < 0) break;
+        if (push_current(rd, l) < 0) r = -2;
+    }
+    hts_itr_destroy(itr);
+    return r < -1 ? -2 : 0;
+}
+
+static int check_counts(reader *rd, const hts_shard_t *shards, int n) {
+    uint64_t mapped = 0, unmapped = 0, m, u, sm = 0, su = 0;
+    int i, nseq;
+
+    if (hts_idx_fmt(rd->idx) == HTS_FMT_CRAI)
+        return 0;
+    switch (rd->kind) {
+    case SAM_KIND: nseq = rd->sam_hdr->n_targets; break;
+    case BCF_KIND: nseq = rd->bcf_hdr->n[BCF_DT_CTG]; break;
+    default:       free(tbx_seqnames(rd->tbx, &nseq)); break;
+    }
+    for (i = 0; i < nseq; i++) {
+        if (hts_idx_get_stat(rd->idx, i, &m, &u) < 0) continue;
+        mapped += m;
+        unmapped += u;
+    }
+    unmapped += hts_idx_get_n_no_coor(rd->idx);
+    for (i = 0; i < n; i++) {
+        sm += shards[i].n_mapped;
+        su += shards[i].n_unmapped;
+    }
+    if (sm != mapped || su != unmapped) {
+        fprintf(stderr, "Shard counts %"PRIu64"/%"PRIu64
+                " differ from index %"PRIu64"/%"PRIu64"\n",
+                sm, su, mapped, unmapped);
+        return -1;
+    }
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    static const int counts[] = { 1, 2, 3, 5, 8, 64 };
+    rec_list ref = { NULL, 0, 0 }, out = { NULL, 0, 0 };
+    reader rd;
+    int c, i, n, failed = 0;
+    size_t k;
+
+    if (argc != 2) {
+        fprintf(stderr, "Usage: test_shard in.{bam,cram,bcf,vcf.gz}\n");
+        return EXIT_FAILURE;
+    }
+
+    if (reader_open(&rd, argv[1]) < 0 || read_all(&rd, &ref) < 0) {
+        fprintf(stderr, "Couldn't read \"%s\" and its index\n", argv[1]);
+        return EXIT_FAILURE;
+    }
+    if (ref.n == 0) {
+        fprintf(stderr, "No records in \"%s\"\n", argv[1]);
+        return EXIT_FAILURE;
+    }
+
+    for (c = 0; c < sizeof(counts) / sizeof(counts[0]); c++) {
+        hts_shard_t *shards = NULL;
+
+        n = hts_idx_shards(rd.idx, counts[c], &shards);
+        if (n <= 0 || n > counts[c]) {
+            fprintf(stderr, "Asked for %d shards, got %d\n", counts[c], n);
+            goto fail;
+        }
+        // The index only has boundaries about every 64 KiB, but the
+        // test files are large enough to be split at least once
+        if (n < 2 && counts[c] >= 2) {
+            fprintf(stderr, "Only %d of %d shards made\n", n, counts[c]);
+            goto fail;
+        }
+        clear(&out);
+        for (i = 0; i < n; i++) {
+            if (i > 0 && shards[i].beg_off != shards[i-1].end_off) {
+                fprintf(stderr, "Gap between shards %d and %d\n", i-1, i);
+                goto fail;
+            }
+            if (read_shard(&rd, &shards[i], &out) < 0) {
+                fprintf(stderr, "Error reading shard %d\n", i);
+                goto fail;
+            }
+        }
+        if (shards[n-1].end_off != UINT64_MAX) {
+            fprintf(stderr, "Last shard does not reach the end of the file\n");
+            goto fail;
+        }
+        if (out.n != ref.n) {
+            fprintf(stderr, "Got %zu records, expected %zu\n", out.n, ref.n);
+            goto fail;
+        }
+        for (k = 0; k < ref.n; k++)
+            if (out.r[k].l != ref.r[k].l
+                || memcmp(out.r[k].s, ref.r[k].s, ref.r[k].l) != 0) break;
+        if (k < ref.n) {
+            fprintf(stderr, "Record %zu differs\n", k);
+            goto fail;
+        }
+        if (check_counts(&rd, shards, n) < 0) goto fail;
+        free(shards);
+        continue;
+
+    fail:
+        fprintf(stderr, "Failed: \"%s\" in %d shards\n", argv[1], counts[c]);
+        free(shards);
+        failed++;
+    }
+
+    clear(&ref);
+    clear(&out);
+    free(ref.r);
+    free(out.r);
+    reader_close(&rd);
+
+    if (failed) {
+        fprintf(stderr, "%d shard tests failed\n", failed);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,252 @@
+/*  test/test_sort.c -- sam_sorter_t test harness.
+
+    Copyright (C) 2019 Genome Research Ltd.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.  */
+
+/*
+ * Sorts the records of a file in every order, with and
+ * without temporary files and threads.  The result of the simplest
+ * configuration is checked to be in order, and every other configuration
+ * must give exactly the same result, which also checks that ties are kept
+ * in input order however the records were split into runs.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "htslib/sam_sort.h"
+#include "htslib/thread_pool.h"
+
+typedef struct {
+    bam1_t **b;
+    size_t n, m;
+} rec_list;
+
+static int push(rec_list *l, const bam1_t *b) {
+    if (l->n == l->m) {
+        size_t m = l->m ? l->m * 2 : 256;
+        bam1_t **nb = realloc(l->b, m * sizeof(*nb));
+        if (!nb) return -1;
+        l->b = nb;
+        l->m = m;
+    }
+    if (!(l->b[l->n] = bam_dup1(b))) return -1;
+    l->n++;
+    return 0;
+}
+
+static void clear(rec_list *l) {
+    size_t i;
+    for (i = 0; i < l->n; i++)
+        bam_destroy1(l->b[i]);
+    l->n = 0;
+}
+
+static int same_rec(const bam1_t *a, const bam1_t *b) {
+    return memcmp(&a->core, &b->core, sizeof(a->core)) == 0
+        && a->l_data == b->l_data
+        && memcmp(a->data, b->data, a->l_data) == 0;
+}
+
+// Compares digit runs as numbers; enough for the names used in the tests
+static int name_cmp(const char *a, const char *b) {
+    while (*a && *b) {
+        if (isdigit((unsigned char) *a) && isdigit((unsigned char) *b)) {
+            char *ea, *eb;
+            unsigned long long x = strtoull(a, &ea, 10);
+            unsigned long long y = strtoull(b, &eb, 10);
+            if (x != y) return x < y ? -1 : 1;
+            a = ea;
+            b = eb;
+        } else {
+            if (*a != *b) return (unsigned char) *a - (unsigned char) *b;
+            a++;
+            b++;
+        }
+    }
+    return *a ? 1 : *b ? -1 : 0;
+}
+
+static uint64_t coord_key(const bam1_t *b) {
+    return (uint64_t)(uint32_t) b->core.tid << 32
+        | (uint64_t)(uint32_t)(b->core.pos + 1) << 1 | bam_is_rev(b);
+}
+
+static int check_order(enum sam_sort_order order, const rec_list *l) {
+    size_t i;
+    for (i = 1; i < l->n; i++) {
+        const bam1_t *a = l->b[i-1], *b = l->b[i];
+        int bad = 0;
+        if (order == SAM_SORT_COORD) {
+            bad = coord_key(a) > coord_key(b);
+        } else if (order == SAM_SORT_NAME) {
+            int t = name_cmp(bam_get_qname(a), bam_get_qname(b));
+            bad = t > 0 || (t == 0 && (a->core.flag & 0xc0) > (b->core.flag & 0xc0));
+        } else {
+            uint8_t *ta = bam_aux_get(a, "NM"), *tb = bam_aux_get(b, "NM");
+            if (ta && !tb) {
+                bad = 1;
+            } else if (ta && tb) {
+                int64_t x = bam_aux2i(ta), y = bam_aux2i(tb);
+                bad = x > y || (x == y && coord_key(a) > coord_key(b));
+            } else if (!ta && !tb) {
+                bad = coord_key(a) > coord_key(b);
+            }
+        }
+        if (bad) {
+            fprintf(stderr, "Records %zu and %zu are out of order\n", i-1, i);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int run_sort(const bam_hdr_t *h, const rec_list *in,
+                    const sam_sort_opts *opts, rec_list *out) {
+    sam_sorter_t *s = sam_sorter_init(h, opts);
+    bam1_t *b = bam_init1();
+    size_t i;
+    int r;
+
+    clear(out);
+    if (!s || !b) goto fail;
+    for (i = 0; i < in->n; i++)
+        if (sam_sorter_add(s, in->b[i]) < 0) goto fail;
+    if (sam_sorter_finish(s) < 0) goto fail;
+    while ((r = sam_sorter_next(s, b)) >= 0)
+        if (push(out, b) < 0) goto fail;
+    if (r < -1) goto fail;
+
+    sam_sorter_destroy(s);
+    bam_destroy1(b);
+    return 0;
+
+ fail:
+    sam_sorter_destroy(s);
+    bam_destroy1(b);
+    return -1;
+}
+
+int main(int argc, char **argv) {
+    static const char *order_names[] = { "coordinate", "name", "tag" };
+    static const size_t mems[] = { 0, 64 << 10, 8 << 10 };
+    static const int levels[] = { -1, 0, 6 };
+    rec_list in = { NULL, 0, 0 }, ref = { NULL, 0, 0 }, out = { NULL, 0, 0 };
+    htsThreadPool p = { NULL, 0 };
+    samFile *fp;
+    bam_hdr_t *h;
+    bam1_t *b;
+    int order, mi, nthreads, r, failed = 0;
+    size_t i;
+
+    if (argc != 2) {
+        fprintf(stderr, "Usage: test_sort in.{sam,bam,cram}\n");
+        return EXIT_FAILURE;
+    }
+
+    if (!(fp = sam_open(argv[1], "r")) || !(h = sam_hdr_read(fp))) {
+        fprintf(stderr, "Couldn't read \"%s\"\n", argv[1]);
+        return EXIT_FAILURE;
+    }
+    b = bam_init1();
+    while ((r = sam_read1(fp, h, b)) >= 0) {
+        // Remove some tags so SAM_SORT_TAG sees missing values
+        if (in.n % 10 == 3) {
+            uint8_t *nm = bam_aux_get(b, "NM");
+            if (nm) bam_aux_del(b, nm);
+        }
+        if (push(&in, b) < 0) {
+            fprintf(stderr, "Out of memory\n");
+            return EXIT_FAILURE;
+        }
+    }
+    if (r < -1 || in.n == 0) {
+        fprintf(stderr, "Error reading \"%s\"\n", argv[1]);
+        return EXIT_FAILURE;
+    }
+    if (!(p.pool = hts_tpool_init(2))) {
+        fprintf(stderr, "Couldn't start thread pool\n");
+        return EXIT_FAILURE;
+    }
+
+    for (order = SAM_SORT_COORD; order <= SAM_SORT_TAG; order++) {
+        for (nthreads = 0; nthreads <= 2; nthreads += 2) {
+            for (mi = 0; mi < 3; mi++) {
+                sam_sort_opts opts;
+                rec_list *res = mi == 0 && nthreads == 0 ? &ref : &out;
+
+                memset(&opts, 0, sizeof(opts));
+                opts.order = order;
+                memcpy(opts.tag, "NM", 2);
+                opts.max_mem = mems[mi];
+                opts.tmp_prefix = "test/test_sort.tmp";
+                opts.level = levels[mi];
+                opts.pool = nthreads ? &p : NULL;
+
+                if (run_sort(h, &in, &opts, res) < 0) {
+                    fprintf(stderr, "Sorting failed\n");
+                    goto fail;
+                }
+                if (res->n != in.n) {
+                    fprintf(stderr, "Got %zu records, expected %zu\n",
+                            res->n, in.n);
+                    goto fail;
+                }
+                if (res == &ref) {
+                    if (check_order(order, res) < 0) goto fail;
+                } else {
+                    for (i = 0; i < ref.n; i++)
+                        if (!same_rec(ref.b[i], res->b[i])) break;
+                    if (i < ref.n) {
+                        fprintf(stderr, "Record %zu differs from reference\n", i);
+                        goto fail;
+                    }
+                }
+                continue;
+
+            fail:
+                fprintf(stderr, "Failed: %s order, max_mem %zu, %d threads\n",
+                        order_names[order], mems[mi], nthreads);
+                failed++;
+            }
+        }
+    }
+
+    clear(&in);
+    clear(&ref);
+    clear(&out);
+    free(in.b);
+    free(ref.b);
+    free(out.b);
+    bam_destroy1(b);
+    bam_hdr_destroy(h);
+    sam_close(fp);
+    hts_tpool_destroy(p.pool);
+
+    if (failed) {
+        fprintf(stderr, "%d sort tests failed\n", failed);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
@@ -45,7 +45,9 @@ struct opts {
     int extra_hdr_nuls;
     int benchmark;
     int nthreads;
+    htsThreadPool *pool;
     int multi_reg;
+    int plan;
     char *index;
     int min_shift;
 };
@@ -59,6 +61,26 @@ enum test_op {
     WRITE_COMPRESSED   = 32, // eg vcf.gz, sam.gz
 };
 
+// Force a multi-region plan, and check that each reference reports using it
+static int check_plan(const hts_idx_t *idx, hts_itr_t *iter, int plan) {
+    int i, used;
+    if (hts_itr_multi_set_plan(idx, iter, plan, 0) < 0) {
+        fprintf(stderr, "Invalid region plan %d\n", plan);
+        return -1;
+    }
+    for (i = 0; i < iter->n_reg; i++) {
+        used = hts_itr_multi_plan(iter, iter->reg_list[i].tid);
+        // Scans fall back to coalescing if the index has no extent
+        if (used >= 0 && used != plan
+            && !(plan == HTS_ITR_PLAN_SCAN && used == HTS_ITR_PLAN_COALESCE)) {
+            fprintf(stderr, "Reference #%d read with plan %d, not %d\n",
+                    iter->reg_list[i].tid, used, plan);
+            return -1;
+        }
+    }
+    return 0;
+}
+
 int sam_loop(int argc, char **argv, int optind, struct opts *opts, htsFile *in, htsFile *out) {
     int r = 0;
     bam_hdr_t *h = NULL;
@@ -128,6 +150,14 @@ int sam_loop(int argc, char **argv, int optind, struct opts *opts, htsFile *in,
             hts_itr_t *iter = sam_itr_regarray(idx, h, &argv[optind + 1], argc - optind-1);
             if (!iter)
                 goto fail;
+            if (opts->plan && check_plan(idx, iter, opts->plan) < 0) {
+                hts_itr_destroy(iter);
+                goto fail;
+            }
+            if (opts->pool && sam_itr_set_thread_pool(in, iter, opts->pool) < 0) {
+                hts_itr_destroy(iter);
+                goto fail;
+            }
             while ((r = sam_itr_next(in, iter, b)) >= 0) {
                 if (!opts->benchmark && sam_write1(out, h, b) < 0) {
                     fprintf(stderr, "Error writing output.\n");
@@ -299,11 +329,13 @@ int main(int argc, char *argv[])
     opts.extra_hdr_nuls = 0;
     opts.benchmark = 0;
     opts.nthreads = 0; // shared pool
+    opts.pool = NULL;
     opts.multi_reg = 0;
+    opts.plan = 0;
     opts.index = NULL;
     opts.min_shift = 0;
 
-    while ((c = getopt(argc, argv, "DSIt:i:bzCul:o:N:BZ:@:Mx:m:p:")) >= 0) {
+    while ((c = getopt(argc, argv, "DSIt:i:bzCul:o:N:BZ:@:MP:x:m:p:")) >= 0) {
         switch (c) {
         case 'D': opts.flag |= READ_CRAM; break;
         case 'S': opts.flag |= READ_COMPRESSED; break;
@@ -320,6 +352,7 @@ int main(int argc, char *argv[])
         case 'B': opts.benchmark = 1; break;
         case 'Z': opts.extra_hdr_nuls = atoi(optarg); break;
         case 'M': opts.multi_reg = 1; break;
+        case 'P': opts.plan = atoi(optarg); break;
         case '@': opts.nthreads = atoi(optarg); break;
         case 'x': opts.index = optarg; break;
         case 'm': opts.min_shift = atoi(optarg); break;
@@ -327,7 +360,7 @@ int main(int argc, char *argv[])
         }
     }
     if (argc == optind) {
-        fprintf(stderr, "Usage: test_view [-DSI] [-t fn_ref] [-i option=value] [-bC] [-l level] [-o option=value] [-N num_reads] [-B] [-Z hdr_nuls] [-@ num_threads] [-x index_fn] [-m min_shift] [-p out] <in.bam>|<in.sam>|<in.cram> [region]\n");
+        fprintf(stderr, "Usage: test_view [-DSI] [-t fn_ref] [-i option=value] [-bC] [-l level] [-o option=value] [-N num_reads] [-B] [-Z hdr_nuls] [-@ num_threads] [-M] [-P plan] [-x index_fn] [-m min_shift] [-p out] <in.bam>|<in.sam>|<in.cram> [region]\n");
         fprintf(stderr, "\n");
         fprintf(stderr, "-D: read CRAM format (mode 'c')\n");
         fprintf(stderr, "-S: read compressed BCF, BAM, FAI (mode 'b')\n");
@@ -344,6 +377,7 @@ int main(int argc, char *argv[])
         fprintf(stderr, "\n");
         fprintf(stderr, "-B: enable benchmarking\n");
         fprintf(stderr, "-M: use hts_itr_multi iterator\n");
+        fprintf(stderr, "-P plan: force the multi-region plan (1 index, 2 coalesce, 3 scan)\n");
         fprintf(stderr, "-Z hdr_nuls: append specified number of null bytes to the SAM header\n");
         fprintf(stderr, "-@ num_threads: use thread pool with specified number of threads\n\n");
         fprintf(stderr, "-x fn: write index to fn\n");
@@ -393,6 +427,7 @@ int main(int argc, char *argv[])
         } else {
             hts_set_opt(in,  HTS_OPT_THREAD_POOL, &p);
             hts_set_opt(out, HTS_OPT_THREAD_POOL, &p);
+            opts.pool = &p;
         }
     }
 
@@ -81,9 +81,11 @@ int DBG_OUT(FILE *fp, char *fmt, ...) {
  * Returns 0 on success;
  *        -1 on failure
  */
+static int hts_tpool_queue_result_locked(hts_tpool_job *j, void *data);
+
 static int hts_tpool_add_result(hts_tpool_job *j, void *data) {
     hts_tpool_process *q = j->q;
-    hts_tpool_result *r;
+    int ret;
 
     pthread_mutex_lock(&q->p->pool_m);
 
@@ -93,11 +95,27 @@ static int hts_tpool_add_result(hts_tpool_job *j, void *data) {
     if (--q->n_processing == 0)
         pthread_cond_signal(&q->none_processing_c);
 
+    ret = hts_tpool_queue_result_locked(j, data);
+
+    pthread_mutex_unlock(&q->p->pool_m);
+
+    return ret;
+}
+
+/*
+ * Appends data to the result queue for job j.  Must be called with the
+ * pool mutex held.
+ *
+ * Returns 0 on success;
+ *        -1 on failure
+ */
+static int hts_tpool_queue_result_locked(hts_tpool_job *j, void *data) {
+    hts_tpool_process *q = j->q;
+    hts_tpool_result *r;
+
     /* No results queue is fine if we don't want any results back */
-    if (q->in_only) {
-        pthread_mutex_unlock(&q->p->pool_m);
+    if (q->in_only)
         return 0;
-    }
 
     if (!(r = malloc(sizeof(*r))))
         return -1;
@@ -124,13 +142,20 @@ static int hts_tpool_add_result(hts_tpool_job *j, void *data) {
         DBG_OUT(stderr, "%d: Broadcast complete\n", worker_id(j->p));
     }
 
-    pthread_mutex_unlock(&q->p->pool_m);
-
     return 0;
 }
 
 static void wake_next_worker(hts_tpool_process *q, int locked);
 
+/*
+ * True if the first job in the input queue is the one whose result is
+ * needed next.  Such a job may always be started, even if the output
+ * queue is full; otherwise tasks released out of order could fill the
+ * output queue with later results and deadlock.
+ */
+#define NEXT_IS_WANTED(q) \
+    ((q)->input_head && (q)->input_head->serial == (q)->next_serial)
+
 /* Core of hts_tpool_next_result() */
 static hts_tpool_result *hts_tpool_next_result_locked(hts_tpool_process *q) {
     hts_tpool_result *r, *last;
@@ -167,6 +192,8 @@ static hts_tpool_result *hts_tpool_next_result_locked(hts_tpool_process *q) {
                 pthread_cond_signal(&q->input_not_full_c);
             if (!q->shutdown)
                 wake_next_worker(q, 1);
+        } else if (NEXT_IS_WANTED(q) && !q->shutdown) {
+            wake_next_worker(q, 1);
         }
     }
 
@@ -308,6 +335,7 @@ static void hts_tpool_process_shutdown_locked(hts_tpool_process *q) {
     pthread_cond_broadcast(&q->input_not_full_c);
     pthread_cond_broadcast(&q->input_empty_c);
     pthread_cond_broadcast(&q->none_processing_c);
+    pthread_cond_broadcast(&q->deferred_c);
 }
 
 void hts_tpool_process_shutdown(hts_tpool_process *q) {
@@ -355,6 +383,7 @@ hts_tpool_process *hts_tpool_process_init(hts_tpool *p, int qsize, int in_only)
     pthread_cond_init(&q->input_not_full_c, NULL);
     pthread_cond_init(&q->input_empty_c,    NULL);
     pthread_cond_init(&q->none_processing_c,NULL);
+    pthread_cond_init(&q->deferred_c,       NULL);
 
     q->p           = p;
     q->input_head  = NULL;
@@ -367,6 +396,7 @@ hts_tpool_process *hts_tpool_process_init(hts_tpool *p, int qsize, int in_only)
     q->n_input     = 0;
     q->n_output    = 0;
     q->n_processing= 0;
+    q->n_deferred  = 0;
     q->qsize       = qsize;
     q->in_only     = in_only;
     q->shutdown    = 0;
@@ -414,6 +444,7 @@ void hts_tpool_process_destroy(hts_tpool_process *q) {
     pthread_cond_destroy(&q->input_not_full_c);
     pthread_cond_destroy(&q->input_empty_c);
     pthread_cond_destroy(&q->none_processing_c);
+    pthread_cond_destroy(&q->deferred_c);
     pthread_mutex_unlock(&q->p->pool_m);
 
     free(q);
@@ -476,6 +507,123 @@ void hts_tpool_process_detach(hts_tpool *p, hts_tpool_process *q) {
 }
 
 
+/* ----------------------------------------------------------------------------
+ * Job allocation and dependency tracking.
+ *
+ * Job structs are recycled via a free list on the pool rather than being
+ * freed after use, so dispatching normally costs no malloc.  All of these
+ * must be called with the pool mutex held.
+ */
+
+static hts_tpool_job *tpool_job_alloc_locked(hts_tpool *p) {
+    hts_tpool_job *j = p->free_jobs;
+
+    if (j) {
+        p->free_jobs = j->next;
+    } else {
+        if (!(j = malloc(sizeof(*j))))
+            return NULL;
+        j->succ = NULL;
+        j->m_succ = 0;
+    }
+
+    j->next = NULL;
+    j->p = p;
+    j->n_deps = 0;
+    j->n_succ = 0;
+    j->cancelled = 0;
+
+    return j;
+}
+
+static void tpool_job_free_list(hts_tpool_job *j) {
+    hts_tpool_job *jn;
+    for (; j; j = jn) {
+        jn = j->next;
+        free(j->succ);
+        free(j);
+    }
+}
+
+/*
+ * Adds j to the input list of its process-queue.  The list is kept in
+ * serial number order so jobs are started in the order their results
+ * are wanted.  Ordinary dispatches always go on the end; only tasks
+ * released after their dependencies finish may need inserting earlier.
+ */
+static void tpool_enqueue_locked(hts_tpool_job *j) {
+    hts_tpool_process *q = j->q;
+
+    j->p->njobs++; // total across all queues
+    q->n_input++;  // queue specific
+
+    if (!q->input_tail) {
+        j->next = NULL;
+        q->input_head = q->input_tail = j;
+    } else if (q->input_tail->serial < j->serial) {
+        j->next = NULL;
+        q->input_tail->next = j;
+        q->input_tail = j;
+    } else if (j->serial < q->input_head->serial) {
+        j->next = q->input_head;
+        q->input_head = j;
+    } else {
+        hts_tpool_job *prev = q->input_head;
+        while (prev->next->serial < j->serial)
+            prev = prev->next;
+        j->next = prev->next;
+        prev->next = j;
+    }
+}
+
+static void tpool_job_done_locked(hts_tpool *p, hts_tpool_job *j);
+
+/*
+ * Called when a task has no outstanding dependencies.  It is queued for
+ * execution, or if a prerequisite was discarded it is cleaned up instead
+ * and an empty result queued in its place so later results in an ordered
+ * process are not held up.
+ */
+static void tpool_task_ready_locked(hts_tpool *p, hts_tpool_job *j) {
+    hts_tpool_process *q = j->q;
+
+    q->n_deferred--;
+    pthread_cond_broadcast(&q->deferred_c);
+
+    if (j->cancelled) {
+        if (j->job_cleanup)
+            j->job_cleanup(j->arg);
+        if (q->next_serial != INT_MAX)
+            hts_tpool_queue_result_locked(j, NULL);
+        tpool_job_done_locked(p, j);
+        return;
+    }
+
+    tpool_enqueue_locked(j);
+    if (!q->shutdown)
+        wake_next_worker(q, 1);
+}
+
+/*
+ * Marks job j as finished, releasing any tasks that were waiting on it,
+ * and returns j to the free list.
+ */
+static void tpool_job_done_locked(hts_tpool *p, hts_tpool_job *j) {
+    int i;
+
+    for (i = 0; i < j->n_succ; i++) {
+        hts_tpool_job *s = j->succ[i];
+        if (j->cancelled)
+            s->cancelled = 1;
+        if (--s->n_deps == 0)
+            tpool_task_ready_locked(p, s);
+    }
+    j->n_succ = 0;
+
+    j->next = p->free_jobs;
+    p->free_jobs = j;
+}
+
 /* ----------------------------------------------------------------------------
  * The thread pool.
  */
@@ -509,7 +657,8 @@ static void *tpool_worker(void *arg) {
             // Iterate over queues, finding one with jobs and also
             // room to put the result.
             //if (q && q->input_head && !hts_tpool_process_output_full(q)) {
-            if (q && q->input_head && q->qsize - q->n_output > p->tsize - p->nwaiting) {
+            if (q && q->input_head && (q->qsize - q->n_output > p->tsize - p->nwaiting
+                                       || NEXT_IS_WANTED(q))) {
                 //printf("Work\n");
                 work_to_do = 1;
                 break;
@@ -551,7 +700,8 @@ static void *tpool_worker(void *arg) {
         // possible before switching to another queue.  This means threads
         // often end up being dedicated to one type of work.
         q->ref_count++;
-        while (q->input_head && q->qsize - q->n_output > q->n_processing) {
+        while (q->input_head && (q->qsize - q->n_output > q->n_processing
+                                 || NEXT_IS_WANTED(q))) {
             if (p->shutdown)
                 goto shutdown;
 
@@ -582,10 +732,9 @@ static void *tpool_worker(void *arg) {
                     worker_id(j->p), q, j->serial);
 
             hts_tpool_add_result(j, j->func(j->arg));
-            //memset(j, 0xbb, sizeof(*j));
-            free(j);
 
             pthread_mutex_lock(&p->pool_m);
+            tpool_job_done_locked(p, j);
         }
         if (--q->ref_count == 0) { // we were the last user
             hts_tpool_process_destroy(q);
@@ -630,7 +779,8 @@ static void wake_next_worker(hts_tpool_process *q, int locked) {
 
     int running = p->tsize - p->nwaiting;
     int sig = p->t_stack_top >= 0 && p->njobs > p->tsize - p->nwaiting
-        && (!q || q->n_processing < q->qsize - q->n_output);
+        && (!q || q->n_processing < q->qsize - q->n_output
+            || NEXT_IS_WANTED(q));
 
 //#define AVG_USAGE
 #ifdef AVG_USAGE
@@ -683,6 +833,7 @@ hts_tpool *hts_tpool_init(int n) {
     p->nwaiting = 0;
     p->shutdown = 0;
     p->q_head = NULL;
+    p->free_jobs = NULL;
     p->t_stack = NULL;
     p->n_count = 0;
     p->n_running = 0;
@@ -765,7 +916,7 @@ int hts_tpool_dispatch3(hts_tpool *p, hts_tpool_process *q,
         return -1;
     }
 
-    if (!(j = malloc(sizeof(*j)))) {
+    if (!(j = tpool_job_alloc_locked(p))) {
         pthread_mutex_unlock(&p->pool_m);
         return -1;
     }
@@ -773,8 +924,6 @@ int hts_tpool_dispatch3(hts_tpool *p, hts_tpool_process *q,
     j->arg = arg;
     j->job_cleanup = job_cleanup;
     j->result_cleanup = result_cleanup;
-    j->next = NULL;
-    j->p = p;
     j->q = q;
     j->serial = q->curr_serial++;
 
@@ -784,7 +933,8 @@ int hts_tpool_dispatch3(hts_tpool *p, hts_tpool_process *q,
             pthread_cond_wait(&q->input_not_full_c, &q->p->pool_m);
         }
         if (q->no_more_input || q->shutdown) {
-            free(j);
+            j->next = p->free_jobs;
+            p->free_jobs = j;
             pthread_mutex_unlock(&p->pool_m);
             return -1;
         }
@@ -794,15 +944,7 @@ int hts_tpool_dispatch3(hts_tpool *p, hts_tpool_process *q,
         }
     }
 
-    p->njobs++;    // total across all queues
-    q->n_input++;  // queue specific
-
-    if (q->input_tail) {
-        q->input_tail->next = j;
-        q->input_tail = j;
-    } else {
-        q->input_head = q->input_tail = j;
-    }
+    tpool_enqueue_locked(j);
 
     DBG_OUT(stderr, "Dispatched (serial %"PRId64")\n", j->serial);
 
@@ -820,6 +962,182 @@ int hts_tpool_dispatch3(hts_tpool *p, hts_tpool_process *q,
     return 0;
 }
 
+/*
+ * Wakes up to n idle workers to process jobs on q.  Unlike
+ * wake_next_worker() this signals distinct threads, as those already
+ * signalled are still marked as waiting in t_stack until they run.
+ */
+static void wake_workers_locked(hts_tpool_process *q, int n) {
+    hts_tpool *p = q->p;
+    int i, running = p->tsize - p->nwaiting;
+
+    if (q->shutdown)
+        return;
+
+    p->q_head = q;
+
+    if (n > p->njobs - running)
+        n = p->njobs - running;
+    if (n > q->qsize - q->n_output - q->n_processing)
+        n = q->qsize - q->n_output - q->n_processing;
+
+    for (i = 0; i < p->tsize && n > 0; i++) {
+        if (p->t_stack[i]) {
+            pthread_cond_signal(&p->t[i].pending_c);
+            n--;
+        }
+    }
+}
+
+/*
+ * Adds n jobs, all calling exec_func, with a single lock acquisition.
+ *
+ * Returns the number of jobs added, which may be fewer than n if
+ *            nonblock is +1 and the queue filled up (errno is then set
+ *            to EAGAIN);
+ *        -1 if no jobs could be added
+ */
+int hts_tpool_dispatch_batch(hts_tpool *p, hts_tpool_process *q,
+                             void *(*exec_func)(void *arg),
+                             void **args, int n,
+                             void (*job_cleanup)(void *arg),
+                             void (*result_cleanup)(void *data),
+                             int nonblock) {
+    hts_tpool_job *j;
+    int i, unwoken = 0;
+
+    pthread_mutex_lock(&p->pool_m);
+
+    DBG_OUT(stderr, "Dispatching %d jobs for queue %p, serial %"PRId64"\n",
+            n, q, q->curr_serial);
+
+    for (i = 0; i < n; i++) {
+        if (q->no_more_input || q->n_input >= q->qsize) {
+            if (nonblock == 1) {
+                errno = EAGAIN;
+                break;
+            }
+            if (nonblock == 0) {
+                // Make sure someone is consuming what we've already added
+                wake_workers_locked(q, unwoken);
+                unwoken = 0;
+                while ((q->no_more_input || q->n_input >= q->qsize) &&
+                       !q->shutdown && !q->wake_dispatch) {
+                    pthread_cond_wait(&q->input_not_full_c, &q->p->pool_m);
+                }
+                if (q->no_more_input || q->shutdown)
+                    break;
+                if (q->wake_dispatch) {
+                    q->wake_dispatch = 0;
+                    errno = EAGAIN;
+                    break;
+                }
+            }
+        }
+
+        if (!(j = tpool_job_alloc_locked(p)))
+            break;
+        j->func = exec_func;
+        j->arg = args[i];
+        j->job_cleanup = job_cleanup;
+        j->result_cleanup = result_cleanup;
+        j->q = q;
+        j->serial = q->curr_serial++;
+
+        tpool_enqueue_locked(j);
+        unwoken++;
+    }
+
+    wake_workers_locked(q, unwoken);
+
+    pthread_mutex_unlock(&p->pool_m);
+
+    return i > 0 || n == 0 ? i : -1;
+}
+
+/*
+ * Creates a task: a job whose execution may be deferred until other tasks
+ * have finished.  The task is held until hts_tpool_task_submit() is called.
+ *
+ * Returns task pointer on success;
+ *         NULL on failure
+ */
+hts_tpool_task *hts_tpool_task_init(hts_tpool_process *q,
+                                    void *(*exec_func)(void *arg), void *arg,
+                                    void (*job_cleanup)(void *arg),
+                                    void (*result_cleanup)(void *data)) {
+    hts_tpool *p = q->p;
+    hts_tpool_job *j;
+
+    pthread_mutex_lock(&p->pool_m);
+    if (q->no_more_input || q->shutdown
+        || !(j = tpool_job_alloc_locked(p))) {
+        pthread_mutex_unlock(&p->pool_m);
+        return NULL;
+    }
+
+    j->func = exec_func;
+    j->arg = arg;
+    j->job_cleanup = job_cleanup;
+    j->result_cleanup = result_cleanup;
+    j->q = q;
+    j->serial = q->curr_serial++;
+    j->n_deps = 1; // submission hold
+    q->n_deferred++;
+
+    pthread_mutex_unlock(&p->pool_m);
+
+    return j;
+}
+
+/*
+ * Declares that task t may not start until task "on" has finished.
+ *
+ * Returns 0 on success;
+ *        -1 on failure
+ */
+int hts_tpool_task_depends(hts_tpool_task *t, hts_tpool_task *on) {
+    hts_tpool *p = t->p;
+
+    if (t == on || p != on->p)
+        return -1;
+
+    pthread_mutex_lock(&p->pool_m);
+    if (on->n_succ == on->m_succ) {
+        int m = on->m_succ ? on->m_succ * 2 : 4;
+        hts_tpool_job **succ = realloc(on->succ, m * sizeof(*succ));
+        if (!succ) {
+            pthread_mutex_unlock(&p->pool_m);
+            return -1;
+        }
+        on->succ = succ;
+        on->m_succ = m;
+    }
+    on->succ[on->n_succ++] = t;
+    t->n_deps++;
+    pthread_mutex_unlock(&p->pool_m);
+
+    return 0;
+}
+
+/*
+ * Releases the hold on task t.  It will be queued as soon as all the tasks
+ * it depends on have finished, which may be immediately.
+ *
+ * Returns 0 on success;
+ *        -1 on failure
+ */
+int hts_tpool_task_submit(hts_tpool_task *t) {
+    hts_tpool *p = t->p;
+
+    pthread_mutex_lock(&p->pool_m);
+    if (--t->n_deps == 0)
+        tpool_task_ready_locked(p, t);
+    pthread_mutex_unlock(&p->pool_m);
+
+    return 0;
+}
+
 /*
  * Wakes up a single thread stuck in dispatch and make it return with
  * errno EAGAIN.
@@ -861,14 +1179,18 @@ int hts_tpool_process_flush(hts_tpool_process *q) {
     if (q->qsize < q->n_output + q->n_input + q->n_processing)
         q->qsize = q->n_output + q->n_input + q->n_processing;
 
-    // Wait for n_input and n_processing to hit zero.
-    while (q->n_input || q->n_processing) {
+    // Wait for n_input, n_processing and n_deferred to hit zero.
+    while (q->n_input || q->n_processing || q->n_deferred) {
         while (q->n_input)
             pthread_cond_wait(&q->input_empty_c, &p->pool_m);
         if (q->shutdown) break;
         while (q->n_processing)
             pthread_cond_wait(&q->none_processing_c, &p->pool_m);
         if (q->shutdown) break;
+        // Tasks waiting on jobs in other processes
+        if (q->n_deferred && !q->n_input)
+            pthread_cond_wait(&q->deferred_c, &p->pool_m);
+        if (q->shutdown) break;
     }
 
     pthread_mutex_unlock(&p->pool_m);
@@ -910,12 +1232,16 @@ int hts_tpool_process_reset(hts_tpool_process *q, int free_results) {
     pthread_mutex_unlock(&q->p->pool_m);
 
     // Release memory.  This can be done unlocked now the lists have been
-    // removed from the queue
+    // removed from the queue, although cancelling any tasks that depend
+    // on the discarded jobs needs the lock.
     for (j = j_head; j; j = jn) {
         //fprintf(stderr, "Discard input %d\n", j->serial);
         jn = j->next;
         if (j->job_cleanup) j->job_cleanup(j->arg);
-        free(j);
+        pthread_mutex_lock(&q->p->pool_m);
+        j->cancelled = 1;
+        tpool_job_done_locked(q->p, j);
+        pthread_mutex_unlock(&q->p->pool_m);
     }
 
     for (r = r_head; r; r = rn) {
@@ -996,6 +1322,7 @@ void hts_tpool_destroy(hts_tpool *p) {
     if (p->t_stack)
         free(p->t_stack);
 
+    tpool_job_free_list(p->free_jobs);
     free(p->t);
     free(p);
 
@@ -1022,6 +1349,7 @@ void hts_tpool_kill(hts_tpool *p) {
     if (p->t_stack)
         free(p->t_stack);
 
+    tpool_job_free_list(p->free_jobs);
     free(p->t);
     free(p);
 
@@ -1394,6 +1722,139 @@ int test_pipe(int n) {
     return 0;
 }
 
+/*-----------------------------------------------------------------------------
+ * Ordered x -> x*x test using batched dispatch.
+ * Results arrive in numerical order.
+ *
+ * As test_squareB, but the dispatcher thread adds jobs several at a time.
+ */
+#define BATCH_SIZE 16
+static void *test_batch_dispatcher(void *arg) {
+    struct squareB_opt *o = (struct squareB_opt *)arg;
+    void *args[BATCH_SIZE];
+    int i, k, n;
+
+    for (i = 0; i < o->n; i += n) {
+        n = o->n - i < BATCH_SIZE ? o->n - i : BATCH_SIZE;
+        for (k = 0; k < n; k++) {
+            int *ip = malloc(sizeof(*ip));
+            *ip = i + k;
+            args[k] = ip;
+        }
+
+        // Blocking, but may be partially completed so loop until done.
+        for (k = 0; k < n; ) {
+            int r = hts_tpool_dispatch_batch(o->p, o->q, doit_square,
+                                             args + k, n - k, NULL, NULL, 0);
+            if (r < 0)
+                pthread_exit((void *)1);
+            k += r;
+        }
+    }
+
+    // Dispatch an sentinel job to mark the end
+    int *ip = malloc(sizeof(*ip));
+    *ip = -1;
+    hts_tpool_dispatch(o->p, o->q, doit_square, ip);
+    pthread_exit(NULL);
+}
+
+int test_batch(int n) {
+    hts_tpool *p = hts_tpool_init(n);
+    hts_tpool_process *q = hts_tpool_process_init(p, n*2, 0);
+    struct squareB_opt o = {p, q, TASK_SIZE};
+    pthread_t tid;
+
+    pthread_create(&tid, NULL, test_batch_dispatcher, &o);
+
+    // Consume all results until we find the end-of-job marker.
+    for(;;) {
+        hts_tpool_result *r = hts_tpool_next_result_wait(q);
+        int x = *(int *)hts_tpool_result_data(r);
+        hts_tpool_delete_result(r, 1);
+        if (x == -1)
+            break;
+        printf("RESULT: %d\n", x);
+    }
+
+    hts_tpool_process_flush(q);
+    assert(hts_tpool_next_result(q) == NULL);
+
+    hts_tpool_process_destroy(q);
+    hts_tpool_destroy(p);
+    pthread_join(tid, NULL);
+
+    return 0;
+}
+
+/*-----------------------------------------------------------------------------
+ * The pipeline test again, but expressed as a graph of tasks.
+ *
+ * Each item has three tasks, one per pipeline stage, with stage N+1
+ * depending on stage N.  The first two stages don't need their results
+ * kept as the pipe_job is updated in place, so only the final process
+ * queue stores output.  There are no intermediate threads moving results
+ * from one queue to the next; the main thread creates the tasks and
+ * consumes the output.
+ */
+static void test_dag_drain(hts_tpool_process *q, int wait, int *eof) {
+    hts_tpool_result *r;
+
+    while ((r = wait ? hts_tpool_next_result_wait(q)
+                     : hts_tpool_next_result(q))) {
+        pipe_job *j = (pipe_job *)hts_tpool_result_data(r);
+        *eof = j->eof;
+        printf("O  %08x\n", j->x);
+        hts_tpool_delete_result(r, 1);
+        if (*eof)
+            break;
+    }
+}
+
+int test_dag(int n) {
+    hts_tpool *p = hts_tpool_init(n);
+    hts_tpool_process *q1 = hts_tpool_process_init(p, n*2, 1);
+    hts_tpool_process *q2 = hts_tpool_process_init(p, n*2, 1);
+    hts_tpool_process *q3 = hts_tpool_process_init(p, n*2, 0);
+    pipe_opt o = {p, q1, q2, q3, TASK_SIZE};
+    int i, eof = 0;
+
+    for (i = 1; i <= o.n; i++) {
+        pipe_job *j = malloc(sizeof(*j));
+        j->o = &o;
+        j->x = i;
+        j->eof = (i == o.n);
+
+        printf("I  %08x\n", j->x);
+
+        hts_tpool_task *t1 = hts_tpool_task_init(q1, pipe_stage1, j, NULL, NULL);
+        hts_tpool_task *t2 = hts_tpool_task_init(q2, pipe_stage2, j, NULL, NULL);
+        hts_tpool_task *t3 = hts_tpool_task_init(q3, pipe_stage3, j, NULL, NULL);
+        if (!t1 || !t2 || !t3
+            || hts_tpool_task_depends(t2, t1) < 0
+            || hts_tpool_task_depends(t3, t2) < 0)
+            return 1;
+
+        // Submit in any order; t1 is the only one free to run.
+        hts_tpool_task_submit(t3);
+        hts_tpool_task_submit(t2);
+        hts_tpool_task_submit(t1);
+
+        // Keep the number of items in flight bounded.
+        test_dag_drain(q3, hts_tpool_process_sz(q3) > n*4, &eof);
+    }
+
+    while (!eof)
+        test_dag_drain(q3, 1, &eof);
+
+    hts_tpool_process_destroy(q1);
+    hts_tpool_process_destroy(q2);
+    hts_tpool_process_destroy(q3);
+    hts_tpool_destroy(p);
+
+    return 0;
+}
+
 /*-----------------------------------------------------------------------------*/
 int main(int argc, char **argv) {
     int n;
@@ -1406,6 +1867,8 @@ int main(int argc, char **argv) {
         fprintf(stderr, "ordered1        # Main thread with non-block API\n");
         fprintf(stderr, "ordered2        # Dispatch thread, blocking API\n");
         fprintf(stderr, "pipe            # Multi-stage pipeline, several queues\n");
+        fprintf(stderr, "batch           # As ordered2, with batched dispatch\n");
+        fprintf(stderr, "dag             # As pipe, using task dependencies\n");
         exit(1);
     }
 
@@ -1414,6 +1877,8 @@ int main(int argc, char **argv) {
     if (strcmp(argv[1], "ordered1") == 0)  return test_square(n);
     if (strcmp(argv[1], "ordered2") == 0)  return test_squareB(n);
     if (strcmp(argv[1], "pipe") == 0)      return test_pipe(n);
+    if (strcmp(argv[1], "batch") == 0)     return test_batch(n);
+    if (strcmp(argv[1], "dag") == 0)       return test_dag(n);
 
     fprintf(stderr, "Unknown sub-command\n");
     exit(1);
@@ -63,6 +63,15 @@ typedef struct hts_tpool_job {
     struct hts_tpool *p;
     struct hts_tpool_process *q;
     uint64_t serial;
+
+    // Dependency tracking, used by the hts_tpool_task_* interface.
+    // n_deps counts unfinished prerequisites plus one for the submission
+    // hold; the job is queued when it reaches zero.  succ holds the jobs
+    // waiting on this one.
+    int n_deps;
+    int n_succ, m_succ;
+    struct hts_tpool_job **succ;
+    int cancelled;                   // a prerequisite was discarded
 } hts_tpool_job;
 
 /*
@@ -111,6 +120,7 @@ struct hts_tpool_process {
     int n_input;                     // no. items in input queue; was njobs
     int n_output;                    // no. items in output queue
     int n_processing;                // no. items being processed (executing)
+    int n_deferred;                  // no. tasks waiting on dependencies
 
     int shutdown;                    // true if pool is being destroyed
     int in_only;                     // if true, don't queue result up.
@@ -122,6 +132,7 @@ struct hts_tpool_process {
     pthread_cond_t input_not_full_c; // Input queue is no longer full
     pthread_cond_t input_empty_c;    // Input queue has become empty
     pthread_cond_t none_processing_c;// n_processing has hit zero
+    pthread_cond_t deferred_c;       // n_deferred has been decremented
 
     struct hts_tpool_process *next, *prev;// to form circular linked list.
 };
@@ -152,6 +163,9 @@ struct hts_tpool {
     // A single mutex used when updating this and any associated structure.
     pthread_mutex_t pool_m;
 
+    // Recycled job structs, to avoid a malloc / free per dispatch.
+    hts_tpool_job *free_jobs;
+
     // Tracking of average number of running jobs.
     // This can be used to dampen any hysteresis caused by bursty
     // input availability.
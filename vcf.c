@@ -2898,7 +2898,50 @@ int bcf_hdr_id2int(const bcf_hdr_t *h, int which, const char *id)
  *** BCF indexing ***
  ********************/
 
-hts_idx_t *bcf_index(htsFile *fp, int min_shift)
+// Readers for hts_idx_build_shards()
+static int64_t bcf_idx_check(void *data, const uint8_t *buf, size_t len)
+{
+    const bcf_hdr_t *h = (const bcf_hdr_t *) data;
+    uint32_t l_shared, l_indiv, n_sample;
+    int32_t rid, pos, rlen;
+
+    if (len < 32) return 0;
+    l_shared = le_to_u32(buf);
+    l_indiv = le_to_u32(buf + 4);
+    rid = le_to_i32(buf + 8);
+    pos = le_to_i32(buf + 12);
+    rlen = le_to_i32(buf + 16);
+    n_sample = le_to_u32(buf + 28) & 0xffffff;
+
+    if (l_shared < 24 || l_shared > INT_MAX || l_indiv > INT_MAX
+        || rid < 0 || rid >= h->n[BCF_DT_CTG] || pos < -1 || rlen < 0
+        || n_sample != bcf_hdr_nsamples(h))
+        return -1;
+    return 8 + (int64_t) l_shared + l_indiv;
+}
+
+static int bcf_idx_read(void *data, BGZF *fp, void **state, hts_idx_rec_t *rec)
+{
+    bcf1_t *b = (bcf1_t *) *state;
+    int ret;
+
+    if (!b && !(b = *state = bcf_init1())) return -2;
+    if ((ret = bcf_read1_core(fp, b)) != 0) return ret;
+    if ((ret = bcf_record_check((const bcf_hdr_t *) data, b)) != 0) return ret;
+    rec->tid = b->rid;
+    rec->beg = b->pos;
+    rec->end = b->pos + b->rlen;
+    rec->is_mapped = 1;
+    return 0;
+}
+
+static void bcf_idx_free_state(void *state)
+{
+    bcf_destroy1((bcf1_t *) state);
+}
+
+static hts_idx_t *bcf_index_(htsFile *fp, const char *fn, int min_shift,
+                             int n_threads)
 {
     int n_lvls, i;
     bcf1_t *b = NULL;
@@ -2922,6 +2965,14 @@ hts_idx_t *bcf_index(htsFile *fp, int min_shift)
     if (!idx) goto fail;
     b = bcf_init1();
     if (!b) goto fail;
+    if (n_threads > 1) {
+        hts_idx_reader_t reader = { 0, bcf_idx_check, bcf_idx_read, NULL,
+                                    bcf_idx_free_state, h };
+        r = hts_idx_build_shards(idx, fn, bgzf_tell(fp->fp.bgzf), n_threads,
+                                 &reader);
+        if (r < 0) goto fail;
+        if (r == 0) goto done;
+    }
     while ((r = bcf_read1(fp,h, b)) >= 0) {
         int ret;
         ret = hts_idx_push(idx, b->rid, b->pos, b->pos + b->rlen, bgzf_tell(fp->fp.bgzf), 1);
@@ -2929,6 +2980,7 @@ hts_idx_t *bcf_index(htsFile *fp, int min_shift)
     }
     if (r < -1) goto fail;
     hts_idx_finish(idx, bgzf_tell(fp->fp.bgzf));
+ done:
     bcf_destroy1(b);
     bcf_hdr_destroy(h);
     return idx;
@@ -2940,11 +2992,21 @@ hts_idx_t *bcf_index(htsFile *fp, int min_shift)
     return NULL;
 }
 
+hts_idx_t *bcf_index(htsFile *fp, int min_shift)
+{
+    return bcf_index_(fp, NULL, min_shift, 0);
+}
+
 hts_idx_t *bcf_index_load2(const char *fn, const char *fnidx)
 {
     return fnidx? hts_idx_load2(fn, fnidx) : bcf_index_load(fn);
 }
 
+hts_idx_t *bcf_index_load3(const char *fn, const char *fnidx, int flags)
+{
+    return hts_idx_load3(fn, fnidx, HTS_FMT_CSI, flags);
+}
+
 int bcf_index_build3(const char *fn, const char *fnidx, int min_shift, int n_threads)
 {
     htsFile *fp;
@@ -2961,7 +3023,7 @@ int bcf_index_build3(const char *fn, const char *fnidx, int min_shift, int n_thr
                 hts_log_error("TBI indices for BCF files are not supported");
                 ret = -1;
             } else {
-                idx = bcf_index(fp, min_shift);
+                idx = bcf_index_(fp, fn, min_shift, n_threads);
                 if (idx) {
                     ret = hts_idx_save_as(idx, fn, fnidx, HTS_FMT_CSI);
                     if (ret < 0) ret = -4;
@@ -2972,7 +3034,8 @@ int bcf_index_build3(const char *fn, const char *fnidx, int min_shift, int n_thr
             break;
 
         case vcf:
-            tbx = tbx_index(hts_get_bgzfp(fp), min_shift, &tbx_conf_vcf);
+            tbx = tbx_index_threads(hts_get_bgzfp(fp), fn, min_shift,
+                                    n_threads, &tbx_conf_vcf);
             if (tbx) {
                 ret = hts_idx_save_as(tbx->idx, fn, fnidx, min_shift > 0 ? HTS_FMT_CSI : HTS_FMT_TBI);
                 if (ret < 0) ret = -4;